@@ -52,3 +52,29 @@ void ext2fs_block_alloc_stats(ext2_filsys fs, blk_t blk, int inuse)
 	ext2fs_mark_super_dirty(fs);
 	ext2fs_mark_bb_dirty(fs);
 }
+
+void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk_t blk,
+				    blk_t num, int inuse)
+{
+	int	group;
+	blk_t	n, group_end;
+
+	while (num) {
+		group = ext2fs_group_of_blk(fs, blk);
+		group_end = fs->super->s_first_data_block +
+			(group + 1) * fs->super->s_blocks_per_group;
+		n = group_end - blk;
+		if (n > num)
+			n = num;
+		if (inuse > 0)
+			ext2fs_mark_block_bitmap_range(fs->block_map, blk, n);
+		else
+			ext2fs_unmark_block_bitmap_range(fs->block_map, blk, n);
+		fs->group_desc[group].bg_free_blocks_count -= inuse * (int) n;
+		fs->super->s_free_blocks_count -= inuse * (int) n;
+		blk += n;
+		num -= n;
+	}
+	ext2fs_mark_super_dirty(fs);
+	ext2fs_mark_bb_dirty(fs);
+}
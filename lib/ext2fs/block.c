@@ -21,6 +21,19 @@
 #include "ext2_fs.h"
 #include "ext2fs.h"
 
+/*
+ * The children of a dind or tind block, read ahead of the walk in
+ * batches.  pos[] holds their offsets in the parent.
+ */
+struct ind_batch {
+	char	*buf;
+	blk_t	list[BLOCK_ITERATE_BATCH];
+	int	pos[BLOCK_ITERATE_BATCH];
+	int	count;
+	int	next;
+	int	end;		/* Entries of the parent looked at so far */
+};
+
 struct block_context {
 	ext2_filsys	fs;
 	int (*func)(ext2_filsys	fs,
@@ -36,15 +49,73 @@ struct block_context {
 	char	*ind_buf;
 	char	*dind_buf;
 	char	*tind_buf;
+	struct ind_batch ind_batch;	/* Children of the dind block */
+	struct ind_batch dind_batch;	/* Children of the tind block */
 	void	*priv_data;
 };
 
+/*
+ * Read the next BLOCK_ITERATE_BATCH children of parent, starting at
+ * entry from.  If that can't be done, or the caller gave no room for
+ * it (see BLOCK_FLAG_BATCH), the batch is left empty, and each child
+ * is read on its own.  Where the I/O channel can read ahead, the batch
+ * after this one is on its way while this one is walked.
+ */
+static void fill_batch(struct block_context *ctx, struct ind_batch *batch,
+		       blk_t *parent, int from)
+{
+	void	*bufs[BLOCK_ITERATE_BATCH];
+	int	i, limit;
+
+	limit = ctx->fs->blocksize >> 2;
+	batch->count = batch->next = 0;
+	for (i = from; i < limit && batch->count < BLOCK_ITERATE_BATCH; i++) {
+		if (!parent[i] ||
+		    parent[i] >= ctx->fs->super->s_blocks_count ||
+		    parent[i] < ctx->fs->super->s_first_data_block)
+			continue;
+		batch->list[batch->count] = parent[i];
+		batch->pos[batch->count++] = i;
+	}
+	batch->end = i;
+	if (i < limit)
+		ext2fs_readahead_ind_blocks(ctx->fs, parent + i,
+			(limit - i < BLOCK_ITERATE_BATCH) ? limit - i :
+			BLOCK_ITERATE_BATCH);
+	if (batch->count < 2 || !batch->buf) {
+		batch->count = 0;
+		return;
+	}
+	for (i = 0; i < batch->count; i++)
+		bufs[i] = batch->buf + i * ctx->fs->blocksize;
+	if (ext2fs_read_ind_blocks(ctx->fs, batch->list, batch->count, bufs))
+		batch->count = 0;
+}
+
+/*
+ * Return the contents of child pos of parent, reading the next batch
+ * of children if need be, or 0 if it wasn't read.
+ */
+static char *batched_child(struct block_context *ctx,
+			   struct ind_batch *batch, blk_t *parent, int pos)
+{
+	if (pos >= batch->end)
+		fill_batch(ctx, batch, parent, pos);
+	while (batch->next < batch->count && batch->pos[batch->next] < pos)
+		batch->next++;
+	if (batch->next < batch->count && batch->pos[batch->next] == pos &&
+	    batch->list[batch->next] == parent[pos])
+		return batch->buf + batch->next++ * ctx->fs->blocksize;
+	return 0;
+}
+
 static int block_iterate_ind(blk_t *ind_block, blk_t ref_block,
-			     int ref_offset, struct block_context *ctx)
+			     int ref_offset, struct block_context *ctx,
+			     char *ind_buf)
 {
 	int	ret = 0, changed = 0;
 	int	i, flags, limit, offset;
-	blk_t	*block_nr;
+	blk_t	*block_nr, blk = *ind_block;
 
 	limit = ctx->fs->blocksize >> 2;
 	if (!(ctx->flags & BLOCK_FLAG_DEPTH_TRAVERSE) &&
@@ -62,14 +133,17 @@ static int block_iterate_ind(blk_t *ind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
-	ctx->errcode = ext2fs_read_ind_block(ctx->fs, *ind_block, 
-					     ctx->ind_buf);
-	if (ctx->errcode) {
-		ret |= BLOCK_ERROR;
-		return ret;
+	if (!ind_buf || *ind_block != blk) {
+		ind_buf = ctx->ind_buf;
+		ctx->errcode = ext2fs_read_ind_block(ctx->fs, *ind_block, 
+						     ind_buf);
+		if (ctx->errcode) {
+			ret |= BLOCK_ERROR;
+			return ret;
+		}
 	}
 
-	block_nr = (blk_t *) ctx->ind_buf;
+	block_nr = (blk_t *) ind_buf;
 	offset = 0;
 	if (ctx->flags & BLOCK_FLAG_APPEND) {
 		for (i = 0; i < limit; i++, ctx->bcount++, block_nr++) {
@@ -100,7 +174,7 @@ static int block_iterate_ind(blk_t *ind_block, blk_t ref_block,
 	}
 	if (changed & BLOCK_CHANGED) {
 		ctx->errcode = ext2fs_write_ind_block(ctx->fs, *ind_block,
-						      ctx->ind_buf);
+						      ind_buf);
 		if (ctx->errcode)
 			ret |= BLOCK_ERROR | BLOCK_ABORT;
 	}
@@ -114,11 +188,12 @@ static int block_iterate_ind(blk_t *ind_block, blk_t ref_block,
 }
 	
 static int block_iterate_dind(blk_t *dind_block, blk_t ref_block,
-			      int ref_offset, struct block_context *ctx)
+			      int ref_offset, struct block_context *ctx,
+			      char *dind_buf)
 {
 	int	ret = 0, changed = 0;
 	int	i, flags, limit, offset;
-	blk_t	*block_nr;
+	blk_t	*block_nr, blk = *dind_block;
 
 	limit = ctx->fs->blocksize >> 2;
 	if (!(ctx->flags & (BLOCK_FLAG_DEPTH_TRAVERSE |
@@ -136,20 +211,26 @@ static int block_iterate_dind(blk_t *dind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
-	ctx->errcode = ext2fs_read_ind_block(ctx->fs, *dind_block, 
-					     ctx->dind_buf);
-	if (ctx->errcode) {
-		ret |= BLOCK_ERROR;
-		return ret;
+	if (!dind_buf || *dind_block != blk) {
+		dind_buf = ctx->dind_buf;
+		ctx->errcode = ext2fs_read_ind_block(ctx->fs, *dind_block, 
+						     dind_buf);
+		if (ctx->errcode) {
+			ret |= BLOCK_ERROR;
+			return ret;
+		}
 	}
+	ctx->ind_batch.count = ctx->ind_batch.end = 0;
 
-	block_nr = (blk_t *) ctx->dind_buf;
+	block_nr = (blk_t *) dind_buf;
 	offset = 0;
 	if (ctx->flags & BLOCK_FLAG_APPEND) {
 		for (i = 0; i < limit; i++, block_nr++) {
 			flags = block_iterate_ind(block_nr,
-						  *dind_block, offset,
-						  ctx);
+						  *dind_block, offset, ctx,
+						  batched_child(ctx,
+							&ctx->ind_batch,
+							(blk_t *) dind_buf, i));
 			changed |= flags;
 			if (flags & (BLOCK_ABORT | BLOCK_ERROR)) {
 				ret |= flags & (BLOCK_ABORT | BLOCK_ERROR);
@@ -164,8 +245,10 @@ static int block_iterate_dind(blk_t *dind_block, blk_t ref_block,
 				continue;
 			}
 			flags = block_iterate_ind(block_nr,
-						  *dind_block, offset,
-						  ctx);
+						  *dind_block, offset, ctx,
+						  batched_child(ctx,
+							&ctx->ind_batch,
+							(blk_t *) dind_buf, i));
 			changed |= flags;
 			if (flags & (BLOCK_ABORT | BLOCK_ERROR)) {
 				ret |= flags & (BLOCK_ABORT | BLOCK_ERROR);
@@ -176,7 +259,7 @@ static int block_iterate_dind(blk_t *dind_block, blk_t ref_block,
 	}
 	if (changed & BLOCK_CHANGED) {
 		ctx->errcode = ext2fs_write_ind_block(ctx->fs, *dind_block,
-						      ctx->dind_buf);
+						      dind_buf);
 		if (ctx->errcode)
 			ret |= BLOCK_ERROR | BLOCK_ABORT;
 	}
@@ -218,14 +301,18 @@ static int block_iterate_tind(blk_t *tind_block, blk_t ref_block,
 		ret |= BLOCK_ERROR;
 		return ret;
 	}
+	ctx->dind_batch.count = ctx->dind_batch.end = 0;
 
 	block_nr = (blk_t *) ctx->tind_buf;
 	offset = 0;
 	if (ctx->flags & BLOCK_FLAG_APPEND) {
 		for (i = 0; i < limit; i++, block_nr++) {
 			flags = block_iterate_dind(block_nr,
-						   *tind_block,
-						   offset, ctx);
+						   *tind_block, offset, ctx,
+						   batched_child(ctx,
+							&ctx->dind_batch,
+							(blk_t *) ctx->tind_buf,
+							i));
 			changed |= flags;
 			if (flags & (BLOCK_ABORT | BLOCK_ERROR)) {
 				ret |= flags & (BLOCK_ABORT | BLOCK_ERROR);
@@ -240,8 +327,11 @@ static int block_iterate_tind(blk_t *tind_block, blk_t ref_block,
 				continue;
 			}
 			flags = block_iterate_dind(block_nr,
-						   *tind_block,
-						   offset, ctx);
+						   *tind_block, offset, ctx,
+						   batched_child(ctx,
+							&ctx->dind_batch,
+							(blk_t *) ctx->tind_buf,
+							i));
 			changed |= flags;
 			if (flags & (BLOCK_ABORT | BLOCK_ERROR)) {
 				ret |= flags & (BLOCK_ABORT | BLOCK_ERROR);
@@ -302,6 +392,18 @@ errcode_t ext2fs_block_iterate2(ext2_filsys fs,
 			return EXT2_ET_FILE_TOO_BIG;
 	}
 
+	/*
+	 * Extent mapped files have a walker of their own
+	 */
+	if (!got_inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode);
+		if (retval)
+			return retval;
+	}
+	if (inode.i_flags & EXT4_EXTENTS_FL)
+		return ext2fs_extent_block_iterate(fs, ino, &inode, flags,
+						   func, priv_data);
+
 	retval = ext2fs_get_blocks(fs, ino, blocks);
 	if (retval)
 		return retval;
@@ -322,6 +424,13 @@ errcode_t ext2fs_block_iterate2(ext2_filsys fs,
 	}
 	ctx.dind_buf = ctx.ind_buf + fs->blocksize;
 	ctx.tind_buf = ctx.dind_buf + fs->blocksize;
+	memset(&ctx.ind_batch, 0, sizeof(struct ind_batch));
+	memset(&ctx.dind_batch, 0, sizeof(struct ind_batch));
+	if (block_buf && (flags & BLOCK_FLAG_BATCH)) {
+		ctx.ind_batch.buf = ctx.tind_buf + fs->blocksize;
+		ctx.dind_batch.buf = ctx.ind_batch.buf +
+			fs->blocksize * BLOCK_ITERATE_BATCH;
+	}
 
 	/*
 	 * Iterate over the HURD translator block (if present)
@@ -355,14 +464,14 @@ errcode_t ext2fs_block_iterate2(ext2_filsys fs,
 	}
 	if (*(blocks + EXT2_IND_BLOCK) || (flags & BLOCK_FLAG_APPEND)) {
 		ret |= block_iterate_ind(blocks + EXT2_IND_BLOCK,
-					 0, EXT2_IND_BLOCK, &ctx);
+					 0, EXT2_IND_BLOCK, &ctx, 0);
 		if (ret & BLOCK_ABORT)
 			goto abort_exit;
 	} else
 		ctx.bcount += limit;
 	if (*(blocks + EXT2_DIND_BLOCK) || (flags & BLOCK_FLAG_APPEND)) {
 		ret |= block_iterate_dind(blocks + EXT2_DIND_BLOCK,
-					  0, EXT2_DIND_BLOCK, &ctx);
+					  0, EXT2_DIND_BLOCK, &ctx, 0);
 		if (ret & BLOCK_ABORT)
 			goto abort_exit;
 	} else
@@ -137,9 +137,9 @@ static _BMAP_INLINE_ errcode_t block_tind_bmap(ext2_filsys fs, int flags,
 	return retval;
 }
 
-errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
-		      char *block_buf, int bmap_flags, blk_t block,
-		      blk_t *phys_blk)
+errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+		       char *block_buf, int bmap_flags, blk_t block,
+		       int *ret_flags, blk_t *phys_blk)
 {
 	struct ext2_inode inode_buf;
 	blk_t addr_per_block;
@@ -158,6 +158,13 @@ errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
 			return retval;
 		inode = &inode_buf;
 	}
+
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return ext2fs_extent_bmap(fs, ino, inode, block_buf, bmap_flags,
+					  block, ret_flags, phys_blk);
+	if (ret_flags)
+		*ret_flags = 0;
+
 	addr_per_block = (blk_t) fs->blocksize >> 2;
 
 	if (!block_buf) {
@@ -269,5 +276,147 @@ done:
 	return retval;
 }
 
+/*
+ * Sets @run to the stretch of the block map @map (@count entries, the
+ * first for logical block @base) around entry @nr, for as long as the
+ * entries keep pointing at consecutive blocks, or keep being holes.
+ */
+static void map_run(blk_t *map, int count, int nr, blk_t base,
+		    struct ext2_bmap_run *run)
+{
+	int	first = nr, last = nr;
+
+	if (map[nr]) {
+		while (first > 0 && map[first - 1] &&
+		       map[first - 1] + 1 == map[first])
+			first--;
+		while (last + 1 < count && map[last + 1] == map[last] + 1)
+			last++;
+	} else {
+		while (first > 0 && !map[first - 1])
+			first--;
+		while (last + 1 < count && !map[last + 1])
+			last++;
+	}
+	run->lblk = base + first;
+	run->pblk = map[first];
+	run->len = last - first + 1;
+	run->flags = 0;
+}
 
+static void hole_run(blk_t base, __u64 span, struct ext2_bmap_run *run)
+{
+	if (span > 0xFFFFFFFFULL - base)
+		span = 0xFFFFFFFFULL - base;
+	run->lblk = base;
+	run->pblk = 0;
+	run->len = span;
+	run->flags = 0;
+}
 
+/*
+ * Finds the run around block @nr of the subtree under @blk, which is
+ * @levels levels of indirect blocks deep and maps logical blocks from
+ * @base on.  A missing indirect block is one hole for all it would map.
+ */
+static errcode_t tree_run(ext2_filsys fs, blk_t blk, int levels,
+			  char *block_buf, blk_t nr, blk_t base,
+			  struct ext2_bmap_run *run)
+{
+	blk_t		addr_per_block = (blk_t) fs->blocksize >> 2;
+	__u64		span = addr_per_block;
+	errcode_t	retval;
+	int		i;
+
+	for (i = 1; i < levels; i++)
+		span *= addr_per_block;
+
+	for (;;) {
+		if (!blk) {
+			hole_run(base, span, run);
+			return 0;
+		}
+		retval = ext2fs_read_ind_block(fs, blk, block_buf);
+		if (retval)
+			return retval;
+		if (--levels == 0)
+			break;
+		span /= addr_per_block;
+		i = nr / span;
+		blk = ((blk_t *) block_buf)[i];
+		base += i * span;
+		nr %= span;
+	}
+	map_run((blk_t *) block_buf, addr_per_block, nr, base, run);
+	return 0;
+}
+
+/*
+ * Like ext2fs_bmap2() without flags, but returns the whole run of blocks
+ * around @block that maps the same way (see struct ext2_bmap_run), so
+ * that callers can cache it and skip the lookup for the blocks nearby.
+ */
+errcode_t ext2fs_bmap_run(ext2_filsys fs, ext2_ino_t ino,
+			  struct ext2_inode *inode, char *block_buf,
+			  blk_t block, struct ext2_bmap_run *run)
+{
+	struct ext2_inode inode_buf;
+	blk_t addr_per_block;
+	blk_t	base = EXT2_NDIR_BLOCKS;
+	char	*buf = 0;
+	errcode_t	retval = 0;
+
+	if (!inode) {
+		retval = ext2fs_read_inode(fs, ino, &inode_buf);
+		if (retval)
+			return retval;
+		inode = &inode_buf;
+	}
+
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return ext2fs_extent_bmap_run(fs, inode, block_buf, block, run);
+
+	if (block < EXT2_NDIR_BLOCKS) {
+		map_run(inode->i_block, EXT2_NDIR_BLOCKS, block, 0, run);
+		return 0;
+	}
+
+	addr_per_block = (blk_t) fs->blocksize >> 2;
+
+	if (!block_buf) {
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+		if (retval)
+			return retval;
+		block_buf = buf;
+	}
+
+	block -= EXT2_NDIR_BLOCKS;
+	if (block < addr_per_block) {
+		retval = tree_run(fs, inode_bmap(inode, EXT2_IND_BLOCK), 1,
+				  block_buf, block, base, run);
+		goto done;
+	}
+	block -= addr_per_block;
+	base += addr_per_block;
+	if (block < addr_per_block * addr_per_block) {
+		retval = tree_run(fs, inode_bmap(inode, EXT2_DIND_BLOCK), 2,
+				  block_buf, block, base, run);
+		goto done;
+	}
+	block -= addr_per_block * addr_per_block;
+	base += addr_per_block * addr_per_block;
+	retval = tree_run(fs, inode_bmap(inode, EXT2_TIND_BLOCK), 3,
+			  block_buf, block, base, run);
+done:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return retval;
+}
+
+errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino, struct ext2_inode *inode,
+		      char *block_buf, int bmap_flags, blk_t block,
+		      blk_t *phys_blk)
+{
+	return ext2fs_bmap2(fs, ino, inode, block_buf, bmap_flags, block,
+			    0, phys_blk);
+}
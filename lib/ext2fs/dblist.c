@@ -19,12 +19,21 @@
 #endif
 #include <string.h>
 #include <time.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fsP.h"
 
 static EXT2_QSORT_TYPE dir_block_cmp(const void *a, const void *b);
 
+#define DBLIST_MIN_GROW		100
+#define DBLIST_RADIX_BITS	11
+#define DBLIST_RADIX_MIN	64	/* Shorter lists are just qsort()ed */
+#define DBLIST_CHUNK		32	/* Blocks handed to a thread at once */
+#define DBLIST_MAX_THREADS	64
+
 /*
  * Returns the number of directories in the filesystem as reported by
  * the group descriptors.  Of course, the group descriptors could be
@@ -161,19 +170,25 @@ errcode_t ext2fs_add_dir_block(ext2_dblist dblist, ext2_ino_t ino, blk_t blk,
 	struct ext2_db_entry 	*new_entry;
 	errcode_t		retval;
 	unsigned long		old_size;
+	ext2_ino_t		new_size;
 	
 	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
 
 	if (dblist->count >= dblist->size) {
+		/*
+		 * Double the list, so that adding n blocks costs O(n)
+		 * copying rather than O(n^2).
+		 */
 		old_size = dblist->size * sizeof(struct ext2_db_entry);
-		dblist->size += 100;
-		retval = ext2fs_resize_mem(old_size, (size_t) dblist->size *
+		new_size = dblist->size * 2;
+		if (new_size < dblist->size + DBLIST_MIN_GROW)
+			new_size = dblist->size + DBLIST_MIN_GROW;
+		retval = ext2fs_resize_mem(old_size, (size_t) new_size *
 					   sizeof(struct ext2_db_entry),
 					   &dblist->list);
-		if (retval) {
-			dblist->size -= 100;
+		if (retval)
 			return retval;
-		}
+		dblist->size = new_size;
 	}
 	new_entry = dblist->list + ( (int) dblist->count++);
 	new_entry->blk = blk;
@@ -206,10 +221,73 @@ errcode_t ext2fs_set_dir_block(ext2_dblist dblist, ext2_ino_t ino, blk_t blk,
 	return EXT2_ET_DB_NOT_FOUND;
 }
 
+/*
+ * Sort the list into the order of dir_block_cmp() with a radix sort on
+ * the block number, DBLIST_RADIX_BITS bits a pass, skipping the passes
+ * on which every block has the same digit.  Entries for the same block
+ * are rare, so they are put in order afterwards by insertion sort.
+ */
+static errcode_t radix_sort(struct ext2_db_entry *list, ext2_ino_t count)
+{
+	struct ext2_db_entry *tmp, *src, *dst, *swap, ent;
+	ext2_ino_t	counts[1 << DBLIST_RADIX_BITS];
+	ext2_ino_t	i, j, k, sum, n;
+	unsigned int	shift, digit, mask = (1 << DBLIST_RADIX_BITS) - 1;
+	errcode_t	retval;
+
+	retval = ext2fs_get_mem((size_t) count * sizeof(struct ext2_db_entry),
+				&tmp);
+	if (retval)
+		return retval;
+
+	src = list;
+	dst = tmp;
+	for (shift = 0; shift < 32; shift += DBLIST_RADIX_BITS) {
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < count; i++)
+			counts[(src[i].blk >> shift) & mask]++;
+		if (counts[(src[0].blk >> shift) & mask] == count)
+			continue;
+		for (digit = 0, sum = 0; digit <= mask; digit++) {
+			n = counts[digit];
+			counts[digit] = sum;
+			sum += n;
+		}
+		for (i = 0; i < count; i++)
+			dst[counts[(src[i].blk >> shift) & mask]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != list)
+		memcpy(list, src,
+		       (size_t) count * sizeof(struct ext2_db_entry));
+	ext2fs_free_mem(&tmp);
+
+	for (i = 1; i < count; i++) {
+		if (list[i].blk != list[i-1].blk)
+			continue;
+		for (j = i; j < count && list[j].blk == list[i-1].blk; j++) {
+			ent = list[j];
+			for (k = j; k >= i &&
+				     dir_block_cmp(&list[k-1], &ent) > 0; k--)
+				list[k] = list[k-1];
+			list[k] = ent;
+		}
+		i = j;
+	}
+	return 0;
+}
+
 void ext2fs_dblist_sort(ext2_dblist dblist,
 			EXT2_QSORT_TYPE (*sortfunc)(const void *,
 						    const void *))
 {
+	if (!sortfunc && dblist->count >= DBLIST_RADIX_MIN &&
+	    !radix_sort(dblist->list, dblist->count)) {
+		dblist->sorted = 1;
+		return;
+	}
 	if (!sortfunc)
 		sortfunc = dir_block_cmp;
 	qsort(dblist->list, (size_t) dblist->count,
@@ -241,6 +319,194 @@ errcode_t ext2fs_dblist_iterate(ext2_dblist dblist,
 	return 0;
 }
 
+struct dblist_par {
+	ext2_dblist	dblist;
+	ext2_ino_t	next;
+	int		abort;
+	errcode_t	error;
+	int		(*func)(ext2_filsys fs, struct ext2_db_entry *db_info,
+				char *buf, int thread, void *priv_data);
+	void		*priv_data;
+#if HAVE_PTHREAD_H
+	pthread_mutex_t	lock;	/* Guards the above, and the I/O channel */
+#endif
+};
+
+struct dblist_thread {
+	struct dblist_par *dp;
+	int		thread;
+	char		*buf;
+#if HAVE_PTHREAD_H
+	pthread_t	tid;
+#endif
+};
+
+#if HAVE_PTHREAD_H
+#define dblist_lock(dp)		pthread_mutex_lock(&(dp)->lock)
+#define dblist_unlock(dp)	pthread_mutex_unlock(&(dp)->lock)
+#else
+#define dblist_lock(dp)		do { } while (0)
+#define dblist_unlock(dp)	do { } while (0)
+#endif
+
+/*
+ * Take the next DBLIST_CHUNK entries of the sorted list, read their
+ * blocks, asking for each run of consecutive blocks to be read ahead
+ * first, and pass them to func.  Only the reads are done under the
+ * lock.
+ */
+static void *dblist_thread(void *arg)
+{
+	struct dblist_thread *dt = arg;
+	struct dblist_par *dp = dt->dp;
+	ext2_dblist	dblist = dp->dblist;
+	ext2_filsys	fs = dblist->fs;
+	struct ext2_db_entry *list;
+	errcode_t	retval;
+	ext2_ino_t	i, n, run;
+	char		*p;
+	int		ret;
+
+	while (1) {
+		dblist_lock(dp);
+		if (dp->error || dp->abort || dp->next >= dblist->count) {
+			dblist_unlock(dp);
+			break;
+		}
+		list = dblist->list + dp->next;
+		n = dblist->count - dp->next;
+		if (n > DBLIST_CHUNK)
+			n = DBLIST_CHUNK;
+		dp->next += n;
+
+		for (i = 0; i < n; i += run) {
+			for (run = 1; i + run < n; run++)
+				if (list[i+run].blk != list[i+run-1].blk + 1)
+					break;
+			if (run > 1)
+				io_channel_cache_readahead(fs->io, list[i].blk,
+							   run);
+		}
+		retval = 0;
+		for (i = 0, p = dt->buf; i < n && !retval;
+		     i++, p += fs->blocksize)
+			retval = ext2fs_read_dir_block(fs, list[i].blk, p);
+		if (retval && !dp->error)
+			dp->error = retval;
+		dblist_unlock(dp);
+		if (retval)
+			break;
+
+		for (i = 0, p = dt->buf; i < n; i++, p += fs->blocksize) {
+			ret = (dp->func)(fs, &list[i], p, dt->thread,
+					 dp->priv_data);
+			if (ret & DBLIST_ABORT) {
+				dblist_lock(dp);
+				dp->abort = 1;
+				dblist_unlock(dp);
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Call func on every block in the directory block list, from up to
+ * threads threads at once (0 for one per processor).  The list is
+ * sorted, and split into disjoint ranges of blocks which are handed
+ * out in disk order, so the blocks are read nearly sequentially.  func
+ * is passed the block's contents, as ext2fs_read_dir_block() returns
+ * them, and the number of the thread, from 0 to threads - 1.  It may
+ * be called from several threads at once, so it mustn't use the
+ * filesystem's I/O channel or change the list.
+ *
+ * Returning DBLIST_ABORT from func stops the iteration.  An error
+ * reading a block stops it too, and is returned.
+ */
+errcode_t ext2fs_dblist_iterate_parallel(ext2_dblist dblist, int threads,
+					 int (*func)(ext2_filsys fs,
+						struct ext2_db_entry *db_info,
+						char *buf, int thread,
+						void *priv_data),
+					 void *priv_data)
+{
+	struct dblist_par dp;
+	struct dblist_thread *dt;
+	errcode_t	retval;
+	int		i, started;
+	long		chunks;
+
+	EXT2_CHECK_MAGIC(dblist, EXT2_ET_MAGIC_DBLIST);
+
+	if (!dblist->sorted)
+		ext2fs_dblist_sort(dblist, 0);
+
+	if (threads <= 0) {
+		threads = 1;
+#if HAVE_PTHREAD_H && defined(_SC_NPROCESSORS_ONLN)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	}
+	if (threads > DBLIST_MAX_THREADS)
+		threads = DBLIST_MAX_THREADS;
+	chunks = (dblist->count + DBLIST_CHUNK - 1) / DBLIST_CHUNK;
+	if (threads > chunks)
+		threads = chunks;
+	if (threads <= 0)
+		threads = 1;
+#if !HAVE_PTHREAD_H
+	threads = 1;
+#endif
+
+	memset(&dp, 0, sizeof(dp));
+	dp.dblist = dblist;
+	dp.func = func;
+	dp.priv_data = priv_data;
+
+	retval = ext2fs_get_mem(threads * sizeof(struct dblist_thread), &dt);
+	if (retval)
+		return retval;
+	memset(dt, 0, threads * sizeof(struct dblist_thread));
+	for (i = 0; i < threads; i++) {
+		dt[i].dp = &dp;
+		dt[i].thread = i;
+		retval = ext2fs_get_mem((size_t) DBLIST_CHUNK *
+					dblist->fs->blocksize, &dt[i].buf);
+		if (retval)
+			goto errout;
+	}
+
+#if HAVE_PTHREAD_H
+	pthread_mutex_init(&dp.lock, NULL);
+#endif
+	/* The calling thread is thread 0, as in ext2fs_inode_scan_parallel() */
+	for (started = 1; started < threads; started++) {
+#if HAVE_PTHREAD_H
+		if (pthread_create(&dt[started].tid, NULL, dblist_thread,
+				   &dt[started]))
+			break;
+#endif
+	}
+	dblist_thread(&dt[0]);
+	for (i = 1; i < started; i++) {
+#if HAVE_PTHREAD_H
+		pthread_join(dt[i].tid, NULL);
+#endif
+	}
+#if HAVE_PTHREAD_H
+	pthread_mutex_destroy(&dp.lock);
+#endif
+	retval = dp.error;
+
+errout:
+	for (i = 0; i < threads; i++)
+		if (dt[i].buf)
+			ext2fs_free_mem(&dt[i].buf);
+	ext2fs_free_mem(&dt);
+	return retval;
+}
+
 static EXT2_QSORT_TYPE dir_block_cmp(const void *a, const void *b)
 {
 	const struct ext2_db_entry *db_a =
@@ -249,10 +515,10 @@ static EXT2_QSORT_TYPE dir_block_cmp(const void *a, const void *b)
 		(const struct ext2_db_entry *) b;
 
 	if (db_a->blk != db_b->blk)
-		return (int) (db_a->blk - db_b->blk);
+		return (db_a->blk < db_b->blk) ? -1 : 1;
 	
 	if (db_a->ino != db_b->ino)
-		return (int) (db_a->ino - db_b->ino);
+		return (db_a->ino < db_b->ino) ? -1 : 1;
 
 	return (int) (db_a->blockcnt - db_b->blockcnt);
 }
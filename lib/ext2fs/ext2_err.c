@@ -112,6 +112,10 @@ static const char * const text[] = {
 		"TDB: Invalid parameter",
 		"TDB: Record does not exist",
 		"TDB: Write not permitted",
+		"Corrupt extent header",
+		"Corrupt extent index",
+		"Corrupt extent",
+		"Can't insert extent, tree is too deep",
     0
 };
 
@@ -126,7 +130,7 @@ struct et_list {
 };
 extern struct et_list *_et_list;
 
-const struct error_table et_ext2_error_table = { text, 2133571328L, 106 };
+const struct error_table et_ext2_error_table = { text, 2133571328L, 110 };
 
 static struct et_list link = { 0, 0 };
 
@@ -111,6 +111,10 @@
 #define EXT2_ET_TDB_ERR_EINVAL                   (2133571431L)
 #define EXT2_ET_TDB_ERR_NOEXIST                  (2133571432L)
 #define EXT2_ET_TDB_ERR_RDONLY                   (2133571433L)
+#define EXT2_ET_EXTENT_HEADER_BAD                (2133571434L)
+#define EXT2_ET_EXTENT_INDEX_BAD                 (2133571435L)
+#define EXT2_ET_EXTENT_LEAF_BAD                  (2133571436L)
+#define EXT2_ET_CANT_INSERT_EXTENT               (2133571437L)
 extern const struct error_table et_ext2_error_table;
 extern void initialize_ext2_error_table(void);
 
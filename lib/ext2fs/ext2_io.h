@@ -70,7 +70,13 @@ struct struct_io_manager {
 				int count, const void *data);
 	errcode_t (*set_option)(io_channel channel, const char *option, 
 				const char *arg);
-	int		reserved[14];
+	errcode_t (*cache_readahead)(io_channel channel, unsigned long block,
+				     int count);
+	errcode_t (*map_blk)(io_channel channel, unsigned long block,
+			     int count, void **ptr);
+	errcode_t (*read_blk_vec)(io_channel channel, unsigned long *list,
+				  int count, void **bufs);
+	int		reserved[9];
 };
 
 #define IO_FLAG_RW		0x0001
@@ -92,10 +98,23 @@ extern errcode_t io_channel_set_options(io_channel channel,
 extern errcode_t io_channel_write_byte(io_channel channel, 
 				       unsigned long offset,
 				       int count, const void *data);
+extern errcode_t io_channel_cache_readahead(io_channel channel,
+					    unsigned long block, int count);
+extern errcode_t io_channel_map_blk(io_channel channel, unsigned long block,
+				    int count, void **ptr);
+extern errcode_t io_channel_read_blocks_vec(io_channel channel,
+					    unsigned long *list,
+					    int count, void **bufs);
 
 /* unix_io.c */
 extern io_manager unix_io_manager;
 
+/* mmap_io.c */
+extern io_manager mmap_io_manager;
+
+/* uring_io.c */
+extern io_manager uring_io_manager;
+
 /* test_io.c */
 extern io_manager test_io_manager, test_io_backing_manager;
 extern void (*test_io_cb_read_blk)
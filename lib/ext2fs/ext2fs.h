@@ -66,10 +66,12 @@ extern "C" {
 #include "e2_types.h"
 #include "ext2_fs.h"
 #include "ext3_extents.h"
+#include "ext2_ext_attr.h"
 #else
 #include <ext2fs/ext2_types.h>
 #include <ext2fs/ext2_fs.h>
 #include <ext2fs/ext3_extents.h>
+#include <ext2fs/ext2_ext_attr.h>
 #endif /* EXT2_FLAT_INCLUDES */
 
 typedef __u32		ext2_ino_t;
@@ -163,6 +165,8 @@ typedef struct ext2_struct_dblist *ext2_dblist;
 #define EXT2_FILE_BUF_DIRTY	0x4000
 #define EXT2_FILE_BUF_VALID	0x2000
 
+#define EXT2_FILE_RUNS		8	/* block map runs cached per file */
+
 typedef struct ext2_file *ext2_file_t;
 
 #define EXT2_SEEK_SET	0
@@ -278,6 +282,10 @@ struct struct_ext2_filsys {
  * BLOCK_FLAG_DATA_ONLY indicates that the iterator function should be
  * called for data blocks only.
  *
+ * BLOCK_FLAG_BATCH indicates that block_buf is BLOCK_ITERATE_BUF_BLOCKS
+ * blocks long rather than 3, and that the children of doubly and triply
+ * indirect blocks should be read into it in batches.
+ *
  * BLOCK_FLAG_NO_LARGE is for internal use only.  It informs
  * ext2fs_block_iterate2 that large files won't be accepted.
  */
@@ -285,6 +293,7 @@ struct struct_ext2_filsys {
 #define BLOCK_FLAG_HOLE		1
 #define BLOCK_FLAG_DEPTH_TRAVERSE	2
 #define BLOCK_FLAG_DATA_ONLY	4
+#define BLOCK_FLAG_BATCH	8
 
 #define BLOCK_FLAG_NO_LARGE	0x1000
 
@@ -296,6 +305,15 @@ struct struct_ext2_filsys {
 #define BLOCK_COUNT_TIND	(-3)
 #define BLOCK_COUNT_TRANSLATOR	(-4)
 
+/*
+ * With BLOCK_FLAG_BATCH, the block iterator reads the children of a
+ * doubly or triply indirect block BLOCK_ITERATE_BATCH at a time.  Its
+ * block_buf then holds one block for each level of indirection, and a
+ * batch of children for each of the two levels above the bottom one.
+ */
+#define BLOCK_ITERATE_BATCH		16
+#define BLOCK_ITERATE_BUF_BLOCKS	(3 + 2 * BLOCK_ITERATE_BATCH)
+
 #if 0
 /*
  * Flags for ext2fs_move_blocks
@@ -341,6 +359,7 @@ typedef struct ext2_struct_inode_scan *ext2_inode_scan;
 #define EXT2_SF_BAD_EXTRA_BYTES	0x0004
 #define EXT2_SF_SKIP_MISSING_ITABLE	0x0008
 #define EXT2_SF_DO_LAZY		0x0010
+#define EXT2_SF_SKIP_FREE_TAIL	0x0020
 
 /*
  * ext2fs_check_if_mounted flags
@@ -408,6 +427,23 @@ typedef struct ext2_icount *ext2_icount_t;
  */
 #define BMAP_ALLOC	0x0001
 #define BMAP_SET	0x0002
+#define BMAP_UNINIT	0x0004	/* with BMAP_SET, extent mapped files only */
+
+/*
+ * Returned flags from ext2fs_bmap2
+ */
+#define BMAP_RET_UNINIT	0x0001	/* block is in an uninitialized extent */
+
+/*
+ * A run of logical blocks found by ext2fs_bmap_run: either mapped to
+ * consecutive physical blocks starting at pblk, or a hole (pblk 0).
+ */
+struct ext2_bmap_run {
+	blk_t	lblk;
+	blk_t	pblk;
+	blk_t	len;
+	int	flags;		/* BMAP_RET_* */
+};
 
 /*
  * Flags for imager.c functions
@@ -452,12 +488,14 @@ typedef struct ext2_icount *ext2_icount_t;
 					 EXT2_FEATURE_INCOMPAT_COMPRESSION|\
 					 EXT3_FEATURE_INCOMPAT_JOURNAL_DEV|\
 					 EXT2_FEATURE_INCOMPAT_META_BG|\
-					 EXT3_FEATURE_INCOMPAT_RECOVER)
+					 EXT3_FEATURE_INCOMPAT_RECOVER|\
+					 EXT3_FEATURE_INCOMPAT_EXTENTS)
 #else
 #define EXT2_LIB_FEATURE_INCOMPAT_SUPP	(EXT2_FEATURE_INCOMPAT_FILETYPE|\
 					 EXT3_FEATURE_INCOMPAT_JOURNAL_DEV|\
 					 EXT2_FEATURE_INCOMPAT_META_BG|\
-					 EXT3_FEATURE_INCOMPAT_RECOVER)
+					 EXT3_FEATURE_INCOMPAT_RECOVER|\
+					 EXT3_FEATURE_INCOMPAT_EXTENTS)
 #endif
 #define EXT2_LIB_FEATURE_RO_COMPAT_SUPP	(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|\
 					 EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
@@ -466,7 +504,7 @@ typedef struct ext2_icount *ext2_icount_t;
  * These features are only allowed if EXT2_FLAG_SOFTSUPP_FEATURES is passed
  * to ext2fs_openfs()
  */
-#define EXT2_LIB_SOFTSUPP_INCOMPAT	(EXT3_FEATURE_INCOMPAT_EXTENTS)
+#define EXT2_LIB_SOFTSUPP_INCOMPAT	(0)
 #define EXT2_LIB_SOFTSUPP_RO_COMPAT	(EXT4_FEATURE_RO_COMPAT_HUGE_FILE|\
 					 EXT4_FEATURE_RO_COMPAT_GDT_CSUM|\
 					 EXT4_FEATURE_RO_COMPAT_DIR_NLINK|\
@@ -498,6 +536,8 @@ void ext2fs_inode_alloc_stats(ext2_filsys fs, ext2_ino_t ino, int inuse);
 void ext2fs_inode_alloc_stats2(ext2_filsys fs, ext2_ino_t ino,
 			       int inuse, int isdir);
 void ext2fs_block_alloc_stats(ext2_filsys fs, blk_t blk, int inuse);
+void ext2fs_block_alloc_stats_range(ext2_filsys fs, blk_t blk,
+				    blk_t num, int inuse);
 
 /* alloc_tables.c */
 extern errcode_t ext2fs_allocate_tables(ext2_filsys fs);
@@ -602,6 +642,13 @@ extern errcode_t ext2fs_bmap(ext2_filsys fs, ext2_ino_t ino,
 			     struct ext2_inode *inode, 
 			     char *block_buf, int bmap_flags,
 			     blk_t block, blk_t *phys_blk);
+extern errcode_t ext2fs_bmap2(ext2_filsys fs, ext2_ino_t ino,
+			      struct ext2_inode *inode,
+			      char *block_buf, int bmap_flags,
+			      blk_t block, int *ret_flags, blk_t *phys_blk);
+extern errcode_t ext2fs_bmap_run(ext2_filsys fs, ext2_ino_t ino,
+				 struct ext2_inode *inode, char *block_buf,
+				 blk_t block, struct ext2_bmap_run *run);
 
 
 #if 0
@@ -651,6 +698,11 @@ extern errcode_t ext2fs_set_dir_block(ext2_dblist dblist, ext2_ino_t ino,
 extern errcode_t ext2fs_copy_dblist(ext2_dblist src,
 				    ext2_dblist *dest);
 extern int ext2fs_dblist_count(ext2_dblist dblist);
+extern errcode_t ext2fs_dblist_iterate_parallel(ext2_dblist dblist,
+	int threads,
+	int (*func)(ext2_filsys fs, struct ext2_db_entry *db_info,
+		    char *buf, int thread, void *priv_data),
+	void *priv_data);
 
 /* dblist_dir.c */
 extern errcode_t
@@ -714,6 +766,8 @@ extern errcode_t ext2fs_dup_handle(ext2_filsys src, ext2_filsys *dest);
 extern errcode_t ext2fs_expand_dir(ext2_filsys fs, ext2_ino_t dir);
 
 /* ext_attr.c */
+extern __u32 ext2fs_ext_attr_hash_entry(struct ext2_ext_attr_entry *entry,
+					void *data);
 extern errcode_t ext2fs_read_ext_attr(ext2_filsys fs, blk_t block, void *buf);
 extern errcode_t ext2fs_write_ext_attr(ext2_filsys fs, blk_t block,
 				       void *buf);
@@ -721,6 +775,31 @@ extern errcode_t ext2fs_adjust_ea_refcount(ext2_filsys fs, blk_t blk,
 					   char *block_buf,
 					   int adjust, __u32 *newcount);
 
+/* extent.c */
+extern void ext2fs_extent_header_init(struct ext2_inode *inode);
+extern errcode_t ext2fs_extent_bmap(ext2_filsys fs, ext2_ino_t ino,
+				    struct ext2_inode *inode, char *block_buf,
+				    int bmap_flags, blk_t block,
+				    int *ret_flags, blk_t *phys_blk);
+extern errcode_t ext2fs_extent_bmap_run(ext2_filsys fs,
+					struct ext2_inode *inode,
+					char *block_buf, blk_t block,
+					struct ext2_bmap_run *run);
+extern errcode_t ext2fs_extent_punch(ext2_filsys fs, struct ext2_inode *inode,
+				     blk_t start, blk_t end,
+				     void (*release)(ext2_filsys fs, blk_t blk,
+						     blk_t count, void *priv),
+				     void *priv);
+extern errcode_t ext2fs_extent_block_iterate(ext2_filsys fs, ext2_ino_t ino,
+					     struct ext2_inode *inode, int flags,
+					     int (*func)(ext2_filsys fs,
+							 blk_t	*blocknr,
+							 e2_blkcnt_t	blockcnt,
+							 blk_t	ref_blk,
+							 int	ref_offset,
+							 void	*priv_data),
+					     void *priv_data);
+
 /* fileio.c */
 extern errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 				   struct ext2_inode *inode,
@@ -730,6 +809,7 @@ extern errcode_t ext2fs_file_open(ext2_filsys fs, ext2_ino_t ino,
 extern ext2_filsys ext2fs_file_get_fs(ext2_file_t file);
 extern errcode_t ext2fs_file_close(ext2_file_t file);
 extern errcode_t ext2fs_file_flush(ext2_file_t file);
+extern void ext2fs_file_invalidate(ext2_file_t file);
 extern errcode_t ext2fs_file_read(ext2_file_t file, void *buf,
 				  unsigned int wanted, unsigned int *got);
 extern errcode_t ext2fs_file_write(ext2_file_t file, const void *buf,
@@ -774,6 +854,10 @@ extern errcode_t ext2fs_image_bitmap_read(ext2_filsys fs, int fd, int flags);
 
 /* ind_block.c */
 errcode_t ext2fs_read_ind_block(ext2_filsys fs, blk_t blk, void *buf);
+errcode_t ext2fs_read_ind_blocks(ext2_filsys fs, blk_t *list, int count,
+				 void **bufs);
+errcode_t ext2fs_readahead_ind_blocks(ext2_filsys fs, blk_t *list,
+				      int count);
 errcode_t ext2fs_write_ind_block(ext2_filsys fs, blk_t blk, void *buf);
 
 /* initialize.c */
@@ -907,6 +991,17 @@ errcode_t ext2fs_link(ext2_filsys fs, ext2_ino_t dir, const char *name,
 errcode_t ext2fs_unlink(ext2_filsys fs, ext2_ino_t dir, const char *name,
 			ext2_ino_t ino, int flags);
 
+/* pscan.c */
+extern int ext2fs_inode_scan_threads(ext2_filsys fs);
+extern errcode_t ext2fs_inode_scan_parallel(ext2_filsys fs, int threads,
+					    int buffer_blocks, int flags,
+					    errcode_t (*func)(ext2_filsys fs,
+						ext2_ino_t ino,
+						struct ext2_inode *inode,
+						int thread,
+						void *priv_data),
+					    void *priv_data);
+
 /* read_bb.c */
 extern errcode_t ext2fs_read_bb_inode(ext2_filsys fs,
 				      ext2_badblocks_list *bb_list);
@@ -0,0 +1,1061 @@
+/*
+ * extent.c --- lookup, update and iteration of extent mapped files
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+#include "ext3_extents.h"
+
+/*
+ * An extent mapped inode keeps the root of a B+ tree in i_block[]: a
+ * header followed by up to four entries.  In the leaves (depth 0) the
+ * entries are extents, each mapping up to 32768 logical blocks to
+ * consecutive physical blocks; above them they are indexes pointing at
+ * the next level down.  Extents longer than EXT_INIT_MAX_LEN are
+ * "uninitialized": the blocks are allocated but read back as zeros.
+ *
+ * Both kinds of entry are 12 bytes long and start with the first logical
+ * block they cover, so searching a node doesn't care which kind it holds.
+ *
+ * Everything on disk is little endian, the root in i_block[] included
+ * (swapfs.c leaves it alone).  Physical blocks are 32 bits here, so the
+ * high 16 bits are always written as zero.
+ */
+
+#define EXT_INIT_MAX_LEN	(1 << 15)
+#define EXT_UNINIT_MAX_LEN	(EXT_INIT_MAX_LEN - 1)
+
+#define EXTENT_MAX_DEPTH	5
+#define EXTENT_ROOT_MAX	((sizeof(((struct ext2_inode *) 0)->i_block) - \
+			  sizeof(struct ext3_extent_header)) / \
+			 sizeof(struct ext3_extent))
+
+#define HDR(p)		((struct ext3_extent_header *) (p))
+#define EXTENT(h, i)	((struct ext3_extent *) ((h) + 1) + (i))
+#define INDEX(h, i)	((struct ext3_extent_idx *) ((h) + 1) + (i))
+
+#if defined(__GNUC__) && !defined(NO_INLINE_FUNCS)
+#define _EXTENT_INLINE_	__inline__
+#else
+#define _EXTENT_INLINE_
+#endif
+
+static _EXTENT_INLINE_ int hdr_entries(struct ext3_extent_header *hdr)
+{
+	return ext2fs_le16_to_cpu(hdr->eh_entries);
+}
+
+static _EXTENT_INLINE_ void hdr_set_entries(struct ext3_extent_header *hdr,
+					    int n)
+{
+	hdr->eh_entries = ext2fs_cpu_to_le16(n);
+}
+
+static _EXTENT_INLINE_ int hdr_max(struct ext3_extent_header *hdr)
+{
+	return ext2fs_le16_to_cpu(hdr->eh_max);
+}
+
+static _EXTENT_INLINE_ int hdr_depth(struct ext3_extent_header *hdr)
+{
+	return ext2fs_le16_to_cpu(hdr->eh_depth);
+}
+
+static _EXTENT_INLINE_ blk_t entry_lblk(struct ext3_extent_header *hdr,
+					int i)
+{
+	return ext2fs_le32_to_cpu(EXTENT(hdr, i)->ee_block);
+}
+
+static _EXTENT_INLINE_ blk_t ext_pblk(struct ext3_extent *ex)
+{
+	return ext2fs_le32_to_cpu(ex->ee_start);
+}
+
+static _EXTENT_INLINE_ int ext_uninit(struct ext3_extent *ex)
+{
+	return ext2fs_le16_to_cpu(ex->ee_len) > EXT_INIT_MAX_LEN;
+}
+
+static _EXTENT_INLINE_ blk_t ext_len(struct ext3_extent *ex)
+{
+	blk_t len = ext2fs_le16_to_cpu(ex->ee_len);
+
+	return len > EXT_INIT_MAX_LEN ? len - EXT_INIT_MAX_LEN : len;
+}
+
+static _EXTENT_INLINE_ void ext_set(struct ext3_extent *ex, blk_t lblk,
+				    blk_t pblk, blk_t len, int uninit)
+{
+	ex->ee_block = ext2fs_cpu_to_le32(lblk);
+	ex->ee_start = ext2fs_cpu_to_le32(pblk);
+	ex->ee_start_hi = 0;
+	ex->ee_len = ext2fs_cpu_to_le16(uninit ? len + EXT_INIT_MAX_LEN : len);
+}
+
+static _EXTENT_INLINE_ blk_t idx_pblk(struct ext3_extent_idx *ix)
+{
+	return ext2fs_le32_to_cpu(ix->ei_leaf);
+}
+
+static _EXTENT_INLINE_ void idx_set(struct ext3_extent_idx *ix, blk_t lblk,
+				    blk_t pblk)
+{
+	ix->ei_block = ext2fs_cpu_to_le32(lblk);
+	ix->ei_leaf = ext2fs_cpu_to_le32(pblk);
+	ix->ei_leaf_hi = 0;
+	ix->ei_unused = 0;
+}
+
+static _EXTENT_INLINE_ int node_max(ext2_filsys fs)
+{
+	return (fs->blocksize - sizeof(struct ext3_extent_header)) /
+		sizeof(struct ext3_extent);
+}
+
+static errcode_t check_node(ext2_filsys fs, struct ext3_extent_header *hdr,
+			    int max, int depth)
+{
+	int	i;
+
+	if (ext2fs_le16_to_cpu(hdr->eh_magic) != EXT3_EXT_MAGIC ||
+	    hdr_max(hdr) > max || hdr_entries(hdr) > hdr_max(hdr) ||
+	    (depth >= 0 && hdr_depth(hdr) != depth) ||
+	    hdr_depth(hdr) > EXTENT_MAX_DEPTH)
+		return EXT2_ET_EXTENT_HEADER_BAD;
+
+	if (hdr_depth(hdr) == 0) {
+		for (i = 0; i < hdr_entries(hdr); i++)
+			if (ext_len(EXTENT(hdr, i)) == 0 ||
+			    ext2fs_le16_to_cpu(EXTENT(hdr, i)->ee_start_hi))
+				return EXT2_ET_EXTENT_LEAF_BAD;
+	} else {
+		for (i = 0; i < hdr_entries(hdr); i++)
+			if (ext2fs_le16_to_cpu(INDEX(hdr, i)->ei_leaf_hi))
+				return EXT2_ET_EXTENT_INDEX_BAD;
+	}
+	return 0;
+}
+
+static errcode_t read_node(ext2_filsys fs, blk_t blk, char *buf, int depth)
+{
+	errcode_t	retval;
+
+	if (blk < fs->super->s_first_data_block ||
+	    blk >= fs->super->s_blocks_count)
+		return EXT2_ET_EXTENT_INDEX_BAD;
+	retval = io_channel_read_blk(fs->io, blk, 1, buf);
+	if (retval)
+		return retval;
+	return check_node(fs, HDR(buf), node_max(fs), depth);
+}
+
+/*
+ * Returns the last entry of the node starting at or before @lblk, or -1
+ * if @lblk lies before all of them.
+ */
+static int search_node(struct ext3_extent_header *hdr, blk_t lblk)
+{
+	int	lo = 0, hi = hdr_entries(hdr) - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (entry_lblk(hdr, mid) <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+void ext2fs_extent_header_init(struct ext2_inode *inode)
+{
+	struct ext3_extent_header *hdr = HDR(inode->i_block);
+
+	memset(inode->i_block, 0, sizeof(inode->i_block));
+	hdr->eh_magic = ext2fs_cpu_to_le16(EXT3_EXT_MAGIC);
+	hdr->eh_entries = 0;
+	hdr->eh_max = ext2fs_cpu_to_le16(EXTENT_ROOT_MAX);
+	hdr->eh_depth = 0;
+	inode->i_flags |= EXT4_EXTENTS_FL;
+}
+
+/*
+ * Plain lookup, which only needs one block of @buf: on the way down each
+ * node replaces its parent.  @run is set to the extent holding @lblk, or
+ * to the whole hole around it, bounded by the neighbouring extents and
+ * by the keys of the indexes passed on the way down.  *goal is set to a
+ * good place to allocate @lblk, should it turn out to be a hole.
+ */
+static errcode_t extent_lookup(ext2_filsys fs, struct ext2_inode *inode,
+			       char *buf, blk_t lblk,
+			       struct ext2_bmap_run *run, blk_t *goal)
+{
+	struct ext3_extent_header *hdr = HDR(inode->i_block);
+	struct ext3_extent *ex;
+	errcode_t	retval;
+	__u64		lo = 0, hi = 1ULL << 32;
+	int		i, depth;
+
+	*goal = 0;
+	retval = check_node(fs, hdr, EXTENT_ROOT_MAX, -1);
+	if (retval)
+		return retval;
+
+	for (depth = hdr_depth(hdr); depth > 0; depth--) {
+		i = search_node(hdr, lblk);
+		if (i < 0) {
+			hi = entry_lblk(hdr, 0);
+			goto hole;
+		}
+		if (entry_lblk(hdr, i) > lo)
+			lo = entry_lblk(hdr, i);
+		if (i + 1 < hdr_entries(hdr) && entry_lblk(hdr, i + 1) < hi)
+			hi = entry_lblk(hdr, i + 1);
+		retval = read_node(fs, idx_pblk(INDEX(hdr, i)), buf,
+				   depth - 1);
+		if (retval)
+			return retval;
+		hdr = HDR(buf);
+	}
+
+	i = search_node(hdr, lblk);
+	if (i + 1 < hdr_entries(hdr) && entry_lblk(hdr, i + 1) < hi)
+		hi = entry_lblk(hdr, i + 1);
+	if (i >= 0) {
+		ex = EXTENT(hdr, i);
+		if (lblk - entry_lblk(hdr, i) < ext_len(ex)) {
+			run->lblk = entry_lblk(hdr, i);
+			run->pblk = ext_pblk(ex);
+			run->len = ext_len(ex);
+			run->flags = ext_uninit(ex) ? BMAP_RET_UNINIT : 0;
+			return 0;
+		}
+		lo = entry_lblk(hdr, i) + ext_len(ex);
+		*goal = ext_pblk(ex) + ext_len(ex) +
+			(lblk - entry_lblk(hdr, i) - ext_len(ex));
+	}
+hole:
+	/* a hole can't cover all 2^32 blocks, blk_t wouldn't hold it */
+	if (hi - lo > 0xFFFFFFFFULL)
+		hi = lo + 0xFFFFFFFFULL;
+	run->lblk = lo;
+	run->pblk = 0;
+	run->len = hi - lo;
+	run->flags = 0;
+	return 0;
+}
+
+/*
+ * Updates go through a handle, which keeps the whole path from the root
+ * down to the leaf for a logical block, a buffer per level.
+ */
+struct extent_level {
+	struct ext3_extent_header *hdr;
+	blk_t	blk;		/* 0 for the root, in the inode */
+	int	idx;		/* entry the path goes through */
+};
+
+struct extent_handle {
+	ext2_filsys		fs;
+	struct ext2_inode	*inode;
+	int			depth;
+	struct extent_level	path[EXTENT_MAX_DEPTH + 1];
+	char			*buf;
+	char			*scratch;
+	blk_t			goal;
+	int			inode_dirty;
+	blk_t			freed;
+	blk_t			split_leaf;	/* empty leaf added for an append */
+	void (*release)(ext2_filsys fs, blk_t blk, blk_t count, void *priv);
+	void			*priv;
+};
+
+static errcode_t handle_open(ext2_filsys fs, struct ext2_inode *inode,
+			     struct extent_handle *h)
+{
+	errcode_t	retval;
+
+	memset(h, 0, sizeof(struct extent_handle));
+	h->fs = fs;
+	h->inode = inode;
+	retval = ext2fs_get_mem(fs->blocksize * (EXTENT_MAX_DEPTH + 1),
+				&h->buf);
+	if (retval)
+		return retval;
+	h->scratch = h->buf + fs->blocksize * EXTENT_MAX_DEPTH;
+	return 0;
+}
+
+static void handle_close(struct extent_handle *h)
+{
+	ext2fs_free_mem(&h->buf);
+}
+
+static void release_blocks(struct extent_handle *h, blk_t blk, blk_t count)
+{
+	if (h->release)
+		(*h->release)(h->fs, blk, count, h->priv);
+	else
+		ext2fs_block_alloc_stats_range(h->fs, blk, count, -1);
+	h->freed += count;
+}
+
+static errcode_t load_path(struct extent_handle *h, blk_t lblk)
+{
+	struct ext3_extent_header *hdr = HDR(h->inode->i_block);
+	errcode_t	retval;
+	int		level, i;
+	char		*buf;
+
+	retval = check_node(h->fs, hdr, EXTENT_ROOT_MAX, -1);
+	if (retval)
+		return retval;
+	h->depth = hdr_depth(hdr);
+	h->path[0].blk = 0;
+
+	for (level = 0; ; level++) {
+		h->path[level].hdr = hdr;
+		i = search_node(hdr, lblk);
+		h->path[level].idx = i;
+		if (level == h->depth)
+			break;
+
+		/* left of everything: go down the leftmost branch */
+		if (!hdr_entries(hdr))
+			return EXT2_ET_EXTENT_INDEX_BAD;
+		if (i < 0)
+			h->path[level].idx = i = 0;
+		buf = h->buf + level * h->fs->blocksize;
+		h->path[level + 1].blk = idx_pblk(INDEX(hdr, i));
+		retval = read_node(h->fs, h->path[level + 1].blk, buf,
+				   h->depth - level - 1);
+		if (retval)
+			return retval;
+		hdr = HDR(buf);
+	}
+	return 0;
+}
+
+static errcode_t write_node(struct extent_handle *h, int level)
+{
+	if (level == 0) {
+		h->inode_dirty = 1;
+		return 0;
+	}
+	return io_channel_write_blk(h->fs->io, h->path[level].blk, 1,
+				    h->path[level].hdr);
+}
+
+/*
+ * The first entry of the node at @level changed; pass its logical block
+ * up to the indexes pointing at it.
+ */
+static errcode_t fix_keys(struct extent_handle *h, int level)
+{
+	struct extent_level *parent;
+	struct ext3_extent_idx *ix;
+	errcode_t	retval;
+	blk_t		key;
+
+	for (; level > 0; level--) {
+		if (!hdr_entries(h->path[level].hdr))
+			break;
+		key = entry_lblk(h->path[level].hdr, 0);
+		parent = &h->path[level - 1];
+		ix = INDEX(parent->hdr, parent->idx);
+		if (ext2fs_le32_to_cpu(ix->ei_block) == key)
+			break;
+		ix->ei_block = ext2fs_cpu_to_le32(key);
+		retval = write_node(h, level - 1);
+		if (retval)
+			return retval;
+		if (parent->idx)
+			break;
+	}
+	return 0;
+}
+
+static errcode_t new_node(struct extent_handle *h, int depth, blk_t *ret)
+{
+	struct ext3_extent_header *hdr;
+	errcode_t	retval;
+
+	retval = ext2fs_alloc_block(h->fs, h->goal, h->scratch, ret);
+	if (retval)
+		return retval;
+	h->inode->i_blocks += h->fs->blocksize / 512;
+	h->inode_dirty = 1;
+
+	hdr = HDR(h->scratch);
+	hdr->eh_magic = ext2fs_cpu_to_le16(EXT3_EXT_MAGIC);
+	hdr->eh_max = ext2fs_cpu_to_le16(node_max(h->fs));
+	hdr->eh_depth = ext2fs_cpu_to_le16(depth);
+	return 0;
+}
+
+/*
+ * Make some progress towards a free slot in the node at @level on the path
+ * to @lblk, which must be loaded.  A full root moves down into a new
+ * block, making the tree one level deeper; any other full node is split
+ * in two, unless its parent is full too, in which case that gets seen to
+ * first.  The path is stale afterwards, callers reload it and try again.
+ */
+static errcode_t make_room(struct extent_handle *h, blk_t lblk, int level)
+{
+	struct extent_level *lv = &h->path[level], *parent;
+	struct ext3_extent_header *hdr = lv->hdr, *nhdr;
+	errcode_t	retval;
+	int		entries = hdr_entries(hdr), split;
+	blk_t		blk, key;
+
+	if (entries < hdr_max(hdr))
+		return 0;
+
+	if (level == 0) {
+		if (h->depth == EXTENT_MAX_DEPTH)
+			return EXT2_ET_CANT_INSERT_EXTENT;
+		retval = new_node(h, h->depth, &blk);
+		if (retval)
+			return retval;
+		nhdr = HDR(h->scratch);
+		hdr_set_entries(nhdr, entries);
+		memcpy(nhdr + 1, hdr + 1, entries * sizeof(struct ext3_extent));
+		retval = io_channel_write_blk(h->fs->io, blk, 1, h->scratch);
+		if (retval) {
+			release_blocks(h, blk, 1);
+			return retval;
+		}
+
+		hdr_set_entries(hdr, 1);
+		hdr->eh_depth = ext2fs_cpu_to_le16(h->depth + 1);
+		idx_set(INDEX(hdr, 0), entry_lblk(nhdr, 0), blk);
+		h->inode_dirty = 1;
+		return 0;
+	}
+
+	parent = &h->path[level - 1];
+	if (hdr_entries(parent->hdr) == hdr_max(parent->hdr))
+		return make_room(h, lblk, level - 1);
+
+	/*
+	 * Files mostly grow at the end, and splitting the last leaf down
+	 * the middle would leave every leaf half empty.  Appends get a new
+	 * empty leaf instead.
+	 */
+	if (level == h->depth && lv->idx == entries - 1)
+		split = entries;
+	else
+		split = entries / 2;
+
+	retval = new_node(h, h->depth - level, &blk);
+	if (retval)
+		return retval;
+	nhdr = HDR(h->scratch);
+	hdr_set_entries(nhdr, entries - split);
+	memcpy(nhdr + 1, EXTENT(hdr, split),
+	       (entries - split) * sizeof(struct ext3_extent));
+	key = split < entries ? entry_lblk(nhdr, 0) : lblk;
+	retval = io_channel_write_blk(h->fs->io, blk, 1, h->scratch);
+	if (retval) {
+		release_blocks(h, blk, 1);
+		return retval;
+	}
+	if (split == entries)
+		h->split_leaf = blk;
+
+	hdr_set_entries(hdr, split);
+	retval = write_node(h, level);
+	if (retval)
+		return retval;
+
+	entries = hdr_entries(parent->hdr);
+	memmove(INDEX(parent->hdr, parent->idx + 2),
+		INDEX(parent->hdr, parent->idx + 1),
+		(entries - parent->idx - 1) * sizeof(struct ext3_extent_idx));
+	idx_set(INDEX(parent->hdr, parent->idx + 1), key, blk);
+	hdr_set_entries(parent->hdr, entries + 1);
+	return write_node(h, level - 1);
+}
+
+static errcode_t remove_entry(struct extent_handle *h, int level, int i);
+
+/*
+ * An insert failed after make_room() added an empty leaf for it; take the
+ * leaf out again, if it's still empty on disk.
+ */
+static void undo_split(struct extent_handle *h, blk_t lblk)
+{
+	blk_t		blk = h->split_leaf;
+
+	h->split_leaf = 0;
+	if (load_path(h, lblk) || h->depth == 0 ||
+	    h->path[h->depth].blk != blk ||
+	    hdr_entries(h->path[h->depth].hdr))
+		return;
+	release_blocks(h, blk, 1);
+	remove_entry(h, h->depth - 1, h->path[h->depth - 1].idx);
+}
+
+static errcode_t insert_extent(struct extent_handle *h, blk_t lblk,
+			       blk_t pblk, blk_t len, int uninit)
+{
+	struct extent_level *leaf;
+	errcode_t	retval;
+	int		entries, pos;
+
+	h->split_leaf = 0;
+	for (;;) {
+		retval = load_path(h, lblk);
+		if (retval)
+			goto errout;
+		leaf = &h->path[h->depth];
+		if (hdr_entries(leaf->hdr) < hdr_max(leaf->hdr))
+			break;
+		retval = make_room(h, lblk, h->depth);
+		if (retval)
+			goto errout;
+	}
+
+	entries = hdr_entries(leaf->hdr);
+	pos = leaf->idx + 1;
+	memmove(EXTENT(leaf->hdr, pos + 1), EXTENT(leaf->hdr, pos),
+		(entries - pos) * sizeof(struct ext3_extent));
+	ext_set(EXTENT(leaf->hdr, pos), lblk, pblk, len, uninit);
+	hdr_set_entries(leaf->hdr, entries + 1);
+	retval = write_node(h, h->depth);
+	if (!retval && !pos)
+		retval = fix_keys(h, h->depth);
+	if (!retval) {
+		h->split_leaf = 0;
+		return 0;
+	}
+errout:
+	if (h->split_leaf)
+		undo_split(h, lblk);
+	return retval;
+}
+
+/*
+ * Take entry @i out of the node at @level.  Nodes left empty are freed and
+ * taken out of their parent in turn; an empty root becomes an empty leaf.
+ */
+static errcode_t remove_entry(struct extent_handle *h, int level, int i)
+{
+	struct ext3_extent_header *hdr = h->path[level].hdr;
+	int		entries = hdr_entries(hdr) - 1;
+
+	memmove(EXTENT(hdr, i), EXTENT(hdr, i + 1),
+		(entries - i) * sizeof(struct ext3_extent));
+	hdr_set_entries(hdr, entries);
+
+	if (!entries && level > 0) {
+		release_blocks(h, h->path[level].blk, 1);
+		return remove_entry(h, level - 1, h->path[level - 1].idx);
+	}
+	if (!entries)
+		hdr->eh_depth = 0;
+	if (i == 0 && entries) {
+		errcode_t retval = write_node(h, level);
+		if (retval)
+			return retval;
+		return fix_keys(h, level);
+	}
+	return write_node(h, level);
+}
+
+/*
+ * Unmaps logical blocks [start, end].  The data blocks are only released
+ * if @release_data is set, tree blocks emptied on the way always are.
+ */
+static errcode_t remove_range(struct extent_handle *h, blk_t start, blk_t end,
+			      int release_data)
+{
+	struct extent_level *leaf;
+	struct ext3_extent *ex;
+	errcode_t	retval;
+	__u64		cur = start, a, b, e_end;
+	blk_t		e_lblk, e_pblk;
+	int		i, level, uninit;
+
+	while (cur <= end) {
+		retval = load_path(h, cur);
+		if (retval)
+			return retval;
+		leaf = &h->path[h->depth];
+		i = leaf->idx;
+		if (i < 0 || entry_lblk(leaf->hdr, i) +
+		    (__u64) ext_len(EXTENT(leaf->hdr, i)) <= cur)
+			i++;
+
+		if (i >= hdr_entries(leaf->hdr)) {
+			/* nothing more in this leaf, go on with the next */
+			for (level = h->depth - 1; level >= 0; level--)
+				if (h->path[level].idx + 1 <
+				    hdr_entries(h->path[level].hdr))
+					break;
+			if (level < 0)
+				break;
+			cur = ext2fs_le32_to_cpu(INDEX(h->path[level].hdr,
+					h->path[level].idx + 1)->ei_block);
+			continue;
+		}
+
+		ex = EXTENT(leaf->hdr, i);
+		e_lblk = entry_lblk(leaf->hdr, i);
+		e_pblk = ext_pblk(ex);
+		e_end = e_lblk + (__u64) ext_len(ex) - 1;
+		uninit = ext_uninit(ex);
+		if (e_lblk > end)
+			break;
+		a = cur > e_lblk ? cur : e_lblk;
+		b = end < e_end ? end : e_end;
+
+		if (a == e_lblk && b == e_end)
+			retval = remove_entry(h, h->depth, i);
+		else if (a == e_lblk) {
+			ext_set(ex, b + 1, e_pblk + (b + 1 - e_lblk),
+				e_end - b, uninit);
+			retval = write_node(h, h->depth);
+			if (!retval && i == 0)
+				retval = fix_keys(h, h->depth);
+		} else if (b == e_end) {
+			ext_set(ex, e_lblk, e_pblk, a - e_lblk, uninit);
+			retval = write_node(h, h->depth);
+		} else {
+			/*
+			 * A hole in the middle: add the right hand part first,
+			 * so that a failure leaves the extent as it was.
+			 */
+			retval = insert_extent(h, b + 1, e_pblk + (b + 1 - e_lblk),
+					       e_end - b, uninit);
+			if (!retval)
+				retval = load_path(h, e_lblk);
+			if (!retval) {
+				leaf = &h->path[h->depth];
+				ext_set(EXTENT(leaf->hdr, leaf->idx), e_lblk,
+					e_pblk, a - e_lblk, uninit);
+				retval = write_node(h, h->depth);
+			}
+		}
+		if (retval)
+			return retval;
+
+		if (release_data)
+			release_blocks(h, e_pblk + (a - e_lblk), b - a + 1);
+		cur = b + 1;
+	}
+	return 0;
+}
+
+/*
+ * Maps @lblk to @pblk, or unmaps it if @pblk is zero.  The block it used
+ * to map to, if any, is left for the caller to deal with.
+ */
+static errcode_t set_bmap(struct extent_handle *h, blk_t lblk, blk_t pblk,
+			  int uninit)
+{
+	struct extent_level *leaf;
+	struct ext3_extent *ex;
+	errcode_t	retval;
+	blk_t		max = uninit ? EXT_UNINIT_MAX_LEN : EXT_INIT_MAX_LEN;
+	int		i;
+
+	retval = remove_range(h, lblk, lblk, 0);
+	if (retval || !pblk)
+		return retval;
+
+	h->goal = pblk;
+	retval = load_path(h, lblk);
+	if (retval)
+		return retval;
+	leaf = &h->path[h->depth];
+	i = leaf->idx;
+
+	/* grow a neighbour if we can, rather than add a new extent */
+	if (i >= 0) {
+		ex = EXTENT(leaf->hdr, i);
+		if (entry_lblk(leaf->hdr, i) + ext_len(ex) == lblk &&
+		    ext_pblk(ex) + ext_len(ex) == pblk &&
+		    ext_uninit(ex) == uninit && ext_len(ex) < max) {
+			ext_set(ex, entry_lblk(leaf->hdr, i), ext_pblk(ex),
+				ext_len(ex) + 1, uninit);
+			return write_node(h, h->depth);
+		}
+	}
+	if (i + 1 < hdr_entries(leaf->hdr)) {
+		ex = EXTENT(leaf->hdr, i + 1);
+		if (entry_lblk(leaf->hdr, i + 1) == lblk + 1 &&
+		    ext_pblk(ex) == pblk + 1 &&
+		    ext_uninit(ex) == uninit && ext_len(ex) < max) {
+			ext_set(ex, lblk, pblk, ext_len(ex) + 1, uninit);
+			retval = write_node(h, h->depth);
+			if (retval || i + 1)
+				return retval;
+			return fix_keys(h, h->depth);
+		}
+	}
+	return insert_extent(h, lblk, pblk, 1, uninit);
+}
+
+errcode_t ext2fs_extent_bmap(ext2_filsys fs, ext2_ino_t ino,
+			     struct ext2_inode *inode, char *block_buf,
+			     int bmap_flags, blk_t block, int *ret_flags,
+			     blk_t *phys_blk)
+{
+	struct extent_handle h;
+	struct ext2_bmap_run run;
+	errcode_t	retval;
+	char		*buf = 0;
+	blk_t		pblk, goal;
+	int		uninit, blocks_alloc = 0;
+
+	if (ret_flags)
+		*ret_flags = 0;
+
+	if (!block_buf) {
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+		if (retval)
+			return retval;
+		block_buf = buf;
+	}
+
+	if (bmap_flags & BMAP_SET) {
+		pblk = *phys_blk;
+		uninit = (bmap_flags & BMAP_UNINIT) != 0;
+		goto update;
+	}
+
+	retval = extent_lookup(fs, inode, block_buf, block, &run, &goal);
+	if (retval)
+		goto done;
+	pblk = run.pblk ? run.pblk + (block - run.lblk) : 0;
+	uninit = (run.flags & BMAP_RET_UNINIT) != 0;
+	*phys_blk = pblk;
+	if (uninit && ret_flags)
+		*ret_flags |= BMAP_RET_UNINIT;
+	if (!(bmap_flags & BMAP_ALLOC) || (pblk && !uninit))
+		goto done;
+
+	/*
+	 * Allocating: either a new block for a hole, or the block of an
+	 * uninitialized extent, which just has to be marked as in use.
+	 */
+	if (!pblk) {
+		retval = ext2fs_alloc_block(fs, goal, block_buf, &pblk);
+		if (retval)
+			goto done;
+		blocks_alloc++;
+	}
+	uninit = 0;
+
+update:
+	retval = handle_open(fs, inode, &h);
+	if (retval)
+		goto done;
+	retval = set_bmap(&h, block, pblk, uninit);
+	if (h.freed)
+		inode->i_blocks -= h.freed * (fs->blocksize / 512);
+	if (retval && blocks_alloc)
+		ext2fs_block_alloc_stats(fs, pblk, -1);
+	else if (!retval && !(bmap_flags & BMAP_SET)) {
+		*phys_blk = pblk;
+		inode->i_blocks += (blocks_alloc * fs->blocksize) / 512;
+	}
+	if (h.inode_dirty || blocks_alloc || h.freed) {
+		errcode_t err = ext2fs_write_inode(fs, ino, inode);
+		if (!retval)
+			retval = err;
+	}
+	handle_close(&h);
+done:
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return retval;
+}
+
+errcode_t ext2fs_extent_bmap_run(ext2_filsys fs, struct ext2_inode *inode,
+				 char *block_buf, blk_t block,
+				 struct ext2_bmap_run *run)
+{
+	errcode_t	retval;
+	char		*buf = 0;
+	blk_t		goal;
+
+	if (!block_buf) {
+		retval = ext2fs_get_mem(fs->blocksize, &buf);
+		if (retval)
+			return retval;
+		block_buf = buf;
+	}
+	retval = extent_lookup(fs, inode, block_buf, block, run, &goal);
+	if (buf)
+		ext2fs_free_mem(&buf);
+	return retval;
+}
+
+errcode_t ext2fs_extent_punch(ext2_filsys fs, struct ext2_inode *inode,
+			      blk_t start, blk_t end,
+			      void (*release)(ext2_filsys fs, blk_t blk,
+					      blk_t count, void *priv),
+			      void *priv)
+{
+	struct extent_handle h;
+	errcode_t	retval;
+
+	if (start > end)
+		return 0;
+	retval = handle_open(fs, inode, &h);
+	if (retval)
+		return retval;
+	h.release = release;
+	h.priv = priv;
+	retval = remove_range(&h, start, end, 1);
+	inode->i_blocks -= h.freed * (fs->blocksize / 512);
+	handle_close(&h);
+	return retval;
+}
+
+/*
+ * ext2fs_block_iterate2() for extent mapped inodes.  Tree blocks below the
+ * root are reported with BLOCK_COUNT_IND, unless BLOCK_FLAG_DATA_ONLY is
+ * given.  Changes to data blocks are collected, and only applied to the
+ * tree once the walk is over.  A tree block changed to 0 is taken out of
+ * the tree along with everything below it, as an indirect block would be;
+ * if that was reported before its children, they aren't visited.
+ */
+struct extent_iter {
+	ext2_filsys	fs;
+	int		flags;
+	int (*func)(ext2_filsys	fs,
+		    blk_t	*blocknr,
+		    e2_blkcnt_t	bcount,
+		    blk_t	ref_blk,
+		    int		ref_offset,
+		    void	*priv_data);
+	void		*priv_data;
+	char		*buf;
+	e2_blkcnt_t	next;		/* block after the last one mapped */
+	blk_t		(*changes)[2];
+	int		nchanges;
+	int		changes_size;
+	int		inode_dirty;
+	blk_t		freed;		/* emptied tree blocks released */
+	errcode_t	errcode;
+};
+
+static int iterate_tree_block(struct extent_iter *it,
+			      struct ext3_extent_header *hdr, blk_t ref_blk,
+			      int i, int *changed)
+{
+	struct ext3_extent_idx *ix = INDEX(hdr, i);
+	blk_t		blk = idx_pblk(ix), new_blk = blk;
+	int		ret;
+
+	ret = (*it->func)(it->fs, &new_blk, BLOCK_COUNT_IND, ref_blk,
+			  (char *) ix - (char *) hdr, it->priv_data);
+	if ((ret & BLOCK_CHANGED) && new_blk != blk) {
+		ix->ei_leaf = ext2fs_cpu_to_le32(new_blk);
+		*changed = 1;
+	}
+	return ret;
+}
+
+static void drop_index(struct ext3_extent_header *hdr, int i)
+{
+	int		entries = hdr_entries(hdr) - 1;
+
+	memmove(INDEX(hdr, i), INDEX(hdr, i + 1),
+		(entries - i) * sizeof(struct ext3_extent_idx));
+	hdr_set_entries(hdr, entries);
+}
+
+static int iterate_node(struct extent_iter *it, struct ext3_extent_header *hdr,
+			blk_t node_blk, int level)
+{
+	struct ext3_extent *ex;
+	struct ext3_extent_header *child;
+	blk_t		lblk, pblk, len, j, blk;
+	int		i, r, ret = 0, changed = 0;
+
+	if (hdr_depth(hdr) == 0) {
+		for (i = 0; i < hdr_entries(hdr); i++) {
+			ex = EXTENT(hdr, i);
+			lblk = entry_lblk(hdr, i);
+			pblk = ext_pblk(ex);
+			len = ext_len(ex);
+			for (j = 0; j < len; j++) {
+				blk = pblk + j;
+				r = (*it->func)(it->fs, &blk, lblk + j,
+						node_blk,
+						(char *) ex - (char *) hdr,
+						it->priv_data);
+				ret |= r & ~BLOCK_CHANGED;
+				if ((r & BLOCK_CHANGED) && blk != pblk + j) {
+					if (it->nchanges == it->changes_size) {
+						it->changes_size += 64;
+						it->errcode = ext2fs_resize_mem(0,
+							it->changes_size *
+							sizeof(*it->changes),
+							&it->changes);
+						if (it->errcode)
+							return ret | BLOCK_ERROR
+								| BLOCK_ABORT;
+					}
+					it->changes[it->nchanges][0] = lblk + j;
+					it->changes[it->nchanges][1] = blk;
+					it->nchanges++;
+				}
+				if (r & BLOCK_ABORT)
+					return ret;
+			}
+			it->next = (e2_blkcnt_t) lblk + len;
+		}
+		return ret;
+	}
+
+	child = HDR(it->buf + level * it->fs->blocksize);
+	for (i = 0; i < hdr_entries(hdr); i++) {
+		if (!(it->flags & (BLOCK_FLAG_DEPTH_TRAVERSE |
+				   BLOCK_FLAG_DATA_ONLY)))
+			ret |= iterate_tree_block(it, hdr, node_blk, i,
+						  &changed);
+		blk = idx_pblk(INDEX(hdr, i));
+		if (blk && !(ret & BLOCK_ABORT)) {
+			it->errcode = read_node(it->fs, blk, (char *) child,
+						hdr_depth(hdr) - 1);
+			if (it->errcode) {
+				ret |= BLOCK_ERROR | BLOCK_ABORT;
+				break;
+			}
+			ret |= iterate_node(it, child, blk, level + 1);
+			if ((it->flags & BLOCK_FLAG_DEPTH_TRAVERSE) &&
+			    !(it->flags & BLOCK_FLAG_DATA_ONLY) &&
+			    !(ret & BLOCK_ABORT))
+				ret |= iterate_tree_block(it, hdr, node_blk, i,
+							  &changed);
+
+			/* keep the index in step with what's left below it */
+			blk = idx_pblk(INDEX(hdr, i));
+			if (blk && !hdr_entries(child)) {
+				ext2fs_block_alloc_stats(it->fs, blk, -1);
+				it->freed++;
+				blk = 0;
+			} else if (blk && entry_lblk(child, 0) !=
+				   entry_lblk(hdr, i)) {
+				INDEX(hdr, i)->ei_block =
+					ext2fs_cpu_to_le32(entry_lblk(child, 0));
+				changed = 1;
+			}
+		}
+		if (!blk) {
+			drop_index(hdr, i--);
+			changed = 1;
+		}
+		if (ret & BLOCK_ABORT)
+			break;
+	}
+
+	if (changed) {
+		/* an empty root is an empty leaf */
+		if (level == 0 && !hdr_entries(hdr))
+			hdr->eh_depth = 0;
+		if (level == 0)
+			it->inode_dirty = 1;
+		else {
+			it->errcode = io_channel_write_blk(it->fs->io,
+							   node_blk, 1, hdr);
+			if (it->errcode)
+				ret |= BLOCK_ERROR | BLOCK_ABORT;
+		}
+	}
+	return ret;
+}
+
+errcode_t ext2fs_extent_block_iterate(ext2_filsys fs, ext2_ino_t ino,
+				      struct ext2_inode *inode, int flags,
+				      int (*func)(ext2_filsys fs,
+						  blk_t	*blocknr,
+						  e2_blkcnt_t	blockcnt,
+						  blk_t	ref_blk,
+						  int		ref_offset,
+						  void	*priv_data),
+				      void *priv_data)
+{
+	struct ext3_extent_header *root = HDR(inode->i_block);
+	struct extent_iter it;
+	struct extent_handle h;
+	errcode_t	retval;
+	blk_t		blk;
+	int		i, ret;
+
+	retval = check_node(fs, root, EXTENT_ROOT_MAX, -1);
+	if (retval)
+		return retval;
+
+	memset(&it, 0, sizeof(it));
+	it.fs = fs;
+	it.flags = flags;
+	it.func = func;
+	it.priv_data = priv_data;
+	retval = ext2fs_get_mem(fs->blocksize * EXTENT_MAX_DEPTH, &it.buf);
+	if (retval)
+		return retval;
+
+	ret = iterate_node(&it, root, 0, 0);
+	retval = (ret & BLOCK_ERROR) ? it.errcode : 0;
+	if (it.freed) {
+		inode->i_blocks -= it.freed * (fs->blocksize / 512);
+		it.inode_dirty = 1;
+	}
+
+	if (!retval && (it.nchanges ||
+	    ((flags & BLOCK_FLAG_APPEND) && !(ret & BLOCK_ABORT)))) {
+		retval = handle_open(fs, inode, &h);
+		for (i = 0; i < it.nchanges && !retval; i++)
+			retval = set_bmap(&h, it.changes[i][0],
+					  it.changes[i][1], 0);
+
+		/* offer the block after the end, for the caller to fill */
+		if (!retval && (flags & BLOCK_FLAG_APPEND) &&
+		    !(ret & BLOCK_ABORT)) {
+			blk = 0;
+			ret = (*func)(fs, &blk, it.next, 0, 0, priv_data);
+			if ((ret & BLOCK_CHANGED) && blk) {
+				h.goal = blk;
+				retval = set_bmap(&h, it.next, blk, 0);
+			}
+		}
+		if (!h.buf)
+			goto out;
+		if (h.freed)
+			inode->i_blocks -= h.freed * (fs->blocksize / 512);
+		if (h.inode_dirty || h.freed)
+			it.inode_dirty = 1;
+		handle_close(&h);
+	}
+out:
+	if (it.inode_dirty) {
+		errcode_t err = ext2fs_write_inode(fs, ino, inode);
+		if (!retval)
+			retval = err;
+	}
+	if (it.changes)
+		ext2fs_free_mem(&it.changes);
+	ext2fs_free_mem(&it.buf);
+	return retval;
+}
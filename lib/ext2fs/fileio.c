@@ -31,10 +31,56 @@ struct ext2_file {
 	blk_t			blockno;
 	blk_t			physblock;
 	char 			*buf;
+	struct ext2_bmap_run	runs[EXT2_FILE_RUNS];
+	int			run_next;
 };
 
 #define BMAP_BUFFER (file->buf + fs->blocksize)
 
+/*
+ * Maps file->blockno, looking in the runs cached by earlier lookups
+ * first.  On a miss the whole run around the block is looked up and
+ * replaces the oldest cached one, so reads within a run already seen
+ * cost no indirect or extent block I/O at all.
+ */
+static errcode_t file_bmap(ext2_file_t file, int *ret_flags)
+{
+	ext2_filsys	fs = file->fs;
+	struct ext2_bmap_run *run;
+	errcode_t	retval;
+	int		i;
+
+	for (i = 0, run = file->runs; i < EXT2_FILE_RUNS; i++, run++)
+		if (run->len && file->blockno - run->lblk < run->len)
+			goto found;
+
+	run = &file->runs[file->run_next];
+	retval = ext2fs_bmap_run(fs, file->ino, &file->inode, BMAP_BUFFER,
+				 file->blockno, run);
+	if (retval) {
+		run->len = 0;
+		return retval;
+	}
+	file->run_next = (file->run_next + 1) % EXT2_FILE_RUNS;
+found:
+	file->physblock = run->pblk ?
+		run->pblk + (file->blockno - run->lblk) : 0;
+	*ret_flags = run->flags;
+	return 0;
+}
+
+/*
+ * Forgets the cached runs that cover logical block @block.
+ */
+static void file_drop_runs(ext2_file_t file, blk_t block)
+{
+	int	i;
+
+	for (i = 0; i < EXT2_FILE_RUNS; i++)
+		if (block - file->runs[i].lblk < file->runs[i].len)
+			file->runs[i].len = 0;
+}
+
 errcode_t ext2fs_file_open2(ext2_filsys fs, ext2_ino_t ino,
 			    struct ext2_inode *inode,
 			    int flags, ext2_file_t *ret)
@@ -124,6 +170,7 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 				     file->blockno, &file->physblock);
 		if (retval)
 			return retval;
+		file_drop_runs(file, file->blockno);
 	}
 
 	retval = io_channel_write_blk(fs->io, file->physblock,
@@ -136,6 +183,19 @@ errcode_t ext2fs_file_flush(ext2_file_t file)
 	return retval;
 }
 
+/*
+ * This function drops the block buffer and all cached block mappings,
+ * for callers that have changed the file's blocks behind its back.  Any
+ * dirty data in the buffer must have been flushed first.
+ */
+void ext2fs_file_invalidate(ext2_file_t file)
+{
+	file->flags &= ~(EXT2_FILE_BUF_VALID | EXT2_FILE_BUF_DIRTY);
+	file->physblock = 0;
+	memset(file->runs, 0, sizeof(file->runs));
+	file->run_next = 0;
+}
+
 /*
  * This function synchronizes the file's block buffer and the current
  * file position, possibly invalidating block buffer if necessary
@@ -169,13 +229,19 @@ static errcode_t load_buffer(ext2_file_t file, int dontfill)
 {
 	ext2_filsys	fs = file->fs;
 	errcode_t	retval;
+	int		ret_flags;
 
 	if (!(file->flags & EXT2_FILE_BUF_VALID)) {
-		retval = ext2fs_bmap(fs, file->ino, &file->inode,
-				     BMAP_BUFFER, 0, file->blockno,
-				     &file->physblock);
+		retval = file_bmap(file, &ret_flags);
 		if (retval)
 			return retval;
+		/*
+		 * Blocks of uninitialized extents read back as zeros,
+		 * just like holes.  ext2fs_file_flush() then marks them
+		 * in use when they are written.
+		 */
+		if (ret_flags & BMAP_RET_UNINIT)
+			file->physblock = 0;
 		if (!dontfill) {
 			if (file->physblock) {
 				retval = io_channel_read_blk(fs->io,
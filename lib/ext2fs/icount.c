@@ -35,14 +35,18 @@
  * Also, e2fsck tends to load the icount data sequentially.
  *
  * So, we use an inode bitmap to indicate which inodes have a count of
- * one, and then use a sorted list to store the counts for inodes
- * which are greater than one.
+ * one, and then use a hash table to store the counts for inodes
+ * which are greater than one.  The table is open addressed, with
+ * linear probing, and is doubled in size when it gets three quarters
+ * full.  Entries are never taken out (a count which drops to zero
+ * stays in the table as zero), so no slot ever needs to be marked as
+ * deleted, and inodes can be added in any order in constant time.
  *
  * We also use an optional bitmap to indicate which inodes are already
- * in the sorted list, to speed up the use of this abstraction by
- * e2fsck's pass 2.  Pass 2 increments inode counts as it finds them,
- * so this extra bitmap avoids searching the sorted list to see if a
- * particular inode is on the sorted list already.
+ * in the table, to speed up the use of this abstraction by e2fsck's
+ * pass 2.  Pass 2 increments inode counts as it finds them, so this
+ * extra bitmap avoids looking in the table to see if a particular
+ * inode is in it already.
  */
 
 struct ext2_icount_el {
@@ -55,9 +59,9 @@ struct ext2_icount {
 	ext2fs_inode_bitmap	single;
 	ext2fs_inode_bitmap	multiple;
 	ext2_ino_t		count;
-	ext2_ino_t		size;
+	ext2_ino_t		size;	/* Entries held before the table grows */
 	ext2_ino_t		num_inodes;
-	ext2_ino_t		cursor;
+	int			bits;	/* The table has 1 << bits slots */
 	struct ext2_icount_el	*list;
 	struct ext2_icount_el	*last_lookup;
 	char			*tdb_fn;
@@ -168,6 +172,119 @@ static void uuid_unparse(void *uu, char *out)
 		uuid.node[3], uuid.node[4], uuid.node[5]);
 }
 
+/*
+ * Fibonacci hashing: the top bits of the product are well mixed even
+ * for runs of consecutive inode numbers.
+ */
+static ext2_ino_t icount_hash(ext2_icount_t icount, ext2_ino_t ino)
+{
+	return (ext2_ino_t) ((__u32) (ino * 2654435761U) >> (32 - icount->bits));
+}
+
+/*
+ * alloc_table() --- allocate an empty table which can hold at least
+ * 	size entries before it has to grow.
+ */
+static errcode_t alloc_table(ext2_icount_t icount, ext2_ino_t size)
+{
+	errcode_t	retval;
+	size_t		slots;
+	int		bits = 4;
+
+	while (bits < 31 && ((ext2_ino_t) 3 << (bits - 2)) < size)
+		bits++;
+	slots = (size_t) 1 << bits;
+	retval = ext2fs_get_mem(slots * sizeof(struct ext2_icount_el),
+				&icount->list);
+	if (retval)
+		return retval;
+	memset(icount->list, 0, slots * sizeof(struct ext2_icount_el));
+	icount->bits = bits;
+	icount->size = (ext2_ino_t) 3 << (bits - 2);
+	icount->count = 0;
+	icount->last_lookup = 0;
+	return 0;
+}
+
+/*
+ * find_slot() --- return the slot holding ino, or the empty slot where
+ * 	it would go.
+ */
+static struct ext2_icount_el *find_slot(ext2_icount_t icount, ext2_ino_t ino)
+{
+	ext2_ino_t	i, mask = ((ext2_ino_t) 1 << icount->bits) - 1;
+
+	for (i = icount_hash(icount, ino); icount->list[i].ino;
+	     i = (i + 1) & mask)
+		if (icount->list[i].ino == ino)
+			break;
+	return &icount->list[i];
+}
+
+/*
+ * grow_table() --- double the size of the table.
+ */
+static errcode_t grow_table(ext2_icount_t icount)
+{
+	struct ext2_icount_el	*old = icount->list, *el;
+	ext2_ino_t		i, old_slots = (ext2_ino_t) 1 << icount->bits;
+	ext2_ino_t		count = icount->count;
+	errcode_t		retval;
+
+	if (icount->bits >= 31)
+		return EXT2_ET_NO_MEMORY;
+#if 0
+	printf("Reallocating icount %u entries...\n", icount->size * 2);
+#endif
+	retval = alloc_table(icount, icount->size * 2);
+	if (retval) {
+		icount->list = old;
+		return retval;
+	}
+	for (i = 0; i < old_slots; i++) {
+		if (!old[i].ino)
+			continue;
+		el = find_slot(icount, old[i].ino);
+		*el = old[i];
+	}
+	icount->count = count;
+	ext2fs_free_mem(&old);
+	return 0;
+}
+
+/*
+ * get_icount_el() --- given an inode number, try to find icount
+ * 	information in the table.  If the create flag is set, and we
+ * 	can't find an entry, create one.
+ */
+static struct ext2_icount_el *get_icount_el(ext2_icount_t icount,
+					    ext2_ino_t ino, int create)
+{
+	struct ext2_icount_el	*el;
+
+	if (!icount || !icount->list)
+		return 0;
+
+	if (icount->last_lookup && icount->last_lookup->ino == ino)
+		return icount->last_lookup;
+
+	el = find_slot(icount, ino);
+	if (!el->ino) {
+		if (!create)
+			return 0;
+		if (icount->count >= icount->size) {
+			if (grow_table(icount))
+				return 0;
+			el = find_slot(icount, ino);
+		}
+		el->ino = ino;
+		el->count = 0;
+		icount->count++;
+	}
+	icount->last_lookup = el;
+	return el;
+}
+
 errcode_t ext2fs_create_icount_tdb(ext2_filsys fs, char *tdb_dir,
 				   int flags, ext2_icount_t *ret)
 {
@@ -209,7 +326,6 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 {
 	ext2_icount_t	icount;
 	errcode_t	retval;
-	size_t		bytes;
 	ext2_ino_t	i;
 
 	if (hint) {
@@ -236,28 +352,22 @@ errcode_t ext2fs_create_icount2(ext2_filsys fs, int flags, unsigned int size,
 		icount->size += fs->super->s_inodes_count / 50;
 	}
 
-	bytes = (size_t) (icount->size * sizeof(struct ext2_icount_el));
-#if 0
-	printf("Icount allocated %u entries, %d bytes.\n",
-	       icount->size, bytes);
-#endif
-	retval = ext2fs_get_mem(bytes, &icount->list);
+	retval = alloc_table(icount, icount->size);
 	if (retval)
 		goto errout;
-	memset(icount->list, 0, bytes);
-
-	icount->count = 0;
-	icount->cursor = 0;
 
 	/*
-	 * Populate the sorted list with those entries which were
-	 * found in the hint icount (since those are ones which will
-	 * likely need to be in the sorted list this time around).
+	 * Populate the table with those entries which were found in
+	 * the hint icount (since those are ones which will likely
+	 * need to be in the table this time around).
 	 */
-	if (hint) {
-		for (i=0; i < hint->count; i++)
-			icount->list[i].ino = hint->list[i].ino;
-		icount->count = hint->count;
+	if (hint && hint->list) {
+		for (i=0; i < ((ext2_ino_t) 1 << hint->bits); i++)
+			if (hint->list[i].ino &&
+			    !get_icount_el(icount, hint->list[i].ino, 1)) {
+				retval = EXT2_ET_NO_MEMORY;
+				goto errout;
+			}
 	}
 
 	*ret = icount;
@@ -275,131 +385,6 @@ errcode_t ext2fs_create_icount(ext2_filsys fs, int flags,
 	return ext2fs_create_icount2(fs, flags, size, 0, ret);
 }
 
-/*
- * insert_icount_el() --- Insert a new entry into the sorted list at a
- * 	specified position.
- */
-static struct ext2_icount_el *insert_icount_el(ext2_icount_t icount,
-					    ext2_ino_t ino, int pos)
-{
-	struct ext2_icount_el 	*el;
-	errcode_t		retval;
-	ext2_ino_t		new_size = 0;
-	int			num;
-
-	if (icount->last_lookup && icount->last_lookup->ino == ino)
-		return icount->last_lookup;
-
-	if (icount->count >= icount->size) {
-		if (icount->count) {
-			new_size = icount->list[(unsigned)icount->count-1].ino;
-			new_size = (ext2_ino_t) (icount->count *
-				((float) icount->num_inodes / new_size));
-		}
-		if (new_size < (icount->size + 100))
-			new_size = icount->size + 100;
-#if 0
-		printf("Reallocating icount %u entries...\n", new_size);
-#endif
-		retval = ext2fs_resize_mem((size_t) icount->size *
-					   sizeof(struct ext2_icount_el),
-					   (size_t) new_size *
-					   sizeof(struct ext2_icount_el),
-					   &icount->list);
-		if (retval)
-			return 0;
-		icount->size = new_size;
-	}
-	num = (int) icount->count - pos;
-	if (num < 0)
-		return 0;	/* should never happen */
-	if (num) {
-		memmove(&icount->list[pos+1], &icount->list[pos],
-			sizeof(struct ext2_icount_el) * num);
-	}
-	icount->count++;
-	el = &icount->list[pos];
-	el->count = 0;
-	el->ino = ino;
-	icount->last_lookup = el;
-	return el;
-}
-
-/*
- * get_icount_el() --- given an inode number, try to find icount
- * 	information in the sorted list.  If the create flag is set,
- * 	and we can't find an entry, create one in the sorted list.
- */
-static struct ext2_icount_el *get_icount_el(ext2_icount_t icount,
-					    ext2_ino_t ino, int create)
-{
-	float	range;
-	int	low, high, mid;
-	ext2_ino_t	lowval, highval;
-
-	if (!icount || !icount->list)
-		return 0;
-
-	if (create && ((icount->count == 0) ||
-		       (ino > icount->list[(unsigned)icount->count-1].ino))) {
-		return insert_icount_el(icount, ino, (unsigned) icount->count);
-	}
-	if (icount->count == 0)
-		return 0;
-
-	if (icount->cursor >= icount->count)
-		icount->cursor = 0;
-	if (ino == icount->list[icount->cursor].ino)
-		return &icount->list[icount->cursor++];
-#if 0
-	printf("Non-cursor get_icount_el: %u\n", ino);
-#endif
-	low = 0;
-	high = (int) icount->count-1;
-	while (low <= high) {
-#if 0
-		mid = (low+high)/2;
-#else
-		if (low == high)
-			mid = low;
-		else {
-			/* Interpolate for efficiency */
-			lowval = icount->list[low].ino;
-			highval = icount->list[high].ino;
-
-			if (ino < lowval)
-				range = 0;
-			else if (ino > highval)
-				range = 1;
-			else {
-				range = ((float) (ino - lowval)) /
-					(highval - lowval);
-				if (range > 0.9)
-					range = 0.9;
-				if (range < 0.1)
-					range = 0.1;
-			}
-			mid = low + ((int) (range * (high-low)));
-		}
-#endif
-		if (ino == icount->list[mid].ino) {
-			icount->cursor = mid+1;
-			return &icount->list[mid];
-		}
-		if (ino < icount->list[mid].ino)
-			high = mid-1;
-		else
-			low = mid+1;
-	}
-	/*
-	 * If we need to create a new entry, it should be right at
-	 * low (where high will be left at low-1).
-	 */
-	if (create)
-		return insert_icount_el(icount, ino, low);
-	return 0;
-}
-
 static errcode_t set_inode_count(ext2_icount_t icount, ext2_ino_t ino,
 				 __u16 count)
 {
@@ -473,11 +458,16 @@ errcode_t ext2fs_icount_validate(ext2_icount_t icount, FILE *out)
 		fprintf(out, "%s: count > size\n", bad);
 		return EXT2_ET_INVALID_ARGUMENT;
 	}
-	for (i=1; i < icount->count; i++) {
-		if (icount->list[i-1].ino >= icount->list[i].ino) {
-			fprintf(out, "%s: list[%d].ino=%u, list[%d].ino=%u\n",
-				bad, i-1, icount->list[i-1].ino,
-				i, icount->list[i].ino);
+	if (!icount->list)
+		return 0;
+	/* Every entry must be reachable from its hash slot */
+	for (i=0; i < ((ext2_ino_t) 1 << icount->bits); i++) {
+		if (!icount->list[i].ino)
+			continue;
+		if (find_slot(icount, icount->list[i].ino) !=
+		    &icount->list[i]) {
+			fprintf(out, "%s: list[%d].ino=%u not found\n",
+				bad, i, icount->list[i].ino);
 			ret = EXT2_ET_INVALID_ARGUMENT;
 		}
 	}
@@ -725,6 +715,37 @@ struct test_program extended[] = {
 	{ EXIT, 0, 0, 0 }
 };
 
+/* Counts going past 1 and back down, with the table growing in between */
+struct test_program crossing[] = {
+	{ INCREMENT, 7, 0, 1 },
+	{ INCREMENT, 7, 0, 2 },
+	{ INCREMENT, 7, 0, 3 },
+	{ DECREMENT, 7, 0, 2 },
+	{ DECREMENT, 7, 0, 1 },
+	{ STORE, 100, 2, 2 },
+	{ STORE, 200, 3, 3 },
+	{ STORE, 300, 4, 4 },
+	{ STORE, 400, 5, 5 },
+	{ INCREMENT, 7, 0, 2 },
+	{ DECREMENT, 7, 0, 1 },
+	{ DECREMENT, 7, 0, 0 },
+	{ INCREMENT, 7, 0, 1 },
+	{ INCREMENT, 7, 0, 2 },
+	{ STORE, 7, 1, 1 },
+	{ INCREMENT, 7, 0, 2 },
+	{ DECREMENT, 7, 0, 1 },
+	{ DECREMENT, 7, 0, 0 },
+	{ DECREMENT, 400, 0, 4 },
+	{ STORE, 300, 0, 0 },
+	{ INCREMENT, 300, 0, 1 },
+	{ INCREMENT, 300, 0, 2 },
+	{ FETCH, 7, 0, 0 },
+	{ FETCH, 100, 0, 2 },
+	{ FETCH, 200, 0, 3 },
+	{ FETCH, 400, 0, 4 },
+	{ EXIT, 0, 0, 0 }
+};
+
 /*
  * Setup the variables for doing the inode scan test.
  */
@@ -831,6 +852,146 @@ int run_test(int flags, int size, char *dir, struct test_program *prog)
 	return problem;
 }
 
+/*
+ * The reference for random_test(): a list of the non-zero counts,
+ * sorted by inode number, the way the counts used to be kept.
+ */
+struct ref_el {
+	ext2_ino_t	ino;
+	__u16		count;
+};
+
+static struct ref_el	*ref_list;
+static int		ref_count, ref_size;
+
+static __u16 *ref_lookup(ext2_ino_t ino, int create)
+{
+	int	low = 0, high = ref_count - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (ref_list[mid].ino == ino)
+			return &ref_list[mid].count;
+		if (ino < ref_list[mid].ino)
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+	if (!create)
+		return 0;
+	if (ref_count == ref_size) {
+		ref_size += 100;
+		ref_list = realloc(ref_list, ref_size * sizeof(struct ref_el));
+		if (!ref_list) {
+			printf("Out of memory\n");
+			exit(1);
+		}
+	}
+	memmove(&ref_list[low + 1], &ref_list[low],
+		(ref_count - low) * sizeof(struct ref_el));
+	ref_count++;
+	ref_list[low].ino = ino;
+	ref_list[low].count = 0;
+	return &ref_list[low].count;
+}
+
+static __u16 ref_fetch(ext2_ino_t ino)
+{
+	__u16	*c = ref_lookup(ino, 0);
+
+	return c ? *c : 0;
+}
+
+/*
+ * Drive the icount with random increments, decrements and stores over
+ * a few inodes (so that their counts keep going past 1 and back down)
+ * and over the whole filesystem (so that the table grows), checking
+ * every count against the reference.
+ */
+int random_test(int flags, int size, unsigned int seed)
+{
+	errcode_t	retval, expect_err;
+	ext2_icount_t	icount, copy;
+	ext2_ino_t	ino, num_inodes = test_fs->super->s_inodes_count;
+	__u16		result, expected;
+	int		i, op, problem = 0;
+
+	retval = ext2fs_create_icount2(test_fs, flags, size, 0, &icount);
+	if (retval) {
+		com_err("random_test", retval, "while creating icount");
+		exit(1);
+	}
+	ref_count = 0;
+	srand(seed);
+	for (i = 0; i < 200000; i++) {
+		if (i & 1)
+			ino = 1 + rand() % 16;
+		else
+			ino = 1 + rand() % num_inodes;
+		expected = ref_fetch(ino);
+		expect_err = 0;
+		result = 0;
+		op = rand() % 8;
+		if (op < 3) {
+			retval = ext2fs_icount_increment(icount, ino, &result);
+			*ref_lookup(ino, 1) = ++expected;
+		} else if (op < 6) {
+			retval = ext2fs_icount_decrement(icount, ino, &result);
+			if (expected)
+				*ref_lookup(ino, 1) = --expected;
+			else
+				expect_err = EXT2_ET_INVALID_ARGUMENT;
+		} else if (op < 7) {
+			expected = rand() % 4;
+			retval = ext2fs_icount_store(icount, ino, expected);
+			result = expected;
+			*ref_lookup(ino, 1) = expected;
+		} else
+			retval = ext2fs_icount_fetch(icount, ino, &result);
+		if (retval != expect_err ||
+		    (!expect_err && result != expected)) {
+			printf("op %d on inode %u: got %u (%ld), expected %u\n",
+			       op, ino, result, (long) retval, expected);
+			problem++;
+			break;
+		}
+	}
+	for (ino = 1; ino <= num_inodes; ino++) {
+		ext2fs_icount_fetch(icount, ino, &result);
+		if (result != ref_fetch(ino)) {
+			printf("inode %u: count %u, expected %u\n",
+			       ino, result, ref_fetch(ino));
+			problem++;
+		}
+	}
+	retval = ext2fs_icount_validate(icount, stdout);
+	if (retval) {
+		com_err("random_test", retval, "while calling icount_validate");
+		exit(1);
+	}
+
+	/* a new icount using this one as a hint starts with no counts */
+	retval = ext2fs_create_icount2(test_fs, flags, 0, icount, &copy);
+	if (retval) {
+		com_err("random_test", retval, "while creating icount");
+		exit(1);
+	}
+	for (ino = 1; ino <= num_inodes; ino++) {
+		ext2fs_icount_fetch(copy, ino, &result);
+		if (result) {
+			printf("hinted icount: inode %u has count %u\n",
+			       ino, result);
+			problem++;
+			break;
+		}
+	}
+	printf("%d inodes in the reference list, icount size is %u: %s\n",
+	       ref_count, ext2fs_get_icount_size(icount),
+	       problem ? "NOT OK" : "OK");
+	ext2fs_free_icount(copy);
+	ext2fs_free_icount(icount);
+	return problem;
+}
 
 int main(int argc, char **argv)
 {
@@ -843,6 +1004,14 @@ int main(int argc, char **argv)
 	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 0, 0, prog);
 	printf("\nResizing icount:\n");
 	failed += run_test(0, 3, 0, extended);
+	printf("\nCounts crossing 1:\n");
+	failed += run_test(0, 3, 0, crossing);
+	printf("\nCounts crossing 1 with the multiple bitmap:\n");
+	failed += run_test(EXT2_ICOUNT_OPT_INCREMENT, 3, 0, crossing);
+	printf("\nRandom run against a sorted list:\n");
+	failed += random_test(0, 3, 1);
+	printf("\nRandom run with the multiple bitmap:\n");
+	failed += random_test(EXT2_ICOUNT_OPT_INCREMENT, 0, 2);
 	printf("\nStandard icount run with tdb:\n");
 	failed += run_test(0, 0, ".", prog);
 	printf("\nMultiple bitmap test with tdb:\n");
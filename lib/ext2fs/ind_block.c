@@ -47,6 +47,75 @@ errcode_t ext2fs_read_ind_block(ext2_filsys fs, blk_t blk, void *buf)
 	return 0;
 }
 
+/*
+ * Read several indirect blocks, in any order, with one request to the
+ * I/O channel.
+ */
+errcode_t ext2fs_read_ind_blocks(ext2_filsys fs, blk_t *list, int count,
+				 void **bufs)
+{
+	errcode_t	retval;
+	unsigned long	*blocks;
+	blk_t		*block_nr;
+	int		i, j;
+	int		limit = fs->blocksize >> 2;
+
+	if ((fs->flags & EXT2_FLAG_IMAGE_FILE) &&
+	    (fs->io != fs->image_io)) {
+		for (i = 0; i < count; i++)
+			memset(bufs[i], 0, fs->blocksize);
+		return 0;
+	}
+	retval = ext2fs_get_mem(count * sizeof(unsigned long), &blocks);
+	if (retval)
+		return retval;
+	for (i = 0; i < count; i++)
+		blocks[i] = list[i];
+	retval = io_channel_read_blocks_vec(fs->io, blocks, count, bufs);
+	ext2fs_free_mem(&blocks);
+	if (retval)
+		return retval;
+#ifdef EXT2FS_ENABLE_SWAPFS
+	if (fs->flags & (EXT2_FLAG_SWAP_BYTES | EXT2_FLAG_SWAP_BYTES_READ)) {
+		for (j = 0; j < count; j++) {
+			block_nr = (blk_t *) bufs[j];
+			for (i = 0; i < limit; i++, block_nr++)
+				*block_nr = ext2fs_swab32(*block_nr);
+		}
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Start reading the indirect blocks in list[] into the I/O channel's
+ * cache, without waiting for them.  Zero entries, and those out of
+ * range, are skipped.  Returns EXT2_ET_UNIMPLEMENTED if the channel
+ * can't do that, in which case the blocks are read when they're used.
+ */
+errcode_t ext2fs_readahead_ind_blocks(ext2_filsys fs, blk_t *list,
+				      int count)
+{
+	errcode_t	retval;
+	int		i, run;
+
+	if (fs->flags & EXT2_FLAG_IMAGE_FILE)
+		return 0;
+	for (i = 0; i < count; i += run) {
+		run = 1;
+		if (!list[i] || list[i] >= fs->super->s_blocks_count ||
+		    list[i] < fs->super->s_first_data_block)
+			continue;
+		while (i + run < count && list[i + run] == list[i] + run &&
+		       list[i + run] < fs->super->s_blocks_count)
+			run++;
+		retval = io_channel_cache_readahead(fs->io, list[i], run);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
 errcode_t ext2fs_write_ind_block(ext2_filsys fs, blk_t blk, void *buf)
 {
 	blk_t		*block_nr;
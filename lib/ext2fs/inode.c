@@ -512,11 +512,15 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 	errcode_t	retval;
 	int 		clen, i, inodes_per_block, length;
 	io_channel	io;
+	void		*mapped;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
-	/* Check to see if user has an override function */
-	if (fs->read_inode) {
+	/*
+	 * Check to see if user has an override function.  It can only
+	 * fill in the standard inode, so it's skipped for larger reads.
+	 */
+	if (fs->read_inode && bufsize == sizeof(struct ext2_inode)) {
 		retval = (fs->read_inode)(fs, ino, inode);
 		if (retval != EXT2_ET_CALLBACK_NOTHANDLED)
 			return retval;
@@ -569,6 +573,14 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 		if ((offset + length) > fs->blocksize)
 			clen = fs->blocksize - offset;
 
+		/* If the block is in memory, copy the inode straight out */
+		if (block_nr != fs->icache->buffer_blk &&
+		    !io_channel_map_blk(io, block_nr, 1, &mapped)) {
+			memcpy(ptr, ((char *) mapped) + (unsigned) offset,
+			       clen);
+			goto next;
+		}
+
 		if (block_nr != fs->icache->buffer_blk) {
 			retval = io_channel_read_blk(io, block_nr, 1,
 						     fs->icache->buffer);
@@ -579,6 +591,7 @@ errcode_t ext2fs_read_inode_full(ext2_filsys fs, ext2_ino_t ino,
 
 		memcpy(ptr, ((char *) fs->icache->buffer) + (unsigned) offset,
 		       clen);
+	next:
 
 		offset = 0;
 		length -= clen;
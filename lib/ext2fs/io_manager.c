@@ -70,3 +70,67 @@ errcode_t io_channel_write_byte(io_channel channel, unsigned long offset,
 
 	return EXT2_ET_UNIMPLEMENTED;
 }
+
+/*
+ * Start reading blocks into the channel's cache without waiting for
+ * them.  Managers which can't do that return EXT2_ET_UNIMPLEMENTED,
+ * which callers are free to ignore.
+ */
+errcode_t io_channel_cache_readahead(io_channel channel, unsigned long block,
+				     int count)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->cache_readahead)
+		return channel->manager->cache_readahead(channel, block,
+							 count);
+
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+/*
+ * Point *ptr at the blocks where they are kept in memory, so they can
+ * be read without being copied.  The pointer is good until the next
+ * call on the channel, and nothing may be written through it.
+ * Managers which don't keep blocks that way return
+ * EXT2_ET_UNIMPLEMENTED, and the blocks must be read as usual.
+ */
+errcode_t io_channel_map_blk(io_channel channel, unsigned long block,
+			     int count, void **ptr)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->map_blk)
+		return channel->manager->map_blk(channel, block, count, ptr);
+
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+/*
+ * Read the blocks in list[], which may be in any order, into bufs[],
+ * one block each.  Managers which can read them together do so;
+ * otherwise they are read one at a time, after all of them have been
+ * queued for readahead where the manager can do that.
+ */
+errcode_t io_channel_read_blocks_vec(io_channel channel, unsigned long *list,
+				     int count, void **bufs)
+{
+	errcode_t	retval;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	if (channel->manager->read_blk_vec)
+		return channel->manager->read_blk_vec(channel, list, count,
+						      bufs);
+
+	if (channel->manager->cache_readahead)
+		for (i = 0; i < count; i++)
+			channel->manager->cache_readahead(channel, list[i], 1);
+	for (i = 0; i < count; i++) {
+		retval = io_channel_read_blk(channel, list[i], 1, bufs[i]);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
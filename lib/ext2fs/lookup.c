@@ -21,31 +21,81 @@
 #include "ext2_fs.h"
 #include "ext2fs.h"
 
+/*
+ * Lookups scan each directory block themselves, rather than going
+ * through ext2fs_dir_iterate() and a callback for every entry.  An
+ * entry is passed over unless its name length matches, and then
+ * unless the first word of its name matches; only entries which get
+ * that far have their whole name compared.
+ */
 struct lookup_struct  {
 	const char	*name;
 	int		len;
 	ext2_ino_t	*inode;
 	int		found;
+	char		*buf;
+	errcode_t	errcode;
+	unsigned long	word;	/* First bytes of the name... */
+	unsigned long	mask;	/* ...and which of them count */
 };	
 
+static unsigned long name_word(const char *p)
+{
+	unsigned long	w;
+
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+/*
+ * Look for the name in the block in ls->buf.  The entries are checked
+ * as ext2fs_process_dir_block() checks them.
+ */
+static int lookup_block(ext2_filsys fs, struct lookup_struct *ls)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset = 0, rec_len;
+	/* Past here the word would run off the end of the block */
+	unsigned int	word_end = fs->blocksize - 8 - sizeof(unsigned long);
+
+	while (offset < fs->blocksize) {
+		dirent = (struct ext2_dir_entry *) (ls->buf + offset);
+		rec_len = dirent->rec_len;
+		if (((offset + rec_len) > fs->blocksize) ||
+		    (rec_len < 8) || ((rec_len % 4) != 0) ||
+		    (((dirent->name_len & 0xFF)+8) > rec_len)) {
+			ls->errcode = EXT2_ET_DIR_CORRUPTED;
+			return BLOCK_ABORT;
+		}
+		if ((dirent->name_len & 0xFF) == ls->len && dirent->inode &&
+		    (offset > word_end ||
+		     (name_word(dirent->name) & ls->mask) == ls->word) &&
+		    !memcmp(dirent->name, ls->name, ls->len)) {
+			*ls->inode = dirent->inode;
+			ls->found++;
+			return BLOCK_ABORT;
+		}
+		offset += rec_len;
+	}
+	return 0;
+}
+
 #ifdef __TURBOC__
  #pragma argsused
 #endif
-static int lookup_proc(struct ext2_dir_entry *dirent,
-		       int	offset EXT2FS_ATTR((unused)),
-		       int	blocksize EXT2FS_ATTR((unused)),
-		       char	*buf EXT2FS_ATTR((unused)),
+static int lookup_proc(ext2_filsys fs,
+		       blk_t	*blocknr,
+		       e2_blkcnt_t blockcnt EXT2FS_ATTR((unused)),
+		       blk_t	ref_block EXT2FS_ATTR((unused)),
+		       int	ref_offset EXT2FS_ATTR((unused)),
 		       void	*priv_data)
 {
 	struct lookup_struct *ls = (struct lookup_struct *) priv_data;
 
-	if (ls->len != (dirent->name_len & 0xFF))
-		return 0;
-	if (strncmp(ls->name, dirent->name, (dirent->name_len & 0xFF)))
-		return 0;
-	*ls->inode = dirent->inode;
-	ls->found++;
-	return DIRENT_ABORT;
+	ls->errcode = ext2fs_read_dir_block(fs, *blocknr, ls->buf);
+	if (ls->errcode)
+		return BLOCK_ABORT;
+	return lookup_block(fs, ls);
 }
 
 
@@ -54,19 +104,47 @@ errcode_t ext2fs_lookup(ext2_filsys fs, ext2_ino_t dir, const char *name,
 {
 	errcode_t	retval;
 	struct lookup_struct ls;
+	unsigned char	bytes[sizeof(unsigned long)];
+	int		n;
 
 	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
 
+	retval = ext2fs_check_directory(fs, dir);
+	if (retval)
+		return retval;
+
 	ls.name = name;
 	ls.len = namelen;
 	ls.inode = inode;
 	ls.found = 0;
+	ls.errcode = 0;
+
+	/* Put together a byte at a time, so byte order doesn't matter */
+	n = (namelen < (int) sizeof(bytes)) ? namelen : (int) sizeof(bytes);
+	if (n < 0)
+		n = 0;
+	memset(bytes, 0, sizeof(bytes));
+	memcpy(bytes, name, n);
+	ls.word = name_word((char *) bytes);
+	memset(bytes, 0, sizeof(bytes));
+	memset(bytes, 0xFF, n);
+	ls.mask = name_word((char *) bytes);
 
-	retval = ext2fs_dir_iterate(fs, dir, 0, buf, lookup_proc, &ls);
+	if (buf)
+		ls.buf = buf;
+	else {
+		retval = ext2fs_get_mem(fs->blocksize, &ls.buf);
+		if (retval)
+			return retval;
+	}
+	retval = ext2fs_block_iterate2(fs, dir, BLOCK_FLAG_DATA_ONLY, 0,
+				       lookup_proc, &ls);
+	if (!buf)
+		ext2fs_free_mem(&ls.buf);
 	if (retval)
 		return retval;
+	if (ls.errcode)
+		return ls.errcode;
 
 	return (ls.found) ? 0 : EXT2_ET_FILE_NOT_FOUND;
 }
-
-
@@ -0,0 +1,546 @@
+/*
+ * mmap_io.c --- I/O manager for filesystem image files, which maps the
+ * 	image into memory.
+ *
+ * Reads and writes are a memcpy to or from the mapping, with no cache
+ * of our own in between, and io_channel_map_blk() hands out pointers
+ * into the mapping so metadata can be read without being copied at
+ * all.  Dirty ranges are written back with msync() when the channel
+ * is flushed.
+ *
+ * On 64-bit systems the whole image is mapped.  On 32-bit systems,
+ * or if that fails, a few windows of MMAP_WINDOW_SIZE bytes are mapped
+ * as they are needed.
+ *
+ * Only regular files are handled; for anything else mmap_open fails,
+ * and unix_io_manager should be used.  If the image is truncated
+ * behind our back, touching the mapping raises SIGBUS.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#if HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#ifdef HAVE_SYS_MMAN_H
+
+#include <sys/mman.h>
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define MMAP_WINDOWS		4
+#define MMAP_WINDOW_SIZE	(64 * 1024 * 1024)	/* A multiple of pages */
+
+struct mmap_window {
+	char		*addr;		/* 0 if nothing is mapped */
+	ext2_loff_t	start;		/* file offset of addr */
+	size_t		len;
+	int		access_time;
+	size_t		dirty_start;	/* [dirty_start, dirty_end) from addr */
+	size_t		dirty_end;
+};
+
+/*
+ * The first five fields are laid out as in unix_io.c's private data,
+ * so code which needs the device can treat both managers alike.
+ */
+struct mmap_private_data {
+	int	magic;
+	int	dev;
+	int	flags;
+	int	access_time;
+	ext2_loff_t offset;
+
+	ext2_loff_t size;		/* mapped; the rest goes to the file */
+	size_t	window_size;		/* 0 if the whole file is mapped */
+	int	prot;
+	struct mmap_window window[MMAP_WINDOWS];
+};
+
+static errcode_t mmap_open(const char *name, int flags, io_channel *channel);
+static errcode_t mmap_close(io_channel channel);
+static errcode_t mmap_set_blksize(io_channel channel, int blksize);
+static errcode_t mmap_read_blk(io_channel channel, unsigned long block,
+			       int count, void *data);
+static errcode_t mmap_write_blk(io_channel channel, unsigned long block,
+				int count, const void *data);
+static errcode_t mmap_flush(io_channel channel);
+static errcode_t mmap_write_byte(io_channel channel, unsigned long offset,
+				 int size, const void *data);
+static errcode_t mmap_set_option(io_channel channel, const char *option,
+				 const char *arg);
+static errcode_t mmap_map_blk(io_channel channel, unsigned long block,
+			      int count, void **ptr);
+
+static struct struct_io_manager struct_mmap_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"mmap I/O Manager",
+	mmap_open,
+	mmap_close,
+	mmap_set_blksize,
+	mmap_read_blk,
+	mmap_write_blk,
+	mmap_flush,
+	mmap_write_byte,
+	mmap_set_option,
+	0,
+	mmap_map_blk
+};
+
+io_manager mmap_io_manager = &struct_mmap_manager;
+
+/*
+ * Here we manage the windows
+ */
+
+/* Write back what has been changed through a window */
+static errcode_t sync_window(struct mmap_window *w)
+{
+	size_t	start, end;
+	long	page = getpagesize();
+
+	if (w->dirty_end <= w->dirty_start)
+		return 0;
+	start = w->dirty_start - w->dirty_start % page;
+	end = w->dirty_end;
+	w->dirty_start = w->dirty_end = 0;
+	if (msync(w->addr + start, end - start, MS_SYNC) < 0)
+		return errno;
+	return 0;
+}
+
+static errcode_t unmap_window(struct mmap_window *w)
+{
+	errcode_t	retval;
+
+	if (!w->addr)
+		return 0;
+	retval = sync_window(w);
+	munmap(w->addr, w->len);
+	w->addr = 0;
+	return retval;
+}
+
+/*
+ * Find the window holding the byte at pos, which must be below
+ * data->size, mapping it if need be in place of the one used least
+ * recently.
+ */
+static errcode_t get_window(struct mmap_private_data *data, ext2_loff_t pos,
+			    struct mmap_window **ret)
+{
+	struct mmap_window	*w, *oldest = 0;
+	ext2_loff_t		start;
+	errcode_t		retval;
+	void			*addr;
+	int			i;
+
+	if (!data->window_size) {
+		*ret = &data->window[0];
+		return 0;
+	}
+
+	start = pos - pos % data->window_size;
+	for (i=0, w = data->window; i < MMAP_WINDOWS; i++, w++) {
+		if (w->addr && w->start == start) {
+			w->access_time = ++data->access_time;
+			*ret = w;
+			return 0;
+		}
+		if (!oldest || !w->addr ||
+		    (oldest->addr && w->access_time < oldest->access_time))
+			oldest = w;
+	}
+
+	if ((retval = unmap_window(oldest)))
+		return retval;
+	oldest->start = start;
+	oldest->len = data->window_size;
+	if (start + (ext2_loff_t) oldest->len > data->size)
+		oldest->len = data->size - start;
+	addr = mmap(0, oldest->len, data->prot, MAP_SHARED, data->dev, start);
+	if (addr == MAP_FAILED)
+		return errno;
+	oldest->addr = addr;
+	oldest->access_time = ++data->access_time;
+	*ret = oldest;
+	return 0;
+}
+
+/*
+ * Copy size bytes between buf and the file at location, through the
+ * mapping where it covers them.  Returns the number of bytes copied
+ * in *actual, which is short only at the end of the file.
+ */
+static errcode_t copy(struct mmap_private_data *data, int writing,
+		      ext2_loff_t location, char *buf, size_t size,
+		      size_t *actual)
+{
+	struct mmap_window	*w;
+	errcode_t		retval;
+	size_t			off, n;
+	ssize_t			done;
+
+	*actual = 0;
+	while (size && location < data->size) {
+		if ((retval = get_window(data, location, &w)))
+			return retval;
+		off = location - w->start;
+		n = w->len - off;
+		if (n > size)
+			n = size;
+		if (writing) {
+			memcpy(w->addr + off, buf, n);
+			if (w->dirty_end <= w->dirty_start) {
+				w->dirty_start = off;
+				w->dirty_end = off + n;
+			} else {
+				if (off < w->dirty_start)
+					w->dirty_start = off;
+				if (off + n > w->dirty_end)
+					w->dirty_end = off + n;
+			}
+		} else
+			memcpy(buf, w->addr + off, n);
+		location += n;
+		buf += n;
+		size -= n;
+		*actual += n;
+	}
+	if (!size)
+		return 0;
+
+	/* Past the end of the mapping */
+	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location)
+		return errno ? errno : EXT2_ET_LLSEEK_FAILED;
+	done = writing ? write(data->dev, buf, size) :
+		read(data->dev, buf, size);
+	if (done < 0)
+		return errno;
+	*actual += done;
+	return 0;
+}
+
+static errcode_t mmap_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct mmap_private_data *data = NULL;
+	errcode_t	retval;
+	int		open_flags;
+	struct stat	st;
+	void		*addr;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	retval = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		return retval;
+	memset(io, 0, sizeof(struct struct_io_channel));
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_mem(sizeof(struct mmap_private_data), &data);
+	if (retval)
+		goto cleanup;
+
+	io->manager = mmap_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->read_error = 0;
+	io->write_error = 0;
+	io->refcount = 1;
+
+	memset(data, 0, sizeof(struct mmap_private_data));
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->flags = flags;
+
+	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
+	if (flags & IO_FLAG_EXCLUSIVE)
+		open_flags |= O_EXCL;
+#ifdef HAVE_OPEN64
+	data->dev = open64(io->name, open_flags);
+#else
+	data->dev = open(io->name, open_flags);
+#endif
+	if (data->dev < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+	if (fstat(data->dev, &st) < 0) {
+		retval = errno;
+		goto close_dev;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		retval = EXT2_ET_UNIMPLEMENTED;
+		goto close_dev;
+	}
+
+	data->size = st.st_size;
+	data->prot = (flags & IO_FLAG_RW) ? PROT_READ | PROT_WRITE :
+		PROT_READ;
+	addr = MAP_FAILED;
+	if (sizeof(void *) >= 8 || data->size <= MMAP_WINDOW_SIZE)
+		addr = mmap(0, data->size, data->prot, MAP_SHARED,
+			    data->dev, 0);
+	if (addr == MAP_FAILED)
+		data->window_size = MMAP_WINDOW_SIZE;
+	else {
+		data->window[0].addr = addr;
+		data->window[0].len = data->size;
+	}
+
+	*channel = io;
+	return 0;
+
+close_dev:
+	close(data->dev);
+cleanup:
+	if (data)
+		ext2fs_free_mem(&data);
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t mmap_close(io_channel channel)
+{
+	struct mmap_private_data *data;
+	errcode_t	retval = 0, retval2;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	for (i = 0; i < MMAP_WINDOWS; i++)
+		if ((retval2 = unmap_window(&data->window[i])))
+			retval = retval2;
+	if (close(data->dev) < 0)
+		retval = errno;
+
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t mmap_set_blksize(io_channel channel, int blksize)
+{
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+
+	channel->block_size = blksize;
+	return 0;
+}
+
+static errcode_t mmap_read_blk(io_channel channel, unsigned long block,
+			       int count, void *buf)
+{
+	struct mmap_private_data *data;
+	errcode_t	retval;
+	size_t		size, actual;
+	ext2_loff_t	location;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? -count : (size_t) count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	retval = copy(data, 0, location, buf, size, &actual);
+	if (!retval && actual == size)
+		return 0;
+	if (!retval)
+		retval = EXT2_ET_SHORT_READ;
+
+	memset((char *) buf+actual, 0, size-actual);
+	if (channel->read_error)
+		retval = (channel->read_error)(channel, block, count, buf,
+					       size, actual, retval);
+	return retval;
+}
+
+static errcode_t mmap_write_blk(io_channel channel, unsigned long block,
+				int count, const void *buf)
+{
+	struct mmap_private_data *data;
+	errcode_t	retval;
+	size_t		size, actual;
+	ext2_loff_t	location;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!(data->flags & IO_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	size = (count < 0) ? -count : (size_t) count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	retval = copy(data, 1, location, (char *) buf, size, &actual);
+	if (!retval && actual == size)
+		return 0;
+	if (!retval)
+		retval = EXT2_ET_SHORT_WRITE;
+
+	if (channel->write_error)
+		retval = (channel->write_error)(channel, block, count, buf,
+						size, actual, retval);
+	return retval;
+}
+
+static errcode_t mmap_write_byte(io_channel channel, unsigned long offset,
+				 int size, const void *buf)
+{
+	struct mmap_private_data *data;
+	errcode_t	retval;
+	size_t		actual;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!(data->flags & IO_FLAG_RW))
+		return EXT2_ET_RO_FILSYS;
+
+	retval = copy(data, 1, offset + data->offset, (char *) buf, size,
+		      &actual);
+	if (!retval && actual != (size_t) size)
+		retval = EXT2_ET_SHORT_WRITE;
+	return retval;
+}
+
+/*
+ * Flush data buffers to disk.
+ */
+static errcode_t mmap_flush(io_channel channel)
+{
+	struct mmap_private_data *data;
+	errcode_t	retval = 0, retval2;
+	int		i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (i = 0; i < MMAP_WINDOWS; i++)
+		if (data->window[i].addr &&
+		    (retval2 = sync_window(&data->window[i])))
+			retval = retval2;
+	fsync(data->dev);
+	return retval;
+}
+
+static errcode_t mmap_set_option(io_channel channel, const char *option,
+				 const char *arg)
+{
+	struct mmap_private_data *data;
+	unsigned long long tmp;
+	char *end;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!strcmp(option, "offset")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoull(arg, &end, 0);
+		if (*end)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->offset = tmp;
+		if (data->offset < 0)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return 0;
+	}
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+/*
+ * Point *ptr at the blocks in the mapping, if they are all in one
+ * window.
+ */
+static errcode_t mmap_map_blk(io_channel channel, unsigned long block,
+			      int count, void **ptr)
+{
+	struct mmap_private_data *data;
+	struct mmap_window *w;
+	errcode_t	retval;
+	size_t		size;
+	ext2_loff_t	location;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct mmap_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	size = (count < 0) ? -count : (size_t) count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	if (location + (ext2_loff_t) size > data->size)
+		return EXT2_ET_UNIMPLEMENTED;
+	if ((retval = get_window(data, location, &w)))
+		return retval;
+	if (location + (ext2_loff_t) size > w->start + (ext2_loff_t) w->len)
+		return EXT2_ET_UNIMPLEMENTED;
+	*ptr = w->addr + (location - w->start);
+	return 0;
+}
+
+#else /* HAVE_SYS_MMAN_H */
+
+static errcode_t mmap_open(const char *name EXT2FS_ATTR((unused)),
+			   int flags EXT2FS_ATTR((unused)),
+			   io_channel *channel EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+static struct struct_io_manager struct_mmap_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"mmap I/O Manager",
+	mmap_open
+};
+
+io_manager mmap_io_manager = &struct_mmap_manager;
+
+#endif /* HAVE_SYS_MMAN_H */
@@ -51,10 +51,15 @@ static errcode_t follow_link(ext2_filsys fs, ext2_ino_t root, ext2_ino_t dir,
 		return EXT2_ET_SYMLINK_LOOP;
 	}
 	if (ext2fs_inode_data_blocks(fs,&ei)) {
+		blk_t blk;
+
+		retval = ext2fs_bmap(fs, inode, &ei, NULL, 0, 0, &blk);
+		if (retval)
+			return retval;
 		retval = ext2fs_get_mem(fs->blocksize, &buffer);
 		if (retval)
 			return retval;
-		retval = io_channel_read_blk(fs->io, ei.i_block[0], 1, buffer);
+		retval = io_channel_read_blk(fs->io, blk, 1, buffer);
 		if (retval) {
 			ext2fs_free_mem(&buffer);
 			return retval;
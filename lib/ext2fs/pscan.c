@@ -0,0 +1,306 @@
+/*
+ * pscan.c --- scan the inode tables with several threads
+ *
+ * The block groups are handed out one at a time to a pool of threads.
+ * Each reads its group's inode table in large chunks and passes the
+ * inodes to the caller's function, which is told which thread it was
+ * called from so that it can keep its results per thread and add them
+ * up afterwards.  The I/O channel can't be used by two threads at
+ * once, so reads are done one at a time; it's the work done on the
+ * inodes which goes in parallel.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define PSCAN_BUFFER_BLOCKS	64	/* Blocks read at once by default */
+#define PSCAN_MAX_THREADS	64
+
+struct pscan {
+	ext2_filsys	fs;
+	int		flags;
+	int		buffer_blocks;
+	dgrp_t		next_group;
+	errcode_t	error;
+	errcode_t	(*func)(ext2_filsys fs, ext2_ino_t ino,
+				struct ext2_inode *inode, int thread,
+				void *priv_data);
+	void		*priv_data;
+#if HAVE_PTHREAD_H
+	pthread_mutex_t	lock;	/* Guards the above, and the I/O channel */
+#endif
+};
+
+struct pscan_thread {
+	struct pscan	*ps;
+	int		thread;
+	char		*buf;
+	char		*swap_buf;
+#if HAVE_PTHREAD_H
+	pthread_t	tid;
+#endif
+};
+
+#if HAVE_PTHREAD_H
+#define pscan_lock(ps)		pthread_mutex_lock(&(ps)->lock)
+#define pscan_unlock(ps)	pthread_mutex_unlock(&(ps)->lock)
+#else
+#define pscan_lock(ps)		do { } while (0)
+#define pscan_unlock(ps)	do { } while (0)
+#endif
+
+/*
+ * Work out how many inodes at the start of the group's table need to
+ * be looked at.  Groups whose table was never initialized are skipped,
+ * and so, with uninit_bg, is the part of the table that was never
+ * used.  With EXT2_SF_SKIP_FREE_TAIL, the inode bitmap, if loaded,
+ * tells us where the last inode in use is.
+ */
+static ext2_ino_t group_inodes(struct pscan *ps, dgrp_t group)
+{
+	ext2_filsys	fs = ps->fs;
+	struct ext2_group_desc *gd = &fs->group_desc[group];
+	ext2_ino_t	n = EXT2_INODES_PER_GROUP(fs->super);
+	ext2_ino_t	first = group * EXT2_INODES_PER_GROUP(fs->super);
+
+	if ((ps->flags & EXT2_SF_DO_LAZY) &&
+	    (gd->bg_flags & EXT2_BG_INODE_UNINIT))
+		return 0;
+	if (EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+				       EXT4_FEATURE_RO_COMPAT_GDT_CSUM)) {
+		if (gd->bg_flags & EXT2_BG_INODE_UNINIT)
+			return 0;
+		n = (gd->bg_itable_unused < n) ? n - gd->bg_itable_unused : 0;
+	}
+	if ((ps->flags & EXT2_SF_SKIP_FREE_TAIL) && fs->inode_map)
+		while (n && !ext2fs_fast_test_inode_bitmap(fs->inode_map,
+							   first + n))
+			n--;
+	return n;
+}
+
+static errcode_t scan_group(struct pscan_thread *pt, dgrp_t group)
+{
+	struct pscan	*ps = pt->ps;
+	ext2_filsys	fs = ps->fs;
+	struct ext2_inode *inode;
+	errcode_t	retval;
+	ext2_ino_t	ino, n, left;
+	blk_t		blk, blocks, done, count;
+	int		i, isize = EXT2_INODE_SIZE(fs->super);
+	int		ipb = EXT2_INODES_PER_BLOCK(fs->super);
+	char		*p;
+
+	n = group_inodes(ps, group);
+	if (!n)
+		return 0;
+	blk = fs->group_desc[group].bg_inode_table;
+	if (!blk)
+		return (ps->flags & EXT2_SF_SKIP_MISSING_ITABLE) ? 0 :
+			EXT2_ET_MISSING_INODE_TABLE;
+
+	ino = group * EXT2_INODES_PER_GROUP(fs->super) + 1;
+	blocks = (n + ipb - 1) / ipb;
+	for (done = 0; done < blocks; done += count) {
+		count = blocks - done;
+		if (count > (blk_t) ps->buffer_blocks)
+			count = ps->buffer_blocks;
+
+		pscan_lock(ps);
+		if (ps->error) {
+			pscan_unlock(ps);
+			return 0;
+		}
+		retval = io_channel_read_blk(fs->io, blk + done, count,
+					     pt->buf);
+		pscan_unlock(ps);
+		if (retval)
+			return EXT2_ET_NEXT_INODE_READ;
+
+		left = n - done * ipb;
+		if (left > count * ipb)
+			left = count * ipb;
+		for (i = 0, p = pt->buf; i < (int) left;
+		     i++, p += isize, ino++) {
+			inode = (struct ext2_inode *) p;
+#ifdef EXT2FS_ENABLE_SWAPFS
+			if (fs->flags & (EXT2_FLAG_SWAP_BYTES |
+					 EXT2_FLAG_SWAP_BYTES_READ)) {
+				ext2fs_swap_inode_full(fs,
+					(struct ext2_inode_large *) pt->swap_buf,
+					(struct ext2_inode_large *) p,
+					0, isize);
+				inode = (struct ext2_inode *) pt->swap_buf;
+			}
+#endif
+			retval = (ps->func)(fs, ino, inode, pt->thread,
+					    ps->priv_data);
+			if (retval)
+				return retval;
+		}
+	}
+	return 0;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct pscan_thread *pt = arg;
+	struct pscan	*ps = pt->ps;
+	errcode_t	retval;
+	dgrp_t		group;
+
+	while (1) {
+		pscan_lock(ps);
+		if (ps->error || ps->next_group >= ps->fs->group_desc_count) {
+			pscan_unlock(ps);
+			break;
+		}
+		group = ps->next_group++;
+		pscan_unlock(ps);
+
+		retval = scan_group(pt, group);
+		if (retval) {
+			pscan_lock(ps);
+			if (!ps->error)
+				ps->error = retval;
+			pscan_unlock(ps);
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The number of threads ext2fs_inode_scan_parallel() uses by default:
+ * one per processor, but no more than there are groups.
+ */
+int ext2fs_inode_scan_threads(ext2_filsys fs)
+{
+	long	n = 1;
+
+#if HAVE_PTHREAD_H && defined(_SC_NPROCESSORS_ONLN)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n > PSCAN_MAX_THREADS)
+		n = PSCAN_MAX_THREADS;
+	if (n > (long) fs->group_desc_count)
+		n = fs->group_desc_count;
+	return (n > 0) ? n : 1;
+}
+
+/*
+ * Call func on every inode in the inode tables, from up to threads
+ * threads at once (0 for ext2fs_inode_scan_threads()), reading
+ * buffer_blocks blocks at a time (0 for the default).  func is passed
+ * the number of the thread, from 0 to threads - 1, and the inode as it
+ * is in the table, which is EXT2_INODE_SIZE() bytes long and must not
+ * be changed.  func may be called from several threads at once, so it
+ * mustn't use the filesystem's I/O channel.  Inodes are handed over in
+ * order within each group, but the groups are done in any order.
+ *
+ * flags takes EXT2_SF_SKIP_MISSING_ITABLE, EXT2_SF_DO_LAZY and
+ * EXT2_SF_SKIP_FREE_TAIL.  A non-zero return from func stops the
+ * scan, and is returned.
+ */
+errcode_t ext2fs_inode_scan_parallel(ext2_filsys fs, int threads,
+				     int buffer_blocks, int flags,
+				     errcode_t (*func)(ext2_filsys fs,
+						       ext2_ino_t ino,
+						       struct ext2_inode *inode,
+						       int thread,
+						       void *priv_data),
+				     void *priv_data)
+{
+	struct pscan	ps;
+	struct pscan_thread *pt;
+	errcode_t	retval;
+	int		i, started;
+
+	EXT2_CHECK_MAGIC(fs, EXT2_ET_MAGIC_EXT2FS_FILSYS);
+
+	if (threads <= 0)
+		threads = ext2fs_inode_scan_threads(fs);
+	if (threads > PSCAN_MAX_THREADS)
+		threads = PSCAN_MAX_THREADS;
+#if !HAVE_PTHREAD_H
+	threads = 1;
+#endif
+
+	memset(&ps, 0, sizeof(ps));
+	ps.fs = fs;
+	ps.flags = flags;
+	if (EXT2_HAS_COMPAT_FEATURE(fs->super, EXT2_FEATURE_COMPAT_LAZY_BG))
+		ps.flags |= EXT2_SF_DO_LAZY;
+	ps.buffer_blocks = buffer_blocks ? buffer_blocks :
+		PSCAN_BUFFER_BLOCKS;
+	ps.func = func;
+	ps.priv_data = priv_data;
+
+	retval = ext2fs_get_mem(threads * sizeof(struct pscan_thread), &pt);
+	if (retval)
+		return retval;
+	memset(pt, 0, threads * sizeof(struct pscan_thread));
+	for (i = 0; i < threads; i++) {
+		pt[i].ps = &ps;
+		pt[i].thread = i;
+		retval = ext2fs_get_mem((size_t) ps.buffer_blocks *
+					fs->blocksize, &pt[i].buf);
+		if (!retval)
+			retval = ext2fs_get_mem(EXT2_INODE_SIZE(fs->super),
+						&pt[i].swap_buf);
+		if (retval)
+			goto errout;
+	}
+
+#if HAVE_PTHREAD_H
+	pthread_mutex_init(&ps.lock, NULL);
+#endif
+	/*
+	 * The calling thread is thread 0.  If fewer threads can be
+	 * started than asked for, the ones we have do all the work.
+	 */
+	for (started = 1; started < threads; started++) {
+#if HAVE_PTHREAD_H
+		if (pthread_create(&pt[started].tid, NULL, scan_thread,
+				   &pt[started]))
+			break;
+#endif
+	}
+	scan_thread(&pt[0]);
+	for (i = 1; i < started; i++) {
+#if HAVE_PTHREAD_H
+		pthread_join(pt[i].tid, NULL);
+#endif
+	}
+#if HAVE_PTHREAD_H
+	pthread_mutex_destroy(&ps.lock);
+#endif
+	retval = ps.error;
+
+errout:
+	for (i = 0; i < threads; i++) {
+		if (pt[i].buf)
+			ext2fs_free_mem(&pt[i].buf);
+		if (pt[i].swap_buf)
+			ext2fs_free_mem(&pt[i].swap_buf);
+	}
+	ext2fs_free_mem(&pt);
+	return retval;
+}
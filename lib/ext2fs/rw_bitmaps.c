@@ -164,6 +164,32 @@ static errcode_t write_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	return 0;
 }
 
+/*
+ * Number of groups whose bitmaps are asked for at once, so an I/O
+ * manager which can read ahead has them all in flight together.
+ */
+#define BITMAP_READAHEAD_GROUPS 8
+
+static void readahead_bitmaps(ext2_filsys fs, dgrp_t first, int do_inode,
+			      int do_block, int lazy_flag)
+{
+	dgrp_t i;
+
+	for (i = first; i < fs->group_desc_count &&
+		     i < first + BITMAP_READAHEAD_GROUPS; i++) {
+		if (do_block && fs->group_desc[i].bg_block_bitmap &&
+		    !(lazy_flag && fs->group_desc[i].bg_flags &
+		      EXT2_BG_BLOCK_UNINIT))
+			io_channel_cache_readahead(fs->io,
+				fs->group_desc[i].bg_block_bitmap, 1);
+		if (do_inode && fs->group_desc[i].bg_inode_bitmap &&
+		    !(lazy_flag && fs->group_desc[i].bg_flags &
+		      EXT2_BG_INODE_UNINIT))
+			io_channel_cache_readahead(fs->io,
+				fs->group_desc[i].bg_inode_bitmap, 1);
+	}
+}
+
 static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 {
 	dgrp_t i;
@@ -229,6 +255,9 @@ static errcode_t read_bitmaps(ext2_filsys fs, int do_inode, int do_block)
 	}
 
 	for (i = 0; i < fs->group_desc_count; i++) {
+		if (i % BITMAP_READAHEAD_GROUPS == 0)
+			readahead_bitmaps(fs, i, inode_bitmap != 0,
+					  block_bitmap != 0, lazy_flag);
 		if (block_bitmap) {
 			blk = fs->group_desc[i].bg_block_bitmap;
 			if (lazy_flag && fs->group_desc[i].bg_flags &
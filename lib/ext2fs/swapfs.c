@@ -163,7 +163,15 @@ void ext2fs_swap_inode_full(ext2_filsys fs, struct ext2_inode_large *t,
 	t->i_flags = ext2fs_swab32(f->i_flags);
 	t->i_file_acl = ext2fs_swab32(f->i_file_acl);
 	t->i_dir_acl = ext2fs_swab32(f->i_dir_acl);
-	if (!islnk || has_data_blocks ) {
+	/*
+	 * The extent tree root is stored little endian, like the
+	 * rest of the tree
+	 */
+	if ((hostorder ? f->i_flags : t->i_flags) & EXT4_EXTENTS_FL) {
+		if (t != f)
+			for (i = 0; i < EXT2_N_BLOCKS; i++)
+				t->i_block[i] = f->i_block[i];
+	} else if (!islnk || has_data_blocks ) {
 		for (i = 0; i < EXT2_N_BLOCKS; i++)
 			t->i_block[i] = ext2fs_swab32(f->i_block[i]);
 	} else if (t != f) {
@@ -0,0 +1,413 @@
+/*
+ * tst_dblist.c --- test that the radix sort of the directory block
+ *	list gives the order the qsort() comparator always gave, and that
+ *	the parallel iterator hands out every block once.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define FIRST_BLOCK	1000	/* the directory blocks written by setup() */
+#define NUM_BLOCKS	4000
+#define NUM_ENTRIES	5000
+#define CHUNK		32	/* entries a thread takes at once, as in dblist.c */
+#define MAX_THREADS	64
+
+ext2_filsys	test_fs;
+ext2_dblist	par_list;		/* the list for the parallel tests */
+unsigned char	seen[NUM_ENTRIES + 1];	/* times each entry was handed out */
+int		calls[MAX_THREADS];	/* entries each thread was handed */
+int		wrong[MAX_THREADS];	/* entries with the wrong block, per thread */
+int		bad_thread;
+int		stop_entry = -1;
+int		failed = 0;
+
+/* the comparator the list was sorted with before the radix sort */
+static EXT2_QSORT_TYPE old_cmp(const void *a, const void *b)
+{
+	const struct ext2_db_entry *db_a = a;
+	const struct ext2_db_entry *db_b = b;
+
+	if (db_a->blk != db_b->blk)
+		return (int) (db_a->blk - db_b->blk);
+
+	if (db_a->ino != db_b->ino)
+		return (int) (db_a->ino - db_b->ino);
+
+	return (int) (db_a->blockcnt - db_b->blockcnt);
+}
+
+/* the same, without the overflow for blocks 2^31 or more apart */
+static EXT2_QSORT_TYPE wide_cmp(const void *a, const void *b)
+{
+	const struct ext2_db_entry *db_a = a;
+	const struct ext2_db_entry *db_b = b;
+
+	if (db_a->blk != db_b->blk)
+		return (db_a->blk < db_b->blk) ? -1 : 1;
+	return old_cmp(a, b);
+}
+
+/*
+ * Each directory block from FIRST_BLOCK on holds a single empty entry
+ * whose inode number is the block's number, so that the callback can
+ * tell whether it was handed the right block.
+ */
+static void setup(char *name)
+{
+	struct ext2_super_block param;
+	struct ext2_dir_entry *dirent;
+	errcode_t	retval;
+	char		*buf;
+	blk_t		blk;
+	int		fd;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(name);
+	if (fd < 0 || ftruncate(fd, 12000 * 1024) < 0) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = 12000;
+
+	retval = ext2fs_initialize(name, EXT2_FLAG_RW, &param,
+				   unix_io_manager, &test_fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing filesystem");
+		exit(1);
+	}
+	retval = ext2fs_get_mem(test_fs->blocksize, &buf);
+	if (retval) {
+		com_err("setup", retval, "while allocating block buffer");
+		exit(1);
+	}
+	memset(buf, 0, test_fs->blocksize);
+	dirent = (struct ext2_dir_entry *) buf;
+	dirent->rec_len = test_fs->blocksize;
+	for (blk = FIRST_BLOCK; blk < FIRST_BLOCK + NUM_BLOCKS; blk++) {
+		dirent->inode = blk;
+		retval = ext2fs_write_dir_block(test_fs, blk, buf);
+		if (retval) {
+			com_err("setup", retval, "while writing block %u", blk);
+			exit(1);
+		}
+	}
+	ext2fs_free_mem(&buf);
+}
+
+struct get_order {
+	struct ext2_db_entry	*list;
+	int			n;
+};
+
+static int get_order_proc(ext2_filsys fs, struct ext2_db_entry *db_info,
+			  void *priv_data)
+{
+	struct get_order *go = priv_data;
+
+	go->list[go->n++] = *db_info;
+	return 0;
+}
+
+/*
+ * Add count entries made by make_entry() to a list, sort it with the
+ * radix sort and a copy with cmp, and compare them, entry by entry.
+ */
+static void test_sort(const char *what, int count,
+		      void (*make_entry)(int i, struct ext2_db_entry *ent),
+		      EXT2_QSORT_TYPE (*cmp)(const void *, const void *))
+{
+	ext2_dblist	dblist, copy;
+	struct ext2_db_entry ent;
+	struct get_order sorted, ref;
+	errcode_t	retval;
+	int		i;
+
+	retval = ext2fs_init_dblist(test_fs, &dblist);
+	if (retval) {
+		com_err(what, retval, "while creating dblist");
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		make_entry(i, &ent);
+		retval = ext2fs_add_dir_block(dblist, ent.ino, ent.blk,
+					      ent.blockcnt);
+		if (retval) {
+			com_err(what, retval, "while adding entry %d", i);
+			exit(1);
+		}
+	}
+	retval = ext2fs_copy_dblist(dblist, &copy);
+	if (retval) {
+		com_err(what, retval, "while copying dblist");
+		exit(1);
+	}
+	ext2fs_dblist_sort(dblist, 0);
+	ext2fs_dblist_sort(copy, cmp);
+
+	sorted.list = malloc(count * sizeof(struct ext2_db_entry));
+	ref.list = malloc(count * sizeof(struct ext2_db_entry));
+	if (!sorted.list || !ref.list) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	sorted.n = ref.n = 0;
+	ext2fs_dblist_iterate(dblist, get_order_proc, &sorted);
+	ext2fs_dblist_iterate(copy, get_order_proc, &ref);
+	if (sorted.n != count || ref.n != count) {
+		printf("%s: %d and %d entries, expected %d\n", what,
+		       sorted.n, ref.n, count);
+		failed++;
+	} else {
+		for (i = 0; i < count; i++) {
+			if (sorted.list[i].blk == ref.list[i].blk &&
+			    sorted.list[i].ino == ref.list[i].ino &&
+			    sorted.list[i].blockcnt == ref.list[i].blockcnt)
+				continue;
+			printf("%s: entry %d is (%u, %u, %d), "
+			       "expected (%u, %u, %d)\n", what, i,
+			       sorted.list[i].blk, sorted.list[i].ino,
+			       sorted.list[i].blockcnt, ref.list[i].blk,
+			       ref.list[i].ino, ref.list[i].blockcnt);
+			failed++;
+			break;
+		}
+	}
+	free(sorted.list);
+	free(ref.list);
+	ext2fs_free_dblist(copy);
+	ext2fs_free_dblist(dblist);
+}
+
+/* many entries for each block, as with blocks shared between directories */
+static void dup_entry(int i, struct ext2_db_entry *ent)
+{
+	ent->blk = rand() % 1000;
+	ent->ino = 1 + rand() % 50;
+	ent->blockcnt = rand() % 20;
+}
+
+/* every entry for the same block: each radix pass is skipped */
+static void same_entry(int i, struct ext2_db_entry *ent)
+{
+	ent->blk = 123456;
+	ent->ino = 1 + rand() % 500;
+	ent->blockcnt = rand() % 100;
+}
+
+/* blocks using every digit */
+static void spread_entry(int i, struct ext2_db_entry *ent)
+{
+	ent->blk = rand() & 0x7fffffff;
+	ent->ino = 1 + rand() % 10000;
+	ent->blockcnt = i & 7;
+}
+
+static void reverse_entry(int i, struct ext2_db_entry *ent)
+{
+	ent->blk = 100000 - i / 2;
+	ent->ino = 1000 - i;
+	ent->blockcnt = i;
+}
+
+/* blocks above 2^31, which the old comparator got wrong */
+static void high_entry(int i, struct ext2_db_entry *ent)
+{
+	ent->blk = (rand() & 0x7fffffff) | ((i & 1) ? 0x80000000 : 0);
+	ent->ino = 1 + rand() % 100;
+	ent->blockcnt = rand() % 4;
+}
+
+/*
+ * Entries for random blocks, some of them shared, so that the sorted
+ * list has runs of consecutive blocks with gaps and repeats between.
+ * Each entry's blockcnt is its number, for check_par_proc().
+ */
+static void make_par_list(void)
+{
+	errcode_t	retval;
+	int		i;
+
+	retval = ext2fs_init_dblist(test_fs, &par_list);
+	for (i = 0; !retval && i < NUM_ENTRIES; i++)
+		retval = ext2fs_add_dir_block(par_list, 1 + rand() % 100,
+					      FIRST_BLOCK + rand() % NUM_BLOCKS,
+					      i);
+	if (retval) {
+		com_err("make_par_list", retval, "while adding entries");
+		exit(1);
+	}
+}
+
+static int check_par_proc(ext2_filsys fs, struct ext2_db_entry *db_info,
+			  char *buf, int thread, void *priv_data)
+{
+	int	threads = *(int *) priv_data;
+	int	i = db_info->blockcnt;
+
+	if (thread < 0 || thread >= threads) {
+		bad_thread++;
+		return 0;
+	}
+	calls[thread]++;
+	seen[i]++;
+	if (((struct ext2_dir_entry *) buf)->inode != db_info->blk)
+		wrong[thread]++;
+	return (i == stop_entry) ? DBLIST_ABORT : 0;
+}
+
+static void clear_par_counts(void)
+{
+	memset(seen, 0, sizeof(seen));
+	memset(calls, 0, sizeof(calls));
+	memset(wrong, 0, sizeof(wrong));
+	bad_thread = 0;
+}
+
+/* every entry, with the right block, exactly once */
+static void test_parallel(int threads)
+{
+	errcode_t	retval;
+	int		i, missed = 0, twice = 0, bad = 0, limit;
+
+	clear_par_counts();
+	limit = threads ? threads : MAX_THREADS;
+	retval = ext2fs_dblist_iterate_parallel(par_list, threads,
+						check_par_proc, &limit);
+	if (retval) {
+		com_err("test_parallel", retval, "with %d threads", threads);
+		failed++;
+		return;
+	}
+	for (i = 0; i < (int) ext2fs_dblist_count(par_list); i++) {
+		if (seen[i] > 1)
+			twice++;
+		else if (!seen[i])
+			missed++;
+	}
+	for (i = 0; i < MAX_THREADS; i++)
+		bad += wrong[i];
+	if (missed || twice || bad || bad_thread) {
+		printf("%d threads: %d entries missed, %d seen twice, "
+		       "%d wrong blocks, %d bad thread numbers\n", threads,
+		       missed, twice, bad, bad_thread);
+		failed++;
+	}
+}
+
+/* how many entries the sorted list has before stop_entry */
+static int find_stop_proc(ext2_filsys fs, struct ext2_db_entry *db_info,
+			  void *priv_data)
+{
+	if (db_info->blockcnt == stop_entry)
+		return DBLIST_ABORT;
+	(*(int *) priv_data)++;
+	return 0;
+}
+
+/*
+ * Once an entry returns DBLIST_ABORT no thread may take another chunk:
+ * each may only finish the one it has.  With one thread, nothing after
+ * the aborting entry is handed out at all.
+ */
+static void test_abort(int threads)
+{
+	errcode_t	retval;
+	int		i, total = 0, pos = 0, limit = threads;
+
+	clear_par_counts();
+	stop_entry = NUM_ENTRIES / 3;
+	ext2fs_dblist_iterate(par_list, find_stop_proc, &pos);
+	retval = ext2fs_dblist_iterate_parallel(par_list, threads,
+						check_par_proc, &limit);
+	for (i = 0; i < MAX_THREADS; i++)
+		total += calls[i];
+	if (retval || bad_thread || total > pos + threads * CHUNK ||
+	    (threads == 1 && total != pos + 1)) {
+		printf("abort with %d threads: returned %ld, %d of %d "
+		       "entries handed out after stopping at %d\n", threads,
+		       (long) retval, total, NUM_ENTRIES, pos);
+		failed++;
+	}
+	stop_entry = -1;
+}
+
+/*
+ * A block past the end of the filesystem can't be read: that stops the
+ * iteration, and the error is returned.
+ */
+static void test_read_error(int threads)
+{
+	errcode_t	retval;
+	int		limit = threads ? threads : MAX_THREADS;
+
+	clear_par_counts();
+	retval = ext2fs_dblist_iterate_parallel(par_list, threads,
+						check_par_proc, &limit);
+	if (retval != EXT2_ET_SHORT_READ || bad_thread) {
+		printf("read error with %d threads: returned %ld\n", threads,
+		       (long) retval);
+		failed++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char		name[] = "/tmp/tst_dblist.XXXXXX";
+	static int	threads[] = { 1, 2, 4, 0 };
+	errcode_t	retval;
+	int		i;
+
+	setup(name);
+	srand(1);
+
+	test_sort("duplicate blocks", 5000, dup_entry, old_cmp);
+	test_sort("one block", 500, same_entry, old_cmp);
+	test_sort("spread blocks", 20000, spread_entry, old_cmp);
+	test_sort("reversed blocks", 1000, reverse_entry, old_cmp);
+	test_sort("short list", 10, dup_entry, old_cmp);
+	test_sort("high blocks", 5000, high_entry, wide_cmp);
+
+	make_par_list();
+	for (i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); i++) {
+		test_parallel(threads[i]);
+		if (threads[i])
+			test_abort(threads[i]);
+	}
+	retval = ext2fs_add_dir_block(par_list, 1, 20000, NUM_ENTRIES);
+	if (retval) {
+		com_err("main", retval, "while adding the unreadable block");
+		exit(1);
+	}
+	for (i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); i++)
+		test_read_error(threads[i]);
+	ext2fs_free_dblist(par_list);
+
+	ext2fs_close(test_fs);
+	unlink(name);
+	if (failed) {
+		printf("Directory block list: %d tests failed.\n", failed);
+		exit(1);
+	}
+	printf("Directory block list sort and iteration tested OK!\n");
+	exit(0);
+}
@@ -0,0 +1,387 @@
+/*
+ * tst_extent.c --- test the extent tree code: splits, merges, punching and
+ *	taking tree blocks out while iterating.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+/* more single block extents than fit in two levels of 1k blocks */
+#define NSLOTS		1200
+#define LONG_START	5000
+#define LONG_LEN	100
+
+ext2_filsys	test_fs;
+ext2_ino_t	test_ino;
+struct ext2_inode test_inode;
+blk_t		expect[2 * NSLOTS];
+blk_t		base;
+int		failed = 0;
+
+static void setup(char *name)
+{
+	struct ext2_super_block param;
+	errcode_t	retval;
+	int		fd;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(name);
+	if (fd < 0 || ftruncate(fd, 20000 * 1024) < 0) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = 20000;
+	param.s_feature_incompat = EXT3_FEATURE_INCOMPAT_EXTENTS;
+	retval = ext2fs_initialize(name, EXT2_FLAG_RW, &param,
+				   unix_io_manager, &test_fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing filesystem");
+		exit(1);
+	}
+	retval = ext2fs_allocate_tables(test_fs);
+	if (retval) {
+		com_err("setup", retval, "while allocating tables");
+		exit(1);
+	}
+
+	test_ino = EXT2_FIRST_INO(test_fs->super);
+	memset(&test_inode, 0, sizeof(test_inode));
+	test_inode.i_mode = LINUX_S_IFREG | 0644;
+	test_inode.i_links_count = 1;
+	test_inode.i_flags = EXT4_EXTENTS_FL;
+	ext2fs_extent_header_init(&test_inode);
+	ext2fs_inode_alloc_stats2(test_fs, test_ino, +1, 0);
+
+	/* the data blocks, so that neighbours can be merged */
+	retval = ext2fs_get_free_blocks(test_fs, 1000,
+					test_fs->super->s_blocks_count,
+					2 * NSLOTS + LONG_LEN,
+					test_fs->block_map, &base);
+	if (retval) {
+		com_err("setup", retval, "while finding data blocks");
+		exit(1);
+	}
+	ext2fs_block_alloc_stats_range(test_fs, base, 2 * NSLOTS + LONG_LEN,
+				       +1);
+}
+
+static void map_block(blk_t lblk, blk_t pblk)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_bmap(test_fs, test_ino, &test_inode, NULL, BMAP_SET,
+			     lblk, &pblk);
+	if (retval) {
+		com_err("map_block", retval, "while mapping block %u", lblk);
+		exit(1);
+	}
+	test_inode.i_blocks += test_fs->blocksize / 512;
+}
+
+static void check_map(const char *what)
+{
+	blk_t		lblk, pblk;
+	errcode_t	retval;
+	int		bad = 0;
+
+	for (lblk = 0; lblk < 2 * NSLOTS; lblk++) {
+		retval = ext2fs_bmap(test_fs, test_ino, &test_inode, NULL, 0,
+				     lblk, &pblk);
+		if (retval || pblk != expect[lblk]) {
+			if (!bad++)
+				printf("%s: block %u maps to %u, expected %u\n",
+				       what, lblk, pblk, expect[lblk]);
+		}
+	}
+	if (bad) {
+		printf("%s: %d blocks wrong\n", what, bad);
+		failed++;
+	}
+}
+
+/* the number of extents, from the runs that cover mapped blocks */
+static int count_extents(blk_t end)
+{
+	struct ext2_bmap_run run;
+	__u64		lblk = 0;
+	int		count = 0;
+
+	while (lblk < end) {
+		if (ext2fs_extent_bmap_run(test_fs, &test_inode, NULL, lblk,
+					   &run)) {
+			failed++;
+			return -1;
+		}
+		if (run.pblk)
+			count++;
+		lblk = (__u64) run.lblk + run.len;
+	}
+	return count;
+}
+
+static int depth(void)
+{
+	struct ext3_extent_header *hdr =
+		(struct ext3_extent_header *) test_inode.i_block;
+
+	return ext2fs_le16_to_cpu(hdr->eh_depth);
+}
+
+static int entries(void)
+{
+	struct ext3_extent_header *hdr =
+		(struct ext3_extent_header *) test_inode.i_block;
+
+	return ext2fs_le16_to_cpu(hdr->eh_entries);
+}
+
+static void fill_even(void)
+{
+	blk_t	lblk;
+
+	memset(expect, 0, sizeof(expect));
+	for (lblk = 0; lblk < 2 * NSLOTS; lblk += 2) {
+		expect[lblk] = base + lblk;
+		map_block(lblk, base + lblk);
+	}
+}
+
+static void test_split_merge(void)
+{
+	blk_t	lblk;
+	int	n;
+
+	fill_even();
+	check_map("split");
+	if (depth() < 2) {
+		printf("split: tree is only %d deep\n", depth());
+		failed++;
+	}
+	n = count_extents(2 * NSLOTS);
+	if (n != NSLOTS) {
+		printf("split: %d extents, expected %d\n", n, NSLOTS);
+		failed++;
+	}
+
+	/* every odd block joins the extent on its left */
+	for (lblk = 1; lblk < 2 * NSLOTS; lblk += 2) {
+		expect[lblk] = base + lblk;
+		map_block(lblk, base + lblk);
+	}
+	check_map("merge");
+	n = count_extents(2 * NSLOTS);
+	if (n != NSLOTS) {
+		printf("merge: %d extents, expected %d\n", n, NSLOTS);
+		failed++;
+	}
+}
+
+static void test_punch(blk_t free_before)
+{
+	struct ext2_bmap_run run;
+	blk_t		lblk;
+	errcode_t	retval;
+
+	/* a range across many leaves */
+	retval = ext2fs_extent_punch(test_fs, &test_inode, 101,
+				     2 * NSLOTS - 102, NULL, NULL);
+	if (retval) {
+		com_err("punch", retval, "while punching a range");
+		exit(1);
+	}
+	for (lblk = 101; lblk <= 2 * NSLOTS - 102; lblk++)
+		expect[lblk] = 0;
+	check_map("punch range");
+
+	/* a hole in the middle of one long extent */
+	for (lblk = 0; lblk < LONG_LEN; lblk++)
+		map_block(LONG_START + lblk, base + 2 * NSLOTS + lblk);
+	retval = ext2fs_extent_punch(test_fs, &test_inode, LONG_START + 40,
+				     LONG_START + 59, NULL, NULL);
+	if (retval) {
+		com_err("punch", retval, "while punching a hole");
+		exit(1);
+	}
+	if (ext2fs_extent_bmap_run(test_fs, &test_inode, NULL,
+				   LONG_START + 10, &run) ||
+	    run.lblk != LONG_START || run.len != 40 ||
+	    ext2fs_extent_bmap_run(test_fs, &test_inode, NULL,
+				   LONG_START + 50, &run) ||
+	    run.pblk || run.lblk != LONG_START + 40 || run.len != 20 ||
+	    ext2fs_extent_bmap_run(test_fs, &test_inode, NULL,
+				   LONG_START + 70, &run) ||
+	    run.lblk != LONG_START + 60 || run.len != 40 ||
+	    run.pblk != base + 2 * NSLOTS + 60) {
+		printf("punch hole: wrong runs around the hole\n");
+		failed++;
+	}
+	check_map("punch hole");
+
+	/* everything: the tree should be gone, blocks and all */
+	retval = ext2fs_extent_punch(test_fs, &test_inode, 0, 0xFFFFFFFF,
+				     NULL, NULL);
+	if (retval) {
+		com_err("punch", retval, "while punching everything");
+		exit(1);
+	}
+	memset(expect, 0, sizeof(expect));
+	check_map("punch all");
+	if (depth() || entries() || test_inode.i_blocks) {
+		printf("punch all: depth %d, %d entries, %u sectors left\n",
+		       depth(), entries(), test_inode.i_blocks);
+		failed++;
+	}
+	/* the data blocks were released too, take them back for later */
+	ext2fs_block_alloc_stats_range(test_fs, base, 2 * NSLOTS + LONG_LEN,
+				       +1);
+	if (test_fs->super->s_free_blocks_count != free_before) {
+		printf("punch all: %u free blocks, expected %u\n",
+		       test_fs->super->s_free_blocks_count, free_before);
+		failed++;
+	}
+}
+
+struct drop_ctx {
+	int	tree_blocks;	/* reported so far */
+	int	drop;		/* which one to take out, -1 for all */
+	int	data;		/* take out data blocks too */
+};
+
+static int drop_proc(ext2_filsys fs, blk_t *blocknr, e2_blkcnt_t blockcnt,
+		     blk_t ref_blk, int ref_offset, void *priv_data)
+{
+	struct drop_ctx *ctx = priv_data;
+
+	if (blockcnt >= 0) {
+		if (!ctx->data)
+			return 0;
+	} else if (ctx->drop >= 0 && ctx->tree_blocks++ != ctx->drop)
+		return 0;
+	ext2fs_block_alloc_stats(fs, *blocknr, -1);
+	*blocknr = 0;
+	return BLOCK_CHANGED;
+}
+
+static void read_test_inode(void)
+{
+	errcode_t	retval;
+
+	retval = ext2fs_read_inode(test_fs, test_ino, &test_inode);
+	if (retval) {
+		com_err("iterate", retval, "while reading the inode");
+		exit(1);
+	}
+}
+
+static void test_iterate(void)
+{
+	struct drop_ctx ctx;
+	blk_t		lblk, first, free_before;
+	errcode_t	retval;
+
+	free_before = test_fs->super->s_free_blocks_count;
+
+	/*
+	 * Take out the first leaf as it is reported: what it mapped is
+	 * gone, the rest is still there.
+	 */
+	fill_even();
+	ctx.tree_blocks = 0;
+	ctx.drop = 1;
+	ctx.data = 0;
+	retval = ext2fs_block_iterate2(test_fs, test_ino, 0, NULL,
+				       drop_proc, &ctx);
+	if (retval) {
+		com_err("iterate", retval, "while dropping a leaf");
+		exit(1);
+	}
+	read_test_inode();
+	for (first = 0; first < 2 * NSLOTS; first += 2) {
+		if (ext2fs_bmap(test_fs, test_ino, &test_inode, NULL, 0,
+				first, &lblk))
+			break;
+		if (lblk)
+			break;
+		expect[first] = 0;
+	}
+	if (!first || first >= 2 * NSLOTS) {
+		printf("iterate: dropped leaf mapped %u blocks\n", first / 2);
+		failed++;
+	}
+	check_map("drop leaf");
+
+	/* and its blocks can be mapped again */
+	for (lblk = 0; lblk < first; lblk += 2) {
+		expect[lblk] = base + lblk;
+		map_block(lblk, base + lblk);
+	}
+	check_map("refill leaf");
+
+	/* depth first, with the data: the whole file goes */
+	ctx.tree_blocks = 0;
+	ctx.drop = -1;
+	ctx.data = 1;
+	retval = ext2fs_block_iterate2(test_fs, test_ino,
+				       BLOCK_FLAG_DEPTH_TRAVERSE, NULL,
+				       drop_proc, &ctx);
+	if (retval) {
+		com_err("iterate", retval, "while dropping everything");
+		exit(1);
+	}
+	read_test_inode();
+	memset(expect, 0, sizeof(expect));
+	check_map("drop all");
+	if (depth() || entries()) {
+		printf("drop all: depth %d, %d entries left\n",
+		       depth(), entries());
+		failed++;
+	}
+	/* the tree blocks, and the data blocks of the even slots */
+	if (test_fs->super->s_free_blocks_count != free_before + NSLOTS) {
+		printf("drop all: %u free blocks, expected %u\n",
+		       test_fs->super->s_free_blocks_count,
+		       free_before + NSLOTS);
+		failed++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char		name[] = "/tmp/tst_extent.XXXXXX";
+	blk_t		free_before;
+
+	setup(name);
+	free_before = test_fs->super->s_free_blocks_count;
+
+	test_split_merge();
+	test_punch(free_before);
+	test_iterate();
+
+	ext2fs_close(test_fs);
+	unlink(name);
+	if (failed) {
+		printf("Extent tree: %d tests failed.\n", failed);
+		exit(1);
+	}
+	printf("Extent tree tested OK!\n");
+	exit(0);
+}
@@ -0,0 +1,250 @@
+/*
+ * tst_pscan.c --- test the parallel inode table scan against the
+ *	sequential one.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define MAX_THREADS	64
+
+ext2_filsys	test_fs;
+struct ext2_inode *ref;		/* the inodes as ext2fs_get_next_inode() saw them */
+unsigned char	*seen;		/* times each was handed to the callback */
+int		wrong[MAX_THREADS];	/* inodes which didn't match, per thread */
+int		bad_thread;
+ext2_ino_t	stop_ino;
+int		failed = 0;
+
+static void setup(char *name)
+{
+	struct ext2_super_block param;
+	struct ext2_inode inode;
+	errcode_t	retval;
+	ext2_ino_t	ino, ipg;
+	dgrp_t		group;
+	int		fd;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(name);
+	if (fd < 0 || ftruncate(fd, 40000 * 1024) < 0) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = 40000;
+	retval = ext2fs_initialize(name, EXT2_FLAG_RW, &param,
+				   unix_io_manager, &test_fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing filesystem");
+		exit(1);
+	}
+	retval = ext2fs_allocate_tables(test_fs);
+	if (retval) {
+		com_err("setup", retval, "while allocating tables");
+		exit(1);
+	}
+
+	/*
+	 * Some inodes in every group but the last, a different number in
+	 * each, with holes between them, so that each group's table ends
+	 * in a free tail of a different length.
+	 */
+	ipg = EXT2_INODES_PER_GROUP(test_fs->super);
+	for (group = 0; group + 1 < test_fs->group_desc_count; group++) {
+		for (ino = group * ipg + 1;
+		     ino <= group * ipg + 20 + 37 * group; ino += 3) {
+			memset(&inode, 0, sizeof(inode));
+			inode.i_mode = LINUX_S_IFREG | 0644;
+			inode.i_links_count = 1;
+			inode.i_size = ino * 7;
+			inode.i_mtime = ino;
+			inode.i_block[0] = ino ^ 0x5a5a;
+			retval = ext2fs_write_inode(test_fs, ino, &inode);
+			if (retval) {
+				com_err("setup", retval,
+					"while writing inode %u", ino);
+				exit(1);
+			}
+			ext2fs_inode_alloc_stats2(test_fs, ino, +1, 0);
+		}
+	}
+}
+
+static void read_reference(void)
+{
+	ext2_inode_scan	scan;
+	ext2_ino_t	ino;
+	struct ext2_inode inode;
+	errcode_t	retval;
+	ext2_ino_t	n = test_fs->super->s_inodes_count;
+
+	ref = calloc(n + 1, sizeof(struct ext2_inode));
+	seen = malloc(n + 1);
+	if (!ref || !seen) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	retval = ext2fs_open_inode_scan(test_fs, 0, &scan);
+	if (retval) {
+		com_err("reference", retval, "while opening inode scan");
+		exit(1);
+	}
+	while (1) {
+		retval = ext2fs_get_next_inode(scan, &ino, &inode);
+		if (retval) {
+			com_err("reference", retval, "while getting next inode");
+			exit(1);
+		}
+		if (!ino)
+			break;
+		ref[ino] = inode;
+	}
+	ext2fs_close_inode_scan(scan);
+}
+
+static errcode_t check_proc(ext2_filsys fs, ext2_ino_t ino,
+			    struct ext2_inode *inode, int thread,
+			    void *priv_data)
+{
+	int	threads = *(int *) priv_data;
+
+	if (thread < 0 || thread >= threads) {
+		bad_thread++;
+		return 0;
+	}
+	if (ino == stop_ino)
+		return EXT2_ET_CANCEL_REQUESTED;
+	seen[ino]++;
+	if (memcmp(inode, &ref[ino], sizeof(struct ext2_inode)))
+		wrong[thread]++;
+	return 0;
+}
+
+static void test_scan(int threads, int buffer_blocks, int flags)
+{
+	errcode_t	retval;
+	ext2_ino_t	ino, n = test_fs->super->s_inodes_count;
+	int		i, missed = 0, twice = 0, bad = 0, limit;
+
+	memset(seen, 0, n + 1);
+	memset(wrong, 0, sizeof(wrong));
+	bad_thread = 0;
+	limit = threads ? threads : ext2fs_inode_scan_threads(test_fs);
+	retval = ext2fs_inode_scan_parallel(test_fs, threads, buffer_blocks,
+					    flags, check_proc, &limit);
+	if (retval) {
+		com_err("test_scan", retval, "with %d threads", threads);
+		failed++;
+		return;
+	}
+	for (ino = 1; ino <= n; ino++) {
+		if (seen[ino] > 1)
+			twice++;
+		/* only the free tail may be left out */
+		else if (!seen[ino] &&
+			 (!(flags & EXT2_SF_SKIP_FREE_TAIL) ||
+			  ext2fs_test_inode_bitmap(test_fs->inode_map, ino)))
+			missed++;
+	}
+	for (i = 0; i < MAX_THREADS; i++)
+		bad += wrong[i];
+	if (missed || twice || bad || bad_thread) {
+		printf("%d threads, %d blocks, flags %#x: %d inodes missed, "
+		       "%d seen twice, %d wrong, %d bad thread numbers\n",
+		       threads, buffer_blocks, flags, missed, twice, bad,
+		       bad_thread);
+		failed++;
+	}
+}
+
+/* each group's scan should stop right after its last inode in use */
+static void test_free_tail(void)
+{
+	ext2_ino_t	ino, last, ipg = EXT2_INODES_PER_GROUP(test_fs->super);
+	dgrp_t		group;
+	int		limit = 1, bad = 0;
+
+	memset(seen, 0, test_fs->super->s_inodes_count + 1);
+	ext2fs_inode_scan_parallel(test_fs, 1, 0, EXT2_SF_SKIP_FREE_TAIL,
+				   check_proc, &limit);
+	for (group = 0; group < test_fs->group_desc_count; group++) {
+		last = 0;
+		for (ino = group * ipg + 1; ino <= (group + 1) * ipg; ino++)
+			if (ext2fs_test_inode_bitmap(test_fs->inode_map, ino))
+				last = ino;
+		for (ino = group * ipg + 1; ino <= (group + 1) * ipg; ino++)
+			if (!seen[ino] != (ino > last))
+				bad++;
+	}
+	if (bad) {
+		printf("free tail: %d inodes wrongly scanned or skipped\n",
+		       bad);
+		failed++;
+	}
+}
+
+static void test_stop(void)
+{
+	errcode_t	retval;
+	int		limit = 4;
+
+	stop_ino = EXT2_INODES_PER_GROUP(test_fs->super) + 4;
+	retval = ext2fs_inode_scan_parallel(test_fs, 4, 0, 0, check_proc,
+					    &limit);
+	stop_ino = 0;
+	if (retval != EXT2_ET_CANCEL_REQUESTED) {
+		printf("stop: scan returned %ld\n", (long) retval);
+		failed++;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	char		name[] = "/tmp/tst_pscan.XXXXXX";
+	static int	threads[] = { 1, 2, 4, 0 };
+	static int	buffers[] = { 1, 3, 0 };
+	int		i, j;
+
+	setup(name);
+	read_reference();
+
+	for (i = 0; i < (int) (sizeof(threads) / sizeof(threads[0])); i++)
+		for (j = 0; j < (int) (sizeof(buffers) / sizeof(buffers[0]));
+		     j++) {
+			test_scan(threads[i], buffers[j], 0);
+			test_scan(threads[i], buffers[j],
+				  EXT2_SF_SKIP_FREE_TAIL);
+		}
+	test_free_tail();
+	test_stop();
+
+	ext2fs_close(test_fs);
+	unlink(name);
+	free(ref);
+	free(seen);
+	if (failed) {
+		printf("Parallel inode scan: %d tests failed.\n", failed);
+		exit(1);
+	}
+	printf("Parallel inode scan tested OK!\n");
+	exit(0);
+}
@@ -0,0 +1,228 @@
+/*
+ * tst_unlink.c --- test removing directory entries, in particular the
+ *	first entry of a block other than the directory's first.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#define FIRST_INO	100
+#define EXTRA_NAMES	10	/* put in the second block */
+#define MAX_NAMES	1000
+
+ext2_filsys	test_fs;
+int		num_names;
+char		removed[MAX_NAMES];	/* names taken out so far */
+int		failed = 0;
+
+static void setup(char *name)
+{
+	struct ext2_super_block param;
+	errcode_t	retval;
+	int		fd;
+
+	initialize_ext2_error_table();
+
+	fd = mkstemp(name);
+	if (fd < 0 || ftruncate(fd, 4000 * 1024) < 0) {
+		perror(name);
+		exit(1);
+	}
+	close(fd);
+
+	memset(&param, 0, sizeof(param));
+	param.s_blocks_count = 4000;
+	retval = ext2fs_initialize(name, EXT2_FLAG_RW, &param,
+				   unix_io_manager, &test_fs);
+	if (retval) {
+		com_err("setup", retval, "while initializing filesystem");
+		exit(1);
+	}
+	retval = ext2fs_allocate_tables(test_fs);
+	if (!retval)
+		retval = ext2fs_mkdir(test_fs, EXT2_ROOT_INO, EXT2_ROOT_INO,
+				      0);
+	if (retval) {
+		com_err("setup", retval, "while creating the root directory");
+		exit(1);
+	}
+}
+
+static void make_name(int i, char *name)
+{
+	sprintf(name, "file%04d", i);
+}
+
+/*
+ * Link names into the root directory until it has a second block, and
+ * a few more after that.
+ */
+static void fill_dir(void)
+{
+	struct ext2_inode inode;
+	char		name[16];
+	errcode_t	retval;
+	int		extra = -1;
+
+	for (num_names = 0; extra < EXTRA_NAMES && num_names < MAX_NAMES;
+	     num_names++) {
+		make_name(num_names, name);
+		retval = ext2fs_link(test_fs, EXT2_ROOT_INO, name,
+				     FIRST_INO + num_names, EXT2_FT_REG_FILE);
+		if (retval == EXT2_ET_DIR_NO_SPACE) {
+			retval = ext2fs_expand_dir(test_fs, EXT2_ROOT_INO);
+			if (!retval)
+				retval = ext2fs_link(test_fs, EXT2_ROOT_INO,
+						     name,
+						     FIRST_INO + num_names,
+						     EXT2_FT_REG_FILE);
+			extra = 0;
+		}
+		if (retval) {
+			com_err("fill_dir", retval, "while linking %s", name);
+			exit(1);
+		}
+		if (extra >= 0)
+			extra++;
+	}
+	retval = ext2fs_read_inode(test_fs, EXT2_ROOT_INO, &inode);
+	if (retval || inode.i_size != 2 * test_fs->blocksize) {
+		printf("fill_dir: root directory is %u bytes\n", inode.i_size);
+		exit(1);
+	}
+}
+
+static void read_block(const char *what, int blockcnt, char *buf)
+{
+	blk_t		blk;
+	errcode_t	retval;
+
+	retval = ext2fs_bmap(test_fs, EXT2_ROOT_INO, NULL, NULL, 0,
+			     blockcnt, &blk);
+	if (!retval)
+		retval = ext2fs_read_dir_block(test_fs, blk, buf);
+	if (retval) {
+		com_err(what, retval, "while reading block %d", blockcnt);
+		exit(1);
+	}
+}
+
+/* each block's entries must still add up to the block */
+static void check_blocks(const char *what, char *buf)
+{
+	struct ext2_dir_entry *dirent;
+	unsigned int	offset;
+	int		blockcnt;
+
+	for (blockcnt = 0; blockcnt < 2; blockcnt++) {
+		read_block(what, blockcnt, buf);
+		for (offset = 0; offset < test_fs->blocksize;
+		     offset += dirent->rec_len) {
+			dirent = (struct ext2_dir_entry *) (buf + offset);
+			if (dirent->rec_len < 8 || dirent->rec_len % 4)
+				break;
+		}
+		if (offset != test_fs->blocksize) {
+			printf("%s: block %d is corrupt at %u\n", what,
+			       blockcnt, offset);
+			failed++;
+		}
+	}
+}
+
+/* every name but the ones removed can still be found */
+static void check_names(const char *what)
+{
+	char		name[16];
+	ext2_ino_t	ino;
+	errcode_t	retval;
+	int		i;
+
+	for (i = 0; i < num_names; i++) {
+		make_name(i, name);
+		retval = ext2fs_lookup(test_fs, EXT2_ROOT_INO, name,
+				       strlen(name), 0, &ino);
+		if (removed[i]) {
+			if (retval != EXT2_ET_FILE_NOT_FOUND) {
+				printf("%s: %s is still there\n", what, name);
+				failed++;
+			}
+		} else if (retval || ino != (ext2_ino_t) (FIRST_INO + i)) {
+			printf("%s: %s is lost\n", what, name);
+			failed++;
+		}
+	}
+}
+
+/*
+ * Remove the first name in the block: in the first block, that's the
+ * one after "." and "..", which is merged into "..".  In the second,
+ * it's the entry at the very start, which can only be cleared.
+ */
+static void test_unlink(const char *what, int blockcnt)
+{
+	struct ext2_dir_entry *dirent;
+	char		*buf, name[EXT2_NAME_LEN + 1];
+	errcode_t	retval;
+
+	buf = malloc(test_fs->blocksize);
+	if (!buf) {
+		printf("Out of memory\n");
+		exit(1);
+	}
+	read_block(what, blockcnt, buf);
+	dirent = (struct ext2_dir_entry *) buf;
+	if (!blockcnt) {
+		dirent = (struct ext2_dir_entry *) (buf + dirent->rec_len);
+		dirent = (struct ext2_dir_entry *) ((char *) dirent +
+						    dirent->rec_len);
+	}
+	memcpy(name, dirent->name, dirent->name_len & 0xFF);
+	name[dirent->name_len & 0xFF] = 0;
+
+	retval = ext2fs_unlink(test_fs, EXT2_ROOT_INO, name, 0, 0);
+	if (retval) {
+		com_err(what, retval, "while unlinking %s", name);
+		failed++;
+	} else {
+		removed[atoi(name + 4)] = 1;
+		check_blocks(what, buf);
+		check_names(what);
+	}
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	char		name[] = "/tmp/tst_unlink.XXXXXX";
+
+	setup(name);
+	fill_dir();
+
+	test_unlink("first block", 0);
+	test_unlink("second block", 1);
+
+	ext2fs_close(test_fs);
+	unlink(name);
+	if (failed) {
+		printf("Directory unlink: %d tests failed.\n", failed);
+		exit(1);
+	}
+	printf("Directory unlink tested OK!\n");
+	exit(0);
+}
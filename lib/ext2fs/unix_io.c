@@ -18,10 +18,14 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* for O_DIRECT */
+#endif
 #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #if HAVE_UNISTD_H
 #include <unistd.h>
@@ -43,6 +47,9 @@
 #if HAVE_SYS_RESOURCE_H
 #include <sys/resource.h>
 #endif
+#if HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 #include "ext2_fs.h"
 #include "ext2fs.h"
@@ -63,8 +70,10 @@ struct unix_cache {
 };
 
 #define CACHE_SIZE 8
+#define DIRECT_CACHE_SIZE 256	/* With O_DIRECT, the only cache there is */
 #define WRITE_DIRECT_SIZE 4	/* Must be smaller than CACHE_SIZE */
 #define READ_DIRECT_SIZE 4	/* Should be smaller than CACHE_SIZE */
+#define READ_VEC_SIZE 64	/* Most blocks read by one preadv() */
 
 struct unix_private_data {
 	int	magic;
@@ -72,7 +81,10 @@ struct unix_private_data {
 	int	flags;
 	int	access_time;
 	ext2_loff_t offset;
-	struct unix_cache cache[CACHE_SIZE];
+	int	cache_size;
+	int	align;		/* With O_DIRECT, the sector size; else 0 */
+	char	*cache_mem;	/* The buffers of all of the cache entries */
+	struct unix_cache *cache;
 };
 
 static errcode_t unix_open(const char *name, int flags, io_channel *channel);
@@ -87,6 +99,8 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 				int size, const void *data);
 static errcode_t unix_set_option(io_channel channel, const char *option, 
 				 const char *arg);
+static errcode_t unix_read_blk_vec(io_channel channel, unsigned long *list,
+				   int count, void **bufs);
 
 static void reuse_cache(io_channel channel, struct unix_private_data *data,
 		 struct unix_cache *cache, unsigned long block);
@@ -113,7 +127,10 @@ static struct struct_io_manager struct_unix_manager = {
 #else
 	unix_write_byte,
 #endif
-	unix_set_option
+	unix_set_option,
+	0,
+	0,
+	unix_read_blk_vec
 };
 
 io_manager unix_io_manager = &struct_unix_manager;
@@ -121,6 +138,77 @@ io_manager unix_io_manager = &struct_unix_manager;
 /*
  * Here are the raw I/O functions
  */
+
+/*
+ * With O_DIRECT, a transfer must start and end on a sector boundary,
+ * to or from an aligned buffer.
+ */
+static int direct_ok(struct unix_private_data *data, ext2_loff_t location,
+		     size_t size, const void *buf)
+{
+	return !data->align || (!(location % data->align) &&
+				!(size % data->align) &&
+				!((unsigned long) buf % data->align));
+}
+
+/*
+ * Do a transfer direct_ok() refuses through an aligned bounce buffer,
+ * covering whole sectors.  A write first reads the sectors it only
+ * partly covers.  *actual is set to the number of the caller's bytes
+ * transferred.
+ */
+static errcode_t bounce_io(struct unix_private_data *data, int writing,
+			   ext2_loff_t location, void *buf, size_t size,
+			   int *actual)
+{
+	ext2_loff_t	start;
+	size_t		len, skip;
+	ssize_t		got = 0;
+	char		*bounce;
+	errcode_t	retval = 0;
+
+	*actual = 0;
+	skip = location % data->align;
+	start = location - skip;
+	len = (skip + size + data->align - 1) / data->align * data->align;
+	if (posix_memalign((void **) &bounce, data->align, len))
+		return EXT2_ET_NO_MEMORY;
+
+	if (!writing || skip || len != size) {
+		if (ext2fs_llseek(data->dev, start, SEEK_SET) != start) {
+			retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
+			goto out;
+		}
+		got = read(data->dev, bounce, len);
+		if (got < 0) {
+			retval = errno;
+			goto out;
+		}
+		/* A write may go past the end of an image file */
+		memset(bounce + got, 0, len - got);
+	}
+
+	if (!writing) {
+		if (got > (ssize_t) skip)
+			*actual = ((size_t) got - skip < size) ?
+				got - skip : size;
+		memcpy(buf, bounce + skip, size);
+		goto out;
+	}
+
+	memcpy(bounce + skip, buf, size);
+	if (ext2fs_llseek(data->dev, start, SEEK_SET) != start) {
+		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
+		goto out;
+	}
+	got = write(data->dev, bounce, len);
+	if (got > (ssize_t) skip)
+		*actual = ((size_t) got - skip < size) ? got - skip : size;
+out:
+	free(bounce);
+	return retval;
+}
+
 #ifndef NEED_BOUNCE_BUFFER
 static errcode_t raw_read_blk(io_channel channel,
 			      struct unix_private_data *data,
@@ -134,6 +222,14 @@ static errcode_t raw_read_blk(io_channel channel,
 
 	size = (count < 0) ? -count : count * channel->block_size;
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	if (!direct_ok(data, location, size, buf)) {
+		retval = bounce_io(data, 0, location, buf, size, &actual);
+		if (!retval && actual == size)
+			return 0;
+		if (!retval)
+			retval = EXT2_ET_SHORT_READ;
+		goto error_out;
+	}
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -176,6 +272,15 @@ static errcode_t raw_read_blk(io_channel channel,
 	printf("count=%d, size=%d, block=%lu, blk_size=%d, location=%llx\n",
 	 		count, size, block, channel->block_size, (long long)location);
 #endif
+	if (!direct_ok(data, location, size, buf)) {
+		retval = bounce_io(data, 0, location, buf, size, &total);
+		if (!retval && total == size)
+			return 0;
+		if (!retval)
+			retval = EXT2_ET_SHORT_READ;
+		actual = total;
+		goto error_out;
+	}
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -229,6 +334,15 @@ static errcode_t raw_write_blk(io_channel channel,
 	}
 
 	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	if (!direct_ok(data, location, size, buf)) {
+		retval = bounce_io(data, 1, location, (void *) buf, size,
+				   &actual);
+		if (!retval && actual == size)
+			return 0;
+		if (!retval)
+			retval = EXT2_ET_SHORT_WRITE;
+		goto error_out;
+	}
 	if (ext2fs_llseek(data->dev, location, SEEK_SET) != location) {
 		retval = errno ? errno : EXT2_ET_LLSEEK_FAILED;
 		goto error_out;
@@ -253,23 +367,32 @@ error_out:
  * Here we implement the cache functions
  */
 
-/* Allocate the cache buffers */
+/* Allocate the cache buffers, in one piece aligned for O_DIRECT */
 static errcode_t alloc_cache(io_channel channel,
 			     struct unix_private_data *data)
 {
 	errcode_t		retval;
 	struct unix_cache	*cache;
+	size_t			align;
 	int			i;
 	
 	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
+	if ((retval = ext2fs_get_mem(data->cache_size *
+				     sizeof(struct unix_cache), &data->cache)))
+		return retval;
+	align = data->align ? data->align : sizeof(double);
+	if (posix_memalign((void **) &data->cache_mem, align,
+			   (size_t) data->cache_size * channel->block_size)) {
+		data->cache_mem = 0;
+		return EXT2_ET_NO_MEMORY;
+	}
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
 		cache->block = 0;
 		cache->access_time = 0;
 		cache->dirty = 0;
 		cache->in_use = 0;
-		if ((retval = ext2fs_get_mem(channel->block_size,
-					     &cache->buf)))
-			return retval;
+		cache->buf = data->cache_mem +
+			(size_t) i * channel->block_size;
 	}
 	return 0;
 }
@@ -277,19 +400,12 @@ static errcode_t alloc_cache(io_channel channel,
 /* Free the cache buffers */
 static void free_cache(struct unix_private_data *data)
 {
-	struct unix_cache	*cache;
-	int			i;
-	
 	data->access_time = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
-		cache->block = 0;
-		cache->access_time = 0;
-		cache->dirty = 0;
-		cache->in_use = 0;
-		if (cache->buf)
-			ext2fs_free_mem(&cache->buf);
-		cache->buf = 0;
-	}
+	if (data->cache)
+		ext2fs_free_mem(&data->cache);
+	data->cache = 0;
+	free(data->cache_mem);
+	data->cache_mem = 0;
 }
 
 #ifndef NO_IO_CACHE
@@ -306,7 +422,7 @@ static struct unix_cache *find_cached_block(struct unix_private_data *data,
 	int			i;
 	
 	unused_cache = oldest_cache = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
 		if (!cache->in_use) {
 			if (!unused_cache)
 				unused_cache = cache;
@@ -353,7 +469,7 @@ static errcode_t flush_cached_blocks(io_channel channel,
 	int			i;
 	
 	retval2 = 0;
-	for (i=0, cache = data->cache; i < CACHE_SIZE; i++, cache++) {
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
 		if (!cache->in_use)
 			continue;
 		
@@ -410,6 +526,7 @@ static errcode_t unix_open(const char *name, int flags, io_channel *channel)
 
 	memset(data, 0, sizeof(struct unix_private_data));
 	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->cache_size = CACHE_SIZE;
 
 	if ((retval = alloc_cache(io, data)))
 		goto cleanup;
@@ -590,6 +707,119 @@ static errcode_t unix_read_blk(io_channel channel, unsigned long block,
 #endif /* NO_IO_CACHE */
 }
 
+/*
+ * Read a run of consecutive blocks into separate buffers, with one
+ * preadv() where we can, else a block at a time.
+ */
+static errcode_t raw_read_vec(io_channel channel,
+			      struct unix_private_data *data,
+			      unsigned long block, int count, void **bufs)
+{
+	errcode_t	retval;
+	int		i;
+#if defined(HAVE_PREADV) && !defined(NEED_BOUNCE_BUFFER)
+	struct iovec	iov[READ_VEC_SIZE];
+	ext2_loff_t	location;
+	int		ok;
+
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	ok = ((off_t) location == location);
+	for (i = 0; i < count; i++) {
+		if (!direct_ok(data, location, channel->block_size, bufs[i]))
+			ok = 0;
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = channel->block_size;
+	}
+	if (ok && preadv(data->dev, iov, count, location) ==
+	    (ssize_t) count * channel->block_size)
+		return 0;
+#endif
+	for (i = 0; i < count; i++) {
+		retval = raw_read_blk(channel, data, block + i, 1, bufs[i]);
+		if (retval)
+			return retval;
+	}
+	return 0;
+}
+
+struct vec_blk {
+	unsigned long	block;
+	void		*buf;
+};
+
+static int vec_blk_cmp(const void *a, const void *b)
+{
+	const struct vec_blk *va = a, *vb = b;
+
+	if (va->block < vb->block)
+		return -1;
+	return va->block > vb->block;
+}
+
+/*
+ * Read scattered blocks: those in the cache are copied from it, and
+ * the rest are sorted so that each run of consecutive blocks is read
+ * in one go.  They aren't added to the cache, which is too small to
+ * hold them.
+ */
+static errcode_t unix_read_blk_vec(io_channel channel, unsigned long *list,
+				   int count, void **bufs)
+{
+	struct unix_private_data *data;
+	struct vec_blk	*vec;
+	void		*run[READ_VEC_SIZE];
+	errcode_t	retval = 0;
+	int		i, j, k, n, todo;
+#ifndef NO_IO_CACHE
+	struct unix_cache *cache;
+#endif
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct unix_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (count <= 0)
+		return 0;
+	retval = ext2fs_get_mem(count * sizeof(struct vec_blk), &vec);
+	if (retval)
+		return retval;
+
+	for (i = todo = 0; i < count; i++) {
+#ifndef NO_IO_CACHE
+		/* A cached block may be newer than the one on disk */
+		if ((cache = find_cached_block(data, list[i], 0))) {
+			memcpy(bufs[i], cache->buf, channel->block_size);
+			continue;
+		}
+#endif
+		vec[todo].block = list[i];
+		vec[todo++].buf = bufs[i];
+	}
+	qsort(vec, todo, sizeof(struct vec_blk), vec_blk_cmp);
+
+	for (i = 0; i < todo; i = j) {
+		run[0] = vec[i].buf;
+		n = 1;
+		for (j = i + 1; j < todo; j++) {
+			if (vec[j].block == vec[j-1].block)
+				continue;	/* Copied once it's read */
+			if (vec[j].block != vec[j-1].block + 1 ||
+			    n == READ_VEC_SIZE)
+				break;
+			run[n++] = vec[j].buf;
+		}
+		retval = raw_read_vec(channel, data, vec[i].block, n, run);
+		if (retval)
+			break;
+		for (k = i + 1; k < j; k++)
+			if (vec[k].block == vec[k-1].block)
+				memcpy(vec[k].buf, vec[k-1].buf,
+				       channel->block_size);
+	}
+	ext2fs_free_mem(&vec);
+	return retval;
+}
+
 static errcode_t unix_write_blk(io_channel channel, unsigned long block,
 				int count, const void *buf)
 {
@@ -661,6 +891,16 @@ static errcode_t unix_write_byte(io_channel channel, unsigned long offset,
 		return retval;
 #endif
 
+	if (data->align) {
+		int done;
+
+		retval = bounce_io(data, 1, offset + data->offset,
+				   (void *) buf, size, &done);
+		if (!retval && done != size)
+			retval = EXT2_ET_SHORT_WRITE;
+		return retval;
+	}
+
 	if (lseek(data->dev, offset + data->offset, SEEK_SET) < 0)
 		return errno;
 	
@@ -690,6 +930,54 @@ static errcode_t unix_flush(io_channel channel)
 	return retval;
 }
 
+/*
+ * Bypass the kernel's cache, so blocks aren't kept both there and in
+ * ours.  Transfers are then aligned to the sector size, and our cache
+ * is made larger to make up for the one given up.
+ */
+static errcode_t set_direct(io_channel channel,
+			    struct unix_private_data *data)
+{
+	errcode_t	retval;
+	struct stat	st;
+	int		sectsize = 0;
+#ifdef O_DIRECT
+	int		fl;
+#endif
+
+	if (data->align)
+		return 0;
+#ifndef NO_IO_CACHE
+	if ((retval = flush_cached_blocks(channel, data, 1)))
+		return retval;
+#endif
+
+	/* For an image file, the block size of the filesystem holding it */
+	if (ext2fs_get_device_sectsize(channel->name, &sectsize) ||
+	    !sectsize) {
+		if (fstat(data->dev, &st) == 0 && st.st_blksize > 0)
+			sectsize = st.st_blksize;
+		else
+			sectsize = 512;
+	}
+
+#if defined(O_DIRECT)
+	fl = fcntl(data->dev, F_GETFL);
+	if (fl < 0 || fcntl(data->dev, F_SETFL, fl | O_DIRECT) < 0)
+		return errno;
+#elif defined(F_NOCACHE)
+	if (fcntl(data->dev, F_NOCACHE, 1) < 0)
+		return errno;
+#else
+	return EXT2_ET_UNIMPLEMENTED;
+#endif
+
+	free_cache(data);
+	data->align = sectsize;
+	data->cache_size = DIRECT_CACHE_SIZE;
+	return alloc_cache(channel, data);
+}
+
 static errcode_t unix_set_option(io_channel channel, const char *option, 
 				 const char *arg)
 {
@@ -713,5 +1001,10 @@ static errcode_t unix_set_option(io_channel channel, const char *option,
 			return EXT2_ET_INVALID_ARGUMENT;
 		return 0;
 	}
+	if (!strcmp(option, "direct")) {
+		if (arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return set_direct(channel, data);
+	}
 	return EXT2_ET_INVALID_ARGUMENT;
 }
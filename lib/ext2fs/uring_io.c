@@ -0,0 +1,1305 @@
+/*
+ * uring_io.c --- I/O manager built on Linux's io_uring.
+ *
+ * Works like the Unix I/O manager, but the cache is larger and its
+ * buffers are registered with the kernel, as is the device, so block
+ * I/O is done with READ_FIXED/WRITE_FIXED requests which can be in
+ * flight together:
+ *
+ *	- a run of uncached blocks is read with one request per block,
+ *	  all submitted at once;
+ *	- cache_readahead() starts reads into the cache and returns
+ *	  without waiting for them;
+ *	- dirty blocks are written back in the background once half of
+ *	  the cache is dirty, and flush waits for all of them.
+ *
+ * Only the system calls are used, not liburing.  Where io_uring is
+ * missing, uring_open fails and callers should fall back to
+ * unix_io_manager.
+ *
+ * %Begin-Header%
+ * This file may be redistributed under the terms of the GNU Public
+ * License.
+ * %End-Header%
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* for O_DIRECT */
+#endif
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <fcntl.h>
+#if HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include "ext2_fs.h"
+#include "ext2fs.h"
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H) && \
+	defined(HAVE_SYS_MMAN_H)
+#define HAVE_URING_IO
+#endif
+
+#ifdef HAVE_URING_IO
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * For checking structure magic numbers...
+ */
+
+#define EXT2_CHECK_MAGIC(struct, code) \
+	  if ((struct)->magic != (code)) return (code)
+
+#define URING_CACHE_SIZE	64
+#define URING_DIRECT_CACHE_SIZE	256	/* With O_DIRECT, the only cache */
+#define URING_DIRECT_SIZE	16	/* Must be smaller than URING_CACHE_SIZE */
+#define URING_READAHEAD_MAX(d)	((d)->cache_size / 2)
+#define URING_DIRTY_MAX(d)	((d)->cache_size / 2)
+#define URING_QUEUE_DEPTH	64
+
+struct uring_cache {
+	char		*buf;
+	struct iovec	iov;		/* buf, when it isn't registered */
+	unsigned long	block;
+	int		access_time;
+	errcode_t	err;		/* set if a background read failed */
+	unsigned	dirty:1;
+	unsigned	in_use:1;
+	unsigned	busy:1;		/* a request on buf is in flight */
+	unsigned	reading:1;	/* ...and it is a read */
+};
+
+/*
+ * A request someone is waiting for, rather than a cache block.  There
+ * is only ever one, and it lives with the channel rather than on the
+ * waiter's stack, since a request given up on after an error may still
+ * complete later.
+ */
+struct uring_wait {
+	int		busy;		/* queued or in flight */
+	int		res;
+	struct iovec	iov;
+};
+
+/*
+ * The first five fields are laid out as in unix_io.c's private data,
+ * so code which needs the device can treat both managers alike.
+ */
+struct uring_private_data {
+	int	magic;
+	int	dev;
+	int	flags;
+	int	access_time;
+	ext2_loff_t offset;
+
+	int	ring_fd;
+	unsigned entries;
+	unsigned queued;		/* filled in, not yet submitted */
+	unsigned inflight;		/* submitted, not yet completed */
+	int	block_size;		/* of the cache buffers */
+	int	cache_size;
+	int	align;			/* with O_DIRECT, the sector size */
+	int	fixed_bufs;		/* the cache buffers are registered */
+	errcode_t write_err;		/* from background write-back */
+	struct uring_wait wait;		/* for ring_io() */
+
+	void	*sq_ptr, *cq_ptr;
+	size_t	sq_len, cq_len, sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	char	*arena;
+	struct uring_cache *cache;
+};
+
+static errcode_t uring_open(const char *name, int flags, io_channel *channel);
+static errcode_t uring_close(io_channel channel);
+static errcode_t uring_set_blksize(io_channel channel, int blksize);
+static errcode_t uring_read_blk(io_channel channel, unsigned long block,
+				int count, void *data);
+static errcode_t uring_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *data);
+static errcode_t uring_flush(io_channel channel);
+static errcode_t uring_write_byte(io_channel channel, unsigned long offset,
+				  int size, const void *data);
+static errcode_t uring_set_option(io_channel channel, const char *option,
+				  const char *arg);
+static errcode_t uring_cache_readahead(io_channel channel,
+				       unsigned long block, int count);
+
+static struct struct_io_manager struct_uring_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"io_uring I/O Manager",
+	uring_open,
+	uring_close,
+	uring_set_blksize,
+	uring_read_blk,
+	uring_write_blk,
+	uring_flush,
+	uring_write_byte,
+	uring_set_option,
+	uring_cache_readahead
+};
+
+io_manager uring_io_manager = &struct_uring_manager;
+
+/*
+ * Here is the ring itself
+ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+				 unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static errcode_t ring_init(struct uring_private_data *data)
+{
+	struct io_uring_params p;
+	char	*sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	data->ring_fd = sys_io_uring_setup(URING_QUEUE_DEPTH, &p);
+	if (data->ring_fd < 0) {
+		data->ring_fd = -1;
+		return errno;
+	}
+	data->entries = p.sq_entries;
+	/* Never have more in flight than the completion queue holds */
+	if (data->entries > p.cq_entries)
+		data->entries = p.cq_entries;
+
+	data->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	data->cq_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (data->cq_len > data->sq_len)
+			data->sq_len = data->cq_len;
+		data->cq_len = data->sq_len;
+	}
+	data->sq_ptr = mmap(0, data->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, data->ring_fd,
+			    IORING_OFF_SQ_RING);
+	if (data->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		data->cq_ptr = data->sq_ptr;
+	else {
+		data->cq_ptr = mmap(0, data->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, data->ring_fd,
+				    IORING_OFF_CQ_RING);
+		if (data->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	data->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	data->sqes = mmap(0, data->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, data->ring_fd,
+			  IORING_OFF_SQES);
+	if (data->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = data->sq_ptr;
+	data->sq_head = (unsigned *) (sq + p.sq_off.head);
+	data->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	data->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	data->sq_array = (unsigned *) (sq + p.sq_off.array);
+	cq = data->cq_ptr;
+	data->cq_head = (unsigned *) (cq + p.cq_off.head);
+	data->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	data->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	data->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	return errno ? errno : EXT2_ET_NO_MEMORY;
+}
+
+static void ring_exit(struct uring_private_data *data)
+{
+	if (data->sqes && data->sqes != MAP_FAILED)
+		munmap(data->sqes, data->sqes_len);
+	if (data->cq_ptr && data->cq_ptr != MAP_FAILED &&
+	    data->cq_ptr != data->sq_ptr)
+		munmap(data->cq_ptr, data->cq_len);
+	if (data->sq_ptr && data->sq_ptr != MAP_FAILED)
+		munmap(data->sq_ptr, data->sq_len);
+	if (data->ring_fd >= 0)
+		close(data->ring_fd);
+	data->sqes = 0;
+	data->sq_ptr = data->cq_ptr = 0;
+	data->ring_fd = -1;
+}
+
+/*
+ * Hand everything queued to the kernel, and wait until at least
+ * min_complete requests have completed.
+ */
+static errcode_t ring_submit(struct uring_private_data *data,
+			     unsigned min_complete)
+{
+	int	ret;
+
+	while (data->queued || min_complete) {
+		ret = sys_io_uring_enter(data->ring_fd, data->queued,
+					 min_complete, min_complete ?
+					 IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		data->queued -= ret;
+		data->inflight += ret;
+		if (!data->queued)
+			break;
+	}
+	return 0;
+}
+
+static void complete(struct uring_private_data *data,
+		     struct io_uring_cqe *cqe)
+{
+	struct uring_cache	*cache;
+	struct uring_wait	*wait;
+	unsigned long		ud = cqe->user_data;
+
+	data->inflight--;
+	if (!(ud & 1)) {
+		wait = (struct uring_wait *) ud;
+		wait->res = cqe->res;
+		wait->busy = 0;
+		return;
+	}
+
+	cache = &data->cache[ud >> 1];
+	cache->busy = 0;
+	if (cache->reading) {
+		cache->reading = 0;
+		if (cqe->res != data->block_size)
+			cache->err = EXT2_ET_SHORT_READ;
+		return;
+	}
+	if (cqe->res != data->block_size) {
+		/* Keep the block dirty so the next flush retries it */
+		cache->dirty = 1;
+		data->write_err = EXT2_ET_SHORT_WRITE;
+	}
+}
+
+/* Process every completion the kernel has posted */
+static void ring_reap(struct uring_private_data *data)
+{
+	unsigned	head, tail;
+
+	head = *data->cq_head;
+	tail = __atomic_load_n(data->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		complete(data, &data->cqes[head & *data->cq_mask]);
+		head++;
+	}
+	__atomic_store_n(data->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Wait for at least one request to complete, and process it */
+static errcode_t ring_wait(struct uring_private_data *data)
+{
+	errcode_t	retval;
+
+	if ((retval = ring_submit(data, 1)))
+		return retval;
+	ring_reap(data);
+	return 0;
+}
+
+static errcode_t ring_wait_all(struct uring_private_data *data)
+{
+	errcode_t	retval;
+
+	while (data->inflight || data->queued)
+		if ((retval = ring_wait(data)))
+			return retval;
+	return 0;
+}
+
+/* Get a submission queue entry, waiting for room if needed */
+static errcode_t ring_get_sqe(struct uring_private_data *data,
+			      struct io_uring_sqe **ret)
+{
+	struct io_uring_sqe	*sqe;
+	unsigned		tail, idx;
+	errcode_t		retval;
+
+	while (data->queued + data->inflight >= data->entries) {
+		if (data->queued)
+			retval = ring_submit(data, 0);
+		else
+			retval = ring_wait(data);
+		if (retval)
+			return retval;
+	}
+	tail = *data->sq_tail;
+	idx = tail & *data->sq_mask;
+	sqe = &data->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	data->sq_array[idx] = idx;
+	*ret = sqe;
+	return 0;
+}
+
+/* Make the entry filled in since ring_get_sqe visible to the kernel */
+static void ring_queue(struct uring_private_data *data)
+{
+	__atomic_store_n(data->sq_tail, *data->sq_tail + 1, __ATOMIC_RELEASE);
+	data->queued++;
+}
+
+/*
+ * Here are the raw I/O functions
+ */
+
+static errcode_t raw_io(struct uring_private_data *data, int writing,
+			ext2_loff_t location, void *buf, size_t size,
+			int *actual);
+
+/* Queue a read or write of a cache block, which completes in the background */
+static errcode_t queue_cache_io(io_channel channel,
+				struct uring_private_data *data,
+				struct uring_cache *cache, int reading)
+{
+	struct io_uring_sqe	*sqe;
+	errcode_t		retval;
+	int			actual;
+
+	if (data->align && channel->block_size % data->align) {
+		/* Blocks smaller than a sector have to be bounced */
+		retval = raw_io(data, !reading,
+				((ext2_loff_t) cache->block *
+				 channel->block_size) + data->offset,
+				cache->buf, channel->block_size, &actual);
+		if (!retval && actual != channel->block_size)
+			retval = reading ? EXT2_ET_SHORT_READ :
+				EXT2_ET_SHORT_WRITE;
+		cache->busy = 0;
+		cache->reading = 0;
+		cache->err = reading ? retval : 0;
+		if (retval && !reading) {
+			cache->dirty = 1;
+			data->write_err = retval;
+		}
+		return 0;
+	}
+
+	if ((retval = ring_get_sqe(data, &sqe)))
+		return retval;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->off = ((ext2_loff_t) cache->block * channel->block_size) +
+		data->offset;
+	sqe->addr = (unsigned long) cache->buf;
+	sqe->len = channel->block_size;
+	if (data->fixed_bufs) {
+		sqe->opcode = reading ? IORING_OP_READ_FIXED :
+			IORING_OP_WRITE_FIXED;
+		sqe->buf_index = 0;
+	} else {
+		/* READ/WRITE would need 5.6; a one-element vector is older */
+		sqe->opcode = reading ? IORING_OP_READV : IORING_OP_WRITEV;
+		sqe->addr = (unsigned long) &cache->iov;
+		sqe->len = 1;
+	}
+	sqe->user_data = ((cache - data->cache) << 1) | 1;
+	ring_queue(data);
+
+	cache->busy = 1;
+	cache->reading = reading;
+	cache->err = 0;
+	return 0;
+}
+
+/*
+ * Wait for the request of ring_io() to complete.  io_uring_enter()
+ * fails only for a moment (the completion queue overflowed, or memory
+ * was short), so keep trying; if it still fails, the request stays
+ * marked busy and the next ring_io() waits for it before starting.
+ */
+static errcode_t ring_wait_sync(struct uring_private_data *data)
+{
+	errcode_t	retval;
+	int		tries = 0;
+
+	while (data->wait.busy) {
+		retval = ring_wait(data);
+		if (!retval)
+			continue;
+		if ((retval != EAGAIN && retval != EBUSY &&
+		     retval != ENOMEM) || ++tries > 100)
+			return retval;
+		usleep(1000);
+	}
+	return 0;
+}
+
+/* Read or write size bytes at location, and wait for it */
+static errcode_t ring_io(struct uring_private_data *data, int writing,
+			ext2_loff_t location, void *buf, size_t size,
+			int *actual)
+{
+	struct io_uring_sqe	*sqe;
+	struct uring_wait	*wait = &data->wait;
+	errcode_t		retval;
+
+	*actual = 0;
+	/* one given up on earlier has to be out of the way first */
+	if ((retval = ring_wait_sync(data)))
+		return retval;
+	while (size) {
+		if ((retval = ring_get_sqe(data, &sqe)))
+			return retval;
+		memset(wait, 0, sizeof(*wait));
+		wait->iov.iov_base = buf;
+		wait->iov.iov_len = size;
+		sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+		sqe->off = location;
+		sqe->addr = (unsigned long) &wait->iov;
+		sqe->len = 1;
+		sqe->user_data = (unsigned long) wait;
+		ring_queue(data);
+		wait->busy = 1;
+		if ((retval = ring_wait_sync(data)))
+			return retval;
+		if (wait->res < 0)
+			return -wait->res;
+		if (wait->res == 0)
+			break;
+		*actual += wait->res;
+		location += wait->res;
+		buf = (char *) buf + wait->res;
+		size -= wait->res;
+	}
+	return 0;
+}
+
+/*
+ * With O_DIRECT, a transfer must start and end on a sector boundary,
+ * to or from an aligned buffer.  Anything else goes through a bounce
+ * buffer covering whole sectors, and a write first reads the sectors
+ * it only partly covers.
+ */
+static errcode_t raw_io(struct uring_private_data *data, int writing,
+			ext2_loff_t location, void *buf, size_t size,
+			int *actual)
+{
+	ext2_loff_t	start;
+	size_t		len, skip;
+	int		got = 0;
+	char		*bounce;
+	errcode_t	retval = 0;
+
+	if (!data->align || (!(location % data->align) &&
+			     !(size % data->align) &&
+			     !((unsigned long) buf % data->align)))
+		return ring_io(data, writing, location, buf, size, actual);
+
+	*actual = 0;
+	skip = location % data->align;
+	start = location - skip;
+	len = (skip + size + data->align - 1) / data->align * data->align;
+	if (posix_memalign((void **) &bounce, data->align, len))
+		return EXT2_ET_NO_MEMORY;
+
+	if (!writing || skip || len != size) {
+		if ((retval = ring_io(data, 0, start, bounce, len, &got)))
+			goto out;
+		/* A write may go past the end of an image file */
+		memset(bounce + got, 0, len - got);
+	}
+	if (writing) {
+		memcpy(bounce + skip, buf, size);
+		if ((retval = ring_io(data, 1, start, bounce, len, &got)))
+			goto out;
+	} else
+		memcpy(buf, bounce + skip, size);
+	if (got > (int) skip)
+		*actual = ((size_t) got - skip < size) ? got - skip : size;
+out:
+	/* still the target of a request given up on: better lost than reused */
+	if (!data->wait.busy)
+		free(bounce);
+	return retval;
+}
+
+static errcode_t raw_read_blk(io_channel channel,
+			      struct uring_private_data *data,
+			      unsigned long block,
+			      int count, void *buf)
+{
+	errcode_t	retval;
+	ssize_t		size;
+	ext2_loff_t	location;
+	int		actual = 0;
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	retval = raw_io(data, 0, location, buf, size, &actual);
+	if (!retval && actual == size)
+		return 0;
+	if (!retval)
+		retval = EXT2_ET_SHORT_READ;
+
+	memset((char *) buf+actual, 0, size-actual);
+	if (channel->read_error)
+		retval = (channel->read_error)(channel, block, count, buf,
+					       size, actual, retval);
+	return retval;
+}
+
+static errcode_t raw_write_blk(io_channel channel,
+			       struct uring_private_data *data,
+			       unsigned long block,
+			       int count, const void *buf)
+{
+	errcode_t	retval;
+	ssize_t		size;
+	ext2_loff_t	location;
+	int		actual = 0;
+
+	size = (count < 0) ? -count : count * channel->block_size;
+	location = ((ext2_loff_t) block * channel->block_size) + data->offset;
+	retval = raw_io(data, 1, location, (void *) buf, size, &actual);
+	if (!retval && actual == size)
+		return 0;
+	if (!retval)
+		retval = EXT2_ET_SHORT_WRITE;
+
+	if (channel->write_error)
+		retval = (channel->write_error)(channel, block, count, buf,
+						size, actual, retval);
+	return retval;
+}
+
+
+/*
+ * Here we implement the cache functions
+ */
+
+/* Allocate the cache buffers, and register them with the ring */
+static errcode_t alloc_cache(io_channel channel,
+			     struct uring_private_data *data)
+{
+	struct uring_cache	*cache;
+	struct iovec		iov;
+	size_t			size;
+	int			i;
+
+	data->access_time = 0;
+	data->block_size = channel->block_size;
+	size = (size_t) channel->block_size * data->cache_size;
+	data->cache = calloc(data->cache_size, sizeof(struct uring_cache));
+	if (!data->cache)
+		return EXT2_ET_NO_MEMORY;
+	if (posix_memalign((void **) &data->arena, getpagesize(), size)) {
+		data->arena = 0;
+		return EXT2_ET_NO_MEMORY;
+	}
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		memset(cache, 0, sizeof(*cache));
+		cache->buf = data->arena + (size_t) i * channel->block_size;
+		cache->iov.iov_base = cache->buf;
+		cache->iov.iov_len = channel->block_size;
+	}
+
+	/*
+	 * One registered buffer covers all of the blocks.  This can fail
+	 * against RLIMIT_MEMLOCK; unregistered buffers still work.
+	 */
+	iov.iov_base = data->arena;
+	iov.iov_len = size;
+	data->fixed_bufs = !sys_io_uring_register(data->ring_fd,
+				IORING_REGISTER_BUFFERS, &iov, 1);
+	return 0;
+}
+
+/* Free the cache buffers; nothing may be in flight */
+static void free_cache(struct uring_private_data *data)
+{
+	if (data->fixed_bufs)
+		sys_io_uring_register(data->ring_fd,
+				      IORING_UNREGISTER_BUFFERS, NULL, 0);
+	data->fixed_bufs = 0;
+	data->access_time = 0;
+	free(data->cache);
+	data->cache = 0;
+	free(data->arena);
+	data->arena = 0;
+}
+
+/*
+ * Try to find a block in the cache.
+ */
+static struct uring_cache *find_cached_block(struct uring_private_data *data,
+					     unsigned long block)
+{
+	struct uring_cache	*cache;
+	int			i;
+
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		if (cache->in_use && cache->block == block) {
+			cache->access_time = ++data->access_time;
+			return cache;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Find the cache entry which should be reused: an unused one, or else
+ * the oldest one that is idle and clean.  Dirty blocks are only taken
+ * if may_write is set, after writing them out.  Returns 0 if there is
+ * nothing to take without waiting, or if writing one out failed.
+ */
+static struct uring_cache *pick_cache(io_channel channel,
+				      struct uring_private_data *data,
+				      int may_write, errcode_t *retval)
+{
+	struct uring_cache	*cache, *clean = 0, *dirty = 0;
+	int			i;
+
+	*retval = 0;
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		if (!cache->in_use)
+			return cache;
+		if (cache->busy)
+			continue;
+		if (cache->dirty) {
+			if (!dirty || cache->access_time < dirty->access_time)
+				dirty = cache;
+		} else if (!clean || cache->access_time < clean->access_time)
+			clean = cache;
+	}
+	if (clean || !may_write || !dirty)
+		return clean;
+
+	/* If it can't be written, it stays as it is, dirty */
+	if ((*retval = raw_write_blk(channel, data, dirty->block, 1,
+				     dirty->buf)))
+		return 0;
+	dirty->dirty = 0;
+	return dirty;
+}
+
+/*
+ * Get a cache entry to hold another block, waiting for requests to
+ * finish if every entry is busy.  Whatever it held is dropped; the
+ * caller gives it its new block with tag_cache() once its buffer holds
+ * that block, or a read of it has been queued.
+ */
+static errcode_t reuse_cache(io_channel channel,
+			     struct uring_private_data *data,
+			     struct uring_cache **ret)
+{
+	struct uring_cache	*cache;
+	errcode_t		retval;
+
+	while (!(cache = pick_cache(channel, data, 1, &retval))) {
+		if (retval)
+			return retval;
+		if ((retval = ring_wait(data)))
+			return retval;
+	}
+	cache->in_use = 0;
+	cache->dirty = 0;
+	*ret = cache;
+	return 0;
+}
+
+static void tag_cache(struct uring_private_data *data,
+		      struct uring_cache *cache, unsigned long block)
+{
+	cache->in_use = 1;
+	cache->block = block;
+	cache->access_time = ++data->access_time;
+}
+
+static errcode_t wait_cache(struct uring_private_data *data,
+			    struct uring_cache *cache)
+{
+	errcode_t	retval;
+
+	while (cache->busy)
+		if ((retval = ring_wait(data)))
+			return retval;
+	return 0;
+}
+
+/* Start writing back all of the dirty blocks which are idle */
+static errcode_t write_back(io_channel channel,
+			    struct uring_private_data *data)
+{
+	struct uring_cache	*cache;
+	errcode_t		retval;
+	int			i;
+
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		if (!cache->in_use || !cache->dirty || cache->busy)
+			continue;
+		if ((retval = queue_cache_io(channel, data, cache, 0)))
+			return retval;
+		cache->dirty = 0;
+	}
+	return ring_submit(data, 0);
+}
+
+static int count_dirty(struct uring_private_data *data)
+{
+	int	i, n = 0;
+
+	for (i = 0; i < data->cache_size; i++)
+		if (data->cache[i].dirty)
+			n++;
+	return n;
+}
+
+/*
+ * Flush all of the blocks in the cache, and wait for them
+ */
+static errcode_t flush_cached_blocks(io_channel channel,
+				     struct uring_private_data *data,
+				     int invalidate)
+{
+	struct uring_cache	*cache;
+	errcode_t		retval;
+	int			i;
+
+	if ((retval = write_back(channel, data)))
+		return retval;
+	if ((retval = ring_wait_all(data)))
+		return retval;
+	retval = data->write_err;
+	data->write_err = 0;
+	if (invalidate)
+		for (i=0, cache = data->cache; i < data->cache_size;
+		     i++, cache++)
+			cache->in_use = 0;
+	return retval;
+}
+
+/*
+ * Write out and drop the cached blocks overlapping a direct write of
+ * [block, block + nblocks), so that neither they nor a write-back in
+ * flight can land on top of it.
+ */
+static errcode_t drop_cached_range(io_channel channel,
+				   struct uring_private_data *data,
+				   unsigned long block, unsigned long nblocks)
+{
+	struct uring_cache	*cache;
+	errcode_t		retval = 0, retval2;
+	int			i;
+
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		if (!cache->in_use || cache->block < block ||
+		    cache->block - block >= nblocks)
+			continue;
+		if ((retval2 = wait_cache(data, cache)))
+			return retval2;
+		if (cache->dirty && !cache->err) {
+			retval2 = raw_write_blk(channel, data, cache->block,
+						1, cache->buf);
+			if (retval2)
+				retval = retval2;
+		}
+		cache->in_use = 0;
+		cache->dirty = 0;
+	}
+	return retval;
+}
+
+static errcode_t uring_open(const char *name, int flags, io_channel *channel)
+{
+	io_channel	io = NULL;
+	struct uring_private_data *data = NULL;
+	errcode_t	retval;
+	int		open_flags;
+
+	if (name == 0)
+		return EXT2_ET_BAD_DEVICE_NAME;
+	retval = ext2fs_get_mem(sizeof(struct struct_io_channel), &io);
+	if (retval)
+		return retval;
+	memset(io, 0, sizeof(struct struct_io_channel));
+	io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+	retval = ext2fs_get_mem(sizeof(struct uring_private_data), &data);
+	if (retval)
+		goto cleanup;
+
+	io->manager = uring_io_manager;
+	retval = ext2fs_get_mem(strlen(name)+1, &io->name);
+	if (retval)
+		goto cleanup;
+
+	strcpy(io->name, name);
+	io->private_data = data;
+	io->block_size = 1024;
+	io->read_error = 0;
+	io->write_error = 0;
+	io->refcount = 1;
+
+	memset(data, 0, sizeof(struct uring_private_data));
+	data->magic = EXT2_ET_MAGIC_UNIX_IO_CHANNEL;
+	data->dev = -1;
+	data->ring_fd = -1;
+	data->cache_size = URING_CACHE_SIZE;
+
+	if ((retval = ring_init(data)))
+		goto cleanup;
+	if ((retval = alloc_cache(io, data)))
+		goto cleanup;
+
+	open_flags = (flags & IO_FLAG_RW) ? O_RDWR : O_RDONLY;
+	if (flags & IO_FLAG_EXCLUSIVE)
+		open_flags |= O_EXCL;
+#ifdef HAVE_OPEN64
+	data->dev = open64(io->name, open_flags);
+#else
+	data->dev = open(io->name, open_flags);
+#endif
+	if (data->dev < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+	if (sys_io_uring_register(data->ring_fd, IORING_REGISTER_FILES,
+				  &data->dev, 1) < 0) {
+		retval = errno;
+		goto cleanup;
+	}
+
+	*channel = io;
+	return 0;
+
+cleanup:
+	if (data) {
+		free_cache(data);
+		ring_exit(data);
+		if (data->dev >= 0)
+			close(data->dev);
+		ext2fs_free_mem(&data);
+	}
+	if (io) {
+		if (io->name)
+			ext2fs_free_mem(&io->name);
+		ext2fs_free_mem(&io);
+	}
+	return retval;
+}
+
+static errcode_t uring_close(io_channel channel)
+{
+	struct uring_private_data *data;
+	errcode_t	retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (--channel->refcount > 0)
+		return 0;
+
+	retval = flush_cached_blocks(channel, data, 0);
+	/* Whatever happened, nothing may still be using the buffers */
+	ring_wait_all(data);
+
+	free_cache(data);
+	ring_exit(data);
+	if (close(data->dev) < 0)
+		retval = errno;
+
+	ext2fs_free_mem(&channel->private_data);
+	if (channel->name)
+		ext2fs_free_mem(&channel->name);
+	ext2fs_free_mem(&channel);
+	return retval;
+}
+
+static errcode_t uring_set_blksize(io_channel channel, int blksize)
+{
+	struct uring_private_data *data;
+	errcode_t		retval;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (channel->block_size != blksize) {
+		if ((retval = flush_cached_blocks(channel, data, 0)))
+			return retval;
+
+		channel->block_size = blksize;
+		free_cache(data);
+		if ((retval = alloc_cache(channel, data)))
+			return retval;
+	}
+	return 0;
+}
+
+/*
+ * Copy [block, block + count) into buf from the cache, reading the
+ * blocks which aren't there with one request each, all in flight
+ * together.
+ */
+static errcode_t read_cached(io_channel channel,
+			     struct uring_private_data *data,
+			     unsigned long block, int count, char *cp,
+			     int size)
+{
+	struct uring_cache *cache, *run[URING_DIRECT_SIZE];
+	errcode_t	retval;
+	int		i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (find_cached_block(data, block + i)) {
+			run[i] = 0;
+			continue;
+		}
+		if ((retval = reuse_cache(channel, data, &cache)))
+			return retval;
+		/* the request reads into the block it's given */
+		cache->block = block + i;
+		if ((retval = queue_cache_io(channel, data, cache, 1)))
+			return retval;
+		tag_cache(data, cache, block + i);
+		run[i] = cache;
+		n++;
+	}
+	if (n && (retval = ring_submit(data, 0)))
+		return retval;
+
+	for (i = 0; i < count; i++, cp += channel->block_size) {
+		/*
+		 * Waiting for one entry to be free may have let another
+		 * one be taken for a different block in the meantime.
+		 */
+		cache = run[i];
+		if (!cache || !cache->in_use || cache->block != block + i)
+			cache = find_cached_block(data, block + i);
+		if (cache && cache->reading &&
+		    (retval = wait_cache(data, cache)))
+			return retval;
+		if (!cache || cache->err) {
+			/* Let the direct read report any error */
+			if (cache)
+				cache->in_use = 0;
+			retval = raw_read_blk(channel, data, block + i,
+				size < channel->block_size ? -size : 1, cp);
+			if (retval)
+				return retval;
+			continue;
+		}
+		memcpy(cp, cache->buf, size < channel->block_size ?
+		       size : channel->block_size);
+	}
+	return 0;
+}
+
+static errcode_t uring_read_blk(io_channel channel, unsigned long block,
+				int count, void *buf)
+{
+	struct uring_private_data *data;
+	struct uring_cache *cache;
+	errcode_t	retval;
+	size_t		size, len;
+	unsigned long	i;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	/* A read of part of one block still goes through the cache */
+	if (count < 0 && -count <= channel->block_size)
+		return read_cached(channel, data, block, 1, buf, -count);
+	if (count >= 0 && count <= URING_DIRECT_SIZE)
+		return read_cached(channel, data, block, count, buf,
+				   channel->block_size);
+
+	/*
+	 * A large or odd-sized read goes straight to the device, with
+	 * any cached blocks it covers copied over the top, since they
+	 * may not have been written yet.
+	 */
+	if ((retval = raw_read_blk(channel, data, block, count, buf)))
+		return retval;
+	size = (count < 0) ? -count : (size_t) count * channel->block_size;
+	for (i=0, cache = data->cache; i < data->cache_size; i++, cache++) {
+		if (!cache->in_use || cache->reading || cache->err ||
+		    cache->block < block ||
+		    (cache->block - block) * channel->block_size >= size)
+			continue;
+		len = size - (cache->block - block) * channel->block_size;
+		if (len > (size_t) channel->block_size)
+			len = channel->block_size;
+		memcpy((char *) buf +
+		       (cache->block - block) * channel->block_size,
+		       cache->buf, len);
+	}
+	return 0;
+}
+
+static errcode_t uring_write_blk(io_channel channel, unsigned long block,
+				 int count, const void *buf)
+{
+	struct uring_private_data *data;
+	struct uring_cache *cache;
+	errcode_t	retval = 0, retval2;
+	const char	*cp;
+	unsigned long	nblocks;
+	int		writethrough;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	/*
+	 * If we're doing an odd-sized write or a very large write,
+	 * get the blocks it covers out of the cache and then do a
+	 * direct write.
+	 */
+	if (count < 0 || count > URING_DIRECT_SIZE) {
+		if (count < 0)
+			nblocks = (-count + channel->block_size - 1) /
+				channel->block_size;
+		else
+			nblocks = count;
+		if ((retval = drop_cached_range(channel, data, block,
+						nblocks)))
+			return retval;
+		return raw_write_blk(channel, data, block, count, buf);
+	}
+
+	writethrough = channel->flags & CHANNEL_FLAGS_WRITETHROUGH;
+	if (writethrough)
+		retval = raw_write_blk(channel, data, block, count, buf);
+
+	cp = buf;
+	while (count > 0) {
+		cache = find_cached_block(data, block);
+		if (cache) {
+			/* Its buffer may be being read into or written */
+			if ((retval2 = wait_cache(data, cache)))
+				return retval2;
+			cache->err = 0;
+		} else {
+			if ((retval2 = reuse_cache(channel, data, &cache)))
+				return retval2;
+			cache->err = 0;
+			tag_cache(data, cache, block);
+		}
+		memcpy(cache->buf, cp, channel->block_size);
+		cache->dirty = !writethrough;
+		count--;
+		block++;
+		cp += channel->block_size;
+	}
+
+	if (count_dirty(data) > URING_DIRTY_MAX(data) &&
+	    (retval2 = write_back(channel, data)))
+		return retval2;
+	return retval;
+}
+
+static errcode_t uring_write_byte(io_channel channel, unsigned long offset,
+				  int size, const void *buf)
+{
+	struct uring_private_data *data;
+	errcode_t	retval;
+	unsigned long	first, last;
+	int		actual;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (size <= 0)
+		return 0;
+	first = offset / channel->block_size;
+	last = (offset + size - 1) / channel->block_size;
+	if ((retval = drop_cached_range(channel, data, first,
+					last - first + 1)))
+		return retval;
+
+	retval = raw_io(data, 1, offset + data->offset, (void *) buf, size,
+			&actual);
+	if (retval)
+		return retval;
+	if (actual != size)
+		return EXT2_ET_SHORT_WRITE;
+	return 0;
+}
+
+/*
+ * Flush data buffers to disk.
+ */
+static errcode_t uring_flush(io_channel channel)
+{
+	struct uring_private_data *data;
+	errcode_t retval = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	retval = flush_cached_blocks(channel, data, 0);
+	fsync(data->dev);
+	return retval;
+}
+
+/*
+ * Bypass the kernel's cache, as unix_io does, with a larger cache of
+ * our own to make up for it.
+ */
+static errcode_t set_direct(io_channel channel,
+			    struct uring_private_data *data)
+{
+	errcode_t	retval;
+	struct stat	st;
+	int		fl, sectsize = 0;
+
+	if (data->align)
+		return 0;
+	if ((retval = flush_cached_blocks(channel, data, 1)))
+		return retval;
+
+	/* For an image file, the block size of the filesystem holding it */
+	if (ext2fs_get_device_sectsize(channel->name, &sectsize) ||
+	    !sectsize) {
+		if (fstat(data->dev, &st) == 0 && st.st_blksize > 0)
+			sectsize = st.st_blksize;
+		else
+			sectsize = 512;
+	}
+
+	/* The registered file shares the open file, and so the flag */
+	fl = fcntl(data->dev, F_GETFL);
+	if (fl < 0 || fcntl(data->dev, F_SETFL, fl | O_DIRECT) < 0)
+		return errno;
+
+	free_cache(data);
+	data->align = sectsize;
+	data->cache_size = URING_DIRECT_CACHE_SIZE;
+	return alloc_cache(channel, data);
+}
+
+static errcode_t uring_set_option(io_channel channel, const char *option,
+				  const char *arg)
+{
+	struct uring_private_data *data;
+	unsigned long long tmp;
+	char *end;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	if (!strcmp(option, "offset")) {
+		if (!arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+
+		tmp = strtoull(arg, &end, 0);
+		if (*end)
+			return EXT2_ET_INVALID_ARGUMENT;
+		data->offset = tmp;
+		if (data->offset < 0)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return 0;
+	}
+	if (!strcmp(option, "direct")) {
+		if (arg)
+			return EXT2_ET_INVALID_ARGUMENT;
+		return set_direct(channel, data);
+	}
+	return EXT2_ET_INVALID_ARGUMENT;
+}
+
+/*
+ * Start reading up to half a cache of the blocks into the cache,
+ * without waiting for them or evicting anything dirty.
+ */
+static errcode_t uring_cache_readahead(io_channel channel,
+				       unsigned long block, int count)
+{
+	struct uring_private_data *data;
+	struct uring_cache *cache;
+	errcode_t	retval;
+	int		n = 0;
+
+	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
+	data = (struct uring_private_data *) channel->private_data;
+	EXT2_CHECK_MAGIC(data, EXT2_ET_MAGIC_UNIX_IO_CHANNEL);
+
+	for (; count > 0 && n < URING_READAHEAD_MAX(data); count--, block++) {
+		if (find_cached_block(data, block))
+			continue;
+		cache = pick_cache(channel, data, 0, &retval);
+		if (!cache)
+			break;
+		cache->in_use = 0;
+		cache->block = block;
+		if ((retval = queue_cache_io(channel, data, cache, 1)))
+			return retval;
+		tag_cache(data, cache, block);
+		n++;
+	}
+	return ring_submit(data, 0);
+}
+
+#else /* HAVE_URING_IO */
+
+static errcode_t uring_open(const char *name EXT2FS_ATTR((unused)),
+			    int flags EXT2FS_ATTR((unused)),
+			    io_channel *channel EXT2FS_ATTR((unused)))
+{
+	return EXT2_ET_UNIMPLEMENTED;
+}
+
+static struct struct_io_manager struct_uring_manager = {
+	EXT2_ET_MAGIC_IO_MANAGER,
+	"io_uring I/O Manager",
+	uring_open
+};
+
+io_manager uring_io_manager = &struct_uring_manager;
+
+#endif /* HAVE_URING_IO */
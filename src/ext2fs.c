@@ -20,6 +20,9 @@
 #include <stddef.h>
 
 #include "wipe_block.h"
+#include "orphan.h"
+#include "icache.h"
+#include "xattr.h"
 #include "perms.h"
 
 #define ext2_err(rc, ...) \
@@ -219,8 +222,15 @@ ext2_file_t do_open(perms_struct perms, ext2_ino_t ino,
 	newflags |= (flags & O_WRONLY) ? EXT2_FILE_WRITE : 0;
 	// TODO: do_open - permission checking for open flags needs checking
 		
-	rc = ext2fs_file_open(fs, ino, newflags, &efile);
-	dbg("ext2fs_file_open() wrote ext2_file {flags 0%o, ino %d}",
+	// all opens of an inode share the one ext2_file
+	rc = icache_open(ino, newflags, &efile);
+	if (rc)
+	{
+		ext2_err(rc, "while opening inode %u", ino);
+		errno = rc;
+		return NULL;
+	}
+	dbg("icache_open() gave ext2_file {flags 0%o, ino %d}",
 		efile->flags, efile->ino);
 	
 	if ((flags & O_RDWR) && !(efile->flags & EXT2_FILE_WRITE))
@@ -228,13 +238,6 @@ ext2_file_t do_open(perms_struct perms, ext2_ino_t ino,
 		efile->flags |= EXT2_FILE_WRITE;
 		dbg("Danger! Danger! EXT2_FILE_WRITE wasn't set!");
 	}
-	
-	if (rc)
-	{
-		ext2_err(rc, "while opening inode %u", ino);
-		errno = rc;
-		return NULL;
-	}
 
 	if (flags & O_TRUNC)
 	{
@@ -261,15 +264,14 @@ ext2_file_t do_open(perms_struct perms, ext2_ino_t ino,
 // In the worst case, we get an inode allocated but never linked, so only
 // wasted space.
 //
-int do_create(perms_struct perms, ext2_ino_t parent,
-			const char *name, mode_t mode,
-			ext2_ino_t *ino, struct ext2_inode *inode, int filetype_in_dir)
+// @target, if not NULL, is stored in i_block, making a fast symlink
+static int create_inode(perms_struct perms, ext2_ino_t parent,
+			const char *name, mode_t mode, ext2_ino_t *ino,
+			struct ext2_inode *inode, int filetype_in_dir,
+			const char *target)
 {
 	errcode_t rc;
 
-	dbg("do_create(parent %u, name %s, mode %u, ino*, inode*)",
-		parent, name, mode);
-
 	// check we have write permission on parent
 	rc = read_inode(parent, inode);
 	if(rc)
@@ -304,6 +306,16 @@ int do_create(perms_struct perms, ext2_ino_t parent,
 	inode->i_atime = inode->i_ctime = inode->i_mtime = time(NULL);
 	inode->i_links_count = 1;
 	inode->i_size = 0;
+	if (target)
+	{
+		// no trailing '\0', i_size says where it ends
+		inode->i_size = strlen(target);
+		memcpy(inode->i_block, target, inode->i_size);
+	}
+	// new files are extent mapped if the filesystem has extents
+	if (LINUX_S_ISREG(mode) && EXT2_HAS_INCOMPAT_FEATURE(fs->super,
+				EXT3_FEATURE_INCOMPAT_EXTENTS))
+		ext2fs_extent_header_init(inode);
 
 	// Write the inode
 	rc = ext2fs_write_new_inode(fs, *ino, inode);
@@ -327,19 +339,28 @@ int do_create(perms_struct perms, ext2_ino_t parent,
 	return 0;
 }
 
-static int release_blocks_proc(ext2_filsys fs, blk_t *blocknr,
-	int blockcnt EXT2FS_ATTR((unused)), void *private EXT2FS_ATTR((unused)))
+int do_create(perms_struct perms, ext2_ino_t parent,
+			const char *name, mode_t mode,
+			ext2_ino_t *ino, struct ext2_inode *inode, int filetype_in_dir)
 {
-	blk_t block;
+	dbg("do_create(parent %u, name %s, mode %u, ino*, inode*)",
+		parent, name, mode);
+	return create_inode(perms, parent, name, mode, ino, inode,
+			filetype_in_dir, NULL);
+}
 
-	block = *blocknr;
-	ext2fs_block_alloc_stats(fs, block, -1);
-	if ((wipe_block_procedure)(block))
-	{
-		dbg("wipe_block %d failed, aborting", (int) block);
-		exit(1);
-	}
-	return 0;
+// Targets shorter than i_block are kept in it, as the kernel does, so
+// making the link takes no data block and a single inode write.
+int do_create_fast_symlink(perms_struct perms, ext2_ino_t parent,
+			const char *name, const char *target,
+			ext2_ino_t *ino, struct ext2_inode *inode)
+{
+	dbg("do_create_fast_symlink(parent %u, name %s, target %s)",
+		parent, name, target);
+	if (strlen(target) >= sizeof(inode->i_block))
+		return ENAMETOOLONG;
+	return create_inode(perms, parent, name, LINUX_S_IFLNK | 0777, ino,
+			inode, EXT2_FT_SYMLINK, target);
 }
 
 // POSIX says removing open files is not allowed; happily FUSE handles this
@@ -355,24 +376,34 @@ void kill_file_by_inode(ext2_ino_t ino, struct ext2_inode *inode)
 {
 	dbg ("kill_file_by_inode(ino %d, inode* %ld)", ino, (long) inode);
 
+	// big files are left to the background delete thread
+	if (!orphan_add(ino, inode))
+		return;
+
 	// For effeciency do_unlink doesn't save a 0-link count for files
 	// about to be deleted, so we do it here.
 	inode->i_links_count = 0;
 	// Set the "deletion time" in the inode, very friendly
 	inode->i_dtime = time(NULL);
+	xattr_release(ino, inode);
 	if(write_inode(ino, inode))
 		return;
 
-	if(!ext2fs_inode_has_valid_blocks(inode))
-		return;
+	if(ext2fs_inode_has_valid_blocks(inode))
+	{
+		// Punch a copy, so the block map on disk is left as it was
+		struct ext2_inode tmp = *inode;
+		errcode_t rc;
 
-	dbg ("deleting blocks for %d...", ino);
-	ext2fs_block_iterate(fs, ino, 0, NULL, release_blocks_proc, NULL);
+		dbg ("deleting blocks for %d...", ino);
+		rc = punch_blocks(&tmp, 0, ~0U);
+		if (rc)
+		{
+			ext2_err(rc, "while freeing blocks of %d", ino);
+			return;
+		}
+	}
 	ext2fs_inode_alloc_stats2(fs, ino, -1, LINUX_S_ISDIR(inode->i_mode));
-	ext2fs_unmark_inode_bitmap(fs->inode_map, ino);
-	ext2fs_mark_ib_dirty(fs);
-	ext2fs_mark_bb_dirty(fs);
-	ext2fs_mark_super_dirty(fs);
 }
 
 int do_link(ext2_ino_t parent, const char *name, ext2_ino_t ino,
@@ -590,7 +621,7 @@ int do_file_flush(struct ext2_file *fh)
 int do_file_close(struct ext2_file *fh)
 {
 	int rc;
-	rc = ext2fs_file_close(fh);
+	rc = icache_close(fh);
 	return rc;	
 }
 
@@ -683,13 +714,19 @@ int ext2_bg_has_super(int group)
 	return 1;
 }
 
-int do_statvfs(struct statvfs *stbuf)
+// Blocks taken by superblocks, group descriptors, bitmaps and inode
+// tables. They don't change while mounted, so are only counted once; the
+// free counts are kept up to date in the superblock by the allocator.
+static unsigned long statvfs_overhead(void)
 {
-	unsigned long overhead, groups_count, db_count, itb_per_group;
+	static ext2_filsys counted_fs = NULL;
+	static blk_t counted_blocks;
+	static unsigned long overhead;
+	unsigned long groups_count, db_count, itb_per_group;
 	int i;
 
-	if(!fs || !stbuf)
-		return 1;
+	if (counted_fs == fs && counted_blocks == fs->super->s_blocks_count)
+		return overhead;
 
 	groups_count = (fs->super->s_blocks_count - fs->super->s_first_data_block-1)
 			/ EXT2_BLOCKS_PER_GROUP(fs->super) + 1;
@@ -703,9 +740,20 @@ int do_statvfs(struct statvfs *stbuf)
 			overhead += 1 + db_count;
 	}
 	overhead += groups_count * (2 + itb_per_group);
+
+	counted_fs = fs;
+	counted_blocks = fs->super->s_blocks_count;
+	return overhead;
+}
+
+int do_statvfs(struct statvfs *stbuf)
+{
+	if(!fs || !stbuf)
+		return 1;
+
 	stbuf->f_bsize = EXT2_BLOCK_SIZE(fs->super);
 	stbuf->f_frsize = EXT2_FRAG_SIZE(fs->super);
-	stbuf->f_blocks = fs->super->s_blocks_count - overhead;
+	stbuf->f_blocks = fs->super->s_blocks_count - statvfs_overhead();
 	stbuf->f_bfree = fs->super->s_free_blocks_count;
 
 	if (stbuf->f_bfree>=fs->super->s_r_blocks_count)
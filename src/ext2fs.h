@@ -22,8 +22,17 @@
 #include "truncate.h"
 
 struct dirbuf {
+	struct fuse_req *req;
 	char *p;
-	size_t size;
+	size_t size;		// bytes used in p
+	size_t alloc;		// bytes allocated for p
+	off_t start;		// listing offset p starts at
+	off_t pos;		// listing offset of the next entry
+	off_t off, end;		// part of the listing wanted
+	int err;
+	// inodes to read ahead, if not NULL
+	ext2_ino_t *prefetch;
+	int nprefetch;
 };
 
 #ifndef __FUNCTION__ 
@@ -71,12 +80,15 @@ struct ext2_file {
 	blk_t blockno;
 	blk_t physblock;
 	char *buf;
+	struct ext2_bmap_run runs[EXT2_FILE_RUNS];
+	int run_next;
 };
 
 /* our filesystem! */
 extern ext2_filsys fs;
 				      
-/* permissions struct, so we don't have to #include fuse stuff here */
+/* permissions struct, so we don't have to #include fuse stuff here: the
+ * fuse_req_t of the request, or NULL not to check */
 typedef const void *perms_struct;
 /* global bool to control whether permissions checking happens or not */
 extern int do_permissions_checks;
@@ -110,6 +122,8 @@ int do_dir_iterate(ext2_ino_t, int,
 ext2_file_t do_open(perms_struct, ext2_ino_t, int);
 int do_create(perms_struct perms, ext2_ino_t, const char *,
 		mode_t,	ext2_ino_t *, struct ext2_inode *, int filetype_in_dir);
+int do_create_fast_symlink(perms_struct perms, ext2_ino_t, const char *,
+		const char *, ext2_ino_t *, struct ext2_inode *);
 
 int do_link(ext2_ino_t, const char *, ext2_ino_t, int);
 int do_unlink(ext2_ino_t, const char *, int);
@@ -140,8 +154,13 @@ int do_rename(perms_struct perms, ext2_ino_t parent_ino,
 errcode_t new_ext2fs_mkdir(perms_struct perms,
 				ext2_ino_t parent, const char *name);
 
+/* fallocate.c */
+int do_fallocate(struct ext2_file *fh, ext2_ino_t ino, int mode,
+		off_t offset, off_t length);
+
 /* wipe_block.c */
 int wipe_block(blk_t block);
+int wipe_block_flush(void);
 
 #endif
 
@@ -0,0 +1,281 @@
+/*
+ *  Copyright (C) 2007-8, see the file AUTHORS for copyright owners.
+ *
+ *  This program can be distributed under the terms of the GNU GPL v2,
+ *  or any later version. See the file COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+#include "ext2fs.h"
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+#define ext2_err(rc, ...) \
+	com_err("ext2fuse_dbg_msg", rc, __VA_ARGS__)
+
+// preallocated blocks are zeroed with writes of up to this size
+#define ZERO_CHUNK_SIZE (1024 * 1024)
+
+// Reserve a run of up to @want free blocks, as close after @goal as we can.
+// Rather than take the first free block, keep looking until a run long
+// enough (or a whole group's worth) turns up, falling back to the longest
+// run seen once the whole bitmap has been scanned.
+static errcode_t alloc_run(blk_t goal, blk_t want, blk_t *ret_start,
+		blk_t *ret_len)
+{
+	blk_t first = fs->super->s_first_data_block;
+	blk_t total = fs->super->s_blocks_count;
+	blk_t enough = min(want, fs->super->s_blocks_per_group);
+	blk_t b, n, scanned = 0, best = 0, best_len = 0;
+
+	if (goal < first || goal >= total)
+		goal = first;
+
+	b = goal;
+	while (scanned < total - first)
+	{
+		if (ext2fs_fast_test_block_bitmap(fs->block_map, b))
+			n = 1;
+		else
+		{
+			for (n = 1; n < want && b + n < total; n++)
+				if (ext2fs_fast_test_block_bitmap(fs->block_map, b + n))
+					break;
+			if (n > best_len)
+			{
+				best = b;
+				best_len = n;
+			}
+			if (n >= enough)
+				break;
+		}
+		b += n;
+		scanned += n;
+		if (b >= total)
+			b = first;
+	}
+
+	if (!best_len)
+		return EXT2_ET_BLOCK_ALLOC_FAIL;
+
+	ext2fs_block_alloc_stats_range(fs, best, best_len, +1);
+	*ret_start = best;
+	*ret_len = best_len;
+	return 0;
+}
+
+static errcode_t zero_blocks(blk_t start, blk_t count)
+{
+	blk_t chunk = ZERO_CHUNK_SIZE / fs->blocksize, n;
+	errcode_t rc = 0;
+	char *zeros;
+
+	zeros = calloc(1, min(count, chunk) * fs->blocksize);
+	if (!zeros)
+		return ENOMEM;
+
+	while (count && !rc)
+	{
+		n = min(count, chunk);
+		rc = io_channel_write_blk(fs->io, start, n, zeros);
+		start += n;
+		count -= n;
+	}
+	free(zeros);
+	return rc;
+}
+
+// zero bytes [from, to) of logical block @lblk, if it is mapped (blocks of
+// uninitialized extents read as zeros already)
+static errcode_t zero_partial_block(ext2_ino_t ino, struct ext2_inode *inode,
+		blk_t lblk, int from, int to)
+{
+	blk_t pblk;
+	errcode_t rc;
+	int flags;
+	char *buf;
+
+	rc = ext2fs_bmap2(fs, ino, inode, NULL, 0, lblk, &flags, &pblk);
+	if (rc || !pblk || (flags & BMAP_RET_UNINIT))
+		return rc;
+
+	buf = malloc(fs->blocksize);
+	if (!buf)
+		return ENOMEM;
+	rc = io_channel_read_blk(fs->io, pblk, 1, buf);
+	if (!rc)
+	{
+		memset(buf + from, 0, to - from);
+		rc = io_channel_write_blk(fs->io, pblk, 1, buf);
+	}
+	free(buf);
+	return rc;
+}
+
+// Map every hole in logical blocks [first, last] to freshly zeroed blocks.
+// Holes are filled a run at a time, each run taken from alloc_run() so
+// that the file ends up laid out sequentially. Extent mapped files get
+// uninitialized extents instead, which read as zeros without the writes.
+static errcode_t prealloc_blocks(ext2_ino_t ino, struct ext2_inode *inode,
+		blk_t first, blk_t last)
+{
+	blk_t lblk = first, pblk, goal = 0, start, len, i;
+	int uninit = (inode->i_flags & EXT4_EXTENTS_FL) != 0;
+	int set_flags = BMAP_ALLOC | BMAP_SET | (uninit ? BMAP_UNINIT : 0);
+	errcode_t rc = 0;
+	char *block_buf;
+
+	block_buf = malloc(fs->blocksize * 2);
+	if (!block_buf)
+		return ENOMEM;
+
+	while (lblk <= last && lblk >= first)
+	{
+		rc = ext2fs_bmap(fs, ino, inode, block_buf, 0, lblk, &pblk);
+		if (rc)
+			break;
+		if (pblk)
+		{
+			goal = pblk + 1;
+			lblk++;
+			continue;
+		}
+
+		rc = alloc_run(goal, last - lblk + 1, &start, &len);
+		if (rc)
+			break;
+		// zero first, so a crash can't leave old data visible in the file
+		if (!uninit)
+			rc = zero_blocks(start, len);
+
+		for (i = 0; i < len && !rc; i++, lblk++)
+		{
+			if (i)
+			{
+				rc = ext2fs_bmap(fs, ino, inode, block_buf, 0, lblk, &pblk);
+				if (rc || pblk)
+					break;
+			}
+			pblk = start + i;
+			rc = ext2fs_bmap(fs, ino, inode, block_buf, set_flags,
+					lblk, &pblk);
+			if (rc)
+				break;
+			inode->i_blocks += fs->blocksize / 512;
+		}
+		// hand back whatever part of the run we didn't get to use,
+		// from the block that failed to map if one did
+		if (i < len)
+			ext2fs_block_alloc_stats_range(fs, start + i, len - i, -1);
+		if (rc)
+			break;
+		goal = start + len;
+	}
+
+	free(block_buf);
+	if (rc == EXT2_ET_BLOCK_ALLOC_FAIL)
+		return ENOSPC;
+	return rc ? EIO : 0;
+}
+
+static int punch_hole(struct ext2_file *fh, ext2_ino_t ino,
+		__u64 offset, __u64 end)
+{
+	blk_t bs = fs->blocksize;
+	__u64 first_full = (offset + bs - 1) / bs;
+	__u64 end_full = end / bs;
+	errcode_t rc = 0;
+
+	if (offset / bs == (end - 1) / bs && (offset % bs || end % bs))
+	{
+		// all within one block
+		rc = zero_partial_block(ino, &fh->inode, offset / bs,
+				offset % bs, end - (offset / bs) * bs);
+	}
+	else
+	{
+		if (offset % bs)
+			rc = zero_partial_block(ino, &fh->inode, offset / bs,
+					offset % bs, bs);
+		if (!rc && end % bs)
+			rc = zero_partial_block(ino, &fh->inode, end / bs, 0, end % bs);
+		if (!rc && first_full < end_full)
+			rc = punch_blocks(&fh->inode, first_full, end_full - 1);
+	}
+	if (rc)
+	{
+		ext2_err(rc, "while punching a hole in %d", ino);
+		return EIO;
+	}
+	return 0;
+}
+
+int do_fallocate(struct ext2_file *fh, ext2_ino_t ino, int mode,
+		off_t offset, off_t length)
+{
+	__u64 end = (__u64) offset + length, max_blocks;
+	int apb = fs->blocksize / sizeof(blk_t);
+	errcode_t rc;
+
+	dbg("do_fallocate(ino %d, mode 0x%x, offset %lld, length %lld)",
+		(int) ino, mode, (long long) offset, (long long) length);
+
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EROFS;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+		return EOPNOTSUPP;
+	if (offset < 0 || length <= 0)
+		return EINVAL;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+		return EINVAL;
+
+	max_blocks = EXT2_NDIR_BLOCKS + apb + (__u64) apb * apb +
+		(__u64) apb * apb * apb;
+	if (max_blocks > 0xFFFFFFFFULL || (fh->inode.i_flags & EXT4_EXTENTS_FL))
+		max_blocks = 0xFFFFFFFFULL;
+	if ((end - 1) / fs->blocksize >= max_blocks)
+		return EFBIG;
+	// no large file support, i_size_high stays 0
+	if (!(mode & FALLOC_FL_PUNCH_HOLE) && end > 0xFFFFFFFFULL)
+		return EFBIG;
+	// A block mapped file can't own blocks past its size (e2fsck would
+	// complain), so KEEP_SIZE only works inside the file. Extent mapped
+	// files can keep uninitialized extents past the end.
+	if (mode == FALLOC_FL_KEEP_SIZE && end > EXT2_I_SIZE(&fh->inode) &&
+			!(fh->inode.i_flags & EXT4_EXTENTS_FL))
+		return EOPNOTSUPP;
+
+	// the file buffer may be dirty, and its cached mapping won't survive
+	rc = ext2fs_file_flush(fh);
+	if (rc)
+		return EIO;
+	ext2fs_file_invalidate(fh);
+
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		rc = punch_hole(fh, ino, offset, end);
+	else
+	{
+		rc = prealloc_blocks(ino, &fh->inode, offset / fs->blocksize,
+				(end - 1) / fs->blocksize);
+		if (!rc && !(mode & FALLOC_FL_KEEP_SIZE) &&
+				end > EXT2_I_SIZE(&fh->inode))
+			fh->inode.i_size = end;
+	}
+
+	fh->inode.i_ctime = fh->inode.i_mtime = time(NULL);
+	if (ext2fs_write_inode(fs, ino, &fh->inode))
+		return EIO;
+	return rc;
+}
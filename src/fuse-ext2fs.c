@@ -5,7 +5,7 @@
  *  or any later version. See the file COPYING.
  */
 
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 29
 #include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 
@@ -21,9 +21,15 @@
 #include <stddef.h>
 
 #include "ext2fs.h"
+#include "wipe_block.h"
+#include "orphan.h"
+#include "icache.h"
+#include "kcache.h"
+#include "wcache.h"
 
 #include "symlink.h"
 #include "readdir.h"
+#include "xattr.h"
 
 // For R_OK flags
 #include <fcntl.h>
@@ -31,6 +37,8 @@
 
 ext2_filsys fs;
 
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* fuse will do permission checks if we pass -o default_permissions
  * The permission checking code here probably needs removing
  */ 
@@ -41,6 +49,8 @@ struct options {
 	char *mount_point;
 	char *mount_options;
 	int debug;
+	io_manager io;
+	int direct;
 };
 static struct options options;
 
@@ -57,6 +67,7 @@ static char def_opts[] = "fsname=";
 void op_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
 	dbg("op_access (inode %d, mask 0%o)", (int) ino, mask);
+	kcache_request(ino);
 
 	// check for RO filesystem
 	if ((mask & W_OK) && !(fs->flags & EXT2_FLAG_RW))
@@ -65,7 +76,7 @@ void op_access(fuse_req_t req, fuse_ino_t ino, int mask)
 		return;
 	}
 	fuse_reply_err(req,
-				check_perms(fuse_req_ctx(req), EXT2FS_INO(ino), mask));
+				check_perms(req, EXT2FS_INO(ino), mask));
 }
 
 // This is basically stat/fstat/lstat
@@ -79,6 +90,7 @@ void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	struct ext2_inode inode;
 
 	dbg("op_getattr(req, ino %d, fuse_file_ info *)", (int) ino);
+	kcache_request(ino);
 
 	memset(&stbuf, 0, sizeof(stbuf));
 	rc = read_inode(EXT2FS_INO(ino), &inode);
@@ -88,7 +100,7 @@ void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 	}
 	fill_statbuf(ino, &inode, &stbuf);
 
-	fuse_reply_attr(req, &stbuf, 1.0);
+	fuse_reply_attr(req, &stbuf, kcache_attr_timeout());
 }
 
 // op_setattr is used for chmod(), chown(), utime() and truncate() - Miklos
@@ -100,16 +112,16 @@ void op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	int rc;
 	struct stat stbuf;
 	struct ext2_inode inode;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_setattr(req, ino %d, stat*, to_set %d, fuse_file_info *)", (int) ino, to_set);
+	kcache_request(ino);
 	memset(&stbuf, 0, sizeof(stbuf));
 
 	// This must be before we read in the inode, as it may change things 
 	// like # of blocks.
 	if(to_set & FUSE_SET_ATTR_SIZE)
 	{
-		rc = do_truncate(ctx, EXT2FS_INO(ino), attr->st_size);
+		rc = do_truncate(req, EXT2FS_INO(ino), attr->st_size);
 		if (rc)
 		{
 			fuse_reply_err(req, rc);
@@ -123,21 +135,21 @@ void op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		return;
 	}
 
-	if ((to_set & FUSE_SET_ATTR_MODE) && !check_owner(ctx, &inode))
+	if ((to_set & FUSE_SET_ATTR_MODE) && !check_owner(req, &inode))
 		inode.i_mode = (inode.i_mode & ~0777) | attr->st_mode;
 
-	if ((to_set & FUSE_SET_ATTR_UID) && !check_owner(ctx, &inode))
+	if ((to_set & FUSE_SET_ATTR_UID) && !check_owner(req, &inode))
 		inode.i_uid = attr->st_uid;
 
-	if ((to_set & FUSE_SET_ATTR_GID) && !check_owner(ctx, &inode))
+	if ((to_set & FUSE_SET_ATTR_GID) && !check_owner(req, &inode))
 		inode.i_gid = attr->st_gid;
 
-	if ((to_set & FUSE_SET_ATTR_ATIME) && !check_owner(ctx, &inode))
+	if ((to_set & FUSE_SET_ATTR_ATIME) && !check_owner(req, &inode))
 		inode.i_atime = attr->st_atime;
 
-	if ((to_set & FUSE_SET_ATTR_MTIME) && !check_owner(ctx, &inode))
+	if ((to_set & FUSE_SET_ATTR_MTIME) && !check_owner(req, &inode))
 		inode.i_mtime = attr->st_mtime;
-	else if (!check_owner(ctx, &inode))
+	else if (!check_owner(req, &inode))
 		inode.i_mtime = time(NULL);
 
 	rc = write_inode(EXT2FS_INO(ino), &inode);
@@ -147,7 +159,7 @@ void op_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	}
 
 	fill_statbuf(ino, &inode, &stbuf);
-	fuse_reply_attr(req, &stbuf, 1.0);
+	fuse_reply_attr(req, &stbuf, kcache_attr_timeout());
 }
 
 void op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
@@ -156,34 +168,55 @@ void op_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 	struct ext2_inode inode;
 	ext2_ino_t ino;
 	int rc;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_lookup(req, parent ino %d, name %s)", (int) parent, name);
+	kcache_request(parent);
 
 	if(!strncmp(name, "(null)", 6)) {
 		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
-	rc = do_lookup(ctx, EXT2FS_INO(parent), name, &ino, &inode);
+	rc = do_lookup(req, EXT2FS_INO(parent), name, &ino, &inode);
+	if (rc == ENOENT && kcache_negative(&fe)) {
+		fuse_reply_entry(req, &fe);
+		return;
+	}
 	if(rc) {
 		fuse_reply_err(req, ENOENT);
 		return;
 	}
 
-	fe.ino = ino;
-	fe.generation = inode.i_generation;
-	fill_statbuf(ino, &inode, &fe.attr);
-	fe.attr_timeout = 2.0;
-	fe.entry_timeout = 2.0;
+	kcache_entry(&fe, ino, &inode);
 	fuse_reply_entry(req, &fe);
 }
 
+// the kernel is done with @nlookup of the references it got from entry
+// replies
+void op_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	dbg("op_forget(req, ino %d, nlookup %lu)", (int) ino, nlookup);
+	kcache_request(ino);
+	icache_forget(EXT2FS_INO(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+void op_forget_multi(fuse_req_t req, size_t count,
+		struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	dbg("op_forget_multi(req, count %d)", (int) count);
+	for (i = 0; i < count; i++)
+		icache_forget(EXT2FS_INO(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
 void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 	dbg("op_open(req, ino %d, flags 0%o)", (int) ino, fi->flags);
-	ext2_file_t efile = do_open(ctx, EXT2FS_INO(ino), fi->flags);
+	kcache_request(ino);
+	ext2_file_t efile = do_open(req, EXT2FS_INO(ino), fi->flags);
 
 	if(!efile)
 		fuse_reply_err(req, errno);
@@ -201,14 +234,14 @@ void op_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 	ext2_file_t efile;
 	struct ext2_inode inode;
 	struct fuse_entry_param fep;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_create(req, parent #%d, name %s, mode 0%o,"\
 		" fuse_file_info {fi->flags 0%o,...})",
 		(int) parent, name, mode, fi->flags);
+	kcache_request(parent);
 
 	// write the inode
-	rc = do_create(ctx, EXT2FS_INO(parent), name,
+	rc = do_create(req, EXT2FS_INO(parent), name,
 			LINUX_S_IFREG | (mode & 0777), &ino, &inode, EXT2_FT_REG_FILE);
 					
 	if(rc)
@@ -223,11 +256,7 @@ void op_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 	}
 
 	fi->fh = (unsigned long) efile;
-	fep.ino = ino;
-	fep.generation = inode.i_generation;
-	fill_statbuf(ino, &inode, &fep.attr);
-	fep.attr_timeout = 2.0;
-	fep.entry_timeout = 2.0;
+	kcache_entry(&fep, ino, &inode);
 	fuse_reply_create(req, &fep, fi);
 	return;
 
@@ -238,8 +267,9 @@ err_out:
 void op_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	dbg("op_unlink(req, parent ino %d, name %s)", (int) parent, name);
+	kcache_request(parent);
 	// we only need write access on the parent to unlink
-	int ret = check_perms(fuse_req_ctx(req), EXT2FS_INO(parent), W_OK);
+	int ret = check_perms(req, EXT2FS_INO(parent), W_OK);
 	if (ret)
 	{
 		fuse_reply_err(req, ret);
@@ -254,21 +284,21 @@ void op_rename(fuse_req_t req, fuse_ino_t parent_ino, const char *name,
 			fuse_ino_t newparent_ino, const char *newname)
 {
 	int ret;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_rename(oldparent %d, \"%s\" -> newparent %d, \"%s\")",
 		(int) parent_ino, name, (int) newparent_ino, newname);
+	kcache_request(parent_ino);
 
 	// We need write permission to BOTH directories
-	ret = check_perms(ctx, EXT2FS_INO(parent_ino), W_OK);
-	ret |= check_perms(ctx, EXT2FS_INO(newparent_ino), W_OK);
+	ret = check_perms(req, EXT2FS_INO(parent_ino), W_OK);
+	ret |= check_perms(req, EXT2FS_INO(newparent_ino), W_OK);
 	if (ret)
 	{
 		fuse_reply_err(req, ret);
 		return;
 	}
 
-	ret = do_rename(ctx, parent_ino, name, newparent_ino, newname);
+	ret = do_rename(req, parent_ino, name, newparent_ino, newname);
 	fuse_reply_err(req, ret);
 }
 
@@ -282,12 +312,12 @@ void op_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
 	int ret;
 	struct ext2_inode inode;
 	struct fuse_entry_param fe;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_link(req, ino %d, new parent ino %d, newname %s)", (int) ino, (int) newparent,  newname);
+	kcache_request(newparent);
 	// we don't need any perms to make a link to something,
 	// only the std parent write perms
-	ret = check_perms(ctx, EXT2FS_INO(newparent), W_OK);
+	ret = check_perms(req, EXT2FS_INO(newparent), W_OK);
 	if (ret)
 	{
 		fuse_reply_err(req, ret);
@@ -325,20 +355,16 @@ void op_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
 		return;
 	}
 
-	fe.ino = ino;
-	fe.generation = inode.i_generation;
-	fill_statbuf(ino, &inode, &fe.attr);
-	fe.attr_timeout = 2.0;
-	fe.entry_timeout = 2.0;
-
+	kcache_entry(&fe, ino, &inode);
 	fuse_reply_entry(req, &fe);
 }
 
-void op_statfs(fuse_req_t req)
+void op_statfs(fuse_req_t req, fuse_ino_t ino)
 {
 	struct statvfs stbuf;
 
-	dbg("op_statfs(req)");
+	dbg("op_statfs(req, ino %d)", (int) ino);
+	kcache_request(ino);
 	do_statvfs(&stbuf);
 	fuse_reply_statfs(req, &stbuf);
 }
@@ -352,6 +378,7 @@ void op_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	unsigned int bytes;
 
 	dbg("op_read(req, ino %d, size %d, off %d, file_info)", (int) ino, (int) size,  (int)off);
+	kcache_request(ino);
 	rc = do_read(EXT2FS_FILE(fi->fh), EXT2FS_INO(ino),
 		size, off, buf, &bytes);
 
@@ -370,6 +397,7 @@ void op_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 	unsigned int bytes;
 
 	dbg("op_write(req, ino %d, buf %s, size %d, off %d, file_info)", (int) ino, buf, (int) size,  (int)off);
+	kcache_request(ino);
 	rc = do_write(EXT2FS_FILE(fi->fh), ino, buf, size, off, &bytes);
 	if(rc)
 		fuse_reply_err(req, rc);
@@ -381,6 +409,7 @@ void op_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
 	int rc;
 	dbg("op_flush(req, ino %d, file_info)", (int) ino);
+	kcache_request(ino);
 	rc = do_file_flush(EXT2FS_FILE(fi->fh));
 	fuse_reply_err(req, rc);
 }
@@ -390,6 +419,7 @@ void op_release(fuse_req_t req, fuse_ino_t ino,
 {
 	int rc;
 	dbg("op_release(req, ino %d, file_info)", (int) ino);
+	kcache_request(ino);
 	rc = do_file_close(EXT2FS_FILE(fi->fh));
 	if (rc)
 		fuse_reply_err(req, EIO);
@@ -406,6 +436,7 @@ void op_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 {
 	// TODO: test fsync somehow!
 	dbg("op_fsync(req, ino %d, data sync %d, file_info)", (int) ino, datasync);
+	kcache_request(ino);
 	ext2fs_flush(fs);
 	fuse_reply_err(req, 0);
 }
@@ -417,12 +448,12 @@ void op_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 	ext2_ino_t ino;
 	struct ext2_inode inode;
 	int ret;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	if(parent == 1) parent = EXT2_ROOT_INO;
 
 	dbg("op_mkdir(req, parent ino %d, name %s, mode 0%o)", (int) parent, name, mode);
-	ret = do_mkdir(ctx, EXT2FS_INO(parent), name, mode, &ino);
+	kcache_request(parent);
+	ret = do_mkdir(req, EXT2FS_INO(parent), name, mode, &ino);
 	if(ret) {
 		fuse_reply_err(req, ret);
 		return;
@@ -434,31 +465,41 @@ void op_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 		return;
 	}
 
-	fe.ino = ino;
-	fe.generation = inode.i_generation;
-	fill_statbuf(ino, &inode, &fe.attr);
-	fe.attr_timeout = 2.0;
-	fe.entry_timeout = 2.0;
+	kcache_entry(&fe, ino, &inode);
 	fuse_reply_entry(req, &fe);
 }
 
 void op_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	int ret;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_rmdir(req, parent ino %d, name %s)", (int) parent, name);
+	kcache_request(parent);
 	// need to be able to write to the parent dir
-	ret = check_perms(ctx, EXT2FS_INO(parent), W_OK);
+	ret = check_perms(req, EXT2FS_INO(parent), W_OK);
 	if (!ret)
-		ret = do_rmdir(ctx, EXT2FS_INO(parent), name);
+		ret = do_rmdir(req, EXT2FS_INO(parent), name);
 	fuse_reply_err(req, ret);
 }
 
+void op_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+			off_t length, struct fuse_file_info *fi)
+{
+	int rc;
+	dbg("op_fallocate(req, ino %d, mode 0x%x, offset %lld, length %lld)",
+		(int) ino, mode, (long long) offset, (long long) length);
+	kcache_request(ino);
+	rc = do_fallocate(EXT2FS_FILE(fi->fh), EXT2FS_INO(ino), mode, offset,
+		length);
+	fuse_reply_err(req, rc);
+}
+
 // The userdata should be a char * specifying the fs device to be mounted
-void op_init(void *userdata)
+void op_init(void *userdata, struct fuse_conn_info *conn)
 {
 	char *fs_device_name = (char *) userdata;
+	const char *io_options = options.direct ? "direct" : NULL;
+	io_manager manager;
 	errcode_t ret;
 
 	dbg("op_init(device_name %s)", fs_device_name);
@@ -468,10 +509,25 @@ void op_init(void *userdata)
 	// superblock is a chosen block # for the superblock.
 	// if superblock == 0, the default position of 1024 bytes in is assumed.
 	// if superblock != 0, must spec block_size.
-	ret = ext2fs_open(fs_device_name,
+	// By default io_uring where the system has it, so cache misses,
+	// readahead and write-back can overlap. Whatever was chosen, plain
+	// synchronous I/O is used if it can't be: no io_uring, an mmap of
+	// something other than an image file, or -o direct with mmap.
+	// -o direct bypasses the kernel's cache, leaving the block cache as
+	// the only one
+	manager = options.io ? options.io : uring_io_manager;
+	ret = ext2fs_open2(fs_device_name, io_options,
+			EXT2_FLAG_RW | EXT2_FLAG_JOURNAL_DEV_OK,
+			0, 0, manager, &fs);
+	if (ret && manager != unix_io_manager)
+	{
+		dbg("%s unavailable (%s), using unix I/O", manager->name,
+			error_message(ret));
+		ret = ext2fs_open2(fs_device_name, io_options,
 				EXT2_FLAG_RW | EXT2_FLAG_JOURNAL_DEV_OK,
 				0, 0, unix_io_manager, &fs);
-				
+	}
+
 	if (ret)
 	{
 		com_err("fuse-ext2fs", ret, "while trying to open %s",
@@ -483,6 +539,8 @@ void op_init(void *userdata)
 	if (ret)
 	{
 		com_err("fuse-ext2", ret, "while reading inode bitmap");
+		ext2fs_close(fs);
+		fs = NULL;
 		return;
 	}
 
@@ -490,24 +548,50 @@ void op_init(void *userdata)
 	if (ret)
 	{
 		com_err("fuse-ext2", ret, "while reading block bitmap");
+		ext2fs_close(fs);
+		fs = NULL;
 		return;
 	}
 
+	icache_init();
+	wcache_load();
+
+	// also finishes off any deletes interrupted by a crash
+	if (orphan_start())
+		printf("background deletion disabled\n");
+
 	printf("fuse-ext2 initialized for device: %s\n", fs->device_name);
 	printf("block size is %d\n", fs->blocksize);
 }
 
+// This runs under fs_lock when the kernel sends DESTROY, so the
+// filesystem is closed by unmount_fs() instead, once the request loop is
+// done with it.
 void op_destroy(void *userdata)
+{
+	dbg("op_destroy()");
+}
+
+static void unmount_fs(void)
 {
 	errcode_t ret;
 
-	dbg("op_destroy()");
+	// op_init() failed
+	if (!fs)
+		return;
+
+	orphan_stop();
+	wcache_snapshot();
+	icache_fini();
+	xattr_fini();
+	wcache_save();
 	ret = ext2fs_close(fs);
 	if (ret)
 	{
 		com_err("fuse-ext2fs", ret, "while trying to close device %s",
 			fs->device_name);
 	}
+	fs = NULL;
 	printf("fuse-ext2fs destroyed\n");
 }
 
@@ -515,7 +599,7 @@ static struct fuse_lowlevel_ops ext2fs_ops = {
 	.init           = op_init,
 	.destroy        = op_destroy,
 	.lookup         = op_lookup,
-	.forget         = NULL,
+	.forget         = op_forget,
 	.getattr        = op_getattr,
 	.setattr        = op_setattr,
 	.readlink       = op_readlink,
@@ -537,12 +621,14 @@ static struct fuse_lowlevel_ops ext2fs_ops = {
 	.releasedir     = op_release,
 	.fsyncdir       = NULL,
 	.statfs         = op_statfs,
-	.setxattr       = NULL,
-	.getxattr       = NULL,
-	.listxattr      = NULL,
-	.removexattr    = NULL,
+	.setxattr       = op_setxattr,
+	.getxattr       = op_getxattr,
+	.listxattr      = op_listxattr,
+	.removexattr    = op_removexattr,
 	.access         = op_access,
 	.create         = op_create,
+	.fallocate      = op_fallocate,
+	.forget_multi   = op_forget_multi,
 };
 
 int opt_proc(void *data, const char *arg, int key,
@@ -586,12 +672,110 @@ static int strappend(char **dest, const char *append)
 	return 0;
 }
 
+/**
+ * add_mount_options - Sort a comma separated -o list
+ * Options ext2fuse understands itself are consumed here, everything else is
+ * appended to options.mount_options and handed on to fuse_mount().
+ *
+ * Return:   0 success, -1 error.
+ */
+static int add_mount_options(const char *opts)
+{
+	char *copy, *opt, *next;
+	int rc = 0;
+
+	copy = strdup(opts);
+	if (!copy)
+		return -1;
+
+	for (opt = copy; opt && !rc; opt = next) {
+		next = strchr(opt, ',');
+		if (next)
+			*next++ = '\0';
+		if (!*opt)
+			continue;
+
+		if (!strncmp(opt, "wipe=", 5)) {
+			if (set_wipe_policy(opt + 5)) {
+				dbg("Unknown wipe policy '%s'", opt + 5);
+				rc = -1;
+			}
+			continue;
+		}
+
+		if (!strncmp(opt, "io=", 3)) {
+			if (!strcmp(opt + 3, "unix"))
+				options.io = unix_io_manager;
+			else if (!strcmp(opt + 3, "uring"))
+				options.io = uring_io_manager;
+			else if (!strcmp(opt + 3, "mmap"))
+				options.io = mmap_io_manager;
+			else {
+				dbg("Unknown I/O method '%s'", opt + 3);
+				rc = -1;
+			}
+			continue;
+		}
+
+		if (!strcmp(opt, "direct")) {
+			options.direct = 1;
+			continue;
+		}
+
+		switch (kcache_option(opt)) {
+		case 1:
+			continue;
+		case -1:
+			dbg("Bad value in '%s'", opt);
+			rc = -1;
+			continue;
+		}
+
+		switch (wcache_option(opt)) {
+		case 1:
+			continue;
+		case -1:
+			dbg("Bad value in '%s'", opt);
+			rc = -1;
+			continue;
+		}
+
+		if (options.mount_options)
+			if (strappend(&options.mount_options, ","))
+				rc = -1;
+		if (!rc && strappend(&options.mount_options, opt))
+			rc = -1;
+	}
+
+	free(copy);
+	return rc;
+}
+
 void usage(const char *prog_name)
 {
 	printf(	"%s devicename mountpoint [--options fuse-option1,fuse-option2,...]\n",
 			prog_name);
 	printf(	"%s --help\n", prog_name);
 	printf(	"%s --version\n", prog_name);
+	printf(	"\next2fuse options:\n");
+	printf(	"    -o wipe=none|zero|random|discard\n"
+		"\t\t\thow to scrub freed blocks (default: none)\n");
+	printf(	"    -o attr_timeout=T, entry_timeout=T, negative_timeout=T\n"
+		"\t\t\tseconds the kernel may cache attributes, names\n"
+		"\t\t\tand missing names (default: 1, 2, 0)\n");
+	printf(	"    -o exclusive\n"
+		"\t\t\tnothing else writes to the filesystem: use long\n"
+		"\t\t\ttimeouts, and tell the kernel about changes\n");
+	printf(	"    -o io=uring|unix|mmap\n"
+		"\t\t\tdevice I/O through io_uring, with requests in\n"
+		"\t\t\tflight together, one at a time, or by mapping an\n"
+		"\t\t\timage file (default: uring where available)\n");
+	printf(	"    -o direct\n"
+		"\t\t\tbypass the kernel's cache (O_DIRECT), caching\n"
+		"\t\t\tblocks only in ext2fuse\n");
+	printf(	"    -o warm_cache=FILE\n"
+		"\t\t\tkeep the hot inodes and their block maps in FILE\n"
+		"\t\t\tat unmount, and reload them at the next mount\n");
 	printf(	"\nSee your distribution's FUSE documentation for FUSE mount options.\n");
 }
 
@@ -630,10 +814,7 @@ static int parse_options(int argc, char *argv[])
 			}
 			break;
 		case 'o':
-			if (options.mount_options)
-				if (strappend(&options.mount_options, ","))
-					return -1;
-			if (strappend(&options.mount_options, optarg))
+			if (add_mount_options(optarg))
 				return -1;
 			break;
 		case 'h':
@@ -668,9 +849,43 @@ static int parse_options(int argc, char *argv[])
 	return 0;
 }
 
-static int try_fuse_mount(char *mount_options)
+// fuse_session_loop(), but with each request handled under fs_lock, so
+// the background delete thread can share the filesystem.
+static int session_loop(struct fuse_session *se)
+{
+	int res = 0;
+	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+	size_t bufsize = fuse_chan_bufsize(ch);
+	char *buf = (char *) malloc(bufsize);
+	if (!buf) {
+		dbg("failed to allocate read buffer");
+		return -1;
+	}
+	kcache_start(ch);
+
+	while (!fuse_session_exited(se)) {
+		struct fuse_chan *tmpch = ch;
+		res = fuse_chan_recv(&tmpch, buf, bufsize);
+		if (res == -EINTR || res == -EAGAIN)
+			continue;
+		if (res <= 0)
+			break;
+
+		lock_for_request();
+		fuse_session_process(se, buf, res, tmpch);
+		kcache_request_done();
+		pthread_mutex_unlock(&fs_lock);
+	}
+
+	kcache_stop();
+	free(buf);
+	fuse_session_reset(se);
+	return res < 0 ? -1 : 0;
+}
+
+static struct fuse_chan *try_fuse_mount(char *mount_options)
 {
-	int fc = -1;
+	struct fuse_chan *fc = NULL;
 	struct fuse_args margs = FUSE_ARGS_INIT(0, NULL);
 	
 	/* The fuse_mount() options get modified, so we always rebuild it */
@@ -693,7 +908,7 @@ int main(int argc, char *argv[])
 {
 	struct fuse_args custom_args = FUSE_ARGS_INIT(0,NULL);
 	int err = -1;
-	int fd;
+	struct fuse_chan *ch;
 
 	init_ext2_stuff();
 	
@@ -706,7 +921,7 @@ int main(int argc, char *argv[])
 		return err;
 	}
 
-	if ((fd = try_fuse_mount(options.mount_options))!=-1) {
+	if ((ch = try_fuse_mount(options.mount_options)) != NULL) {
 		struct fuse_session *se=(struct fuse_session*)1;
 		if (fuse_opt_add_arg(&custom_args, "") == -1)
 			se = NULL;
@@ -718,18 +933,16 @@ int main(int argc, char *argv[])
 				sizeof(ext2fs_ops), options.device_name);
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1) {
-				struct fuse_chan *ch = fuse_kern_chan_new(fd);
-				if (ch != NULL) {
-					fuse_session_add_chan(se, ch);
-					err = fuse_session_loop(se);
-				}
+				fuse_session_add_chan(se, ch);
+				err = session_loop(se);
 				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
 			}
 			fuse_session_destroy(se);
 		}
-		close(fd);
+		fuse_unmount(options.mount_point, ch);
+		unmount_fs();
 	}
-	fuse_unmount(options.mount_point);
 	fuse_opt_free_args(&custom_args);
 
 	return err ? 1 : 0;
@@ -0,0 +1,369 @@
+/*
+ *  Copyright (C) 2007-8, see the file AUTHORS for copyright owners.
+ *
+ *  This program can be distributed under the terms of the GNU GPL v2,
+ *  or any later version. See the file COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext2fs.h"
+
+#include "icache.h"
+
+// number of hash buckets, a power of two
+#define ICACHE_HASH_SIZE 4096
+// unpinned inodes kept around in case they are wanted again
+#define ICACHE_MAX_UNPINNED 1024
+
+struct icache_entry
+{
+	ext2_ino_t ino;
+	int valid;			// inode holds what's on disk
+	struct ext2_inode inode;
+	__u64 nlookup;			// references held by the kernel
+	int nopen;			// opens sharing file
+	struct ext2_file *file;
+	// block map runs of the last open, to start the next one with
+	struct ext2_bmap_run runs[EXT2_FILE_RUNS];
+	struct icache_entry *hash_next;
+	// on the LRU list, while not pinned
+	struct icache_entry *lru_prev, *lru_next;
+};
+
+static struct icache_entry *icache_hash[ICACHE_HASH_SIZE];
+// most recently used first
+static struct icache_entry icache_lru = { .lru_prev = &icache_lru,
+	.lru_next = &icache_lru };
+static int icache_unpinned = 0;
+static void (*icache_watcher)(ext2_ino_t ino) = NULL;
+
+static struct icache_entry **bucket(ext2_ino_t ino)
+{
+	return &icache_hash[ino & (ICACHE_HASH_SIZE - 1)];
+}
+
+static struct icache_entry *find(ext2_ino_t ino)
+{
+	struct icache_entry *e;
+
+	for (e = *bucket(ino); e; e = e->hash_next)
+		if (e->ino == ino)
+			return e;
+	return NULL;
+}
+
+static int pinned(struct icache_entry *e)
+{
+	return e->nlookup || e->nopen;
+}
+
+static void lru_del(struct icache_entry *e)
+{
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	icache_unpinned--;
+}
+
+static void lru_add(struct icache_entry *e)
+{
+	e->lru_next = icache_lru.lru_next;
+	e->lru_prev = &icache_lru;
+	e->lru_next->lru_prev = e;
+	icache_lru.lru_next = e;
+	icache_unpinned++;
+}
+
+static void evict(void)
+{
+	struct icache_entry *e, **pp;
+
+	while (icache_unpinned > ICACHE_MAX_UNPINNED)
+	{
+		e = icache_lru.lru_prev;
+		lru_del(e);
+		for (pp = bucket(e->ino); *pp != e; pp = &(*pp)->hash_next)
+			;
+		*pp = e->hash_next;
+		free(e);
+	}
+}
+
+static void touch(struct icache_entry *e)
+{
+	if (!pinned(e))
+	{
+		lru_del(e);
+		lru_add(e);
+	}
+}
+
+// call before taking a pin
+static void pin(struct icache_entry *e)
+{
+	if (!pinned(e))
+		lru_del(e);
+}
+
+// call after dropping a pin
+static void unpin(struct icache_entry *e)
+{
+	if (!pinned(e))
+	{
+		lru_add(e);
+		evict();
+	}
+}
+
+// the entry for @ino, made if need be; new entries start out unpinned
+static struct icache_entry *get(ext2_ino_t ino)
+{
+	struct icache_entry *e = find(ino);
+
+	if (e)
+	{
+		touch(e);
+		return e;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	e->ino = ino;
+	e->hash_next = *bucket(ino);
+	*bucket(ino) = e;
+	lru_add(e);
+	evict();
+	return e;
+}
+
+static errcode_t read_hook(ext2_filsys fs, ext2_ino_t ino,
+		struct ext2_inode *inode)
+{
+	struct icache_entry *e = find(ino);
+	errcode_t rc;
+
+	if (e && e->valid)
+	{
+		touch(e);
+		*inode = e->inode;
+		return 0;
+	}
+
+	fs->read_inode = NULL;
+	rc = ext2fs_read_inode(fs, ino, inode);
+	fs->read_inode = read_hook;
+	if (rc)
+		return rc;
+
+	e = get(ino);
+	if (e)
+	{
+		e->inode = *inode;
+		e->valid = 1;
+	}
+	return 0;
+}
+
+// Has the block map of the inode changed between @old and @new? A
+// change of i_blocks alone can also be an extended attribute block coming
+// or going (fsetxattr() on an open file), which leaves the map alone.
+static int map_changed(struct ext2_inode *new, struct ext2_inode *old)
+{
+	blk_t ea = fs->blocksize / 512;
+
+	if (memcmp(new->i_block, old->i_block, sizeof(new->i_block)))
+		return 1;
+	return new->i_blocks - (new->i_file_acl ? ea : 0) !=
+		old->i_blocks - (old->i_file_acl ? ea : 0);
+}
+
+// Is the block in the buffer of @file still mapped where it was in @inode?
+static int buffer_still_mapped(ext2_ino_t ino, struct ext2_inode *inode,
+		struct ext2_file *file)
+{
+	blk_t pblk;
+
+	if (!file->physblock)
+		return 0;
+	if (ext2fs_bmap(fs, ino, inode, NULL, 0, file->blockno, &pblk))
+		return 0;
+	return pblk == file->physblock;
+}
+
+// Inodes are written through, the table only keeps a copy. If the inode
+// of an open file was written from some other copy, the file takes the
+// new one too. Should its block map have changed under it (which only
+// happens when it is truncated or deleted while still open) its buffer and
+// cached runs go, as do the runs kept from its last open. Dirty data in
+// the buffer is written out first if its block is still part of the file.
+static errcode_t write_hook(ext2_filsys fs, ext2_ino_t ino,
+		struct ext2_inode *inode)
+{
+	struct icache_entry *e = find(ino);
+	struct ext2_file *file;
+
+	if (!e)
+		return EXT2_ET_CALLBACK_NOTHANDLED;
+
+	file = e->file;
+	if (file && inode != &file->inode)
+	{
+		if (map_changed(inode, &file->inode))
+		{
+			if ((file->flags & EXT2_FILE_BUF_DIRTY) &&
+					buffer_still_mapped(ino, inode, file))
+				ext2fs_file_flush(file);
+			ext2fs_file_invalidate(file);
+		}
+		file->inode = *inode;
+	}
+	if (e->valid && map_changed(inode, &e->inode))
+		memset(e->runs, 0, sizeof(e->runs));
+	e->inode = *inode;
+	e->valid = 1;
+	touch(e);
+	if (icache_watcher && e->nlookup)
+		icache_watcher(ino);
+	return EXT2_ET_CALLBACK_NOTHANDLED;
+}
+
+void icache_init(void)
+{
+	fs->read_inode = read_hook;
+	fs->write_inode = write_hook;
+}
+
+void icache_fini(void)
+{
+	struct icache_entry *e, *next;
+	int i;
+
+	for (i = 0; i < ICACHE_HASH_SIZE; i++)
+	{
+		for (e = icache_hash[i]; e; e = next)
+		{
+			next = e->hash_next;
+			if (e->file)
+				ext2fs_file_close(e->file);
+			free(e);
+		}
+		icache_hash[i] = NULL;
+	}
+	icache_lru.lru_prev = icache_lru.lru_next = &icache_lru;
+	icache_unpinned = 0;
+
+	fs->read_inode = NULL;
+	fs->write_inode = NULL;
+}
+
+void icache_watch(void (*fn)(ext2_ino_t ino))
+{
+	icache_watcher = fn;
+}
+
+void icache_lookup(ext2_ino_t ino)
+{
+	struct icache_entry *e = get(ino);
+
+	// without an entry the reference just isn't counted, and the inode
+	// is read from disk again next time
+	if (!e)
+		return;
+	pin(e);
+	e->nlookup++;
+}
+
+void icache_forget(ext2_ino_t ino, __u64 nlookup)
+{
+	struct icache_entry *e = find(ino);
+
+	dbg("icache_forget(ino %u, nlookup %llu)", ino,
+		(unsigned long long) nlookup);
+	if (!e || !e->nlookup)
+		return;
+	e->nlookup = nlookup < e->nlookup ? e->nlookup - nlookup : 0;
+	unpin(e);
+}
+
+errcode_t icache_open(ext2_ino_t ino, int flags, ext2_file_t *ret)
+{
+	struct icache_entry *e = get(ino);
+	errcode_t rc;
+
+	if (!e)
+		return EXT2_ET_NO_MEMORY;
+
+	if (!e->file)
+	{
+		rc = ext2fs_file_open(fs, ino, flags, &e->file);
+		if (rc)
+		{
+			e->file = NULL;
+			return rc;
+		}
+		memcpy(e->file->runs, e->runs, sizeof(e->runs));
+	}
+	else if ((flags & EXT2_FILE_WRITE) &&
+			!(e->file->flags & EXT2_FILE_WRITE))
+	{
+		if (!(fs->flags & EXT2_FLAG_RW))
+			return EXT2_ET_RO_FILSYS;
+		e->file->flags |= EXT2_FILE_WRITE;
+	}
+
+	pin(e);
+	e->nopen++;
+	*ret = e->file;
+	return 0;
+}
+
+errcode_t icache_close(ext2_file_t file)
+{
+	struct icache_entry *e = find(file->ino);
+	errcode_t rc;
+
+	if (!e || e->file != file)
+		return ext2fs_file_close(file);
+
+	if (e->nopen > 1)
+	{
+		e->nopen--;
+		return ext2fs_file_flush(file);
+	}
+
+	// the last flush may write the inode, so stay pinned until it's done,
+	// and keep the block map it leaves for the next open
+	if (!ext2fs_file_flush(file))
+		memcpy(e->runs, file->runs, sizeof(e->runs));
+	rc = ext2fs_file_close(file);
+	e->file = NULL;
+	e->nopen = 0;
+	unpin(e);
+	return rc;
+}
+
+void icache_iterate(void (*fn)(ext2_ino_t ino, struct ext2_inode *inode,
+		struct ext2_bmap_run *runs, void *priv), void *priv)
+{
+	struct icache_entry *e;
+	int i;
+
+	for (i = 0; i < ICACHE_HASH_SIZE; i++)
+		for (e = icache_hash[i]; e; e = e->hash_next)
+			if (e->valid && pinned(e))
+				fn(e->ino, &e->inode,
+					e->file ? e->file->runs : e->runs, priv);
+	for (e = icache_lru.lru_next; e != &icache_lru; e = e->lru_next)
+		if (e->valid)
+			fn(e->ino, &e->inode, e->runs, priv);
+}
+
+void icache_set_runs(ext2_ino_t ino, struct ext2_bmap_run *runs)
+{
+	struct icache_entry *e = find(ino);
+
+	if (e && e->valid && !e->file)
+		memcpy(e->runs, runs, sizeof(e->runs));
+}
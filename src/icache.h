@@ -0,0 +1,53 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_fs.h>
+
+// In-memory table of inodes, keyed by inode number. Every inode read or
+// written through libext2fs passes through it (it hooks fs->read_inode and
+// fs->write_inode), so a cached copy is never stale.
+//
+// An inode stays pinned in the table while the kernel holds references to
+// it (counted from entry replies, dropped by forget) or while it is open.
+// Opens of the same inode share one ext2_file, so its block buffer and
+// cached block map live as long as the inode is open, and every handle
+// sees the same size and blocks. Unpinned inodes are kept around on an
+// LRU list, up to a limit, along with the block map runs their last open
+// found, which start off the next open.
+
+// hook the table into the (already opened) global fs
+void icache_init(void);
+
+// closes anything still open, and empties the table
+void icache_fini(void);
+
+// Have @fn called for every inode written while the kernel holds
+// references to it, or stop with NULL.
+void icache_watch(void (*fn)(ext2_ino_t ino));
+
+// the kernel got a new reference to @ino, through an entry reply
+void icache_lookup(ext2_ino_t ino);
+
+// the kernel dropped @nlookup references to @ino
+void icache_forget(ext2_ino_t ino, __u64 nlookup);
+
+// Open @ino with the EXT2_FILE_* @flags, sharing the ext2_file with any
+// other opens of the same inode. Returns 0 or an errcode.
+errcode_t icache_open(ext2_ino_t ino, int flags, ext2_file_t *ret);
+
+// Drop one open of @file, closing it for real with the last one. Either
+// way any buffered data is written out.
+errcode_t icache_close(ext2_file_t file);
+
+// Call @fn for every inode in the table, the pinned ones first and then
+// the rest, most recently used first. @runs are the EXT2_FILE_RUNS block
+// map runs known for it, unused ones having len 0.
+void icache_iterate(void (*fn)(ext2_ino_t ino, struct ext2_inode *inode,
+		struct ext2_bmap_run *runs, void *priv), void *priv);
+
+// Have the next open of @ino, if it's in the table and not open, start
+// with the block map @runs (EXT2_FILE_RUNS of them).
+void icache_set_runs(ext2_ino_t ino, struct ext2_bmap_run *runs);
+
+#endif
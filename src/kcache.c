@@ -0,0 +1,237 @@
+/*
+ *  Copyright (C) 2007-8, see the file AUTHORS for copyright owners.
+ *
+ *  This program can be distributed under the terms of the GNU GPL v2,
+ *  or any later version. See the file COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ext2fs.h"
+
+#include "icache.h"
+#include "kcache.h"
+
+#define ext2_err(rc, ...) \
+	com_err("ext2fuse_dbg_msg", rc, __VA_ARGS__)
+
+// timeouts in seconds, when not given as options
+#define KCACHE_ATTR_TIMEOUT 1.0
+#define KCACHE_ENTRY_TIMEOUT 2.0
+#define KCACHE_NEGATIVE_TIMEOUT 0.0
+// ...and with -o exclusive
+#define KCACHE_EXCLUSIVE_TIMEOUT 86400.0
+
+// negative until set by an option
+static double attr_timeout = -1.0;
+static double entry_timeout = -1.0;
+static double negative_timeout = -1.0;
+static int exclusive = 0;
+
+// inodes written during the current request, under fs_lock
+static ext2_ino_t *changed = NULL;
+static size_t nchanged = 0, changed_size = 0;
+// the inode the current request is for, 0 if it isn't for one
+static ext2_ino_t request_ino = 0;
+
+// inodes to send invalidations for, under notify_lock
+static ext2_ino_t *queued = NULL;
+static size_t nqueued = 0, queued_size = 0;
+
+static struct fuse_chan *notify_ch;
+static pthread_t notify_thread;
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+static int notify_running = 0;
+static int notify_stopping = 0;
+
+static double timeout(double set, double def)
+{
+	if (set >= 0)
+		return set;
+	return exclusive ? KCACHE_EXCLUSIVE_TIMEOUT : def;
+}
+
+static int parse_timeout(const char *val, double *ret)
+{
+	char *end;
+	double t = strtod(val, &end);
+
+	if (end == val || *end || t < 0)
+		return -1;
+	*ret = t;
+	return 1;
+}
+
+int kcache_option(const char *opt)
+{
+	if (!strncmp(opt, "attr_timeout=", 13))
+		return parse_timeout(opt + 13, &attr_timeout);
+	if (!strncmp(opt, "entry_timeout=", 14))
+		return parse_timeout(opt + 14, &entry_timeout);
+	if (!strncmp(opt, "negative_timeout=", 17))
+		return parse_timeout(opt + 17, &negative_timeout);
+	if (!strcmp(opt, "exclusive"))
+	{
+		exclusive = 1;
+		return 1;
+	}
+	return 0;
+}
+
+void kcache_entry(struct fuse_entry_param *fe, ext2_ino_t ino,
+		struct ext2_inode *inode)
+{
+	memset(fe, 0, sizeof(*fe));
+	fe->ino = ino;
+	fe->generation = inode->i_generation;
+	fill_statbuf(ino, inode, &fe->attr);
+	fe->attr_timeout = timeout(attr_timeout, KCACHE_ATTR_TIMEOUT);
+	fe->entry_timeout = timeout(entry_timeout, KCACHE_ENTRY_TIMEOUT);
+	icache_lookup(ino);
+}
+
+int kcache_negative(struct fuse_entry_param *fe)
+{
+	memset(fe, 0, sizeof(*fe));
+	fe->entry_timeout = timeout(negative_timeout, KCACHE_NEGATIVE_TIMEOUT);
+	return fe->entry_timeout > 0;
+}
+
+double kcache_attr_timeout(void)
+{
+	return timeout(attr_timeout, KCACHE_ATTR_TIMEOUT);
+}
+
+// add @ino to the set in @list, growing it as needed
+static void add_ino(ext2_ino_t **list, size_t *n, size_t *size,
+		ext2_ino_t ino)
+{
+	ext2_ino_t *p;
+	size_t i;
+
+	for (i = 0; i < *n; i++)
+		if ((*list)[i] == ino)
+			return;
+	if (*n == *size)
+	{
+		p = realloc(*list, (*size ? *size * 2 : 16) * sizeof(ext2_ino_t));
+		// the kernel keeps stale attributes until they time out
+		if (!p)
+			return;
+		*list = p;
+		*size = *size ? *size * 2 : 16;
+	}
+	(*list)[(*n)++] = ino;
+}
+
+static void watch(ext2_ino_t ino)
+{
+	add_ino(&changed, &nchanged, &changed_size, ino);
+}
+
+void kcache_request(fuse_ino_t nodeid)
+{
+	request_ino = nodeid == FUSE_ROOT_ID ? EXT2_ROOT_INO : nodeid;
+}
+
+void kcache_request_done(void)
+{
+	ext2_ino_t ino = request_ino;
+	size_t i;
+
+	request_ino = 0;
+	if (!nchanged)
+		return;
+
+	pthread_mutex_lock(&notify_lock);
+	for (i = 0; i < nchanged; i++)
+		if (changed[i] != ino)
+			add_ino(&queued, &nqueued, &queued_size, changed[i]);
+	if (nqueued)
+		pthread_cond_signal(&notify_cond);
+	pthread_mutex_unlock(&notify_lock);
+	nchanged = 0;
+}
+
+static void *notify_worker(void *arg EXT2FS_ATTR((unused)))
+{
+	ext2_ino_t *batch;
+	fuse_ino_t ino;
+	size_t n, i;
+	int rc;
+
+	pthread_mutex_lock(&notify_lock);
+	for (;;)
+	{
+		if (!nqueued)
+		{
+			if (notify_stopping)
+				break;
+			pthread_cond_wait(&notify_cond, &notify_lock);
+			continue;
+		}
+
+		batch = queued;
+		n = nqueued;
+		queued = NULL;
+		nqueued = queued_size = 0;
+		pthread_mutex_unlock(&notify_lock);
+
+		for (i = 0; i < n; i++)
+		{
+			ino = batch[i] == EXT2_ROOT_INO ? FUSE_ROOT_ID : batch[i];
+			rc = fuse_lowlevel_notify_inval_inode(notify_ch, ino, -1, 0);
+			// ENOENT: the kernel has forgotten it by now
+			if (rc && rc != -ENOENT)
+				dbg("invalidating inode %u failed: %d", batch[i], rc);
+		}
+		free(batch);
+
+		pthread_mutex_lock(&notify_lock);
+	}
+	pthread_mutex_unlock(&notify_lock);
+	return NULL;
+}
+
+int kcache_start(struct fuse_chan *ch)
+{
+	int rc;
+
+	if (!exclusive || notify_running)
+		return 0;
+
+	notify_ch = ch;
+	notify_stopping = 0;
+	rc = pthread_create(&notify_thread, NULL, notify_worker, NULL);
+	if (rc)
+	{
+		// without invalidations the long timeouts aren't safe
+		ext2_err(0, "couldn't start kernel notification thread");
+		exclusive = 0;
+		return rc;
+	}
+	notify_running = 1;
+	icache_watch(watch);
+	return 0;
+}
+
+void kcache_stop(void)
+{
+	if (!notify_running)
+		return;
+
+	icache_watch(NULL);
+	pthread_mutex_lock(&notify_lock);
+	notify_stopping = 1;
+	pthread_cond_signal(&notify_cond);
+	pthread_mutex_unlock(&notify_lock);
+
+	pthread_join(notify_thread, NULL);
+	notify_running = 0;
+	free(changed);
+	changed = NULL;
+	nchanged = changed_size = 0;
+}
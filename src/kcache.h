@@ -0,0 +1,46 @@
+#ifndef KCACHE_H
+#define KCACHE_H
+
+#define FUSE_USE_VERSION 29
+
+#include <fuse_lowlevel.h>
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_fs.h>
+
+// How long the kernel may cache what we tell it: attributes, names, and
+// names that don't exist. The timeouts come from the attr_timeout,
+// entry_timeout and negative_timeout mount options.
+//
+// With -o exclusive ext2fuse promises to be the only writer of the
+// filesystem, so the kernel gets very long timeouts instead. Whenever a
+// request changes an inode the kernel knows about, other than the one the
+// request was for (which the kernel expects to change), the kernel is told
+// to drop its attributes. The notifications are sent from a thread of
+// their own, as the kernel may have to wait for other requests first.
+
+// Handle a -o option. Returns 1 if it was one of ours, 0 if it wasn't, or
+// -1 if it was but its value is bad.
+int kcache_option(const char *opt);
+
+// Fill in an entry reply for @ino. The reply gives the kernel a reference
+// to the inode, which is counted here, until it forgets it.
+void kcache_entry(struct fuse_entry_param *fe, ext2_ino_t ino,
+		struct ext2_inode *inode);
+
+// Fill in an entry reply for a name that doesn't exist. Returns 0 if
+// negative entries aren't cached, and an error should be sent instead.
+int kcache_negative(struct fuse_entry_param *fe);
+
+double kcache_attr_timeout(void);
+
+// start and stop sending invalidations (only done with -o exclusive)
+int kcache_start(struct fuse_chan *ch);
+void kcache_stop(void);
+
+// Every request calls kcache_request() with the node id it is for (the
+// parent, for requests on a name), and kcache_request_done() is called
+// once it has been handled.
+void kcache_request(fuse_ino_t nodeid);
+void kcache_request_done(void);
+
+#endif
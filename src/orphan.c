@@ -0,0 +1,242 @@
+/*
+ *  Copyright (C) 2007-8, see the file AUTHORS for copyright owners.
+ *
+ *  This program can be distributed under the terms of the GNU GPL v2,
+ *  or any later version. See the file COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ext2fs.h"
+
+#include "orphan.h"
+#include "truncate.h"
+#include "xattr.h"
+
+#define ext2_err(rc, ...) \
+	com_err("ext2fuse_dbg_msg", rc, __VA_ARGS__)
+
+// Logical blocks freed per turn of the worker before it lets requests back
+// in. Files that fit in a single batch are not worth the trip through the
+// orphan list and are still deleted synchronously.
+#define ORPHAN_BATCH_BLOCKS 1024
+
+static pthread_t orphan_thread;
+static pthread_cond_t orphan_cond = PTHREAD_COND_INITIALIZER;
+static int orphan_running = 0;
+static ext2_ino_t orphan_cur_ino = 0;
+static blk_t orphan_window;
+static int orphan_stopping = 0;
+
+// requests waiting for fs_lock, and the worker waiting for them to be done
+static pthread_mutex_t waiters_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waiters_cond = PTHREAD_COND_INITIALIZER;
+static int fs_lock_waiters = 0;
+
+void lock_for_request(void)
+{
+	pthread_mutex_lock(&waiters_lock);
+	fs_lock_waiters++;
+	pthread_mutex_unlock(&waiters_lock);
+
+	pthread_mutex_lock(&fs_lock);
+
+	pthread_mutex_lock(&waiters_lock);
+	if (--fs_lock_waiters == 0)
+		pthread_cond_broadcast(&waiters_cond);
+	pthread_mutex_unlock(&waiters_lock);
+}
+
+// give up on the whole list, e2fsck will have to sort it out
+static void orphan_clear_list(void)
+{
+	fs->super->s_last_orphan = 0;
+	ext2fs_mark_super_dirty(fs);
+}
+
+// drop the head of the orphan list, leaving the inode for e2fsck
+static void orphan_drop(ext2_ino_t ino, struct ext2_inode *inode)
+{
+	fs->super->s_last_orphan = inode->i_dtime;
+	inode->i_dtime = inode->i_links_count ? 0 : time(NULL);
+	write_inode(ino, inode);
+	ext2fs_mark_super_dirty(fs);
+}
+
+// Frees whatever a truncate left mapped past i_size, as do_shorten() would
+// have. The inode is written back by orphan_drop().
+static void orphan_finish_truncate(ext2_ino_t ino, struct ext2_inode *inode)
+{
+	__u64 size = EXT2_I_SIZE(inode);
+	errcode_t rc;
+
+	if (!ext2fs_inode_has_valid_blocks(inode) || !inode->i_blocks)
+		return;
+
+	dbg("finishing truncate of orphan %u to %llu bytes", ino,
+		(unsigned long long) size);
+	rc = punch_blocks(inode, size ? ((size - 1) / fs->blocksize) + 1 : 0,
+		~0U);
+	if (rc)
+		ext2_err(rc, "while truncating orphan %u", ino);
+}
+
+// Free one batch of blocks from the head of the orphan list, and once
+// it has none left, the inode itself.
+static void orphan_process(ext2_ino_t ino)
+{
+	struct ext2_inode inode;
+	errcode_t rc;
+	blk_t nblocks, start;
+	__u32 before;
+
+	if (ino < EXT2_FIRST_INO(fs->super) || ino > fs->super->s_inodes_count)
+	{
+		ext2_err(0, "bad inode %u on orphan list, clearing it", ino);
+		orphan_clear_list();
+		return;
+	}
+
+	if (read_inode(ino, &inode))
+	{
+		orphan_clear_list();
+		return;
+	}
+
+	// still linked somewhere (the kernel puts files being truncated on
+	// the list too), so it's not ours to delete, but a truncate that was
+	// cut short still has to free the blocks past i_size
+	if (inode.i_links_count)
+	{
+		orphan_finish_truncate(ino, &inode);
+		orphan_drop(ino, &inode);
+		return;
+	}
+
+	// Free the file from the tail, a window of logical blocks at a time,
+	// moving i_size down as we go so the inode stays consistent in between.
+	// Windows that turn out to be mostly holes double the next one.
+	nblocks = (EXT2_I_SIZE(&inode) + fs->blocksize - 1) / fs->blocksize;
+	if (ino != orphan_cur_ino)
+	{
+		orphan_cur_ino = ino;
+		orphan_window = ORPHAN_BATCH_BLOCKS;
+	}
+	if (ext2fs_inode_has_valid_blocks(&inode) && inode.i_blocks)
+	{
+		start = nblocks > orphan_window ? nblocks - orphan_window : 0;
+		before = inode.i_blocks;
+		rc = punch_blocks(&inode, start, ~0U);
+		if (rc)
+		{
+			ext2_err(rc, "while deleting orphan %u", ino);
+			orphan_drop(ino, &inode);
+			return;
+		}
+		if ((before - inode.i_blocks) / (fs->blocksize / 512) <
+				ORPHAN_BATCH_BLOCKS / 2)
+			orphan_window *= 2;
+		if (start)
+		{
+			inode.i_size = (__u64) start * fs->blocksize;
+			inode.i_size_high = ((__u64) start * fs->blocksize) >> 32;
+			write_inode(ino, &inode);
+			return;
+		}
+	}
+
+	dbg("orphan %u has no blocks left, freeing it", ino);
+	fs->super->s_last_orphan = inode.i_dtime;
+	inode.i_dtime = time(NULL);
+	xattr_release(ino, &inode);
+	inode.i_blocks = 0;
+	write_inode(ino, &inode);
+	ext2fs_inode_alloc_stats2(fs, ino, -1, LINUX_S_ISDIR(inode.i_mode));
+	ext2fs_mark_ib_dirty(fs);
+	ext2fs_mark_super_dirty(fs);
+}
+
+static void *orphan_worker(void *arg EXT2FS_ATTR((unused)))
+{
+	pthread_mutex_lock(&fs_lock);
+	for (;;)
+	{
+		if (!fs->super->s_last_orphan)
+		{
+			if (orphan_stopping)
+				break;
+			pthread_cond_wait(&orphan_cond, &fs_lock);
+			continue;
+		}
+
+		orphan_process(fs->super->s_last_orphan);
+
+		// let any waiting request in before the next batch
+		pthread_mutex_unlock(&fs_lock);
+		pthread_mutex_lock(&waiters_lock);
+		while (fs_lock_waiters)
+			pthread_cond_wait(&waiters_cond, &waiters_lock);
+		pthread_mutex_unlock(&waiters_lock);
+		pthread_mutex_lock(&fs_lock);
+	}
+	pthread_mutex_unlock(&fs_lock);
+	return NULL;
+}
+
+int orphan_start(void)
+{
+	int rc;
+
+	if (orphan_running)
+		return 0;
+	if (fs->super->s_last_orphan)
+		dbg("orphan list not empty, finishing deletes from last mount");
+
+	orphan_stopping = 0;
+	rc = pthread_create(&orphan_thread, NULL, orphan_worker, NULL);
+	if (rc)
+	{
+		ext2_err(0, "couldn't start background delete thread");
+		return rc;
+	}
+	orphan_running = 1;
+	return 0;
+}
+
+void orphan_stop(void)
+{
+	if (!orphan_running)
+		return;
+
+	pthread_mutex_lock(&fs_lock);
+	orphan_stopping = 1;
+	pthread_cond_signal(&orphan_cond);
+	pthread_mutex_unlock(&fs_lock);
+
+	pthread_join(orphan_thread, NULL);
+	orphan_running = 0;
+}
+
+// The inode goes to disk straight away; the new list head in the
+// superblock is written with the next flush, like the bitmaps are.
+int orphan_add(ext2_ino_t ino, struct ext2_inode *inode)
+{
+	if (!orphan_running || !LINUX_S_ISREG(inode->i_mode))
+		return EAGAIN;
+	if (inode->i_blocks / (fs->blocksize / 512) <= ORPHAN_BATCH_BLOCKS)
+		return EAGAIN;
+
+	dbg("orphan_add(ino %u), deleting in the background", ino);
+	inode->i_links_count = 0;
+	inode->i_dtime = fs->super->s_last_orphan;
+	if (write_inode(ino, inode))
+		return EIO;
+	fs->super->s_last_orphan = ino;
+	ext2fs_mark_super_dirty(fs);
+
+	pthread_cond_signal(&orphan_cond);
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef ORPHAN_H
+#define ORPHAN_H
+
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_fs.h>
+#include <pthread.h>
+
+// Big files are deleted in the background: the unlink only puts the inode
+// on the on-disk orphan list (s_last_orphan in the superblock, chained
+// through i_dtime like ext3 does) and a worker thread frees its blocks a
+// batch at a time. Whatever is left on the list after a crash is finished
+// off at the next mount.
+
+// Everything that touches the filesystem holds fs_lock. The request loop
+// takes it with lock_for_request(), which the worker waits on between
+// batches, so that requests get the lock first.
+extern pthread_mutex_t fs_lock;
+
+// lock fs_lock to handle a request
+void lock_for_request(void);
+
+// start the worker, which first works through any orphans left over from
+// the last mount. Returns 0, or an errno if the thread can't be started.
+int orphan_start(void);
+
+// finishes all pending deletes, then stops the worker
+void orphan_stop(void);
+
+// Queue @ino for background deletion. @inode must be an up-to-date copy,
+// it is written back here. Returns 0 if the inode was queued; anything else
+// means the caller has to free the file itself (no worker running, or the
+// file is too small to be worth it).
+int orphan_add(ext2_ino_t ino, struct ext2_inode *inode);
+
+#endif
@@ -1,17 +1,86 @@
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 29
 #include <fuse_lowlevel.h>
 #include <syslog.h>
+#include <time.h>
 #include "ext2fs.h"
 #include "perms.h"
 
+// Supplementary groups are fetched from the kernel (through /proc on
+// Linux), which is too slow to do for every check. They belong to a
+// process, not to a user, so they're kept per pid (along with the uid and
+// gid it had) for a few seconds. A process that changes its groups with
+// setgroups() but keeps its uid and gid may have its checks done against
+// the old groups for up to PERMS_GROUPS_TTL seconds.
+#define PERMS_GROUPS_TTL 5
+// processes remembered, a power of two
+#define PERMS_GROUPS_CACHE 64
+// groups kept per process; one in more has them fetched every time
+#define PERMS_MAX_GROUPS 32
+
+struct perms_groups
+{
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+    time_t fetched;         // 0 if unused
+    int ngroups;            // -1 if there were too many to keep
+    gid_t groups[PERMS_MAX_GROUPS];
+};
+
+static struct perms_groups groups_cache[PERMS_GROUPS_CACHE];
+
+// Is the requester in supplementary group @gid?
+static int in_group(fuse_req_t req, gid_t gid)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct perms_groups *g = &groups_cache[ctx->pid & (PERMS_GROUPS_CACHE - 1)];
+    time_t now = time(NULL);
+    gid_t *list;
+    int i, n;
+
+    if (!g->fetched || g->pid != ctx->pid || g->uid != ctx->uid ||
+            g->gid != ctx->gid || now - g->fetched >= PERMS_GROUPS_TTL)
+    {
+        n = fuse_req_getgroups(req, PERMS_MAX_GROUPS, g->groups);
+        // not supported here (-ENOSYS): only the primary group counts
+        if (n < 0)
+            n = 0;
+        g->pid = ctx->pid;
+        g->uid = ctx->uid;
+        g->gid = ctx->gid;
+        g->fetched = now;
+        g->ngroups = n > PERMS_MAX_GROUPS ? -1 : n;
+    }
+
+    if (g->ngroups >= 0)
+    {
+        for (i = 0; i < g->ngroups; i++)
+            if (g->groups[i] == gid)
+                return 1;
+        return 0;
+    }
+
+    n = fuse_req_getgroups(req, 0, NULL);
+    list = n > 0 ? malloc(n * sizeof(gid_t)) : NULL;
+    if (!list)
+        return 0;
+    n = fuse_req_getgroups(req, n, list);
+    for (i = 0; i < n; i++)
+        if (list[i] == gid)
+            break;
+    free(list);
+    return i < n;
+}
+
 int check_perms_in_inode(perms_struct ps, struct ext2_inode *inode,
                 int perms_requested)
 {
-    const struct fuse_ctx *ctx = ps;
+    const struct fuse_ctx *ctx;
     int perms = inode->i_mode & 0777;
     // ps = NULL is a way of saying to ops "don't check permissions"
     if (!ps)
         return 0;
+    ctx = fuse_req_ctx((fuse_req_t) ps);
     // Check that the inode exists
     /*
     if (perms_requested == F_OK) {
@@ -31,8 +100,8 @@ int check_perms_in_inode(perms_struct ps, struct ext2_inode *inode,
 	syslog( LOG_DEBUG, "inode->i_uid = %d, ctx->uid = %d, perms_requested = %d, perms = %d", (int)inode->i_uid, (int)ctx->uid, perms_requested, perms );
         return EACCES;
     }
-    // TODO: er, can't the user be in multiple groups? what's going on here?
-    else if (inode->i_gid == ctx->gid)
+    // the primary group, or one of the supplementary ones
+    else if (inode->i_gid == ctx->gid || in_group((fuse_req_t) ps, inode->i_gid))
     {   
         if (((perms_requested << 3) & perms) == (perms_requested << 3))
             return 0;
@@ -49,7 +118,7 @@ int check_perms(perms_struct ps, ext2_ino_t ino, int perms_requested)
 {
 	if (!do_permissions_checks)
 		return 0;
-    static struct ext2_inode inode;
+    struct ext2_inode inode;
     // ps = NULL is a way of saying to ops "don't check permissions"
     if (!ps)
         return 0;
@@ -63,10 +132,10 @@ int check_owner(perms_struct ps, struct ext2_inode *inode)
 	if (!do_permissions_checks)
 		return 0;
     // allow root all access
-    if (((struct fuse_ctx *) ps)->uid == 0)
+    if (fuse_req_ctx((fuse_req_t) ps)->uid == 0)
         return 0;
     // check to see if we are the owner
-    if (((struct fuse_ctx *) ps)->uid == inode->i_uid)
+    if (fuse_req_ctx((fuse_req_t) ps)->uid == inode->i_uid)
 		return 0;
 	return EACCES;
 }
@@ -74,7 +143,7 @@ int check_owner(perms_struct ps, struct ext2_inode *inode)
 
 int set_perms(perms_struct ps, struct ext2_inode *inode)
 {
-    const struct fuse_ctx *ctx = ps;
+    const struct fuse_ctx *ctx = fuse_req_ctx((fuse_req_t) ps);
     if (!inode)
         return 1;
     inode->i_uid = ctx->uid;
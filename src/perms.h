@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 29
 #include <fuse_lowlevel.h>
 #include <syslog.h>
 #include "ext2fs.h"
@@ -1,9 +1,14 @@
 #include "readdir.h"
 #include "ext2fs.h"
+#include "kcache.h"
 
 // For R_OK flags:
 #include <fcntl.h>
 
+// Most inodes read ahead for one listing; more than the inode cache keeps
+// around would only push each other out.
+#define READDIR_PREFETCH_MAX 512
+
 static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
                              off_t off, size_t maxsize)
 {
@@ -13,33 +18,118 @@ static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
         return fuse_reply_buf(req, NULL, 0);
 }
 
-static void dirbuf_add(struct dirbuf *b, const char *name, ext2_ino_t ino)
+// the file type bits of st_mode for an EXT2_FT_* directory entry type,
+// or 0 if it's unknown (no filetype feature)
+static mode_t ftype_to_mode(int ftype)
+{
+    switch (ftype)
+    {
+    case EXT2_FT_REG_FILE:  return S_IFREG;
+    case EXT2_FT_DIR:       return S_IFDIR;
+    case EXT2_FT_CHRDEV:    return S_IFCHR;
+    case EXT2_FT_BLKDEV:    return S_IFBLK;
+    case EXT2_FT_FIFO:      return S_IFIFO;
+    case EXT2_FT_SOCK:      return S_IFSOCK;
+    case EXT2_FT_SYMLINK:   return S_IFLNK;
+    default:                return 0;
+    }
+}
+
+// Make room for @len more bytes in @b, doubling it so a big directory
+// takes a handful of reallocs rather than one per entry.
+static int dirbuf_grow(struct dirbuf *b, size_t len)
+{
+    size_t alloc = b->alloc ? b->alloc : 4096;
+    char *p;
+
+    while (alloc < b->size + len)
+        alloc *= 2;
+    if (alloc == b->alloc)
+        return 0;
+    p = realloc(b->p, alloc);
+    if (!p)
+        return -ENOMEM;
+    b->p = p;
+    b->alloc = alloc;
+    return 0;
+}
+
+// Add an entry at the end of the listing. Only entries in the part asked
+// for are encoded, the rest are just counted so the offsets come out the
+// same whatever the part. Returns 1 once past it, or -ENOMEM (also left in
+// b->err).
+static int dirbuf_add(struct dirbuf *b, const char *name, ext2_ino_t ino,
+        int ftype)
 {
     struct stat stbuf;
-    size_t oldsize = b->size;
-    b->size += fuse_dirent_size(strlen(name));
-    b->p = (char *) realloc(b->p, b->size);
+    size_t len = fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+    off_t pos = b->pos;
+
+    if (pos >= b->end)
+        return 1;
+    b->pos += len;
+    if (b->pos <= b->off)
+        return 0;
+
+    if (dirbuf_grow(b, len))
+    {
+        b->err = ENOMEM;
+        return -ENOMEM;
+    }
+    if (!b->size)
+        b->start = pos;
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
+    // gives the entry a d_type, so find -type needn't stat it
+    stbuf.st_mode = ftype_to_mode(ftype);
+    fuse_add_direntry(b->req, b->p + b->size, len, name, &stbuf, b->pos);
+    b->size += len;
+    return 0;
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+    ext2_ino_t x = *(const ext2_ino_t *) a, y = *(const ext2_ino_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// A listing is usually followed by a lookup of every name in it (ls -l,
+// find), each needing the inode. Read them all now, in inode number order,
+// which is the order they sit in the inode table: libext2fs keeps the last
+// table block it read, so each block is read once however many of the
+// listed inodes it holds. The inode cache then serves the lookups.
+static void prefetch_inodes(ext2_ino_t *inos, int n)
+{
+    struct ext2_inode inode;
+    int i;
+
+    qsort(inos, n, sizeof(*inos), cmp_ino);
+    for (i = 0; i < n; i++)
+        if (!i || inos[i] != inos[i - 1])
+            ext2fs_read_inode(fs, inos[i], &inode);
 }
 
 static int walk_dir(struct ext2_dir_entry *de, int offset, int blocksize,
         char *buf, void *priv_data)
 {
     struct dirbuf *b = (struct dirbuf *) priv_data;
-    char *s;
+    // names on disk aren't terminated, and fuse wants them to be
+    char name[EXT2_NAME_LEN + 1];
     int name_len = de->name_len & 0xFF;
+    int rc;
 
-    s = malloc(name_len + 1);
-    if(!s)
-        return -ENOMEM;
+    memcpy(name, de->name, name_len);
+    name[name_len] = '\0';
 
-    memcpy(s, de->name, name_len);
-    s[name_len] = '\0';
+    rc = dirbuf_add(b, name, de->inode, de->name_len >> 8);
+    if (rc < 0)
+        return DIRENT_ABORT;
 
-    dirbuf_add(b, s, de->inode);
-    free(s);
+    if (b->prefetch && b->nprefetch < READDIR_PREFETCH_MAX &&
+            strcmp(name, ".") && strcmp(name, ".."))
+        b->prefetch[b->nprefetch++] = de->inode;
+    else if (rc)
+        return DIRENT_ABORT;
     return 0;
 }
 
@@ -50,8 +140,9 @@ void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     struct dirbuf b;
 
     dbg("op_readdir(req, ino %d, size %d, off, fuse_file_info *)", (int) ino, size);
+    kcache_request(ino);
     // need read permissions on the directory
-    rc = check_perms(fuse_req_ctx(req), EXT2FS_INO(ino), R_OK);
+    rc = check_perms(req, EXT2FS_INO(ino), R_OK);
     if (rc)
     {   
         fuse_reply_err(req, rc);
@@ -59,16 +150,28 @@ void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     }
 
     memset(&b, 0, sizeof(b));
+    b.req = req;
+    b.off = off;
+    b.end = off + size;
+    // the directory is walked again for each chunk, only read ahead once
+    if (!off)
+        b.prefetch = malloc(READDIR_PREFETCH_MAX * sizeof(ext2_ino_t));
 
     rc = do_dir_iterate(EXT2FS_INO(ino), 0, walk_dir, &b);
-    if (rc) {
-        fuse_reply_err(req, EIO);
+    if (rc || b.err) {
+        fuse_reply_err(req, rc ? EIO : b.err);
         free(b.p);
+        free(b.prefetch);
         return;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
+    reply_buf_limited(req, b.p, b.size, off - b.start, size);
     free(b.p);
+
+    // after the reply, so the listing isn't held up by it
+    if (b.prefetch)
+        prefetch_inodes(b.prefetch, b.nprefetch);
+    free(b.prefetch);
 }
 
 
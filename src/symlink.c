@@ -1,5 +1,6 @@
 #include "symlink.h"
 #include "ext2fs.h"
+#include "kcache.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,25 +13,46 @@
 
 
 
-// TODO: implement fast symlinks
+// Short targets go in the inode itself (fast symlinks), longer ones in a
+// data block. Either way without a trailing '\0', as the kernel does.
 //
 void op_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,                      const char *name)
 {
 	int rc;
 	unsigned int bytes;
+	size_t len = strlen(link);
 	ext2_ino_t ino;
 	ext2_file_t efile;
 	struct ext2_inode inode;
 	struct fuse_entry_param fep;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_symlink (link \"%s\", parent #%d, name \"%s\")",
 		link, (int) parent, name);
+	kcache_request(parent);
 
-	// makes a new file, and links it in. yes, use EXT2_FT_UNKNOWN
-	// despite their being an EXT2_FT_SYMLINK, don't ask me.
-	rc = do_create(ctx, EXT2FS_INO(parent), name, LINUX_S_IFLNK | 0777,
-		    &ino, &inode, EXT2_FT_UNKNOWN);
+	if (len >= fs->blocksize)
+	{
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+
+	if (len < sizeof(inode.i_block))
+	{
+		rc = do_create_fast_symlink(req, EXT2FS_INO(parent), name, link,
+			    &ino, &inode);
+		if (rc)
+		{
+			fuse_reply_err(req, rc);
+			return;
+		}
+		kcache_entry(&fep, ino, &inode);
+		fuse_reply_entry(req, &fep);
+		return;
+	}
+
+	// makes a new file, and links it in
+	rc = do_create(req, EXT2FS_INO(parent), name, LINUX_S_IFLNK | 0777,
+		    &ino, &inode, EXT2_FT_SYMLINK);
 	if (rc)
 	{   
 	fuse_reply_err(req, rc);
@@ -43,10 +65,10 @@ void op_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
 		fuse_reply_err(req, errno);
 		return;
 	}
-	// add one to the string length, as we'd like to copy the '\0' too
-	rc = do_write(efile, ino, link, strlen(link) + 1, (off_t) 0, &bytes);
+	rc = do_write(efile, ino, link, len, (off_t) 0, &bytes);
 	if (rc)
 	{   
+		do_file_close(efile);
 		fuse_reply_err(req, rc);
 		return;
 	}
@@ -57,19 +79,21 @@ void op_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
 		return;
 	}
 
-	if (bytes != strlen(link) + 1)
+	if (bytes != len)
 	{   
-		dbg("op_symlink: wrote only %d/%d bytes to file", bytes,
-			strlen(link)+1);
+		dbg("op_symlink: wrote only %d/%d bytes to file", bytes, len);
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	dbg("op_symlink: wrote %d/%d bytes to file", bytes, len);
+	// the entry reply wants the inode as written
+	if (read_inode(ino, &inode))
+	{
 		fuse_reply_err(req, EIO);
+		return;
 	}
-	dbg("op_symlink: wrote %d/%d bytes to file", bytes, strlen(link) + 1);
 
-	fep.ino = ino;
-	fep.generation = inode.i_generation;
-	fill_statbuf(ino, &inode, &fep.attr);
-	fep.attr_timeout = 2.0;
-	fep.entry_timeout = 2.0;
+	kcache_entry(&fep, ino, &inode);
 	fuse_reply_entry(req, &fep);
 	return;
 }
@@ -84,58 +108,76 @@ void op_readlink(fuse_req_t req, fuse_ino_t ino)
 	char *buf;
 	unsigned int bytes; 
 	struct ext2_inode inode;
-	const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
 	dbg("op_readlink(req, ino %d)", (int) ino);
+	kcache_request(ino);
 	rc = read_inode(EXT2FS_INO(ino), &inode);
 	if (rc)
 	{   
 		fuse_reply_err(req, EIO);
 		return; 
 	}   
-	buf = (char *) malloc(inode.i_size+1);
-	if (!buf) 
-	{   
-		fuse_reply_err(req, ENOMEM);
-		return; 
-	}   
 
 	dbg("op_readlink: inode contents: i_mode=0%o, i_links_count=%d",
 		inode.i_mode, inode.i_links_count);
 
-	/* Try to handle fast symlinks */
-	if (inode.i_blocks==0)
-		strcpy(buf, (char*)inode.i_block);
-	else
+	// Fast symlinks are answered straight from the (cached) inode. Their
+	// blocks, if any, belong to an attribute block.
+	if (ext2fs_inode_data_blocks(fs, &inode) == 0)
 	{
-		ext2_file_t efile = do_open(ctx, EXT2FS_INO(ino), O_RDONLY);
-		if (!efile)
-		{
-			fuse_reply_err(req, errno);
-			return;
-		}   
+		char target[sizeof(inode.i_block) + 1];
 
-		rc = do_read(efile, EXT2FS_INO(ino), inode.i_size,
-			(off_t) 0, buf, &bytes);
-		if (rc)
-		{
-			fuse_reply_err(req, rc);
-			return;
-		}
-		rc = do_file_close(efile);
-		if (rc)
+		if (inode.i_size >= sizeof(inode.i_block))
 		{
-			fuse_reply_err(req, rc);
-			return;
-		}
-		if (bytes != inode.i_size)
-		{
-			dbg ("op_readlink: do_read only read %d/%d bytes", bytes,inode.i_size);
 			fuse_reply_err(req, EIO);
 			return;
 		}
+		memcpy(target, inode.i_block, inode.i_size);
+		target[inode.i_size] = '\0';
+		fuse_reply_readlink(req, target);
+		return;
 	}
+
+	buf = (char *) malloc(inode.i_size+1);
+	if (!buf) 
+	{   
+		fuse_reply_err(req, ENOMEM);
+		return; 
+	}   
+
+	ext2_file_t efile = do_open(req, EXT2FS_INO(ino), O_RDONLY);
+	if (!efile)
+	{
+		fuse_reply_err(req, errno);
+		free(buf);
+		return;
+	}   
+
+	rc = do_read(efile, EXT2FS_INO(ino), inode.i_size,
+		(off_t) 0, buf, &bytes);
+	if (rc)
+	{
+		do_file_close(efile);
+		fuse_reply_err(req, rc);
+		free(buf);
+		return;
+	}
+	rc = do_file_close(efile);
+	if (rc)
+	{
+		fuse_reply_err(req, rc);
+		free(buf);
+		return;
+	}
+	if (bytes != inode.i_size)
+	{
+		dbg ("op_readlink: do_read only read %d/%d bytes", bytes,inode.i_size);
+		fuse_reply_err(req, EIO);
+		free(buf);
+		return;
+	}
+	// links made by older versions include the '\0' in their size
+	buf[bytes] = '\0';
 	fuse_reply_readlink(req, buf);
 	free (buf);
 }
-
@@ -1,7 +1,7 @@
 #ifndef SYMLINK_H
 #define SYMLINK_H
 
-#define FUSE_USE_VERSION 25
+#define FUSE_USE_VERSION 29
 
 #include <fuse_lowlevel.h>
 
@@ -47,169 +47,200 @@ int set_file_size(ext2_ino_t ino,
     return ext2fs_write_inode(fs, ino, inode);
 }
 
-// for info.delete_indirect_flags
-#define DEL_SINGLE_INDIRECT 1
-#define DEL_ALL_BUT_TRIPLE  2
-#define DEL_ALL_INDIRECT    4
+// how many indirect blocks ahead of the walk are read in the background
+#define PUNCH_READAHEAD 16
 
-struct truncate_blocks_info
+// State for punch_blocks(). Freed blocks are collected into runs of
+// consecutive block numbers, so the bitmap and group counts get updated
+// once per run rather than once per block.
+struct punch_ctx
 {
-    int last_block_to_keep;
-    int num_in_indirect_block;
-    int delete_indirect_flags;
-    int total_num_blocks;
-    // So we can trigger the zeroing of the indirect ptrs in the inode.
-    // the direct block ptrs are 0'ed from a more efficient memset.
-    // Denotes which of the fields (indirect, d_ind, t_ind) to clear.
-    // if =1, clears all 3, =2, clears d_ind and t_ind, =3, clear t_ind.
-    int clear_indirect_ptrs_from_inode;
+    __u64 start;            // first logical block to free
+    __u64 end;              // last logical block to free
+    int addr_per_block;
+    char *buf;              // one block per indirection level
+    blk_t freed;            // blocks freed so far, indirect ones included
+    blk_t run_start;
+    blk_t run_len;
+    errcode_t err;
 };
 
-static int truncate_blocks_proc(ext2_filsys fs, blk_t *blocknr,
-                int blockcnt, void *private)
+static void punch_flush_run(struct punch_ctx *ctx)
 {
-    struct truncate_blocks_info *infp =
-            (struct truncate_blocks_info *) private;
-    blk_t block = *blocknr;
+    if (!ctx->run_len)
+        return;
+    ext2fs_block_alloc_stats_range(fs, ctx->run_start, ctx->run_len, -1);
+    ctx->run_len = 0;
+}
 
-    dbg("shorten: truncate_blocks_proc(block %d)", block);
-    dbg("shorten: truncate_blocks_proc: current_block = %d", blockcnt);
-    dbg("shorten: truncate_blocks_proc: delete_indirect_flags = %d",
-        infp->delete_indirect_flags);
+static void punch_release(struct punch_ctx *ctx, blk_t block)
+{
+    if (wipe_block(block))
+        ctx->err = EIO;
 
-    // if called on a indirect block...
-    if (blockcnt < 0)
+    if (ctx->run_len && ctx->run_start + ctx->run_len == block)
+        ctx->run_len++;
+    else
     {
-        switch (blockcnt) {
-            case BLOCK_COUNT_IND:
-                dbg("encountered indirect block!");
-                if (infp->delete_indirect_flags)
-                {
-                    dbg("wiping");
-                    ext2fs_block_alloc_stats(fs, block, -1);
-                    *blocknr = 0;
-					if ((wipe_block_procedure)(block))
-						exit(1);
-                    return BLOCK_CHANGED;
-                }
-                break;
-            case BLOCK_COUNT_DIND:
-                dbg("encountered double-indirect block");
-                if (infp->delete_indirect_flags &
-                        (DEL_ALL_BUT_TRIPLE | DEL_ALL_INDIRECT))
-                {
-                    dbg("wiping");
-                    ext2fs_block_alloc_stats(fs, block, -1);
-                    *blocknr = 0;
-					if ((wipe_block_procedure)(block))
-						exit(1);
-                    return BLOCK_CHANGED;
-                }
-                break;
-            case BLOCK_COUNT_TIND:
-                dbg("encountered triple-indirect block");
-                if (infp->delete_indirect_flags & DEL_ALL_INDIRECT)
-                {
-                    dbg("wiping");
-                    ext2fs_block_alloc_stats(fs, block, -1);
-                    *blocknr = 0;
-					if ((wipe_block_procedure)(block))
-						exit(1);
-                    return BLOCK_CHANGED;
-                }
-                break;
-            default:
-                break;
-        }
-        infp->total_num_blocks++;
-        return 0;
+        punch_flush_run(ctx);
+        ctx->run_start = block;
+        ctx->run_len = 1;
     }
-    // we have now dealt with all indirect blocks, blockcnt is guarranteed
-    // to be > 0
+    ctx->freed++;
+}
+
+// @ref points at a block of the given @level (0 for a data block, 1 for an
+// indirect block, ...) whose subtree maps the logical blocks from @base on.
+// Frees whatever of it lies inside [ctx->start, ctx->end], and the block
+// itself once nothing below it is left, zeroing *ref in that case.
+static void punch_tree(struct punch_ctx *ctx, blk_t *ref, int level,
+                __u64 base)
+{
+    __u64 span = 1, child_span;
+    blk_t *entries;
+    int i, first, last, changed = 0;
+    char *buf;
 
-    // if we don't want this block, remove it, and any indirect blocks that
-    // are no longer needed.
-    if (blockcnt > infp->last_block_to_keep)
+    if (!*ref || ctx->err)
+        return;
+
+    if (level == 0)
     {
-        dbg("wiping!");
-        ext2fs_block_alloc_stats(fs, block, -1);
-        *blocknr = 0;
-		if ((wipe_block_procedure)(block))
-			exit(1);
-
-        // Work out whether this is the 0th block of an indirect block, in
-        // which case we can remove some(!) indirect blocks.
-        //
-        // This was a pain to work out, use a diagram!
-        // and remember that the iteration is in order, from top
-        // to bottom, so there are a few effeciencies built in :/
-        if (blockcnt < 12)
-            return BLOCK_CHANGED;
-        else if (blockcnt == 12)
-        {
-            infp->clear_indirect_ptrs_from_inode = 1;
-            infp->delete_indirect_flags |= DEL_ALL_INDIRECT;
-            return BLOCK_CHANGED;
-        }
-        else if (blockcnt == infp->num_in_indirect_block + EXT2_NDIR_BLOCKS)
+        if (base >= ctx->start && base <= ctx->end)
         {
-            infp->clear_indirect_ptrs_from_inode = 2;
-            infp->delete_indirect_flags |= DEL_ALL_INDIRECT;
-            return BLOCK_CHANGED;
+            punch_release(ctx, *ref);
+            *ref = 0;
         }
-        else if (blockcnt > infp->num_in_indirect_block + EXT2_NDIR_BLOCKS)
-        {
-            int i = blockcnt - EXT2_NDIR_BLOCKS;
-            // if i is a multiple of 1024...
-            // note no return here, as a more important flag may yet be set.
-            if ((i % (infp->num_in_indirect_block)) == 0)
-                infp->delete_indirect_flags |= DEL_SINGLE_INDIRECT;
-
-            i -= infp->num_in_indirect_block +
-                (infp->num_in_indirect_block * infp->num_in_indirect_block);
-            if (i == 0)
-            {
-                infp->clear_indirect_ptrs_from_inode = 3;
-                infp->delete_indirect_flags |= DEL_ALL_INDIRECT;
-                return BLOCK_CHANGED;
-            }
-            else if (i > 0)
-            {
-                // if i is a multiple of (1024^2)
-                if ((i % (infp->num_in_indirect_block *
-                        infp->num_in_indirect_block)) == 0)
-                    infp->delete_indirect_flags |= DEL_ALL_BUT_TRIPLE;
-                return BLOCK_CHANGED;
-            }
-        }
-        return BLOCK_CHANGED;
+        return;
+    }
+
+    for (i = 0; i < level; i++)
+        span *= ctx->addr_per_block;
+    if (base + span <= ctx->start || base > ctx->end)
+        return;
+    child_span = span / ctx->addr_per_block;
+
+    buf = ctx->buf + (level - 1) * fs->blocksize;
+    ctx->err = ext2fs_read_ind_block(fs, *ref, buf);
+    if (ctx->err)
+        return;
+    entries = (blk_t *) buf;
+
+    // only visit the children that overlap the range
+    first = ctx->start > base ? (ctx->start - base) / child_span : 0;
+    last = ctx->end - base >= span ? ctx->addr_per_block - 1
+            : (ctx->end - base) / child_span;
+    for (i = first; i <= last; i++)
+    {
+        // children that are indirect blocks themselves get read one
+        // window ahead, where the I/O manager can do that in the
+        // background, so that the walk doesn't wait on each of them
+        if (level >= 2 && (i - first) % PUNCH_READAHEAD == 0)
+            ext2fs_readahead_ind_blocks(fs, entries + i,
+                    (last - i < 2 * PUNCH_READAHEAD) ? last - i + 1
+                        : 2 * PUNCH_READAHEAD);
+        if (!entries[i])
+            continue;
+        punch_tree(ctx, &entries[i], level - 1, base + i * child_span);
+        if (!entries[i])
+            changed = 1;
+    }
+
+    for (i = 0; i < ctx->addr_per_block; i++)
+        if (entries[i])
+            break;
+    if (i == ctx->addr_per_block)
+    {
+        punch_release(ctx, *ref);
+        *ref = 0;
+    }
+    else if (changed && !ctx->err)
+        ctx->err = ext2fs_write_ind_block(fs, *ref, buf);
+}
+
+// extent mapped files: the library walks the tree and hands back runs of
+// blocks, keeping i_blocks up to date itself
+static void punch_extent_release(ext2_filsys fs, blk_t blk, blk_t count,
+                void *priv)
+{
+    struct punch_ctx *ctx = priv;
+
+    while (count--)
+        punch_release(ctx, blk++);
+}
+
+errcode_t punch_blocks(struct ext2_inode *inode, blk_t start, blk_t end)
+{
+    struct punch_ctx ctx;
+    __u64 base;
+    int i, level;
+    errcode_t rc;
+
+    dbg("punch_blocks(start %u, end %u)", start, end);
+    if (start > end || !ext2fs_inode_has_valid_blocks(inode))
+        return 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    if (inode->i_flags & EXT4_EXTENTS_FL)
+    {
+        rc = ext2fs_extent_punch(fs, inode, start, end,
+                punch_extent_release, &ctx);
+        punch_flush_run(&ctx);
+        if (wipe_block_flush() && !rc)
+            rc = EIO;
+        if (ctx.freed)
+            ext2fs_mark_bb_dirty(fs);
+        return rc ? rc : ctx.err;
     }
-    dbg("keeping!");
-    infp->total_num_blocks++;
-    return 0;
+
+    ctx.start = start;
+    ctx.end = end;
+    ctx.addr_per_block = fs->blocksize / sizeof(blk_t);
+    rc = ext2fs_get_mem(fs->blocksize * 3, &ctx.buf);
+    if (rc)
+        return rc;
+
+    for (i = 0; i < EXT2_NDIR_BLOCKS; i++)
+        punch_tree(&ctx, &inode->i_block[i], 0, i);
+
+    base = EXT2_NDIR_BLOCKS;
+    for (level = 1; level <= 3; level++)
+    {
+        punch_tree(&ctx, &inode->i_block[EXT2_NDIR_BLOCKS + level - 1],
+                level, base);
+        base += (__u64) ctx.addr_per_block *
+            (level == 1 ? 1 : level == 2 ? ctx.addr_per_block
+                : ctx.addr_per_block * ctx.addr_per_block);
+    }
+
+    punch_flush_run(&ctx);
+    ext2fs_free_mem(&ctx.buf);
+
+    // the freed blocks must be wiped before anything can reallocate them
+    if (wipe_block_flush() && !ctx.err)
+        ctx.err = EIO;
+
+    // i_blocks counts 512 byte sectors, indirect blocks included
+    inode->i_blocks -= ctx.freed * (fs->blocksize / 512);
+    if (ctx.freed)
+        ext2fs_mark_bb_dirty(fs);
+    return ctx.err;
 }
 
 
 // do_shorten only shortens files
 // does not alter seek.
 //
-// consistency:
-//      save new i_size, as that's what read() counts on
-//      iterate through blocks, changing i_block[]
-//      re-read inode to get new block struct (guh)
-//      save # blocks info to read inode
-//      write inode
-//
-//  This is quite inefficient, 3 inode writes,
-//  given we already have an open file. To improve that, I'd have to write
-//  my own block iterator
+// The open file's buffer may be dirty, or may cache the mapping of a block
+// we're about to free, so it is flushed and invalidated first. Then the
+// blocks past the new end go in one pass over the block tree, and the
+// inode is written once at the end.
 //
 static int do_shorten(struct ext2_file *fh,
                 ext2_ino_t ino, off_t length)
 {
-    int rc;
-    struct truncate_blocks_info info;
-    struct ext2_inode inode;
+    errcode_t rc;
+    blk_t first_to_free;
 
     dbg("do_shorten(fs, fh, ino %d, length %ld)", (int) ino, (long) length);
     // check the length arg will actually shorten the file
@@ -218,47 +249,27 @@ static int do_shorten(struct ext2_file *fh,
     else if (length > fh->inode.i_size)
         return EFAULT;
 
-    // Remember, start counting from 0!
-    // division always rounds down
-	info.last_block_to_keep = length ? ((length - 1)/fs->blocksize) : -1;
-    info.num_in_indirect_block = (fs->blocksize)/sizeof(__u32);
-    info.delete_indirect_flags = 0;
-    info.clear_indirect_ptrs_from_inode = 0;
-    info.total_num_blocks = 0;
-    dbg("blocksize = %d", fs->blocksize);
-    dbg("last_block_to_keep = %d", info.last_block_to_keep);
-    dbg("num_in_indirect_block = %d", info.num_in_indirect_block);
-
-
-    // set file size
-    rc = set_file_size(ino, &fh->inode, length);
+    rc = ext2fs_file_flush(fh);
     if (rc)
-        return rc;
-
-    //  call the block iterator to go through blocks in order.
-    //  this also removes indirect blocks, if necessary.
-    //  THIS CHANGES THE INODE!
-    ext2fs_block_iterate(fs, ino, BLOCK_FLAG_DEPTH_TRAVERSE,
-        NULL, truncate_blocks_proc, &info);
+    {
+        ext2_err(rc, "while flushing %d", ino);
+        return EIO;
+    }
+    ext2fs_file_invalidate(fh);
 
-    // re-read inode values
-    rc = ext2fs_read_inode(fs, ino, &inode);
+    // division always rounds down
+    first_to_free = length ? ((length - 1) / fs->blocksize) + 1 : 0;
+    rc = punch_blocks(&fh->inode, first_to_free, ~0U);
     if (rc)
-        return rc;
+    {
+        ext2_err(rc, "while freeing blocks of %d", ino);
+        return EIO;
+    }
 
-    // Set the number of (block/sectors) the file is using...
-    // Note that i_blocks counts from 1, not 0
-    // i_blocks isn't actually the number of blocks, that'd be too easy.
-    // Instead, it counts the number of 512 byte sectors, like the kernel.
-    // It also includes any indirect blocks.
-    // TODO: apparently sector size is not always 512, e.g. on CDROMs...
-    inode.i_blocks = (info.total_num_blocks * fs->blocksize) / 512;
-    dbg("number of (4096 sized) blocks used = %d", info.last_block_to_keep + 1);
-    dbg("total num (4096) blocks, incl. indirect  = %d", info.total_num_blocks);
-    dbg("i_blocks  = %d", inode.i_blocks);
-
-    ext2fs_mark_bb_dirty(fs);
-    return ext2fs_write_inode(fs, ino, &inode);
+    fh->inode.i_mtime = time(NULL);
+    fh->inode.i_size = length;
+    fh->inode.i_size_high = 0;
+    return ext2fs_write_inode(fs, ino, &fh->inode);
 }
 
 // do_lengthen emulates sparse gaps in files
@@ -10,6 +10,12 @@ int set_file_size(ext2_ino_t ino,
 		struct ext2_inode *inode, off_t desired_size);
 
 
+// Frees the blocks mapping logical blocks [start, end] of the file, and the
+// indirect (or extent tree) blocks that are left empty; pass end = ~0U to
+// free everything from @start on. Only the in-memory @inode (i_block[],
+// i_blocks) is changed, writing it back is up to the caller.
+errcode_t punch_blocks(struct ext2_inode *inode, blk_t start, blk_t end);
+
 // The main truncate routines -
 // they support the creation of sparse gaps if you specify lengths
 // larger than the size of the file
@@ -0,0 +1,219 @@
+/*
+ *  Copyright (C) 2007-8, see the file AUTHORS for copyright owners.
+ *
+ *  This program can be distributed under the terms of the GNU GPL v2,
+ *  or any later version. See the file COPYING.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ext2fs/tdb.h>
+
+#include "ext2fs.h"
+
+#include "icache.h"
+#include "wcache.h"
+
+#define ext2_err(rc, ...) \
+	com_err("ext2fuse_dbg_msg", rc, __VA_ARGS__)
+
+#define WCACHE_MAGIC 0x45325743		// "E2WC", and the format version
+// inodes kept, about as many as the inode table keeps unpinned
+#define WCACHE_MAX_INODES 1024
+
+// The record stored under the UUID: a header, then the inodes. It's in
+// host byte order, as the file only makes sense on this machine anyway.
+struct wcache_header
+{
+	__u32 magic;
+	__u32 mnt_count;		// the superblock as it was left
+	__u32 mtime;
+	__u32 wtime;
+	__u32 count;			// inodes following
+};
+
+struct wcache_inode
+{
+	__u32 ino;
+	// the blocks the runs were found for
+	__u32 i_blocks;
+	__u32 i_block[EXT2_N_BLOCKS];
+	struct ext2_bmap_run runs[EXT2_FILE_RUNS];
+};
+
+static char *cache_file = NULL;
+// taken by wcache_snapshot(), most recently used first
+static struct wcache_inode *snap = NULL;
+static int nsnap = 0;
+
+int wcache_option(const char *opt)
+{
+	if (strncmp(opt, "warm_cache=", 11))
+		return 0;
+	if (!opt[11])
+		return -1;
+	free(cache_file);
+	cache_file = strdup(opt + 11);
+	return cache_file ? 1 : -1;
+}
+
+static TDB_DATA uuid_key(void)
+{
+	TDB_DATA key;
+
+	key.dptr = fs->super->s_uuid;
+	key.dsize = sizeof(fs->super->s_uuid);
+	return key;
+}
+
+static int ino_cmp(const void *a, const void *b)
+{
+	const struct wcache_inode *wa = *(const struct wcache_inode **) a;
+	const struct wcache_inode *wb = *(const struct wcache_inode **) b;
+
+	return wa->ino < wb->ino ? -1 : wa->ino > wb->ino;
+}
+
+void wcache_load(void)
+{
+	TDB_CONTEXT *tdb;
+	TDB_DATA data;
+	struct wcache_header *hdr;
+	struct wcache_inode *wi, **order = NULL;
+	struct ext2_inode inode;
+	__u32 i;
+
+	if (!cache_file || !fs)
+		return;
+
+	tdb = tdb_open(cache_file, 0, TDB_DEFAULT, O_RDWR | O_CREAT, 0600);
+	if (!tdb)
+	{
+		ext2_err(0, "couldn't open warm cache %s", cache_file);
+		return;
+	}
+	// once loaded, it's stale as soon as we write anything
+	data = tdb_fetch(tdb, uuid_key());
+	tdb_delete(tdb, uuid_key());
+	tdb_close(tdb);
+	if (!data.dptr)
+		return;
+
+	hdr = (struct wcache_header *) data.dptr;
+	if (data.dsize < sizeof(*hdr) || hdr->magic != WCACHE_MAGIC ||
+			hdr->count > WCACHE_MAX_INODES ||
+			data.dsize != sizeof(*hdr) +
+				hdr->count * sizeof(struct wcache_inode))
+	{
+		dbg("warm cache %s is corrupt", cache_file);
+		goto out;
+	}
+	if (hdr->mnt_count != fs->super->s_mnt_count ||
+			hdr->mtime != fs->super->s_mtime ||
+			hdr->wtime != fs->super->s_wtime)
+	{
+		dbg("filesystem written since the warm cache was saved");
+		goto out;
+	}
+
+	// Read the inodes in inode number order, so their tables are read
+	// about sequentially, then again (from the inode table) coldest first,
+	// so they end up in the same LRU order they were saved in.
+	wi = (struct wcache_inode *) (hdr + 1);
+	order = malloc(hdr->count * sizeof(*order));
+	if (order)
+	{
+		for (i = 0; i < hdr->count; i++)
+			order[i] = &wi[i];
+		qsort(order, hdr->count, sizeof(*order), ino_cmp);
+		for (i = 0; i < hdr->count; i++)
+			ext2fs_read_inode(fs, order[i]->ino, &inode);
+		free(order);
+	}
+	for (i = hdr->count; i-- > 0; )
+	{
+		if (ext2fs_read_inode(fs, wi[i].ino, &inode))
+			continue;
+		if (inode.i_blocks == wi[i].i_blocks &&
+				!memcmp(inode.i_block, wi[i].i_block,
+					sizeof(inode.i_block)))
+			icache_set_runs(wi[i].ino, wi[i].runs);
+	}
+	dbg("warm cache: %u inodes loaded", hdr->count);
+out:
+	free(data.dptr);
+}
+
+static void add_inode(ext2_ino_t ino, struct ext2_inode *inode,
+		struct ext2_bmap_run *runs, void *priv EXT2FS_ATTR((unused)))
+{
+	struct wcache_inode *wi;
+
+	if (nsnap == WCACHE_MAX_INODES || !inode->i_links_count)
+		return;
+	wi = &snap[nsnap++];
+	wi->ino = ino;
+	wi->i_blocks = inode->i_blocks;
+	memcpy(wi->i_block, inode->i_block, sizeof(wi->i_block));
+	memcpy(wi->runs, runs, sizeof(wi->runs));
+}
+
+void wcache_snapshot(void)
+{
+	if (!cache_file || !fs)
+		return;
+
+	free(snap);
+	nsnap = 0;
+	snap = malloc(WCACHE_MAX_INODES * sizeof(*snap));
+	if (snap)
+		icache_iterate(add_inode, NULL);
+}
+
+void wcache_save(void)
+{
+	TDB_CONTEXT *tdb;
+	TDB_DATA data;
+	struct wcache_header *hdr;
+	errcode_t rc;
+
+	if (!snap)
+		return;
+	// never mounted, or already closed: there's nothing to flush
+	if (!fs)
+		goto out;
+
+	// written now, the superblock says when the filesystem was left
+	rc = ext2fs_flush(fs);
+	if (rc)
+	{
+		ext2_err(rc, "while flushing for the warm cache");
+		goto out;
+	}
+
+	data.dsize = sizeof(*hdr) + nsnap * sizeof(*snap);
+	data.dptr = malloc(data.dsize);
+	if (!data.dptr)
+		goto out;
+	hdr = (struct wcache_header *) data.dptr;
+	hdr->magic = WCACHE_MAGIC;
+	hdr->mnt_count = fs->super->s_mnt_count;
+	hdr->mtime = fs->super->s_mtime;
+	hdr->wtime = fs->super->s_wtime;
+	hdr->count = nsnap;
+	memcpy(hdr + 1, snap, nsnap * sizeof(*snap));
+
+	tdb = tdb_open(cache_file, 0, TDB_DEFAULT, O_RDWR | O_CREAT, 0600);
+	if (!tdb || tdb_store(tdb, uuid_key(), data, TDB_REPLACE))
+		ext2_err(0, "couldn't save warm cache %s", cache_file);
+	else
+		dbg("warm cache: %d inodes saved", nsnap);
+	if (tdb)
+		tdb_close(tdb);
+	free(data.dptr);
+out:
+	free(snap);
+	snap = NULL;
+	nsnap = 0;
+}
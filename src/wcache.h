@@ -0,0 +1,35 @@
+#ifndef WCACHE_H
+#define WCACHE_H
+
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_fs.h>
+
+// The warm cache: with -o warm_cache=FILE, what the inode table (see
+// icache.h) holds at unmount is kept in FILE, a tdb database, under the
+// filesystem's UUID. That is the inode numbers, most recently used first,
+// and the block map runs known for each. The next mount reads those
+// inodes back in and hands their runs to the inode table, so a restarted
+// daemon doesn't begin cold.
+//
+// The snapshot is only used if nothing has written to the filesystem
+// since: its mount count (the mount generation), last mount time and last
+// write time must still be as they were left. It is deleted as it is
+// loaded, so a crash leaves nothing behind to trust, and the runs of each
+// inode are dropped if its blocks don't match what was saved.
+
+// Handle a -o option. Returns 1 if it was one of ours, 0 if it wasn't, or
+// -1 if it was but its value is bad.
+int wcache_option(const char *opt);
+
+// reload the snapshot, if any, into the (already set up) inode table
+void wcache_load(void);
+
+// take the snapshot from the inode table, before it's emptied
+void wcache_snapshot(void);
+
+// flush the filesystem and store the snapshot, before it's closed. This
+// is done once the request loop has finished, not from op_destroy(), and
+// does nothing (other than drop the snapshot) if there's no filesystem.
+void wcache_save(void);
+
+#endif
@@ -1,51 +1,251 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* for fallocate() */
+#endif
 #include "ext2fs.h"
 #include <ext2fs/ext2_io.h>
 #include <unistd.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/falloc.h>
+#endif
 
 #include "wipe_block.h"
 
-// TODO: implement a large random pool buffer here to speed up block wipes
-static const char *get_random_block(unsigned int blocksize)
+// Freed blocks are not wiped one at a time any more. wipe_block() just
+// records the block, merging runs of neighbouring blocks into extents, and
+// wipe_block_flush() later wipes every extent with a few large sequential
+// writes (or one discard request per extent).
+//
+// The flush *must* happen before any of the queued blocks can be handed out
+// again by the allocator, otherwise we'd wipe somebody else's new data. The
+// delete and truncate paths flush as soon as they have finished freeing.
+//
+// The wipe itself is synchronous: the caller waits until every extent is
+// written or discarded. Even with io=uring, io_channel_write_blk() only
+// returns once its request has completed, as no io manager has a way to
+// queue a write and collect the result later. The cost is at least paid
+// once per extent rather than once per block.
+
+int wipe_policy = WIPE_NONE;
+
+// size of the buffer used for zero/random overwrites
+#define WIPE_CHUNK_SIZE (1024 * 1024)
+
+struct wipe_extent {
+	blk_t start;
+	blk_t count;
+};
+
+static struct wipe_extent *wipe_list = NULL;
+static int wipe_list_count = 0;
+static int wipe_list_size = 0;
+
+static char *wipe_buffer = NULL;
+
+int set_wipe_policy(const char *name)
 {
-	static char *buffer = NULL;
-	static unsigned int buffer_size = 0;
-	if (!buffer)
+	if (!strcmp(name, "none"))
+		wipe_policy = WIPE_NONE;
+	else if (!strcmp(name, "zero"))
+		wipe_policy = WIPE_ZERO;
+	else if (!strcmp(name, "random"))
+		wipe_policy = WIPE_RANDOM;
+	else if (!strcmp(name, "discard"))
+		wipe_policy = WIPE_DISCARD;
+	else
+		return EINVAL;
+	return 0;
+}
+
+// Random pool for the "random" policy.
+//
+// Reading /dev/urandom for every chunk costs a syscall per few KB and is
+// far slower than the disk, so instead we seed a ChaCha20 keystream once
+// from the kernel and expand it in userspace. After every fill the key is
+// replaced by fresh keystream output ("fast key erasure"), so the state
+// left in memory can't be used to reconstruct data already written.
+//
+// The block function works on CHACHA_LANES blocks side by side, with the
+// lane index as the innermost loop, so that the compiler can turn every
+// quarter round into a handful of vector instructions.
+
+#define CHACHA_LANES 4
+#define CHACHA_BLOCK_SIZE 64
+
+static __u32 chacha_key[8];
+static __u64 chacha_counter;
+static int chacha_seeded = 0;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+	for (l = 0; l < CHACHA_LANES; l++) { \
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL32(x[d][l], 16); \
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL32(x[b][l], 12); \
+		x[a][l] += x[b][l]; x[d][l] ^= x[a][l]; x[d][l] = ROTL32(x[d][l], 8); \
+		x[c][l] += x[d][l]; x[b][l] ^= x[c][l]; x[b][l] = ROTL32(x[b][l], 7); \
+	}
+
+// generates CHACHA_LANES consecutive keystream blocks into @out
+static void chacha_blocks(unsigned char *out)
+{
+	__u32 in[16][CHACHA_LANES], x[16][CHACHA_LANES];
+	int i, l, round;
+
+	for (l = 0; l < CHACHA_LANES; l++)
 	{
-		if (buffer_size)
-		{
-			dbg("strange error, buffer_size != 0");
-			exit(1);
-		}
-		// This should only happen once, on the first call.
-		// note this data is persistant, but it's only one block
-		buffer = (char *) malloc((size_t) blocksize);
-		if (!buffer)
-			return (buffer = NULL);
-		buffer_size = blocksize;
+		// "expand 32-byte k"
+		in[0][l] = 0x61707865;
+		in[1][l] = 0x3320646e;
+		in[2][l] = 0x79622d32;
+		in[3][l] = 0x6b206574;
+		for (i = 0; i < 8; i++)
+			in[4 + i][l] = chacha_key[i];
+		in[12][l] = (__u32) (chacha_counter + l);
+		in[13][l] = (__u32) ((chacha_counter + l) >> 32);
+		in[14][l] = 0;
+		in[15][l] = 0;
 	}
-	else if (buffer_size != blocksize)
+	chacha_counter += CHACHA_LANES;
+	memcpy(x, in, sizeof(x));
+
+	for (round = 0; round < 10; round++)
 	{
-		dbg("fatal error, blocksize has changed! dying...");
-		exit(1);
+		QUARTERROUND(0, 4, 8, 12);
+		QUARTERROUND(1, 5, 9, 13);
+		QUARTERROUND(2, 6, 10, 14);
+		QUARTERROUND(3, 7, 11, 15);
+		QUARTERROUND(0, 5, 10, 15);
+		QUARTERROUND(1, 6, 11, 12);
+		QUARTERROUND(2, 7, 8, 13);
+		QUARTERROUND(3, 4, 9, 14);
+	}
+
+	for (l = 0; l < CHACHA_LANES; l++)
+	{
+		__u32 v[16];
+		for (i = 0; i < 16; i++)
+			v[i] = ext2fs_cpu_to_le32(x[i][l] + in[i][l]);
+		memcpy(out + l * CHACHA_BLOCK_SIZE, v, CHACHA_BLOCK_SIZE);
 	}
+}
+
+// memset() of a buffer that isn't read again may be optimised away, this
+// can't be
+static void secure_zero(void *p, size_t size)
+{
+	volatile unsigned char *v = p;
 
+	while (size--)
+		*v++ = 0;
+}
+
+static int chacha_seed(void)
+{
+	unsigned char *p = (unsigned char *) chacha_key;
+	size_t size = sizeof(chacha_key);
+	ssize_t got;
 	int fd = open("/dev/urandom", O_RDONLY);
 	if (fd == -1)
-		return NULL;
-	
-	if (read(fd, buffer, (size_t) blocksize) != (ssize_t) blocksize)
+		return errno;
+
+	while (size > 0)
 	{
-		close(fd);
-		dbg("read from dev/urandom failed!");
-		return NULL;
+		got = read(fd, p, size);
+		if (got <= 0)
+		{
+			dbg("read from dev/urandom failed!");
+			close(fd);
+			return EIO;
+		}
+		p += got;
+		size -= got;
 	}
-
 	close(fd);
-	return buffer;
+	chacha_counter = 0;
+	chacha_seeded = 1;
+	return 0;
+}
+
+// fills the first @size bytes of @buf with random data
+static int get_random_data(char *buf, size_t size)
+{
+	unsigned char tmp[CHACHA_LANES * CHACHA_BLOCK_SIZE];
+	size_t chunk = sizeof(tmp);
+	int rc;
+
+	if (!chacha_seeded)
+	{
+		rc = chacha_seed();
+		if (rc)
+			return rc;
+	}
+
+	while (size >= chunk)
+	{
+		chacha_blocks((unsigned char *) buf);
+		buf += chunk;
+		size -= chunk;
+	}
+
+	if (size > 0)
+	{
+		chacha_blocks(tmp);
+		memcpy(buf, tmp, size);
+	}
+
+	// the new key comes from keystream blocks of its own, which nothing
+	// else ever sees
+	chacha_blocks(tmp);
+	secure_zero(chacha_key, sizeof(chacha_key));
+	memcpy(chacha_key, tmp, sizeof(chacha_key));
+	chacha_counter = 0;
+	secure_zero(tmp, sizeof(tmp));
+	return 0;
+}
+
+// Overwrite an extent through the io channel. Writes of more than a few
+// blocks bypass (and invalidate) the unix_io cache, smaller ones land in it,
+// so either way the cache never hands back the old contents.
+static int overwrite_extent(blk_t start, blk_t count)
+{
+	errcode_t rc;
+	blk_t chunk_blocks = WIPE_CHUNK_SIZE / fs->blocksize;
+	blk_t n;
+
+	if (!wipe_buffer)
+	{
+		wipe_buffer = malloc(WIPE_CHUNK_SIZE);
+		if (!wipe_buffer)
+			return ENOMEM;
+		memset(wipe_buffer, 0, WIPE_CHUNK_SIZE);
+	}
+
+	while (count > 0)
+	{
+		n = min(count, chunk_blocks);
+		if (wipe_policy == WIPE_RANDOM)
+		{
+			rc = get_random_data(wipe_buffer, n * fs->blocksize);
+			if (rc)
+				return rc;
+		}
+		rc = io_channel_write_blk(fs->io, start, n, wipe_buffer);
+		if (rc)
+		{
+			dbg("wipe write of %u blocks at %u failed", n, start);
+			return EIO;
+		}
+		start += n;
+		count -= n;
+	}
+	return 0;
 }
 
 
@@ -59,103 +259,286 @@ struct unix_cache {
     unsigned    in_use:1;
 };
 
-#define CACHE_SIZE 8
 struct unix_private_data {
     int magic;
     int dev;
     int flags;
     int access_time;
     ext2_loff_t offset;
-    struct unix_cache cache[CACHE_SIZE];
+    int cache_size;
+    int align;
+    char *cache_mem;
+    struct unix_cache *cache;
 };
 
+// Ask the device (or the filesystem holding the image file) to drop the
+// extent. Returns non-zero if that isn't possible, so the caller can fall
+// back to overwriting.
+static int discard_extent(blk_t start, blk_t count)
+{
+	struct unix_private_data *data;
+	struct stat st;
+	ext2_loff_t location, length;
 
+	// uring_io and mmap_io keep the same fields at the start of their
+	// private data
+	if (fs->io->manager != unix_io_manager &&
+			fs->io->manager != uring_io_manager &&
+			fs->io->manager != mmap_io_manager)
+		return EOPNOTSUPP;
+	data = (struct unix_private_data *) fs->io->private_data;
 
-static int test_wipe_block(blk_t block)
-{
-	int written;
-	io_channel channel = fs->io;
-	struct unix_private_data *data = (struct unix_private_data *)
-			channel->private_data;	
-	
-	ext2_loff_t location = ((ext2_loff_t) block * fs->blocksize)
-							+ data->offset;
+	location = ((ext2_loff_t) start * fs->blocksize) + data->offset;
+	length = (ext2_loff_t) count * fs->blocksize;
 
-	char *buffer = malloc((size_t) fs->blocksize);
-	if (!buffer)
-	{
-		dbg("no memory left!");
-		return 1;
-	}
-	memset(buffer, 't', fs->blocksize);
-	
-	if (lseek(data->dev, location, SEEK_SET) == -1)
-	{
-		dbg("seek failed!");
+	if (fstat(data->dev, &st))
 		return errno;
-	}
 
-	dbg("write(dev, buffer, blocksize %d)", fs->blocksize);
-	written = write(data->dev, buffer, fs->blocksize);
-	if (written != fs->blocksize)
+#ifdef BLKDISCARD
+	if (S_ISBLK(st.st_mode))
 	{
-		dbg("write failed with ret %d", written);
-		return 1;
+		__u64 range[2];
+		range[0] = location;
+		range[1] = length;
+		if (ioctl(data->dev, BLKDISCARD, &range))
+			return errno;
+		return 0;
 	}
-	else
-		dbg("succesfully test_wiped block %d", (int) block);
-	return 0;
+#endif
 
+	if (S_ISREG(st.st_mode))
+	{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+		if (fallocate(data->dev, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				location, length))
+			return errno;
+		return 0;
+#elif defined(F_PUNCHHOLE)
+		struct fpunchhole punch;
+		memset(&punch, 0, sizeof(punch));
+		punch.fp_offset = location;
+		punch.fp_length = length;
+		if (fcntl(data->dev, F_PUNCHHOLE, &punch))
+			return errno;
+		return 0;
+#endif
+	}
+	return EOPNOTSUPP;
 }
 
-// Non-cached direct IO here, for simplicity.
+static int wipe_extent_cmp(const void *a, const void *b)
+{
+	const struct wipe_extent *ea = a, *eb = b;
+
+	if (ea->start < eb->start)
+		return -1;
+	return ea->start > eb->start;
+}
 
-static int secure_wipe_block(blk_t block)
+// Wipes every queued extent, and returns only when all of them are done.
+int wipe_block_flush(void)
 {
-	// slightly hacky interface that avoids the cache but is simple to code
-	// errcode_t rc = (unix_io_manager->write_blk) (fs.io, block, 1, buffer);
+	int i, n, rc = 0;
 
-	int written;
-	io_channel channel = fs->io;
-	struct unix_private_data *data = (struct unix_private_data *)
-			channel->private_data;	
-	
-	ext2_loff_t location = ((ext2_loff_t) block * fs->blocksize)
-							+ data->offset;
+	if (!wipe_list_count)
+		return 0;
 
-	const char *buffer = get_random_block(fs->blocksize);
-	if (!buffer)
+	// Sort and merge once more: block_iterate hands blocks over mostly in
+	// order, but indirect blocks and fragmented files break the runs up.
+	qsort(wipe_list, wipe_list_count, sizeof(struct wipe_extent),
+		wipe_extent_cmp);
+	for (i = 1, n = 0; i < wipe_list_count; i++)
 	{
-		dbg("failed to get_random_block");
-		return 1;
+		if (wipe_list[n].start + wipe_list[n].count == wipe_list[i].start)
+			wipe_list[n].count += wipe_list[i].count;
+		else
+			wipe_list[++n] = wipe_list[i];
 	}
+	wipe_list_count = n + 1;
 
-	if (lseek(data->dev, location, SEEK_SET) == -1)
+	// discard requests go straight to the device, so anything the cache
+	// still has to write back must hit the disk first
+	if (wipe_policy == WIPE_DISCARD)
+		io_channel_flush(fs->io);
+
+	for (i = 0; i < wipe_list_count && !rc; i++)
 	{
-		dbg("seek failed!");
-		return errno;
+		dbg("wiping %u blocks from %u", wipe_list[i].count,
+			wipe_list[i].start);
+		if (wipe_policy != WIPE_DISCARD ||
+		    discard_extent(wipe_list[i].start, wipe_list[i].count))
+			rc = overwrite_extent(wipe_list[i].start, wipe_list[i].count);
 	}
 
-	dbg("write(dev, buffer, blocksize %d)", fs->blocksize);
-	written = write(data->dev, buffer, fs->blocksize);
-	if (written != fs->blocksize)
+	wipe_list_count = 0;
+	return rc;
+}
+
+int wipe_block(blk_t block)
+{
+	struct wipe_extent *last, *p;
+
+	if (wipe_policy == WIPE_NONE)
+		return 0;
+
+	if (wipe_list_count)
 	{
-		dbg("write failed with ret %d", written);
-		return 1;
+		last = &wipe_list[wipe_list_count - 1];
+		if (last->start + last->count == block)
+		{
+			last->count++;
+			return 0;
+		}
+		if (block + 1 == last->start)
+		{
+			last->start--;
+			last->count++;
+			return 0;
+		}
 	}
-	else
-		dbg("succesfully test_wiped block %d", (int) block);
+
+	if (wipe_list_count == wipe_list_size)
+	{
+		p = realloc(wipe_list, (wipe_list_size ? wipe_list_size * 2 : 64)
+				* sizeof(struct wipe_extent));
+		if (!p)
+		{
+			// out of memory: wipe what we have and start over
+			int rc = wipe_block_flush();
+			if (rc)
+				return rc;
+			if (!wipe_list_size)
+				return overwrite_extent(block, 1);
+		}
+		else
+		{
+			wipe_list = p;
+			wipe_list_size = wipe_list_size ? wipe_list_size * 2 : 64;
+		}
+	}
+
+	wipe_list[wipe_list_count].start = block;
+	wipe_list[wipe_list_count].count = 1;
+	wipe_list_count++;
 	return 0;
 }
 
-static int null_wipe_block(blk_t block)
+#ifdef WIPE_BLOCK_TEST
+// Known-answer tests for the random pool: the all-zero nonce keystream
+// vectors of RFC 7539, appendix A.1, and a check that the key left behind
+// is none of the output.
+
+ext2_filsys fs;
+
+struct chacha_test
 {
-	dbg("null_wiped block %d", (int) block);
-	return 0;
-}
+	__u32 key[8];
+	__u64 counter;
+	unsigned char block[CHACHA_BLOCK_SIZE];
+};
+
+static struct chacha_test chacha_tests[] = {
+	{ { 0 }, 0, {
+		0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90,
+		0x40, 0x5d, 0x6a, 0xe5, 0x53, 0x86, 0xbd, 0x28,
+		0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d, 0xed, 0x1a,
+		0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7,
+		0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d,
+		0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+		0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c,
+		0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86 } },
+	{ { 0 }, 1, {
+		0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a,
+		0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d, 0x08, 0x0d,
+		0xcb, 0x0f, 0x29, 0xa0, 0x48, 0xe3, 0x65, 0x69,
+		0x12, 0xc6, 0x53, 0x3e, 0x32, 0xee, 0x7a, 0xed,
+		0x29, 0xb7, 0x21, 0x76, 0x9c, 0xe6, 0x4e, 0x43,
+		0xd5, 0x71, 0x33, 0xb0, 0x74, 0xd8, 0x39, 0xd5,
+		0x31, 0xed, 0x1f, 0x28, 0x51, 0x0a, 0xfb, 0x45,
+		0xac, 0xe1, 0x0a, 0x1f, 0x4b, 0x79, 0x4d, 0x6f } },
+	// key 00 00 ... 00 01
+	{ { 0, 0, 0, 0, 0, 0, 0, 0x01000000 }, 1, {
+		0x3a, 0xeb, 0x52, 0x24, 0xec, 0xf8, 0x49, 0x92,
+		0x9b, 0x9d, 0x82, 0x8d, 0xb1, 0xce, 0xd4, 0xdd,
+		0x83, 0x20, 0x25, 0xe8, 0x01, 0x8b, 0x81, 0x60,
+		0xb8, 0x22, 0x84, 0xf3, 0xc9, 0x49, 0xaa, 0x5a,
+		0x8e, 0xca, 0x00, 0xbb, 0xb4, 0xa7, 0x3b, 0xda,
+		0xd1, 0x92, 0xb5, 0xc4, 0x2f, 0x73, 0xf2, 0xfd,
+		0x4e, 0x27, 0x36, 0x44, 0xc8, 0xb3, 0x61, 0x25,
+		0xa6, 0x4a, 0xdd, 0xeb, 0x00, 0x6c, 0x13, 0xa0 } },
+	// key 00 ff 00 ... 00
+	{ { 0x0000ff00, 0, 0, 0, 0, 0, 0, 0 }, 2, {
+		0x72, 0xd5, 0x4d, 0xfb, 0xf1, 0x2e, 0xc4, 0x4b,
+		0x36, 0x26, 0x92, 0xdf, 0x94, 0x13, 0x7f, 0x32,
+		0x8f, 0xea, 0x8d, 0xa7, 0x39, 0x90, 0x26, 0x5e,
+		0xc1, 0xbb, 0xbe, 0xa1, 0xae, 0x9a, 0xf0, 0xca,
+		0x13, 0xb2, 0x5a, 0xa2, 0x6c, 0xb4, 0xa6, 0x48,
+		0xcb, 0x9b, 0x9d, 0x1b, 0xe6, 0x5b, 0x2c, 0x09,
+		0x24, 0xa6, 0x6c, 0x54, 0xd5, 0x45, 0xec, 0x1b,
+		0x73, 0x74, 0xf4, 0x87, 0x2e, 0x99, 0xf0, 0x96 } },
+};
+
+int main(int argc, char **argv)
+{
+	unsigned char out[CHACHA_LANES * CHACHA_BLOCK_SIZE];
+	__u32 key[8];
+	char buf[3 * CHACHA_LANES * CHACHA_BLOCK_SIZE + 100];
+	int i, j, failed = 0;
+
+	for (i = 0; i < sizeof(chacha_tests) / sizeof(chacha_tests[0]); i++)
+	{
+		// the block should come out the same in every lane
+		for (j = 0; j < CHACHA_LANES; j++)
+		{
+			memcpy(chacha_key, chacha_tests[i].key, sizeof(chacha_key));
+			chacha_counter = chacha_tests[i].counter - j;
+			chacha_blocks(out);
+			if (memcmp(out + j * CHACHA_BLOCK_SIZE, chacha_tests[i].block,
+						CHACHA_BLOCK_SIZE))
+			{
+				printf("Keystream test %d, lane %d failed\n", i, j);
+				failed++;
+			}
+		}
+	}
 
+	// get_random_data() hands out the keystream in order, tail included,
+	// then rekeys from the blocks after those, which nobody has seen
+	memset(chacha_key, 0, sizeof(chacha_key));
+	chacha_counter = 0;
+	chacha_seeded = 1;
+	if (get_random_data(buf, sizeof(buf)))
+	{
+		printf("get_random_data failed\n");
+		failed++;
+	}
+	memcpy(key, chacha_key, sizeof(key));
 
-// For std ext2 file system, don't wipe blocks after use
-//wipe_block_proc wipe_block_procedure = null_wipe_block;
-wipe_block_proc wipe_block_procedure = test_wipe_block;
+	memset(chacha_key, 0, sizeof(chacha_key));
+	chacha_counter = 0;
+	for (i = 0; i < sizeof(buf); i += sizeof(out))
+	{
+		chacha_blocks(out);
+		j = sizeof(buf) - i < sizeof(out) ? sizeof(buf) - i : sizeof(out);
+		if (memcmp(buf + i, out, j))
+		{
+			printf("get_random_data output at %d differs\n", i);
+			failed++;
+		}
+	}
+	chacha_blocks(out);
+	if (memcmp(key, out, sizeof(key)))
+	{
+		printf("get_random_data left the wrong key\n");
+		failed++;
+	}
 
+	if (failed)
+	{
+		printf("Random pool: %d tests failed.\n", failed);
+		exit(1);
+	}
+	printf("Random pool tested OK!\n");
+	exit(0);
+}
+#endif
@@ -1,9 +1,15 @@
 #ifndef WIPE_BLOCK_H
 #define WIPE_BLOCK_H
 
-typedef int (*wipe_block_proc) (blk_t);
+// Secure-delete policies, selected at mount time with -o wipe=<policy>
+#define WIPE_NONE	0	// standard ext2 behaviour, freed blocks are left alone
+#define WIPE_ZERO	1	// overwrite freed blocks with zeros
+#define WIPE_RANDOM	2	// overwrite freed blocks with random data
+#define WIPE_DISCARD	3	// BLKDISCARD / hole punch, falling back to zeros
 
-extern wipe_block_proc wipe_block_procedure;
+extern int wipe_policy;
 
-#endif
+// returns 0 on success, or EINVAL for an unknown policy name
+int set_wipe_policy(const char *name);
 
+#endif
@@ -0,0 +1,964 @@
+/*
+ *  Copyright (C) 2007-8, see the file AUTHORS for copyright owners.
+ *
+ *  This program can be distributed under the terms of the GNU GPL v2,
+ *  or any later version. See the file COPYING.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/xattr.h>
+
+#include "ext2fs.h"
+#include "perms.h"
+#include "xattr.h"
+#include "kcache.h"
+
+#define ext2_err(rc, ...) \
+	com_err("ext2fuse_dbg_msg", rc, __VA_ARGS__)
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+// attribute blocks kept in memory
+#define XATTR_CACHE_BLOCKS 256
+// buckets for finding them by block number and by hash, a power of two
+#define XATTR_HASH_SIZE 256
+
+#define BLOCK_HASH_SHIFT 16
+
+// name indexes, as on disk
+#define XATTR_INDEX_USER		1
+#define XATTR_INDEX_TRUSTED		4
+#define XATTR_INDEX_SECURITY		6
+
+static const struct
+{
+	int index;
+	const char *prefix;
+} xattr_prefixes[] = {
+	{ XATTR_INDEX_USER,	"user." },
+	{ XATTR_INDEX_TRUSTED,	"trusted." },
+	{ XATTR_INDEX_SECURITY,	"security." },
+	{ 0, NULL }
+};
+
+struct xattr
+{
+	int index;
+	const char *name;
+	int name_len;
+	const char *value;
+	size_t size;
+	int in_inode;		// where it goes when stored
+};
+
+// all the attributes of one inode, wherever they are kept
+struct xattr_list
+{
+	struct ext2_inode_large *inode;	// the whole on-disk inode
+	int isize;
+	struct xattr *attrs;
+	int n, max;
+};
+
+// a cached attribute block
+struct ea_block
+{
+	blk_t blk;
+	char *data;
+	struct ea_block *blk_next, *hash_next;
+	struct ea_block *lru_prev, *lru_next;
+};
+
+static struct ea_block *ea_by_blk[XATTR_HASH_SIZE];
+static struct ea_block *ea_by_hash[XATTR_HASH_SIZE];
+// most recently used first
+static struct ea_block ea_lru = { .lru_prev = &ea_lru, .lru_next = &ea_lru };
+static int ea_cached = 0;
+
+static struct ext2_ext_attr_header *header(char *data)
+{
+	return (struct ext2_ext_attr_header *) data;
+}
+
+static struct ea_block **blk_bucket(blk_t blk)
+{
+	return &ea_by_blk[blk & (XATTR_HASH_SIZE - 1)];
+}
+
+static struct ea_block **hash_bucket(__u32 hash)
+{
+	return &ea_by_hash[hash & (XATTR_HASH_SIZE - 1)];
+}
+
+static void ea_unlink(struct ea_block **pp, struct ea_block *b, int by_hash)
+{
+	for (; *pp; pp = by_hash ? &(*pp)->hash_next : &(*pp)->blk_next)
+	{
+		if (*pp == b)
+		{
+			*pp = by_hash ? b->hash_next : b->blk_next;
+			return;
+		}
+	}
+}
+
+static void ea_lru_del(struct ea_block *b)
+{
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void ea_lru_add(struct ea_block *b)
+{
+	b->lru_next = ea_lru.lru_next;
+	b->lru_prev = &ea_lru;
+	b->lru_next->lru_prev = b;
+	ea_lru.lru_next = b;
+}
+
+static void ea_forget(struct ea_block *b)
+{
+	ea_unlink(blk_bucket(b->blk), b, 0);
+	ea_unlink(hash_bucket(header(b->data)->h_hash), b, 1);
+	ea_lru_del(b);
+	ea_cached--;
+	free(b->data);
+	free(b);
+}
+
+// call after changing the hash in b's header
+static void ea_rehash(struct ea_block *b, __u32 old_hash)
+{
+	ea_unlink(hash_bucket(old_hash), b, 1);
+	b->hash_next = *hash_bucket(header(b->data)->h_hash);
+	*hash_bucket(header(b->data)->h_hash) = b;
+}
+
+// Cache a copy of the attribute block @blk holding @data
+static struct ea_block *ea_insert(blk_t blk, const char *data)
+{
+	struct ea_block *b;
+
+	while (ea_cached >= XATTR_CACHE_BLOCKS)
+		ea_forget(ea_lru.lru_prev);
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		return NULL;
+	b->data = malloc(fs->blocksize);
+	if (!b->data)
+	{
+		free(b);
+		return NULL;
+	}
+	memcpy(b->data, data, fs->blocksize);
+	b->blk = blk;
+	b->blk_next = *blk_bucket(blk);
+	*blk_bucket(blk) = b;
+	b->hash_next = *hash_bucket(header(b->data)->h_hash);
+	*hash_bucket(header(b->data)->h_hash) = b;
+	ea_lru_add(b);
+	ea_cached++;
+	return b;
+}
+
+// the attribute block @blk, read in if it isn't cached
+static int ea_get(blk_t blk, struct ea_block **ret)
+{
+	struct ext2_ext_attr_header *h;
+	struct ea_block *b;
+	errcode_t rc;
+	char *buf;
+
+	for (b = *blk_bucket(blk); b; b = b->blk_next)
+	{
+		if (b->blk == blk)
+		{
+			ea_lru_del(b);
+			ea_lru_add(b);
+			*ret = b;
+			return 0;
+		}
+	}
+
+	if (blk < fs->super->s_first_data_block ||
+			blk >= fs->super->s_blocks_count)
+		return EIO;
+	buf = malloc(fs->blocksize);
+	if (!buf)
+		return ENOMEM;
+	rc = ext2fs_read_ext_attr(fs, blk, buf);
+	if (rc)
+	{
+		ext2_err(rc, "while reading attribute block %u", blk);
+		free(buf);
+		return EIO;
+	}
+	h = header(buf);
+	if ((h->h_magic != EXT2_EXT_ATTR_MAGIC &&
+			h->h_magic != EXT2_EXT_ATTR_MAGIC_v1) || h->h_blocks != 1)
+	{
+		ext2_err(0, "bad attribute block %u", blk);
+		free(buf);
+		return EIO;
+	}
+
+	b = ea_insert(blk, buf);
+	free(buf);
+	if (!b)
+		return ENOMEM;
+	*ret = b;
+	return 0;
+}
+
+static int ea_write(struct ea_block *b)
+{
+	errcode_t rc = ext2fs_write_ext_attr(fs, b->blk, b->data);
+
+	if (rc)
+	{
+		ext2_err(rc, "while writing attribute block %u", b->blk);
+		return EIO;
+	}
+	return 0;
+}
+
+// do blocks @a and @b hold the same attributes (refcounts aside)?
+static int same_attrs(const char *a, const char *b)
+{
+	size_t refcount = offsetof(struct ext2_ext_attr_header, h_refcount);
+	size_t after = refcount + sizeof(__u32);
+
+	return !memcmp(a, b, refcount) &&
+		!memcmp(a + after, b + after, fs->blocksize - after);
+}
+
+// a cached block other than @not holding what @data does, that can take
+// another reference
+static struct ea_block *ea_find_shared(const char *data, blk_t not)
+{
+	__u32 hash = header((char *) data)->h_hash;
+	struct ea_block *b;
+
+	// a zero hash marks a block that mustn't be shared
+	if (!hash)
+		return NULL;
+	for (b = *hash_bucket(hash); b; b = b->hash_next)
+	{
+		if (b->blk != not && header(b->data)->h_hash == hash &&
+				header(b->data)->h_refcount <
+					EXT2_EXT_ATTR_REFCOUNT_MAX &&
+				same_attrs(b->data, data))
+			return b;
+	}
+	return NULL;
+}
+
+// Drop a reference to attribute block @blk, freeing it with the last one.
+static int ea_put(blk_t blk)
+{
+	struct ea_block *b;
+	int rc;
+
+	rc = ea_get(blk, &b);
+	if (rc)
+		return rc;
+
+	if (header(b->data)->h_refcount > 1)
+	{
+		header(b->data)->h_refcount--;
+		return ea_write(b);
+	}
+
+	ea_forget(b);
+	rc = wipe_block(blk);
+	if (wipe_block_flush() && !rc)
+		rc = EIO;
+	ext2fs_block_alloc_stats(fs, blk, -1);
+	return rc;
+}
+
+// Parse the entries from @e on, whose values are at offsets from
+// @values, into @l. Everything must lie before @end.
+static int parse_entries(struct xattr_list *l, struct ext2_ext_attr_entry *e,
+		char *values, char *end, int in_inode)
+{
+	struct xattr *x;
+
+	while ((char *) e + sizeof(__u32) <= end && !EXT2_EXT_IS_LAST_ENTRY(e))
+	{
+		if ((char *) EXT2_EXT_ATTR_NEXT(e) > end || e->e_value_block ||
+				values + e->e_value_offs + e->e_value_size > end)
+			return EIO;
+
+		if (l->n == l->max)
+		{
+			x = realloc(l->attrs, (l->max ? l->max * 2 : 16) *
+					sizeof(struct xattr));
+			if (!x)
+				return ENOMEM;
+			l->attrs = x;
+			l->max = l->max ? l->max * 2 : 16;
+		}
+		x = &l->attrs[l->n++];
+		x->index = e->e_name_index;
+		x->name = EXT2_EXT_ATTR_NAME(e);
+		x->name_len = e->e_name_len;
+		x->value = values + e->e_value_offs;
+		x->size = e->e_value_size;
+		x->in_inode = in_inode;
+		e = EXT2_EXT_ATTR_NEXT(e);
+	}
+	return 0;
+}
+
+// The attribute area at the end of a large inode: a magic number, then
+// entries, with values at offsets from the first entry. NULL if there's
+// no room for one.
+static char *ibody(struct xattr_list *l, char **end)
+{
+	int extra;
+
+	if (l->isize <= EXT2_GOOD_OLD_INODE_SIZE)
+		return NULL;
+	extra = l->inode->i_extra_isize;
+	// i_extra_isize itself takes up some of the extra space
+	if (extra < sizeof(__u32) || (extra & 3) ||
+			EXT2_GOOD_OLD_INODE_SIZE + extra + 2 * sizeof(__u32) >
+				(unsigned) l->isize)
+		return NULL;
+	*end = (char *) l->inode + l->isize;
+	return (char *) l->inode + EXT2_GOOD_OLD_INODE_SIZE + extra;
+}
+
+static void xattr_free(struct xattr_list *l)
+{
+	free(l->inode);
+	free(l->attrs);
+}
+
+// Read every attribute of @ino. Values point into l->inode and the block
+// cache, so stay valid until the cache is next changed.
+static int xattr_load(ext2_ino_t ino, struct xattr_list *l)
+{
+	struct ea_block *b;
+	char *p, *end;
+	errcode_t rc;
+	int err;
+
+	memset(l, 0, sizeof(*l));
+	l->isize = EXT2_INODE_SIZE(fs->super);
+	l->inode = malloc(l->isize);
+	if (!l->inode)
+		return ENOMEM;
+	rc = ext2fs_read_inode_full(fs, ino, (struct ext2_inode *) l->inode,
+			l->isize);
+	if (rc)
+	{
+		ext2_err(rc, "while reading inode %u", ino);
+		xattr_free(l);
+		return EIO;
+	}
+
+	p = ibody(l, &end);
+	if (p && *(__u32 *) p == EXT2_EXT_ATTR_MAGIC)
+	{
+		p += sizeof(__u32);
+		err = parse_entries(l, (struct ext2_ext_attr_entry *) p, p, end, 1);
+		if (err)
+		{
+			ext2_err(0, "bad attributes in inode %u", ino);
+			xattr_free(l);
+			return err;
+		}
+	}
+
+	if (l->inode->i_file_acl)
+	{
+		err = ea_get(l->inode->i_file_acl, &b);
+		if (!err)
+			err = parse_entries(l, (struct ext2_ext_attr_entry *)
+					(b->data + sizeof(struct ext2_ext_attr_header)),
+					b->data, b->data + fs->blocksize, 0);
+		if (err)
+		{
+			xattr_free(l);
+			return err;
+		}
+	}
+	return 0;
+}
+
+static struct xattr *xattr_find(struct xattr_list *l, int index,
+		const char *name)
+{
+	int i, len = strlen(name);
+
+	for (i = 0; i < l->n; i++)
+		if (l->attrs[i].index == index && l->attrs[i].name_len == len &&
+				!memcmp(l->attrs[i].name, name, len))
+			return &l->attrs[i];
+	return NULL;
+}
+
+// the order the kernel keeps attribute blocks in
+static int cmp_xattr(const void *a, const void *b)
+{
+	const struct xattr *x = a, *y = b;
+
+	if (x->index != y->index)
+		return x->index - y->index;
+	if (x->name_len != y->name_len)
+		return x->name_len - y->name_len;
+	return memcmp(x->name, y->name, x->name_len);
+}
+
+static size_t xattr_space(struct xattr *x)
+{
+	return EXT2_EXT_ATTR_LEN(x->name_len) + EXT2_EXT_ATTR_SIZE(x->size);
+}
+
+// Write the entries of @l with in_inode == @in_inode from @e on, their
+// values down from @values_end, at offsets from @values.
+static void write_entries(struct xattr_list *l, int in_inode,
+		struct ext2_ext_attr_entry *e, char *values, char *values_end)
+{
+	struct xattr *x;
+	int i;
+
+	for (i = 0; i < l->n; i++)
+	{
+		x = &l->attrs[i];
+		if (x->in_inode != in_inode)
+			continue;
+		e->e_name_len = x->name_len;
+		e->e_name_index = x->index;
+		e->e_value_block = 0;
+		e->e_value_size = x->size;
+		e->e_value_offs = 0;
+		if (x->size)
+		{
+			values_end -= EXT2_EXT_ATTR_SIZE(x->size);
+			memcpy(values_end, x->value, x->size);
+			e->e_value_offs = values_end - values;
+		}
+		memcpy(EXT2_EXT_ATTR_NAME(e), x->name, x->name_len);
+		e->e_hash = ext2fs_ext_attr_hash_entry(e, values + e->e_value_offs);
+		e = EXT2_EXT_ATTR_NEXT(e);
+	}
+}
+
+static __u32 block_hash(char *data)
+{
+	struct ext2_ext_attr_entry *e = (struct ext2_ext_attr_entry *)
+		(data + sizeof(struct ext2_ext_attr_header));
+	__u32 hash = 0;
+
+	for (; !EXT2_EXT_IS_LAST_ENTRY(e); e = EXT2_EXT_ATTR_NEXT(e))
+	{
+		if (!e->e_hash)
+			return 0;
+		hash = (hash << BLOCK_HASH_SHIFT) ^
+			(hash >> (8 * sizeof(hash) - BLOCK_HASH_SHIFT)) ^
+			e->e_hash;
+	}
+	return hash;
+}
+
+// Point the inode at a block holding @data (or at none if NULL): an
+// identical shared one, its old one rewritten, or a new one.
+static int store_block(ext2_ino_t ino, struct xattr_list *l, char *data)
+{
+	blk_t old = l->inode->i_file_acl, blk;
+	struct ea_block *b = NULL, *shared;
+	__u32 old_hash;
+	int rc;
+
+	if (data)
+	{
+		if (old && !ea_get(old, &b) && same_attrs(b->data, data))
+			return 0;
+
+		shared = ea_find_shared(data, old);
+		if (shared)
+		{
+			header(shared->data)->h_refcount++;
+			rc = ea_write(shared);
+			if (rc)
+			{
+				// the cached copy mustn't keep a reference nobody holds
+				header(shared->data)->h_refcount--;
+				return rc;
+			}
+			blk = shared->blk;
+		}
+		else if (b && header(b->data)->h_refcount == 1)
+		{
+			old_hash = header(b->data)->h_hash;
+			memcpy(b->data, data, fs->blocksize);
+			ea_rehash(b, old_hash);
+			return ea_write(b);
+		}
+		else
+		{
+			rc = ext2fs_new_block(fs, ext2fs_group_first_block(fs,
+					ext2fs_group_of_ino(fs, ino)), 0, &blk);
+			if (rc)
+				return ENOSPC;
+			b = ea_insert(blk, data);
+			if (!b)
+				return ENOMEM;
+			rc = ea_write(b);
+			if (rc)
+			{
+				ea_forget(b);
+				return rc;
+			}
+			ext2fs_block_alloc_stats(fs, blk, +1);
+		}
+	}
+	else
+		blk = 0;
+
+	if (old)
+	{
+		rc = ea_put(old);
+		if (rc)
+			ext2_err(0, "while releasing attribute block %u of %u",
+				old, ino);
+		l->inode->i_blocks -= fs->blocksize / 512;
+	}
+	if (blk)
+		l->inode->i_blocks += fs->blocksize / 512;
+	l->inode->i_file_acl = blk;
+	return 0;
+}
+
+// Lay the attributes of @l out again, in the inode where they fit and in
+// the block otherwise, and write them and the inode.
+static int xattr_store(ext2_ino_t ino, struct xattr_list *l)
+{
+	struct ext2_ext_attr_header *h;
+	char *p, *end = NULL, *body = NULL, *data = NULL;
+	size_t iroom = 0, broom;
+	int i, inode_n = 0, block_n = 0, rc;
+
+	qsort(l->attrs, l->n, sizeof(struct xattr), cmp_xattr);
+
+	// inodes written before the large inode fields were known have none
+	if ((unsigned) l->isize >= sizeof(struct ext2_inode_large) +
+			2 * sizeof(__u32) && !l->inode->i_extra_isize)
+	{
+		memset((char *) l->inode + EXT2_GOOD_OLD_INODE_SIZE, 0,
+			sizeof(struct ext2_inode_large) - EXT2_GOOD_OLD_INODE_SIZE);
+		l->inode->i_extra_isize = sizeof(struct ext2_inode_large) -
+			EXT2_GOOD_OLD_INODE_SIZE;
+	}
+	p = ibody(l, &end);
+	if (p)
+		iroom = end - p - 2 * sizeof(__u32);
+	broom = fs->blocksize - sizeof(struct ext2_ext_attr_header) -
+		sizeof(__u32);
+
+	for (i = 0; i < l->n; i++)
+	{
+		if (xattr_space(&l->attrs[i]) <= iroom)
+		{
+			iroom -= xattr_space(&l->attrs[i]);
+			l->attrs[i].in_inode = 1;
+			inode_n++;
+		}
+		else if (xattr_space(&l->attrs[i]) <= broom)
+		{
+			broom -= xattr_space(&l->attrs[i]);
+			l->attrs[i].in_inode = 0;
+			block_n++;
+		}
+		else
+			return ENOSPC;
+	}
+
+	// values point into the old layout, so build the new one apart
+	if (p)
+	{
+		body = calloc(1, end - p);
+		if (!body)
+			return ENOMEM;
+		if (inode_n)
+		{
+			*(__u32 *) body = EXT2_EXT_ATTR_MAGIC;
+			write_entries(l, 1, (struct ext2_ext_attr_entry *)
+					(body + sizeof(__u32)), body + sizeof(__u32),
+					body + (end - p));
+		}
+	}
+	if (block_n)
+	{
+		data = calloc(1, fs->blocksize);
+		if (!data)
+		{
+			free(body);
+			return ENOMEM;
+		}
+		h = header(data);
+		h->h_magic = EXT2_EXT_ATTR_MAGIC;
+		h->h_refcount = 1;
+		h->h_blocks = 1;
+		write_entries(l, 0, (struct ext2_ext_attr_entry *) (h + 1),
+				data, data + fs->blocksize);
+		h->h_hash = block_hash(data);
+	}
+	if (p)
+	{
+		memcpy(p, body, end - p);
+		free(body);
+	}
+
+	rc = store_block(ino, l, data);
+	free(data);
+	if (rc)
+		return rc;
+
+	if (l->n && !EXT2_HAS_COMPAT_FEATURE(fs->super,
+				EXT2_FEATURE_COMPAT_EXT_ATTR))
+	{
+		fs->super->s_feature_compat |= EXT2_FEATURE_COMPAT_EXT_ATTR;
+		ext2fs_mark_super_dirty(fs);
+	}
+	l->inode->i_ctime = time(NULL);
+	rc = ext2fs_write_inode_full(fs, ino, (struct ext2_inode *) l->inode,
+			l->isize);
+	if (rc)
+	{
+		ext2_err(rc, "while writing inode %u", ino);
+		return EIO;
+	}
+	return 0;
+}
+
+// Split a full attribute name into its index and the rest.
+static int xattr_name(const char *name, int *index, const char **suffix)
+{
+	int i, len;
+
+	for (i = 0; xattr_prefixes[i].prefix; i++)
+	{
+		len = strlen(xattr_prefixes[i].prefix);
+		if (!strncmp(name, xattr_prefixes[i].prefix, len))
+		{
+			*index = xattr_prefixes[i].index;
+			*suffix = name + len;
+			break;
+		}
+	}
+	if (!xattr_prefixes[i].prefix)
+	{
+#ifdef __APPLE__
+		*index = XATTR_INDEX_USER;
+		*suffix = name;
+#else
+		return EOPNOTSUPP;
+#endif
+	}
+	if (!**suffix)
+		return EINVAL;
+	if (strlen(*suffix) > 255)
+		return ERANGE;
+	return 0;
+}
+
+// May the requester get (R_OK) or set (W_OK) attributes of @index?
+static int xattr_perms(fuse_req_t req, ext2_ino_t ino, int index, int mask)
+{
+	struct ext2_inode inode;
+
+	if (!do_permissions_checks)
+		return 0;
+	switch (index)
+	{
+	case XATTR_INDEX_TRUSTED:
+		return fuse_req_ctx(req)->uid ? EPERM : 0;
+	case XATTR_INDEX_USER:
+		if (read_inode(ino, &inode))
+			return EIO;
+		// only files and directories can have user attributes
+		if (!LINUX_S_ISREG(inode.i_mode) && !LINUX_S_ISDIR(inode.i_mode))
+			return mask == W_OK ? EPERM : ENOATTR;
+		return check_perms_in_inode(req, &inode, mask);
+	case XATTR_INDEX_SECURITY:
+		// anyone may read them, only the owner (or root) may set them
+		if (mask != W_OK)
+			return 0;
+		if (read_inode(ino, &inode))
+			return EIO;
+		return check_owner(req, &inode) ? EPERM : 0;
+	default:
+		return 0;
+	}
+}
+
+// Set (or, with @value NULL, remove) an attribute
+static int do_setxattr(fuse_req_t req, ext2_ino_t ino, const char *name,
+		const char *value, size_t size, int flags)
+{
+	struct xattr_list l;
+	struct xattr *x;
+	const char *suffix;
+	int index, rc;
+
+	if (!(fs->flags & EXT2_FLAG_RW))
+		return EROFS;
+	rc = xattr_name(name, &index, &suffix);
+	if (!rc)
+		rc = xattr_perms(req, ino, index, W_OK);
+	if (rc)
+		return rc;
+	// too big for any block, however empty: not the same as a full one
+	if (value && size > fs->blocksize)
+		return E2BIG;
+
+	rc = xattr_load(ino, &l);
+	if (rc)
+		return rc;
+
+	x = xattr_find(&l, index, suffix);
+	if (!value)
+	{
+		if (!x)
+			rc = ENOATTR;
+		else
+			*x = l.attrs[--l.n];
+	}
+	else if (x && (flags & XATTR_CREATE))
+		rc = EEXIST;
+	else if (x)
+	{
+		x->value = value;
+		x->size = size;
+	}
+	else if (flags & XATTR_REPLACE)
+		rc = ENOATTR;
+	else
+	{
+		if (l.n == l.max)
+		{
+			x = realloc(l.attrs, (l.max + 1) * sizeof(struct xattr));
+			if (!x)
+				rc = ENOMEM;
+			else
+			{
+				l.attrs = x;
+				l.max++;
+			}
+		}
+		if (!rc)
+		{
+			x = &l.attrs[l.n++];
+			x->index = index;
+			x->name = suffix;
+			x->name_len = strlen(suffix);
+			x->value = value;
+			x->size = size;
+		}
+	}
+
+	if (!rc)
+		rc = xattr_store(ino, &l);
+	xattr_free(&l);
+	return rc;
+}
+
+#ifdef __APPLE__
+void op_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		const char *value, size_t size, int flags, uint32_t position)
+#else
+void op_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		const char *value, size_t size, int flags)
+#endif
+{
+	dbg("op_setxattr(req, ino %d, name \"%s\", value, size %d, flags %d)",
+		(int) ino, name, (int) size, flags);
+	kcache_request(ino);
+#ifdef __APPLE__
+	// only resource forks are written in pieces
+	if (position)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+#endif
+	fuse_reply_err(req, do_setxattr(req, EXT2FS_INO(ino), name,
+				value ? value : "", size, flags));
+}
+
+void op_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+	dbg("op_removexattr(req, ino %d, name \"%s\")", (int) ino, name);
+	kcache_request(ino);
+	fuse_reply_err(req, do_setxattr(req, EXT2FS_INO(ino), name, NULL, 0, 0));
+}
+
+#ifdef __APPLE__
+void op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size, uint32_t position)
+#else
+void op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size)
+#endif
+{
+	struct ext2_inode inode;
+	struct xattr_list l;
+	struct xattr *x;
+	const char *suffix;
+	int index, rc;
+
+	dbg("op_getxattr(req, ino %d, name \"%s\", size %d)", (int) ino, name,
+		(int) size);
+	kcache_request(ino);
+#ifdef __APPLE__
+	if (position)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+#endif
+	rc = xattr_name(name, &index, &suffix);
+	if (!rc)
+		rc = xattr_perms(req, EXT2FS_INO(ino), index, R_OK);
+	if (rc)
+	{
+		fuse_reply_err(req, rc);
+		return;
+	}
+
+	// most inodes have no attributes at all, and the cached inode says so
+	if (read_inode(EXT2FS_INO(ino), &inode))
+	{
+		fuse_reply_err(req, EIO);
+		return;
+	}
+	if (!inode.i_file_acl && EXT2_INODE_SIZE(fs->super) ==
+			EXT2_GOOD_OLD_INODE_SIZE)
+	{
+		fuse_reply_err(req, ENOATTR);
+		return;
+	}
+
+	rc = xattr_load(EXT2FS_INO(ino), &l);
+	if (rc)
+	{
+		fuse_reply_err(req, rc);
+		return;
+	}
+	x = xattr_find(&l, index, suffix);
+	if (!x)
+		fuse_reply_err(req, ENOATTR);
+	else if (!size)
+		fuse_reply_xattr(req, x->size);
+	else if (size < x->size)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, x->value, x->size);
+	xattr_free(&l);
+}
+
+void op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	struct xattr_list l;
+	struct xattr *x;
+	const char *prefix;
+	char *buf = NULL, *p;
+	size_t len = 0;
+	int i, j, pass, rc;
+
+	dbg("op_listxattr(req, ino %d, size %d)", (int) ino, (int) size);
+	kcache_request(ino);
+	rc = xattr_load(EXT2FS_INO(ino), &l);
+	if (rc)
+	{
+		fuse_reply_err(req, rc);
+		return;
+	}
+
+	// count the names, then copy them
+	for (pass = 0; pass < 2; pass++)
+	{
+		p = buf;
+		for (i = 0; i < l.n; i++)
+		{
+			x = &l.attrs[i];
+			for (j = 0; xattr_prefixes[j].prefix; j++)
+				if (xattr_prefixes[j].index == x->index)
+					break;
+			prefix = xattr_prefixes[j].prefix;
+			// ACLs and the like can't be read through here anyway
+			if (!prefix || (x->index == XATTR_INDEX_TRUSTED &&
+					do_permissions_checks &&
+					fuse_req_ctx(req)->uid))
+				continue;
+#ifdef __APPLE__
+			if (x->index == XATTR_INDEX_USER)
+				prefix = "";
+#endif
+			if (!pass)
+			{
+				len += strlen(prefix) + x->name_len + 1;
+				continue;
+			}
+			p = stpcpy(p, prefix);
+			memcpy(p, x->name, x->name_len);
+			p += x->name_len;
+			*p++ = '\0';
+		}
+
+		if (pass)
+			break;
+		if (!size)
+		{
+			fuse_reply_xattr(req, len);
+			xattr_free(&l);
+			return;
+		}
+		if (size < len)
+		{
+			fuse_reply_err(req, ERANGE);
+			xattr_free(&l);
+			return;
+		}
+		buf = malloc(len + 1);
+		if (!buf)
+		{
+			fuse_reply_err(req, ENOMEM);
+			xattr_free(&l);
+			return;
+		}
+	}
+
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+	xattr_free(&l);
+}
+
+void xattr_release(ext2_ino_t ino, struct ext2_inode *inode)
+{
+	if (!inode->i_file_acl)
+		return;
+	if (ea_put(inode->i_file_acl))
+		ext2_err(0, "while releasing attribute block %u of %u",
+			inode->i_file_acl, ino);
+	inode->i_file_acl = 0;
+	if (inode->i_blocks >= fs->blocksize / 512)
+		inode->i_blocks -= fs->blocksize / 512;
+}
+
+void xattr_fini(void)
+{
+	while (ea_cached)
+		ea_forget(ea_lru.lru_prev);
+}
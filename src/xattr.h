@@ -0,0 +1,42 @@
+#ifndef XATTR_H
+#define XATTR_H
+
+#define FUSE_USE_VERSION 29
+
+#include <fuse_lowlevel.h>
+#include <ext2fs/ext2fs.h>
+#include <ext2fs/ext2_fs.h>
+
+// Extended attributes, stored the way Linux stores them on ext2/3/4: in
+// the space left at the end of large inodes, and in an attribute block.
+// Inodes with the same attributes in their block share one block, found
+// through a cache of attribute blocks keyed by their hash.
+//
+// The user., trusted. and security. namespaces are supported. POSIX ACLs
+// (system.posix_acl_*) are kept as they are, but can't be read or set, as
+// they are stored in a different format from the one the kernel sends.
+// On Mac OS X, names without a known prefix are stored as user. ones.
+
+#ifdef __APPLE__
+void op_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		const char *value, size_t size, int flags, uint32_t position);
+void op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size, uint32_t position);
+#else
+void op_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		const char *value, size_t size, int flags);
+void op_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+		size_t size);
+#endif
+void op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size);
+void op_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name);
+
+// Drop the attribute block of @inode, which is being deleted, freeing it
+// if no other inode shares it. Only *inode is updated; the caller writes
+// it out.
+void xattr_release(ext2_ino_t ino, struct ext2_inode *inode);
+
+// empty the attribute block cache
+void xattr_fini(void);
+
+#endif